@@ -0,0 +1,349 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#  include <Windows.h>
+#  include <malloc.h>
+#  include <process.h>
+#else
+#  include <pthread.h>
+#  include <sched.h>
+#  include <time.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  define BENCH_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define BENCH_HAS_TSC 1
+#else
+#  define BENCH_HAS_TSC 0
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+void bench_flag_set(bench_flag* flag)
+{
+  InterlockedExchange(&flag->value, 1);
+}
+
+bool bench_flag_is_set(bench_flag* flag)
+{
+  return InterlockedCompareExchange(&flag->value, 0, 0) != 0;
+}
+
+#else
+
+void bench_flag_set(bench_flag* flag)
+{
+  atomic_store_explicit(&flag->value, 1, memory_order_release);
+}
+
+bool bench_flag_is_set(bench_flag* flag)
+{
+  return atomic_load_explicit(&flag->value, memory_order_acquire) != 0;
+}
+
+#endif
+
+#if BENCH_HAS_TSC
+
+uint64_t bench_cycles()
+{
+  return __rdtsc();
+}
+
+const char* bench_cycles_unit()
+{
+  return "tsc";
+}
+
+#else
+
+uint64_t bench_cycles()
+{
+  return bench_now_ns();
+}
+
+const char* bench_cycles_unit()
+{
+  return "ns";
+}
+
+#endif
+
+#ifdef _WIN32
+
+uint64_t bench_now_ns()
+{
+  static LARGE_INTEGER frequency = {0};
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  uint64_t ticks = (uint64_t)counter.QuadPart;
+  uint64_t hz = (uint64_t)frequency.QuadPart;
+  return ticks / hz * 1000000000U + ticks % hz * 1000000000U / hz;
+}
+
+bool bench_pin_to_core(uint32_t core)
+{
+  if (core >= sizeof(DWORD_PTR) * 8) {
+    return false;
+  }
+
+  DWORD_PTR mask = (DWORD_PTR)1 << core;
+  return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+void bench_sleep_ms(uint32_t milliseconds)
+{
+  Sleep(milliseconds);
+}
+
+void* bench_alloc(size_t size, size_t alignment)
+{
+  void* pointer = _aligned_malloc(size, alignment);
+  if (pointer != NULL) {
+    memset(pointer, 0, size);
+  }
+
+  return pointer;
+}
+
+void bench_free(void* pointer)
+{
+  _aligned_free(pointer);
+}
+
+static unsigned __stdcall thread_entry(void* argument)
+{
+  bench_thread* thread = argument;
+  thread->function(thread->argument);
+  return 0;
+}
+
+bool bench_thread_start(bench_thread* thread,
+                        bench_thread_function function,
+                        void* argument)
+{
+  thread->function = function;
+  thread->argument = argument;
+  uintptr_t handle = _beginthreadex(NULL, 0, thread_entry, thread, 0, NULL);
+  thread->handle = (void*)handle;
+  return handle != 0;
+}
+
+void bench_thread_join(bench_thread* thread)
+{
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+}
+
+#else
+
+uint64_t bench_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+bool bench_pin_to_core(uint32_t core)
+{
+#ifdef __linux__
+  if (core >= CPU_SETSIZE) {
+    return false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)core;
+  return false;
+#endif
+}
+
+void bench_sleep_ms(uint32_t milliseconds)
+{
+  struct timespec duration = {
+      (time_t)(milliseconds / 1000),
+      (long)(milliseconds % 1000) * 1000000L,
+  };
+  nanosleep(&duration, NULL);
+}
+
+void* bench_alloc(size_t size, size_t alignment)
+{
+  void* pointer = NULL;
+  if (alignment < sizeof(void*)) {
+    alignment = sizeof(void*);
+  }
+  if (posix_memalign(&pointer, alignment, size) != 0) {
+    return NULL;
+  }
+
+  memset(pointer, 0, size);
+  return pointer;
+}
+
+void bench_free(void* pointer)
+{
+  free(pointer);
+}
+
+static void* thread_entry(void* argument)
+{
+  bench_thread* thread = argument;
+  thread->function(thread->argument);
+  return NULL;
+}
+
+bool bench_thread_start(bench_thread* thread,
+                        bench_thread_function function,
+                        void* argument)
+{
+  thread->function = function;
+  thread->argument = argument;
+  pthread_t* handle = malloc(sizeof(pthread_t));
+  if (handle == NULL) {
+    return false;
+  }
+
+  if (pthread_create(handle, NULL, thread_entry, thread) != 0) {
+    free(handle);
+    return false;
+  }
+
+  thread->handle = handle;
+  return true;
+}
+
+void bench_thread_join(bench_thread* thread)
+{
+  pthread_t* handle = thread->handle;
+  pthread_join(*handle, NULL);
+  free(handle);
+}
+
+#endif
+
+bool bench_parse_ipv4(const char* string, uint16_t port, ah_ipv4_address* out)
+{
+  ah_ipv4_address address = {{0}, port};
+  for (int i = 0; i != 4; ++i) {
+    char* end;
+    unsigned long octet = strtoul(string, &end, 10);
+    if (end == string || octet > 255 || *end != (i == 3 ? '\0' : '.')) {
+      return false;
+    }
+
+    address.address[i] = (uint8_t)octet;
+    string = end + 1;
+  }
+
+  *out = address;
+  return true;
+}
+
+static int highest_bit(uint64_t value)
+{
+  int bit = 0;
+  while (value >>= 1) {
+    ++bit;
+  }
+
+  return bit;
+}
+
+static size_t bucket_index(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (size_t)value;
+  }
+
+  int shift = highest_bit(value) - HISTOGRAM_SUB_BUCKET_BITS;
+  uint64_t sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t)sub_bucket;
+}
+
+static uint64_t bucket_midpoint(size_t index)
+{
+  if (index < HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+
+  int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+  uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+  uint64_t lower = (HISTOGRAM_SUB_BUCKETS | sub_bucket) << shift;
+  return lower + ((uint64_t)1 << shift) / 2;
+}
+
+void histogram_record(latency_histogram* histogram, uint64_t value)
+{
+  ++histogram->count;
+  histogram->total += value;
+  if (histogram->max < value) {
+    histogram->max = value;
+  }
+  ++histogram->buckets[bucket_index(value)];
+}
+
+void histogram_merge(latency_histogram* destination,
+                     const latency_histogram* source)
+{
+  destination->count += source->count;
+  destination->total += source->total;
+  if (destination->max < source->max) {
+    destination->max = source->max;
+  }
+  for (size_t i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+    destination->buckets[i] += source->buckets[i];
+  }
+}
+
+uint64_t histogram_percentile(const latency_histogram* histogram,
+                              double quantile)
+{
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(quantile * (double)histogram->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = bucket_midpoint(i);
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+
+  return histogram->max;
+}
+
+void histogram_write_json(const latency_histogram* histogram, FILE* file)
+{
+  uint64_t count = histogram->count;
+  uint64_t mean = count == 0 ? 0 : histogram->total / count;
+  fprintf(file,
+          "{\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, "
+          "\"p999\": %llu, \"max\": %llu}",
+          (unsigned long long)count,
+          (unsigned long long)mean,
+          (unsigned long long)histogram_percentile(histogram, 0.5),
+          (unsigned long long)histogram_percentile(histogram, 0.99),
+          (unsigned long long)histogram_percentile(histogram, 0.999),
+          (unsigned long long)histogram->max);
+}
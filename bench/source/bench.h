@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "server.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+typedef struct bench_flag {
+  volatile long value;
+} bench_flag;
+#else
+#  include <stdatomic.h>
+
+typedef struct bench_flag {
+  atomic_int value;
+} bench_flag;
+#endif
+
+/**
+ * @brief Sets the flag, so other threads can observe it.
+ */
+void bench_flag_set(bench_flag* flag);
+
+/**
+ * @brief Returns whether the flag was set by any thread.
+ */
+bool bench_flag_is_set(bench_flag* flag);
+
+/**
+ * @brief Returns the value of a monotonic clock in nanoseconds.
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * @brief Returns the value of the time stamp counter, or of the monotonic
+ * clock in nanoseconds on architectures without one.
+ */
+uint64_t bench_cycles(void);
+
+/**
+ * @brief Returns the unit of the values returned by ::bench_cycles.
+ */
+const char* bench_cycles_unit(void);
+
+/**
+ * @brief Pins the calling thread to the CPU core with the provided index.
+ */
+bool bench_pin_to_core(uint32_t core);
+
+/**
+ * @brief Suspends the calling thread for at least \c milliseconds.
+ */
+void bench_sleep_ms(uint32_t milliseconds);
+
+/**
+ * @brief Allocates zeroed memory with the provided alignment.
+ */
+void* bench_alloc(size_t size, size_t alignment);
+
+/**
+ * @brief Frees memory allocated with ::bench_alloc.
+ */
+void bench_free(void* pointer);
+
+typedef void (*bench_thread_function)(void* argument);
+
+typedef struct bench_thread {
+  void* handle;
+  bench_thread_function function;
+  void* argument;
+} bench_thread;
+
+/**
+ * @brief Starts a thread running \c function with \c argument.
+ */
+bool bench_thread_start(bench_thread* thread,
+                        bench_thread_function function,
+                        void* argument);
+
+/**
+ * @brief Waits for the thread to finish.
+ */
+void bench_thread_join(bench_thread* thread);
+
+/**
+ * @brief Parses an IPv4 address in dotted decimal notation.
+ */
+bool bench_parse_ipv4(const char* string, uint16_t port, ah_ipv4_address* out);
+
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS \
+  ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * @brief Log-linear histogram of nanosecond latencies.
+ *
+ * Values are recorded with a relative error of at most 1/64, so percentiles
+ * can be computed without storing every sample.
+ */
+typedef struct latency_histogram {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} latency_histogram;
+
+/**
+ * @brief Records a value in the histogram.
+ */
+void histogram_record(latency_histogram* histogram, uint64_t value);
+
+/**
+ * @brief Adds the samples of \c source to \c destination.
+ */
+void histogram_merge(latency_histogram* destination,
+                     const latency_histogram* source);
+
+/**
+ * @brief Returns the value below which the \c quantile of the samples fall.
+ */
+uint64_t histogram_percentile(const latency_histogram* histogram,
+                              double quantile);
+
+/**
+ * @brief Writes the summary of the histogram as a JSON object.
+ */
+void histogram_write_json(const latency_histogram* histogram, FILE* file);
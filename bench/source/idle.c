@@ -0,0 +1,760 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "server.h"
+
+/**
+ * @file
+ *
+ * Idle connection scale benchmark. The server runs in a forked child, so its
+ * resident set size only contains what the server side spends on the
+ * connections. The parent opens the requested number of connections, using
+ * as many loopback source addresses as necessary to not run out of ephemeral
+ * ports, and never sends anything on them. Once every connection is accepted,
+ * the child reports its memory use and the latency of ::server_tick with
+ * every connection idle.
+ */
+
+typedef enum session_mode
+{
+  SESSION_MODE_SESSION,
+  SESSION_MODE_POOLED,
+} session_mode;
+
+static const char* const session_mode_names[] = {"session", "pooled"};
+
+typedef struct idle_options {
+  session_mode mode;
+  uint32_t connections;
+  uint32_t per_address;
+  uint32_t in_flight;
+  uint32_t buffer_size;
+  uint32_t ticks;
+  uint16_t port;
+  const char* output;
+  const char* label;
+} idle_options;
+
+#define RAMP_SAMPLES 10
+#define CONTROL_POLL_MS 10
+#define DESCRIPTOR_HEADROOM 64
+
+typedef struct ramp_sample {
+  uint64_t connections;
+  uint64_t rss_bytes;
+  uint64_t elapsed_ns;
+} ramp_sample;
+
+/* Sent from the server process to the client process through a pipe */
+typedef struct server_report {
+  bool ok;
+  uint64_t accepted;
+  uint64_t rss_before_bytes;
+  uint64_t rss_after_bytes;
+  uint64_t accept_ns;
+  uint32_t ramp_samples;
+  ramp_sample ramp[RAMP_SAMPLES];
+  latency_histogram tick_latency;
+} server_report;
+
+static bool is_retry(ah_error_code error_code)
+{
+  return error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE;
+}
+
+static uint64_t resident_set_bytes(void)
+{
+  FILE* file = fopen("/proc/self/status", "r");
+  if (file == NULL) {
+    return 0;
+  }
+
+  char line[256];
+  unsigned long long kilobytes = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "VmRSS: %llu kB", &kilobytes) == 1) {
+      break;
+    }
+  }
+
+  fclose(file);
+  return (uint64_t)kilobytes * 1024U;
+}
+
+static bool write_all(int descriptor, const void* data, size_t size)
+{
+  const uint8_t* pointer = data;
+  while (size != 0) {
+    ssize_t result = write(descriptor, pointer, size);
+    if (result <= 0) {
+      return false;
+    }
+    pointer += result;
+    size -= (size_t)result;
+  }
+
+  return true;
+}
+
+static bool read_all(int descriptor, void* data, size_t size)
+{
+  uint8_t* pointer = data;
+  while (size != 0) {
+    ssize_t result = read(descriptor, pointer, size);
+    if (result <= 0) {
+      return false;
+    }
+    pointer += result;
+    size -= (size_t)result;
+  }
+
+  return true;
+}
+
+/* Server */
+
+/* Mirrors io_session in lib.c, but the size of the buffer is configurable, so
+ * its cost can be told apart from the rest of the session. In pooled mode,
+ * the sessions have no buffer and read into one shared by the server. */
+typedef struct idle_session {
+  ah_io_dock dock;
+  size_t state;
+  ah_socket_accepted socket;
+  ah_address address;
+  uint32_t bytes_read;
+  uint8_t buffer[];
+} idle_session;
+
+typedef struct idle_server {
+  const idle_options* options;
+  int control;
+  int results;
+  ah_context context;
+  ah_server* server;
+  ah_socket* listener;
+  ah_acceptor* acceptor;
+  ah_timer* timer;
+  uint8_t* pool;
+  uint64_t target;
+  uint64_t first_accept_ns;
+  server_report* report;
+  bool failed;
+} idle_server;
+
+static bool session_on_read(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data);
+
+static bool session_queue_read(idle_session* session)
+{
+  idle_server* state = context_from_socket(&session->socket)->user_data;
+  ah_io_buffer buffer = state->pool == NULL
+      ? (ah_io_buffer) {state->options->buffer_size, session->buffer}
+      : (ah_io_buffer) {state->options->buffer_size, state->pool};
+  return queue_read_operation(&session->dock, buffer, session_on_read);
+}
+
+static bool session_on_read(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data)
+{
+  (void)per_call_data;
+
+  idle_session* session = (idle_session*)dock_from_operation(operation);
+  if (is_retry(error_code)) {
+    return session_queue_read(session);
+  }
+
+  /* The clients never send anything, so the only completion is the peer
+   * going away */
+  session->bytes_read = bytes_transferred;
+  bool result = destroy_socket(&session->socket);
+  free(session);
+  return result;
+}
+
+static void sample_ramp(idle_server* state, uint64_t now)
+{
+  server_report* report = state->report;
+  uint64_t connections = state->options->connections;
+  uint32_t index = report->ramp_samples;
+  if (index == RAMP_SAMPLES
+      || report->accepted < connections * (index + 1) / RAMP_SAMPLES)
+  {
+    return;
+  }
+
+  report->ramp[index] = (ramp_sample) {
+      report->accepted,
+      resident_set_bytes(),
+      now - state->first_accept_ns,
+  };
+  report->ramp_samples = index + 1;
+}
+
+static bool server_on_accept(ah_error_code error_code,
+                             ah_socket* socket,
+                             const ah_address* address)
+{
+  idle_server* state = context_from_socket(socket)->user_data;
+  if (error_code != AH_ERR_OK) {
+    fprintf(stderr, "Accept failed with error code %d\n", error_code);
+    state->failed = true;
+    return true;
+  }
+
+  size_t buffer_size = state->pool == NULL ? state->options->buffer_size : 0;
+  idle_session* session = calloc(1, sizeof(idle_session) + buffer_size);
+  if (session == NULL) {
+    state->failed = true;
+    return true;
+  }
+
+  move_socket(&session->socket, socket);
+  session->dock.socket = &session->socket;
+  session->address = *address;
+
+  uint64_t now = bench_now_ns();
+  server_report* report = state->report;
+  if (++report->accepted == 1) {
+    state->first_accept_ns = now;
+  }
+  report->accept_ns = now - state->first_accept_ns;
+  sample_ramp(state, now);
+
+  return session_queue_read(session);
+}
+
+static bool server_on_control_timer(ah_timer* timer, void* user_data)
+{
+  idle_server* state = user_data;
+  struct pollfd descriptor = {state->control, POLLIN, 0};
+  if (poll(&descriptor, 1, 0) != 1) {
+    start_timer(timer, CONTROL_POLL_MS);
+    return true;
+  }
+
+  /* The client either reports how many connections it managed to open or
+   * closes the pipe if it failed */
+  if (!read_all(state->control, &state->target, sizeof(state->target))) {
+    state->failed = true;
+  }
+
+  return true;
+}
+
+static bool server_on_tick_timer(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+  (void)user_data;
+
+  return true;
+}
+
+static void server_measure_ticks(idle_server* state)
+{
+  server_report* report = state->report;
+  stop_timer(state->timer);
+  create_timer(state->timer, state->server, server_on_tick_timer, NULL);
+
+  /* An expired timer makes the tick poll without blocking, so this measures
+   * the cost of a tick that has nothing to do */
+  for (uint32_t i = 0; i != state->options->ticks; ++i) {
+    start_timer(state->timer, 0);
+    uint64_t start = bench_now_ns();
+    if (!server_tick(state->server, NULL)) {
+      state->failed = true;
+      return;
+    }
+    histogram_record(&report->tick_latency, bench_now_ns() - start);
+  }
+}
+
+static void server_run(idle_server* state)
+{
+  const idle_options* options = state->options;
+  server_report* report = state->report;
+
+  state->server = bench_alloc(server_size(), server_alignment());
+  state->listener = bench_alloc(socket_size(), socket_alignment());
+  state->acceptor = bench_alloc(acceptor_size(), acceptor_alignment());
+  state->timer = bench_alloc(timer_size(), timer_alignment());
+  if (state->server == NULL || state->listener == NULL
+      || state->acceptor == NULL || state->timer == NULL)
+  {
+    return;
+  }
+
+  if (options->mode == SESSION_MODE_POOLED) {
+    state->pool = malloc(options->buffer_size);
+    if (state->pool == NULL) {
+      return;
+    }
+  }
+
+  if (!create_server(state->server)) {
+    return;
+  }
+
+  state->context = (ah_context) {state->server, state};
+  set_socket_span(state->server, (ah_socket_span) {1, state->listener});
+  if (!create_socket(state->listener, &state->context, options->port)
+      || !create_acceptor(state->acceptor, state->listener, server_on_accept))
+  {
+    return;
+  }
+
+  /* The report follows the byte signalling that the server listens */
+  uint8_t ready = 1;
+  if (!write_all(state->results, &ready, 1)) {
+    return;
+  }
+
+  create_timer(state->timer, state->server, server_on_control_timer, state);
+  start_timer(state->timer, CONTROL_POLL_MS);
+  state->target = UINT64_MAX;
+  report->rss_before_bytes = resident_set_bytes();
+
+  while (!state->failed && report->accepted < state->target) {
+    if (!server_tick(state->server, NULL)) {
+      return;
+    }
+  }
+  if (state->failed) {
+    return;
+  }
+
+  report->rss_after_bytes = resident_set_bytes();
+  server_measure_ticks(state);
+  report->ok = !state->failed;
+}
+
+static int server_process(const idle_options* options,
+                          int control,
+                          int results)
+{
+  server_report* report = calloc(1, sizeof(server_report));
+  if (report == NULL) {
+    return 1;
+  }
+
+  idle_server state = {
+      .options = options,
+      .control = control,
+      .results = results,
+      .report = report,
+  };
+  server_run(&state);
+
+  /* The sessions are not torn down one by one, because the process exits
+   * right after the report is sent anyway */
+  return write_all(results, report, sizeof(server_report)) && report->ok ? 0
+                                                                         : 1;
+}
+
+/* Client */
+
+typedef struct idle_client {
+  const idle_options* options;
+  ah_context context;
+  ah_server* server;
+  uint8_t* connectors;
+  ah_socket_accepted* sockets;
+  uint32_t next;
+  uint32_t established;
+  uint32_t pending;
+  bool failed;
+} idle_client;
+
+static ah_address source_address(const idle_client* client, uint32_t index)
+{
+  /* Every source address has its own set of ephemeral ports, so the
+   * connections are spread over 127.x.y.1-254 */
+  uint32_t source = index / client->options->per_address;
+  return address_from_ipv4((ah_ipv4_address) {
+      {127,
+       (uint8_t)(source / 254 / 256),
+       (uint8_t)(source / 254 % 256),
+       (uint8_t)(source % 254 + 1)},
+      0,
+  });
+}
+
+static bool client_connect_next(idle_client* client, ah_connector* connector)
+{
+  const idle_options* options = client->options;
+  if (client->failed || client->next == options->connections) {
+    return true;
+  }
+
+  ah_address local_address = source_address(client, client->next);
+  ah_address address =
+      address_from_ipv4((ah_ipv4_address) {{127, 0, 0, 1}, options->port});
+  ++client->next;
+  ++client->pending;
+  return queue_connect_operation(
+      connector, &address, &local_address, connector);
+}
+
+static bool client_on_connect(ah_error_code error_code,
+                              ah_socket* socket,
+                              void* per_call_data)
+{
+  idle_client* client = context_from_socket(socket)->user_data;
+  --client->pending;
+  if (error_code != AH_ERR_OK) {
+    fprintf(stderr,
+            "Connect failed with error code %d after %u connections\n",
+            error_code,
+            client->established);
+    client->failed = true;
+    return true;
+  }
+
+  move_socket(&client->sockets[client->established++], socket);
+  return client_connect_next(client, per_call_data);
+}
+
+static bool client_run(idle_client* client)
+{
+  const idle_options* options = client->options;
+  size_t size = connector_size();
+
+  client->server = bench_alloc(server_size(), server_alignment());
+  client->connectors =
+      bench_alloc(size * options->in_flight, connector_alignment());
+  client->sockets = calloc(options->connections, sizeof(ah_socket_accepted));
+  if (client->server == NULL || client->connectors == NULL
+      || client->sockets == NULL || !create_server(client->server))
+  {
+    return false;
+  }
+
+  client->context = (ah_context) {client->server, client};
+  for (uint32_t i = 0; i != options->in_flight; ++i) {
+    ah_connector* connector = (ah_connector*)(client->connectors + i * size);
+    create_connector(connector, &client->context, client_on_connect);
+    if (!client_connect_next(client, connector)) {
+      return false;
+    }
+  }
+
+  while (client->pending != 0) {
+    if (!server_tick(client->server, NULL)) {
+      return false;
+    }
+  }
+
+  return !client->failed;
+}
+
+static void client_destroy(idle_client* client)
+{
+  for (uint32_t i = 0; i != client->established; ++i) {
+    destroy_socket(&client->sockets[i]);
+  }
+
+  if (client->connectors != NULL) {
+    for (uint32_t i = 0; i != client->options->in_flight; ++i) {
+      size_t offset = i * connector_size();
+      destroy_connector((ah_connector*)(client->connectors + offset));
+    }
+  }
+
+  if (client->server != NULL) {
+    destroy_server(client->server);
+  }
+  bench_free(client->server);
+  bench_free(client->connectors);
+  free(client->sockets);
+}
+
+/* Driver */
+
+static void print_usage(void)
+{
+  fputs(
+      "Usage: adhoc-server_idle [options]\n"
+      "  --mode session|pooled  per-session buffers as in lib.c, or one\n"
+      "                         buffer shared by the server (default: "
+      "session)\n"
+      "  --connections N        idle connections to open (default: 10000)\n"
+      "  --per-address N        connections per loopback source address\n"
+      "                         (default: 3/4 of the ephemeral port range)\n"
+      "  --in-flight N          concurrent connect operations (default: "
+      "128)\n"
+      "  --buffer-size N        read buffer bytes (default: 8192)\n"
+      "  --ticks N              idle ticks to measure (default: 10000)\n"
+      "  --port N               server port (default: 1339)\n"
+      "  --output FILE          write the results as JSON to FILE\n"
+      "  --label TEXT           label stored in the JSON results\n"
+      "Both processes need N + 64 file descriptors, so the hard limit of\n"
+      "RLIMIT_NOFILE (and fs.nr_open) must be raised for 1M connections.\n",
+      stderr);
+}
+
+static uint32_t default_per_address(void)
+{
+  unsigned int low = 32768;
+  unsigned int high = 60999;
+  FILE* file = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+  if (file != NULL) {
+    if (fscanf(file, "%u %u", &low, &high) != 2 || high < low) {
+      low = 32768;
+      high = 60999;
+    }
+    fclose(file);
+  }
+
+  /* Leave room for the ports of other sockets on the machine */
+  return (high - low + 1) / 4 * 3;
+}
+
+static bool parse_options(int argc, const char* argv[], idle_options* options)
+{
+  unsigned long port = options->port;
+  for (int i = 1; i < argc; ++i) {
+    const char* name = argv[i];
+    if (i + 1 == argc) {
+      return false;
+    }
+
+    const char* value = argv[++i];
+    if (strcmp(name, "--mode") == 0) {
+      if (strcmp(value, session_mode_names[SESSION_MODE_SESSION]) == 0) {
+        options->mode = SESSION_MODE_SESSION;
+      } else if (strcmp(value, session_mode_names[SESSION_MODE_POOLED]) == 0)
+      {
+        options->mode = SESSION_MODE_POOLED;
+      } else {
+        return false;
+      }
+    } else if (strcmp(name, "--connections") == 0) {
+      options->connections = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--per-address") == 0) {
+      options->per_address = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--in-flight") == 0) {
+      options->in_flight = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--buffer-size") == 0) {
+      options->buffer_size = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--ticks") == 0) {
+      options->ticks = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--port") == 0) {
+      port = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--output") == 0) {
+      options->output = value;
+    } else if (strcmp(name, "--label") == 0) {
+      options->label = value;
+    } else {
+      return false;
+    }
+  }
+
+  options->port = (uint16_t)port;
+  return port != 0 && port <= UINT16_MAX && options->connections != 0
+      && options->per_address != 0 && options->in_flight != 0
+      && options->buffer_size != 0;
+}
+
+static bool raise_descriptor_limit(uint32_t connections)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+    perror("getrlimit");
+    return false;
+  }
+
+  rlim_t needed = (rlim_t)connections + DESCRIPTOR_HEADROOM;
+  if (limit.rlim_cur >= needed) {
+    return true;
+  }
+  if (limit.rlim_max < needed) {
+    fprintf(stderr,
+            "%u connections need %llu file descriptors, but the hard limit "
+            "is %llu\n",
+            connections,
+            (unsigned long long)needed,
+            (unsigned long long)limit.rlim_max);
+    return false;
+  }
+
+  limit.rlim_cur = needed;
+  if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+    perror("setrlimit");
+    return false;
+  }
+
+  return true;
+}
+
+static void write_results(const idle_options* options,
+                          const idle_client* client,
+                          const server_report* report,
+                          uint64_t connect_ns,
+                          FILE* file)
+{
+  uint64_t established = client->established;
+  uint64_t rss_delta = report->rss_after_bytes > report->rss_before_bytes
+      ? report->rss_after_bytes - report->rss_before_bytes
+      : 0;
+  uint32_t addresses =
+      (options->connections - 1) / options->per_address + 1;
+  size_t buffer_size =
+      options->mode == SESSION_MODE_SESSION ? options->buffer_size : 0;
+  double accept_s = (double)report->accept_ns / 1e9;
+  fprintf(file,
+          "{\n"
+          "  \"benchmark\": \"idle\",\n"
+          "  \"label\": \"%s\",\n"
+          "  \"backend\": \"%s\",\n"
+          "  \"mode\": \"%s\",\n"
+          "  \"connections_requested\": %u,\n"
+          "  \"connections\": %llu,\n"
+          "  \"source_addresses\": %u,\n"
+          "  \"buffer_size\": %u,\n"
+          "  \"sizes\": {\"session\": %zu, \"io_dock\": %zu, "
+          "\"socket_accepted\": %zu, \"socket\": %zu, \"acceptor\": %zu},\n"
+          "  \"rss_before_bytes\": %llu,\n"
+          "  \"rss_after_bytes\": %llu,\n"
+          "  \"rss_per_connection_bytes\": %.1f,\n"
+          "  \"connect_s\": %.3f,\n"
+          "  \"accept_s\": %.3f,\n"
+          "  \"accepts_per_second\": %.1f,\n"
+          "  \"ramp\": [",
+          options->label,
+          server_backend_name(),
+          session_mode_names[options->mode],
+          options->connections,
+          (unsigned long long)established,
+          addresses,
+          options->buffer_size,
+          sizeof(idle_session) + buffer_size,
+          sizeof(ah_io_dock),
+          sizeof(ah_socket_accepted),
+          socket_size(),
+          acceptor_size(),
+          (unsigned long long)report->rss_before_bytes,
+          (unsigned long long)report->rss_after_bytes,
+          established == 0 ? 0.0 : (double)rss_delta / (double)established,
+          (double)connect_ns / 1e9,
+          accept_s,
+          report->accept_ns == 0 ? 0.0 : (double)report->accepted / accept_s);
+  for (uint32_t i = 0; i != report->ramp_samples; ++i) {
+    const ramp_sample* sample = &report->ramp[i];
+    fprintf(file,
+            "%s\n    {\"connections\": %llu, \"rss_bytes\": %llu, "
+            "\"elapsed_s\": %.3f}",
+            i == 0 ? "" : ",",
+            (unsigned long long)sample->connections,
+            (unsigned long long)sample->rss_bytes,
+            (double)sample->elapsed_ns / 1e9);
+  }
+  fputs("\n  ],\n  \"idle_tick_ns\": ", file);
+  histogram_write_json(&report->tick_latency, file);
+  fputs("\n}\n", file);
+}
+
+static int run(const idle_options* options)
+{
+  int control[2];
+  int results[2];
+  if (pipe(control) == -1 || pipe(results) == -1) {
+    perror("pipe");
+    return 1;
+  }
+
+  pid_t child = fork();
+  if (child == -1) {
+    perror("fork");
+    return 1;
+  }
+  if (child == 0) {
+    close(control[1]);
+    close(results[0]);
+    _exit(server_process(options, control[0], results[1]));
+  }
+
+  close(control[0]);
+  close(results[1]);
+
+  int exit_code = 1;
+  server_report* report = calloc(1, sizeof(server_report));
+  idle_client client = {.options = options};
+  uint8_t ready;
+  if (report == NULL || !read_all(results[0], &ready, 1)) {
+    goto exit;
+  }
+
+  uint64_t start = bench_now_ns();
+  bool connected = client_run(&client);
+  uint64_t connect_ns = bench_now_ns() - start;
+
+  uint64_t target = client.established;
+  if (!write_all(control[1], &target, sizeof(target))
+      || !read_all(results[0], report, sizeof(server_report)))
+  {
+    goto exit;
+  }
+
+  write_results(options, &client, report, connect_ns, stdout);
+  if (options->output != NULL) {
+    FILE* file = fopen(options->output, "w");
+    if (file == NULL) {
+      perror("fopen");
+      goto exit;
+    }
+    write_results(options, &client, report, connect_ns, file);
+    fclose(file);
+  }
+
+  exit_code = connected && report->ok ? 0 : 1;
+
+exit:
+  close(control[1]);
+  close(results[0]);
+  int status = 0;
+  if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0)
+  {
+    exit_code = 1;
+  }
+
+  client_destroy(&client);
+  free(report);
+  return exit_code;
+}
+
+int main(int argc, const char* argv[])
+{
+  idle_options options = {
+      .mode = SESSION_MODE_SESSION,
+      .connections = 10000,
+      .per_address = default_per_address(),
+      .in_flight = 128,
+      .buffer_size = 8192,
+      .ticks = 10000,
+      .port = 1339,
+      .label = "",
+  };
+  if (!parse_options(argc, argv, &options)) {
+    print_usage();
+    return 2;
+  }
+
+  if (options.in_flight > options.connections) {
+    options.in_flight = options.connections;
+  }
+  if (!raise_descriptor_limit(options.connections)) {
+    return 1;
+  }
+
+  return run(&options);
+}
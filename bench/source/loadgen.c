@@ -0,0 +1,963 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "http.h"
+#include "memcached.h"
+#include "server.h"
+
+/**
+ * @file
+ *
+ * Closed-loop load generator for the server library. Every client thread runs
+ * its own ::ah_server event loop and keeps a fixed number of connections busy
+ * with one outstanding request each. The server side is either run in-process
+ * on a separate thread, or in another process started with \c --serve. The
+ * HTTP workload sends a batch of pipelined requests instead and counts each
+ * of them. The memcached workload stores a value of the response size with
+ * \c noreply and retrieves it with a batch of pipelined \c get commands.
+ */
+
+typedef enum workload
+{
+  WORKLOAD_ECHO,
+  WORKLOAD_REQUEST_RESPONSE,
+  WORKLOAD_CHURN,
+  WORKLOAD_HTTP,
+  WORKLOAD_MEMCACHED,
+} workload;
+
+static const char* const workload_names[] = {
+    "echo", "rr", "churn", "http", "memcached"};
+
+#define WORKLOAD_COUNT (sizeof(workload_names) / sizeof(workload_names[0]))
+
+typedef struct loadgen_options {
+  workload workload;
+  uint32_t threads;
+  uint32_t connections;
+  double duration_s;
+  double warmup_s;
+  uint32_t request_size;
+  uint32_t response_size;
+  uint32_t pipeline;
+  ah_ipv4_address address;
+  bool serve;
+  bool external;
+  const char* output;
+  const char* label;
+} loadgen_options;
+
+#define SCRATCH_SIZE (64 * 1024)
+#define STOP_POLL_MS 50
+
+#define HTTP_REQUEST "GET /plaintext HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define HTTP_STATIC_HEADERS "Server: adhoc\r\nContent-Type: text/plain\r\n"
+#define HTTP_BODY "Hello, World!"
+
+#define MEMCACHED_KEY "bench"
+#define MEMCACHED_GET "get " MEMCACHED_KEY "\r\n"
+#define MEMCACHED_END "END\r\n"
+#define MEMCACHED_MEMORY_LIMIT (64 * 1024 * 1024)
+
+#define STRING_LENGTH(str) ((uint32_t)sizeof(str) - 1)
+
+/* The responses of the in-process server have a fixed size */
+static uint32_t http_response_size(void)
+{
+  return STRING_LENGTH("HTTP/1.1 200 OK\r\n") + AH_HTTP_DATE_LENGTH
+      + STRING_LENGTH("Content-Length: 13\r\n")
+      + STRING_LENGTH(HTTP_STATIC_HEADERS "\r\n" HTTP_BODY);
+}
+
+static uint32_t memcached_set_length(const loadgen_options* options,
+                                     char* line)
+{
+  return (uint32_t)sprintf(line,
+                           "set " MEMCACHED_KEY " 0 0 %u noreply\r\n",
+                           options->response_size);
+}
+
+static uint32_t memcached_response_size(const loadgen_options* options)
+{
+  char line[64];
+  uint32_t length = (uint32_t)sprintf(
+      line, "VALUE " MEMCACHED_KEY " 0 %u\r\n", options->response_size);
+  return length + options->response_size + 2 + STRING_LENGTH(MEMCACHED_END);
+}
+
+static bool is_pipelined(const loadgen_options* options)
+{
+  return options->workload == WORKLOAD_HTTP
+      || options->workload == WORKLOAD_MEMCACHED;
+}
+
+static uint32_t expected_response_size(const loadgen_options* options)
+{
+  switch (options->workload) {
+    case WORKLOAD_ECHO:
+      return options->request_size;
+    case WORKLOAD_HTTP:
+      return options->pipeline * http_response_size();
+    case WORKLOAD_MEMCACHED:
+      return options->pipeline * memcached_response_size(options);
+    default:
+      return options->response_size;
+  }
+}
+
+/* Server */
+
+typedef struct server_connection server_connection;
+
+typedef struct server_state {
+  const loadgen_options* options;
+  ah_context context;
+  ah_server* server;
+  ah_socket* listener;
+  ah_acceptor* acceptor;
+  ah_timer* timer;
+  uint8_t* response;
+  ah_http_server http;
+  ah_memcached_server memcached;
+  server_connection* connections;
+  bench_flag listening;
+  bench_flag stop;
+  bool ok;
+} server_state;
+
+struct server_connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  server_state* state;
+  server_connection* previous;
+  server_connection* next;
+  uint32_t received;
+  uint32_t write_size;
+  uint32_t written;
+  uint8_t buffer[SCRATCH_SIZE];
+};
+
+static bool is_retry(ah_error_code error_code)
+{
+  return error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE;
+}
+
+static bool server_close(server_connection* connection)
+{
+  server_state* state = connection->state;
+  if (connection->previous == NULL) {
+    state->connections = connection->next;
+  } else {
+    connection->previous->next = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->previous = connection->previous;
+  }
+
+  bool result = destroy_socket(&connection->socket);
+  free(connection);
+  return result;
+}
+
+static bool server_on_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data);
+
+static bool server_on_write(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data);
+
+static bool server_queue_read(server_connection* connection)
+{
+  ah_io_buffer buffer = {SCRATCH_SIZE, connection->buffer};
+  return queue_read_operation(&connection->dock, buffer, server_on_read);
+}
+
+static bool server_queue_write(server_connection* connection)
+{
+  server_state* state = connection->state;
+  uint8_t* data = state->options->workload == WORKLOAD_ECHO
+      ? connection->buffer
+      : state->response;
+  ah_io_buffer buffer = {
+      connection->write_size - connection->written,
+      data + connection->written,
+  };
+  return queue_write_operation(&connection->dock, buffer, server_on_write);
+}
+
+static bool server_on_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data)
+{
+  (void)per_call_data;
+
+  server_connection* connection =
+      (server_connection*)dock_from_operation(operation);
+  if (is_retry(error_code)) {
+    return server_queue_read(connection);
+  }
+  if (error_code != AH_ERR_OK || bytes_transferred == 0) {
+    return server_close(connection);
+  }
+
+  const loadgen_options* options = connection->state->options;
+  if (options->workload == WORKLOAD_ECHO) {
+    connection->write_size = bytes_transferred;
+  } else {
+    connection->received += bytes_transferred;
+    if (connection->received < options->request_size) {
+      return server_queue_read(connection);
+    }
+    connection->received = 0;
+    connection->write_size = options->response_size;
+  }
+
+  connection->written = 0;
+  return server_queue_write(connection);
+}
+
+static bool server_on_write(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data)
+{
+  (void)per_call_data;
+
+  server_connection* connection =
+      (server_connection*)dock_from_operation(operation);
+  if (is_retry(error_code)) {
+    return server_queue_write(connection);
+  }
+  if (error_code != AH_ERR_OK) {
+    return server_close(connection);
+  }
+
+  connection->written += bytes_transferred;
+  if (connection->written < connection->write_size) {
+    return server_queue_write(connection);
+  }
+
+  /* Churning clients get disconnected by the server, so the TIME_WAIT state
+   * does not eat up the ephemeral ports of the client */
+  if (connection->state->options->workload == WORKLOAD_CHURN) {
+    return server_close(connection);
+  }
+
+  return server_queue_read(connection);
+}
+
+static bool server_on_http_request(ah_http_exchange* exchange,
+                                   const ah_http_request* request,
+                                   void* user_data)
+{
+  (void)request;
+  (void)user_data;
+
+  static uint8_t body[] = HTTP_BODY;
+  ah_io_buffer buffer = {STRING_LENGTH(HTTP_BODY), body};
+  return http_respond(exchange, 200, (ah_io_buffer) {0}, buffer, NULL, NULL);
+}
+
+static bool server_on_accept(ah_error_code error_code,
+                             ah_socket* socket,
+                             const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK) {
+    return true;
+  }
+
+  server_state* state = context_from_socket(socket)->user_data;
+  if (state->options->workload == WORKLOAD_HTTP) {
+    return http_accept(&state->http, socket);
+  }
+  if (state->options->workload == WORKLOAD_MEMCACHED) {
+    return memcached_accept(&state->memcached, socket);
+  }
+
+  server_connection* connection = calloc(1, sizeof(server_connection));
+  if (connection == NULL) {
+    return true;
+  }
+
+  connection->state = state;
+  connection->next = state->connections;
+  if (state->connections != NULL) {
+    state->connections->previous = connection;
+  }
+  state->connections = connection;
+
+  move_socket(&connection->socket, socket);
+  connection->dock.socket = &connection->socket;
+  return server_queue_read(connection);
+}
+
+static bool server_on_timer(ah_timer* timer, void* user_data)
+{
+  server_state* state = user_data;
+  if (!bench_flag_is_set(&state->stop)) {
+    start_timer(timer, STOP_POLL_MS);
+  }
+
+  return true;
+}
+
+static void server_thread(void* argument)
+{
+  server_state* state = argument;
+  const loadgen_options* options = state->options;
+
+  state->server = bench_alloc(server_size(), server_alignment());
+  state->listener = bench_alloc(socket_size(), socket_alignment());
+  state->acceptor = bench_alloc(acceptor_size(), acceptor_alignment());
+  state->timer = bench_alloc(timer_size(), timer_alignment());
+  state->response = calloc(1, options->response_size + 1);
+  if (state->server == NULL || state->listener == NULL
+      || state->acceptor == NULL || state->timer == NULL
+      || state->response == NULL)
+  {
+    goto exit;
+  }
+
+  if (!create_server(state->server)) {
+    goto exit;
+  }
+
+  static uint8_t static_headers[] = HTTP_STATIC_HEADERS;
+  if (options->workload == WORKLOAD_HTTP
+      && !create_http_server(
+          &state->http,
+          state->server,
+          (ah_io_buffer) {STRING_LENGTH(HTTP_STATIC_HEADERS), static_headers},
+          server_on_http_request,
+          state))
+  {
+    goto exit;
+  }
+
+  if (options->workload == WORKLOAD_MEMCACHED
+      && !create_memcached_server(
+          &state->memcached, state->server, MEMCACHED_MEMORY_LIMIT))
+  {
+    goto exit;
+  }
+
+  state->context = (ah_context) {state->server, state};
+  set_socket_span(state->server, (ah_socket_span) {1, state->listener});
+  if (!create_socket(state->listener, &state->context, options->address.port)
+      || !create_acceptor(state->acceptor, state->listener, server_on_accept))
+  {
+    goto exit;
+  }
+
+  create_timer(state->timer, state->server, server_on_timer, state);
+  start_timer(state->timer, STOP_POLL_MS);
+  bench_flag_set(&state->listening);
+
+  state->ok = true;
+  while (!bench_flag_is_set(&state->stop)) {
+    if (!server_tick(state->server, NULL)) {
+      state->ok = false;
+      break;
+    }
+  }
+
+  while (state->connections != NULL) {
+    server_close(state->connections);
+  }
+
+exit:
+  destroy_http_server(&state->http);
+  destroy_memcached_server(&state->memcached);
+  bench_flag_set(&state->listening);
+  if (state->server != NULL) {
+    destroy_server(state->server);
+  }
+  bench_free(state->server);
+  bench_free(state->listener);
+  bench_free(state->acceptor);
+  bench_free(state->timer);
+  free(state->response);
+}
+
+/* Client */
+
+typedef struct client_thread client_thread;
+
+typedef struct client_connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  client_thread* thread;
+  ah_connector* connector;
+  uint64_t started_ns;
+  uint32_t written;
+  uint32_t received;
+  bool open;
+} client_connection;
+
+struct client_thread {
+  const loadgen_options* options;
+  bench_thread thread;
+  ah_context context;
+  ah_server* server;
+  ah_timer* timer;
+  uint8_t* request;
+  uint8_t* scratch;
+  client_connection* connections;
+  uint64_t warmup_end_ns;
+  uint64_t end_ns;
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t connects;
+  uint64_t errors;
+  latency_histogram latency;
+  bool stop;
+  bool ok;
+};
+
+static bool client_connect(client_connection* connection);
+
+static bool client_on_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data);
+
+static bool client_on_write(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data);
+
+static bool client_close(client_connection* connection)
+{
+  connection->open = false;
+  return destroy_socket(&connection->socket);
+}
+
+static bool client_fail(client_connection* connection)
+{
+  client_thread* thread = connection->thread;
+  ++thread->errors;
+  bool result = client_close(connection);
+  return thread->stop ? result : client_connect(connection) && result;
+}
+
+static bool client_queue_write(client_connection* connection)
+{
+  client_thread* thread = connection->thread;
+  ah_io_buffer buffer = {
+      thread->options->request_size - connection->written,
+      thread->request + connection->written,
+  };
+  return queue_write_operation(&connection->dock, buffer, client_on_write);
+}
+
+static bool client_queue_read(client_connection* connection)
+{
+  client_thread* thread = connection->thread;
+  uint32_t remaining =
+      expected_response_size(thread->options) - connection->received;
+  ah_io_buffer buffer = {
+      remaining < SCRATCH_SIZE ? remaining : SCRATCH_SIZE,
+      thread->scratch,
+  };
+  return queue_read_operation(&connection->dock, buffer, client_on_read);
+}
+
+static bool client_send_request(client_connection* connection)
+{
+  if (connection->thread->options->workload != WORKLOAD_CHURN) {
+    connection->started_ns = bench_now_ns();
+  }
+  connection->written = 0;
+  connection->received = 0;
+  return client_queue_write(connection);
+}
+
+static bool client_on_write(ah_error_code error_code,
+                            ah_io_operation* operation,
+                            uint32_t bytes_transferred,
+                            void* per_call_data)
+{
+  (void)per_call_data;
+
+  client_connection* connection =
+      (client_connection*)dock_from_operation(operation);
+  if (is_retry(error_code)) {
+    return client_queue_write(connection);
+  }
+  if (error_code != AH_ERR_OK) {
+    return client_fail(connection);
+  }
+
+  connection->written += bytes_transferred;
+  if (connection->written < connection->thread->options->request_size) {
+    return client_queue_write(connection);
+  }
+
+  return client_queue_read(connection);
+}
+
+static bool client_on_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data)
+{
+  (void)per_call_data;
+
+  client_connection* connection =
+      (client_connection*)dock_from_operation(operation);
+  client_thread* thread = connection->thread;
+  if (is_retry(error_code)) {
+    return client_queue_read(connection);
+  }
+  if (error_code != AH_ERR_OK || bytes_transferred == 0) {
+    return client_fail(connection);
+  }
+
+  connection->received += bytes_transferred;
+  if (connection->received < expected_response_size(thread->options)) {
+    return client_queue_read(connection);
+  }
+
+  uint64_t now = bench_now_ns();
+  if (now >= thread->warmup_end_ns && now < thread->end_ns) {
+    thread->requests +=
+        is_pipelined(thread->options) ? thread->options->pipeline : 1;
+    thread->bytes += connection->written + connection->received;
+    histogram_record(&thread->latency, now - connection->started_ns);
+  }
+
+  if (thread->stop) {
+    return client_close(connection);
+  }
+
+  if (thread->options->workload == WORKLOAD_CHURN) {
+    return client_close(connection) && client_connect(connection);
+  }
+
+  return client_send_request(connection);
+}
+
+static bool client_on_connect(ah_error_code error_code,
+                              ah_socket* socket,
+                              void* per_call_data)
+{
+  client_connection* connection = per_call_data;
+  client_thread* thread = connection->thread;
+  if (error_code != AH_ERR_OK) {
+    ++thread->errors;
+    /* Refused connections would be retried in a tight loop, so only
+     * transient errors are retried */
+    if (error_code != AH_ERR_ADDRESS_NOT_AVAILABLE || thread->stop) {
+      fprintf(stderr, "Connect failed with error code %d\n", error_code);
+      thread->ok = false;
+      thread->stop = true;
+      return true;
+    }
+
+    return client_connect(connection);
+  }
+
+  move_socket(&connection->socket, socket);
+  connection->dock.socket = &connection->socket;
+  connection->open = true;
+  ++thread->connects;
+  if (thread->stop) {
+    return client_close(connection);
+  }
+
+  return client_send_request(connection);
+}
+
+static bool client_connect(client_connection* connection)
+{
+  client_thread* thread = connection->thread;
+  if (thread->options->workload == WORKLOAD_CHURN) {
+    connection->started_ns = bench_now_ns();
+  }
+
+  ah_address address = address_from_ipv4(thread->options->address);
+  return queue_connect_operation(
+      connection->connector, &address, NULL, connection);
+}
+
+static bool client_on_timer(ah_timer* timer, void* user_data)
+{
+  client_thread* thread = user_data;
+  if (bench_now_ns() >= thread->end_ns) {
+    thread->stop = true;
+  } else {
+    start_timer(timer, STOP_POLL_MS);
+  }
+
+  return true;
+}
+
+static void client_thread_run(void* argument)
+{
+  client_thread* thread = argument;
+  const loadgen_options* options = thread->options;
+  uint32_t count = options->connections;
+
+  thread->server = bench_alloc(server_size(), server_alignment());
+  thread->timer = bench_alloc(timer_size(), timer_alignment());
+  thread->request = calloc(1, options->request_size + 1);
+  thread->scratch = malloc(SCRATCH_SIZE);
+  thread->connections = calloc(count, sizeof(client_connection));
+  if (thread->server == NULL || thread->timer == NULL
+      || thread->request == NULL || thread->scratch == NULL
+      || thread->connections == NULL || !create_server(thread->server))
+  {
+    goto exit;
+  }
+
+  if (options->workload == WORKLOAD_HTTP) {
+    for (uint32_t i = 0; i != options->pipeline; ++i) {
+      memcpy(thread->request + i * STRING_LENGTH(HTTP_REQUEST),
+             HTTP_REQUEST,
+             STRING_LENGTH(HTTP_REQUEST));
+    }
+  }
+
+  /* The value is stored again with every batch, so the workload also runs
+   * against a server that was restarted */
+  if (options->workload == WORKLOAD_MEMCACHED) {
+    char* request = (char*)thread->request;
+    uint32_t length = memcached_set_length(options, request);
+    memset(request + length, 'x', options->response_size);
+    length += options->response_size;
+    memcpy(request + length, "\r\n", 2);
+    length += 2;
+    for (uint32_t i = 0; i != options->pipeline; ++i) {
+      memcpy(request + length, MEMCACHED_GET, STRING_LENGTH(MEMCACHED_GET));
+      length += STRING_LENGTH(MEMCACHED_GET);
+    }
+  }
+
+  thread->context = (ah_context) {thread->server, thread};
+  create_timer(thread->timer, thread->server, client_on_timer, thread);
+  start_timer(thread->timer, STOP_POLL_MS);
+
+  thread->ok = true;
+  for (uint32_t i = 0; i != count; ++i) {
+    client_connection* connection = &thread->connections[i];
+    connection->thread = thread;
+    connection->connector =
+        bench_alloc(connector_size(), connector_alignment());
+    if (connection->connector == NULL) {
+      thread->ok = false;
+      goto cleanup;
+    }
+
+    create_connector(
+        connection->connector, &thread->context, client_on_connect);
+    if (!client_connect(connection)) {
+      thread->ok = false;
+      goto cleanup;
+    }
+  }
+
+  while (!thread->stop) {
+    if (!server_tick(thread->server, NULL)) {
+      thread->ok = false;
+      break;
+    }
+  }
+
+cleanup:
+  for (uint32_t i = 0; i != count; ++i) {
+    client_connection* connection = &thread->connections[i];
+    if (connection->open) {
+      client_close(connection);
+    }
+    if (connection->connector != NULL) {
+      destroy_connector(connection->connector);
+      bench_free(connection->connector);
+    }
+  }
+
+exit:
+  if (thread->server != NULL) {
+    destroy_server(thread->server);
+  }
+  bench_free(thread->server);
+  bench_free(thread->timer);
+  free(thread->request);
+  free(thread->scratch);
+  free(thread->connections);
+}
+
+/* Driver */
+
+static void print_usage(void)
+{
+  fputs(
+      "Usage: adhoc-server_loadgen [options]\n"
+      "  --workload echo|rr|churn|http|memcached\n"
+      "                            workload to run (default: echo)\n"
+      "  --threads N               client threads (default: 2)\n"
+      "  --connections N           connections per thread (default: 32)\n"
+      "  --duration S              measured seconds (default: 5)\n"
+      "  --warmup S                unmeasured seconds (default: 1)\n"
+      "  --request-size N          request bytes (default: 64)\n"
+      "  --response-size N         response bytes for rr/churn, value bytes\n"
+      "                            for memcached (default: 64)\n"
+      "  --pipeline N              pipelined requests for http/memcached\n"
+      "                            (default: 16)\n"
+      "  --host A.B.C.D            server address (default: 127.0.0.1)\n"
+      "  --port N                  server port (default: 1338)\n"
+      "  --external                do not start an in-process server\n"
+      "  --serve                   only run the server\n"
+      "  --output FILE             write the results as JSON to FILE\n"
+      "  --label TEXT              label stored in the JSON results\n",
+      stderr);
+}
+
+static bool parse_options(int argc,
+                          const char* argv[],
+                          loadgen_options* options)
+{
+  const char* host = "127.0.0.1";
+  unsigned long port = 1338;
+  for (int i = 1; i < argc; ++i) {
+    const char* name = argv[i];
+    if (strcmp(name, "--serve") == 0) {
+      options->serve = true;
+      continue;
+    }
+    if (strcmp(name, "--external") == 0) {
+      options->external = true;
+      continue;
+    }
+
+    if (i + 1 == argc) {
+      return false;
+    }
+    const char* value = argv[++i];
+    if (strcmp(name, "--workload") == 0) {
+      bool found = false;
+      for (size_t j = 0; j != WORKLOAD_COUNT; ++j) {
+        if (strcmp(value, workload_names[j]) == 0) {
+          options->workload = (workload)j;
+          found = true;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+    } else if (strcmp(name, "--threads") == 0) {
+      options->threads = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--connections") == 0) {
+      options->connections = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--duration") == 0) {
+      options->duration_s = strtod(value, NULL);
+    } else if (strcmp(name, "--warmup") == 0) {
+      options->warmup_s = strtod(value, NULL);
+    } else if (strcmp(name, "--request-size") == 0) {
+      options->request_size = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--response-size") == 0) {
+      options->response_size = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--pipeline") == 0) {
+      options->pipeline = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--host") == 0) {
+      host = value;
+    } else if (strcmp(name, "--port") == 0) {
+      port = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--output") == 0) {
+      options->output = value;
+    } else if (strcmp(name, "--label") == 0) {
+      options->label = value;
+    } else {
+      return false;
+    }
+  }
+
+  /* HTTP requests are fixed, so only their count can be chosen */
+  if (options->workload == WORKLOAD_HTTP) {
+    if (options->pipeline == 0) {
+      return false;
+    }
+    options->request_size = options->pipeline * STRING_LENGTH(HTTP_REQUEST);
+  }
+
+  /* The memcached requests follow from the value size and their count */
+  if (options->workload == WORKLOAD_MEMCACHED) {
+    char line[64];
+    if (options->pipeline == 0 || options->response_size > SCRATCH_SIZE) {
+      return false;
+    }
+    options->request_size = memcached_set_length(options, line)
+        + options->response_size + 2
+        + options->pipeline * STRING_LENGTH(MEMCACHED_GET);
+  }
+
+  return port <= UINT16_MAX && options->threads != 0
+      && options->connections != 0 && options->request_size != 0
+      && options->request_size <= SCRATCH_SIZE
+      && options->response_size != 0
+      && bench_parse_ipv4(host, (uint16_t)port, &options->address);
+}
+
+static void write_results(const loadgen_options* options,
+                          client_thread* threads,
+                          FILE* file)
+{
+  latency_histogram* latency = calloc(1, sizeof(latency_histogram));
+  if (latency == NULL) {
+    return;
+  }
+
+  uint64_t requests = 0;
+  uint64_t bytes = 0;
+  uint64_t connects = 0;
+  uint64_t errors = 0;
+  for (uint32_t i = 0; i != options->threads; ++i) {
+    requests += threads[i].requests;
+    bytes += threads[i].bytes;
+    connects += threads[i].connects;
+    errors += threads[i].errors;
+    histogram_merge(latency, &threads[i].latency);
+  }
+
+  double seconds = options->duration_s;
+  const ah_ipv4_address* address = &options->address;
+  fprintf(file,
+          "{\n"
+          "  \"benchmark\": \"loadgen\",\n"
+          "  \"label\": \"%s\",\n"
+          "  \"backend\": \"%s\",\n"
+          "  \"workload\": \"%s\",\n"
+          "  \"address\": \"%u.%u.%u.%u:%u\",\n"
+          "  \"threads\": %u,\n"
+          "  \"connections_per_thread\": %u,\n"
+          "  \"duration_s\": %.3f,\n"
+          "  \"request_size\": %u,\n"
+          "  \"response_size\": %u,\n"
+          "  \"pipeline\": %u,\n"
+          "  \"requests\": %llu,\n"
+          "  \"connects\": %llu,\n"
+          "  \"errors\": %llu,\n"
+          "  \"requests_per_second\": %.1f,\n"
+          "  \"megabytes_per_second\": %.3f,\n"
+          "  \"latency_ns\": ",
+          options->label,
+          server_backend_name(),
+          workload_names[options->workload],
+          address->address[0],
+          address->address[1],
+          address->address[2],
+          address->address[3],
+          address->port,
+          options->threads,
+          options->connections,
+          seconds,
+          options->request_size,
+          expected_response_size(options),
+          is_pipelined(options) ? options->pipeline : 1,
+          (unsigned long long)requests,
+          (unsigned long long)connects,
+          (unsigned long long)errors,
+          (double)requests / seconds,
+          (double)bytes / seconds / 1e6);
+  histogram_write_json(latency, file);
+  fputs("\n}\n", file);
+  free(latency);
+}
+
+int main(int argc, const char* argv[])
+{
+  loadgen_options options = {
+      .workload = WORKLOAD_ECHO,
+      .threads = 2,
+      .connections = 32,
+      .duration_s = 5.0,
+      .warmup_s = 1.0,
+      .request_size = 64,
+      .response_size = 64,
+      .pipeline = 16,
+      .label = "",
+  };
+  if (!parse_options(argc, argv, &options)) {
+    print_usage();
+    return 2;
+  }
+
+  server_state* server = NULL;
+  bench_thread server_handle;
+  if (options.serve || !options.external) {
+    server = calloc(1, sizeof(server_state));
+    if (server == NULL) {
+      return 1;
+    }
+
+    server->options = &options;
+    if (options.serve) {
+      server_thread(server);
+      return server->ok ? 0 : 1;
+    }
+
+    if (!bench_thread_start(&server_handle, server_thread, server)) {
+      return 1;
+    }
+    while (!bench_flag_is_set(&server->listening)) {
+      bench_sleep_ms(1);
+    }
+  }
+
+  int exit_code = 0;
+  client_thread* threads = calloc(options.threads, sizeof(client_thread));
+  if (threads == NULL) {
+    return 1;
+  }
+
+  uint64_t start = bench_now_ns();
+  uint64_t warmup_end = start + (uint64_t)(options.warmup_s * 1e9);
+  uint64_t end = warmup_end + (uint64_t)(options.duration_s * 1e9);
+  for (uint32_t i = 0; i != options.threads; ++i) {
+    client_thread* thread = &threads[i];
+    thread->options = &options;
+    thread->warmup_end_ns = warmup_end;
+    thread->end_ns = end;
+    if (!bench_thread_start(&thread->thread, client_thread_run, thread)) {
+      return 1;
+    }
+  }
+
+  for (uint32_t i = 0; i != options.threads; ++i) {
+    bench_thread_join(&threads[i].thread);
+    if (!threads[i].ok) {
+      exit_code = 1;
+    }
+  }
+
+  if (server != NULL) {
+    bench_flag_set(&server->stop);
+    bench_thread_join(&server_handle);
+    if (!server->ok) {
+      exit_code = 1;
+    }
+  }
+
+  write_results(&options, threads, stdout);
+  if (options.output != NULL) {
+    FILE* file = fopen(options.output, "w");
+    if (file == NULL) {
+      perror("fopen");
+      exit_code = 1;
+    } else {
+      write_results(&options, threads, file);
+      fclose(file);
+    }
+  }
+
+  free(threads);
+  free(server);
+  return exit_code;
+}
@@ -0,0 +1,846 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "server.h"
+#ifndef _WIN32
+#  include "server/detail.posix.h"
+#endif
+
+/**
+ * @file
+ *
+ * Microbenchmarks for the primitives on the hot paths of the event loop. Every
+ * case runs its operation in a tight loop, which is repeated a number of
+ * times on a pinned core. The minimum and the median of the cost per
+ * operation over the repetitions are reported, the minimum being the most
+ * reproducible one across runs.
+ */
+
+typedef struct micro_options {
+  uint64_t iterations;
+  uint32_t repetitions;
+  uint32_t core;
+  bool pin;
+  uint16_t port;
+  const char* filter;
+  const char* output;
+  const char* label;
+} micro_options;
+
+#define MAX_REPETITIONS 101
+#define DOCK_COUNT 64
+#define ERROR_CODE_COUNT 8
+#define TIMER_COUNT 64
+#define BUMP_BUFFER_SIZE (64 * 1024)
+#define CONNECT_TICK_LIMIT 1000
+#define FRAME_RING_SIZE (64 * 1024)
+
+/* Keeps the results of the measured operations alive */
+static volatile uint64_t sink;
+
+typedef struct frame_stream {
+  ah_ring ring;
+  ah_framer framer;
+  uint32_t delimiter_length;
+  uint32_t cursor;
+} frame_stream;
+
+typedef struct micro_fixture {
+  const micro_options* options;
+  ah_context context;
+  ah_server* server;
+  ah_socket* listener;
+  ah_acceptor* acceptor;
+  ah_connector* connector;
+  ah_timer* timer;
+  uint8_t* timers;
+  ah_socket_accepted server_socket;
+  ah_socket_accepted client_socket;
+  ah_io_dock server_dock;
+  ah_io_dock client_dock;
+  bool accepted;
+  bool connected;
+  bool connect_done;
+  bool received;
+  bool failed;
+  uint8_t byte_in;
+  uint8_t byte_out;
+  ah_io_dock docks[DOCK_COUNT];
+  int error_codes[ERROR_CODE_COUNT];
+  uint8_t* bump_buffer;
+  size_t bump_offset;
+  frame_stream lines;
+  frame_stream headers;
+  uint64_t frames;
+  uint64_t frame_bytes;
+} micro_fixture;
+
+typedef struct micro_case {
+  const char* name;
+  /* The iteration count is divided by this, so cases doing syscalls finish
+   * in a similar time as the rest */
+  uint32_t divisor;
+  bool needs_connection;
+  void (*run)(micro_fixture* fixture, uint64_t iterations);
+} micro_case;
+
+static bool is_retry(ah_error_code error_code)
+{
+  return error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE;
+}
+
+/* Error classification */
+
+enum
+{
+  ERROR_CODES_TRY_AGAIN,
+  ERROR_CODES_MISS,
+  ERROR_CODES_MIXED,
+};
+
+static const int error_code_sets[][ERROR_CODE_COUNT] = {
+    [ERROR_CODES_TRY_AGAIN] = {AH_ERR_TRY_AGAIN},
+    [ERROR_CODES_MISS] = {-1},
+    [ERROR_CODES_MIXED] =
+        {
+            AH_ERR_TRY_AGAIN,
+            AH_ERR_CONNECTION_RESET,
+            AH_ERR_TRY_AGAIN,
+            AH_ERR_BROKEN_PIPE,
+            AH_ERR_TRY_AGAIN,
+            AH_ERR_ACCESS_DENIED,
+            AH_ERR_TRY_AGAIN,
+            -1,
+        },
+};
+
+/* The codes are read through a volatile pointer, because the lookups are
+ * inline and would be folded for arguments known at compile time */
+static void load_error_codes(micro_fixture* fixture, size_t set)
+{
+  for (size_t i = 0; i != ERROR_CODE_COUNT; ++i) {
+    int value = error_code_sets[set][i];
+    fixture->error_codes[i] =
+        set == ERROR_CODES_MIXED ? value : error_code_sets[set][0];
+  }
+}
+
+static void run_is_ah_error_code(micro_fixture* fixture, uint64_t iterations)
+{
+  const volatile int* codes = fixture->error_codes;
+  uint64_t count = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    count += is_ah_error_code(codes[i % ERROR_CODE_COUNT]);
+  }
+  sink = count;
+}
+
+static void run_error_code_try_again(micro_fixture* fixture,
+                                     uint64_t iterations)
+{
+  load_error_codes(fixture, ERROR_CODES_TRY_AGAIN);
+  run_is_ah_error_code(fixture, iterations);
+}
+
+static void run_error_code_miss(micro_fixture* fixture, uint64_t iterations)
+{
+  load_error_codes(fixture, ERROR_CODES_MISS);
+  run_is_ah_error_code(fixture, iterations);
+}
+
+static void run_error_code_mixed(micro_fixture* fixture, uint64_t iterations)
+{
+  load_error_codes(fixture, ERROR_CODES_MIXED);
+  run_is_ah_error_code(fixture, iterations);
+}
+
+static void run_error_class_mixed(micro_fixture* fixture, uint64_t iterations)
+{
+  load_error_codes(fixture, ERROR_CODES_MIXED);
+
+  const volatile int* codes = fixture->error_codes;
+  uint64_t count = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    int value = codes[i % ERROR_CODE_COUNT];
+    count += error_class_from_code(value) == AH_ERROR_CLASS_RETRYABLE;
+  }
+  sink = count;
+}
+
+/* I/O operations */
+
+#ifndef _WIN32
+
+/* Fills in the state of an operation the same way queuing a read does,
+ * through the same function */
+static void run_io_port_init(micro_fixture* fixture, uint64_t iterations)
+{
+  for (uint64_t i = 0; i != iterations; ++i) {
+    ah_io_dock* dock = &fixture->docks[i % DOCK_COUNT];
+    ah_io_buffer buffer = {(uint32_t)i, dock};
+    init_io_port((ah_io_port*)&dock->read_port, true, buffer, NULL, NULL);
+  }
+  sink = fixture->docks[0].read_port.reserved[0];
+}
+
+#endif
+
+static void run_dock_from_operation(micro_fixture* fixture,
+                                    uint64_t iterations)
+{
+  uintptr_t total = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    ah_io_dock* dock = &fixture->docks[i % DOCK_COUNT];
+    ah_io_operation* operation =
+        (i & 1) != 0 ? &dock->write_port : &dock->read_port;
+    total += (uintptr_t)dock_from_operation(operation);
+  }
+  sink = total;
+}
+
+/* Allocators */
+
+static void run_malloc_free(uint64_t iterations, size_t size)
+{
+  uintptr_t total = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    void* pointer = malloc(size);
+    total += (uintptr_t)pointer;
+    free(pointer);
+  }
+  sink = total;
+}
+
+static void run_malloc_free_small(micro_fixture* fixture, uint64_t iterations)
+{
+  (void)fixture;
+
+  /* The size of a session without a buffer */
+  run_malloc_free(iterations, 128);
+}
+
+static void run_malloc_free_session(micro_fixture* fixture,
+                                    uint64_t iterations)
+{
+  (void)fixture;
+
+  /* The size of io_session in lib.c */
+  run_malloc_free(iterations, 8320);
+}
+
+/* The same allocation scheme as ez_malloc in lib.c */
+static void* bump_alloc(micro_fixture* fixture, size_t size, size_t alignment)
+{
+  size_t offset = fixture->bump_offset + alignment - 1;
+  offset -= offset % alignment;
+  if (offset + size > BUMP_BUFFER_SIZE) {
+    offset = 0;
+  }
+
+  fixture->bump_offset = offset + size;
+  return fixture->bump_buffer + offset;
+}
+
+static void run_bump_alloc(micro_fixture* fixture, uint64_t iterations)
+{
+  uintptr_t total = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    total += (uintptr_t)bump_alloc(fixture, 128, 16);
+  }
+  sink = total;
+}
+
+/* Timers */
+
+static bool on_timer_noop(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+  (void)user_data;
+
+  return true;
+}
+
+static void run_timer_start_stop(micro_fixture* fixture, uint64_t iterations)
+{
+  /* Other timers are active with later deadlines, so starting a timer has to
+   * walk the list the way a server with many connections would */
+  size_t size = timer_size();
+  for (uint32_t i = 0; i != TIMER_COUNT; ++i) {
+    ah_timer* timer = (ah_timer*)(fixture->timers + i * size);
+    start_timer(timer, 60000 + i * 1000);
+  }
+
+  for (uint64_t i = 0; i != iterations; ++i) {
+    start_timer(fixture->timer, (uint32_t)(i % 120000));
+    stop_timer(fixture->timer);
+  }
+
+  for (uint32_t i = 0; i != TIMER_COUNT; ++i) {
+    stop_timer((ah_timer*)(fixture->timers + i * size));
+  }
+}
+
+/* Framing */
+
+/* Lines of 16 to 256 bytes, like the requests of text protocols, are split on
+ * line breaks. Blocks of 10 header lines of 12 to 52 bytes are split on the
+ * empty line after them, where the first byte of the delimiter also matches at
+ * every line break. Either way the last frame ends at the end of the ring. */
+static void fill_frame_stream(frame_stream* stream, bool headers)
+{
+  ah_ring* ring = &stream->ring;
+  uint32_t state = 1;
+  uint32_t offset = 0;
+  uint32_t line = 0;
+  while (offset != ring->capacity) {
+    state = state * 1103515245U + 12345U;
+    uint32_t length = headers ? 12 + (state >> 16) % 41
+                              : 16 + (state >> 16) % 241;
+    bool last_line = headers ? ++line % 10 == 0 : true;
+    uint32_t line_end = last_line ? stream->delimiter_length : 2;
+    if (ring->capacity - offset < length + line_end + 64) {
+      length = ring->capacity - offset - stream->delimiter_length;
+      line_end = stream->delimiter_length;
+    }
+
+    for (uint32_t i = 0; i != length; ++i) {
+      ring->data[offset + i] = (uint8_t)('a' + (offset + i) % 26);
+    }
+    memcpy(ring->data + offset + length, "\r\n\r\n", line_end);
+    offset += length + line_end;
+  }
+}
+
+static bool on_frame_count(ah_error_code error_code,
+                           ah_framer* framer,
+                           ah_io_buffer frame,
+                           void* user_data)
+{
+  (void)framer;
+
+  micro_fixture* fixture = user_data;
+  ++fixture->frames;
+  fixture->frame_bytes += frame.buffer_length;
+  return error_code == AH_ERR_OK;
+}
+
+/* The straightforward way of splitting the stream, which the framer is
+ * compared against */
+static void run_memchr(frame_stream* stream, uint64_t iterations)
+{
+  const uint8_t* data = stream->ring.data;
+  const uint8_t* delimiter = stream->framer.delimiter;
+  uint32_t length = stream->delimiter_length;
+  uint32_t size = stream->ring.capacity;
+  uint32_t cursor = stream->cursor;
+  uint64_t total = 0;
+  for (uint64_t i = 0; i != iterations; ++i) {
+    uint32_t start = cursor;
+    const uint8_t* match = NULL;
+    while (match == NULL) {
+      match = memchr(data + cursor, delimiter[0], size - cursor);
+      cursor = (uint32_t)(match - data) + 1;
+      if (memcmp(match + 1, delimiter + 1, length - 1) != 0) {
+        match = NULL;
+      }
+    }
+
+    total += (uint32_t)(match - data) - start;
+    cursor += length - 1;
+    cursor = cursor == size ? 0 : cursor;
+  }
+  stream->cursor = cursor;
+  sink = total;
+}
+
+static void run_framer(micro_fixture* fixture,
+                       frame_stream* stream,
+                       uint64_t iterations)
+{
+  fixture->frames = 0;
+  while (fixture->frames < iterations) {
+    ring_produce(&stream->ring, stream->ring.capacity);
+    if (!deliver_frames(&stream->framer)) {
+      fixture->failed = true;
+      return;
+    }
+  }
+  sink = fixture->frame_bytes;
+}
+
+static void run_framing_memchr_lines(micro_fixture* fixture,
+                                     uint64_t iterations)
+{
+  run_memchr(&fixture->lines, iterations);
+}
+
+static void run_framing_lines(micro_fixture* fixture, uint64_t iterations)
+{
+  run_framer(fixture, &fixture->lines, iterations);
+}
+
+static void run_framing_memchr_headers(micro_fixture* fixture,
+                                       uint64_t iterations)
+{
+  run_memchr(&fixture->headers, iterations);
+}
+
+static void run_framing_headers(micro_fixture* fixture, uint64_t iterations)
+{
+  run_framer(fixture, &fixture->headers, iterations);
+}
+
+/* Event loop */
+
+static void run_server_tick_idle(micro_fixture* fixture, uint64_t iterations)
+{
+  /* An expired timer makes the tick poll without blocking */
+  for (uint64_t i = 0; i != iterations; ++i) {
+    start_timer(fixture->timer, 0);
+    if (!server_tick(fixture->server, NULL)) {
+      fixture->failed = true;
+      return;
+    }
+  }
+}
+
+static bool on_ping_read(ah_error_code error_code,
+                         ah_io_operation* operation,
+                         uint32_t bytes_transferred,
+                         void* per_call_data)
+{
+  micro_fixture* fixture = per_call_data;
+  if (is_retry(error_code)) {
+    ah_io_buffer buffer = buffer_from_io_operation(operation);
+    return queue_read_operation(
+        dock_from_operation(operation), buffer, on_ping_read, fixture);
+  }
+
+  fixture->failed = error_code != AH_ERR_OK || bytes_transferred != 1;
+  fixture->received = true;
+  return true;
+}
+
+static bool on_ping_write(ah_error_code error_code,
+                          ah_io_operation* operation,
+                          uint32_t bytes_transferred,
+                          void* per_call_data)
+{
+  micro_fixture* fixture = per_call_data;
+  if (is_retry(error_code)) {
+    ah_io_buffer buffer = buffer_from_io_operation(operation);
+    return queue_write_operation(
+        dock_from_operation(operation), buffer, on_ping_write, fixture);
+  }
+
+  if (error_code != AH_ERR_OK || bytes_transferred != 1) {
+    fixture->failed = true;
+    fixture->received = true;
+  }
+  return true;
+}
+
+static void run_server_tick_ping(micro_fixture* fixture, uint64_t iterations)
+{
+  ah_io_buffer in = {1, &fixture->byte_in};
+  ah_io_buffer out = {1, &fixture->byte_out};
+  for (uint64_t i = 0; i != iterations && !fixture->failed; ++i) {
+    fixture->received = false;
+    if (!queue_read_operation(
+            &fixture->server_dock, in, on_ping_read, fixture)
+        || !queue_write_operation(
+            &fixture->client_dock, out, on_ping_write, fixture))
+    {
+      fixture->failed = true;
+      return;
+    }
+
+    while (!fixture->received) {
+      if (!server_tick(fixture->server, NULL)) {
+        fixture->failed = true;
+        return;
+      }
+    }
+  }
+}
+
+static const micro_case micro_cases[] = {
+    {"is_ah_error_code/try_again", 1, false, run_error_code_try_again},
+    {"is_ah_error_code/miss", 1, false, run_error_code_miss},
+    {"is_ah_error_code/mixed", 1, false, run_error_code_mixed},
+    {"error_class_from_code/mixed", 1, false, run_error_class_mixed},
+#ifndef _WIN32
+    {"io_port_init", 1, false, run_io_port_init},
+#endif
+    {"dock_from_operation", 1, false, run_dock_from_operation},
+    {"malloc_free/128", 1, false, run_malloc_free_small},
+    {"malloc_free/8320", 1, false, run_malloc_free_session},
+    {"bump_alloc/128", 1, false, run_bump_alloc},
+    {"timer_start_stop", 1, false, run_timer_start_stop},
+    {"framing/memchr/lines", 1, false, run_framing_memchr_lines},
+    {"framing/delimited/lines", 1, false, run_framing_lines},
+    {"framing/memchr/headers", 1, false, run_framing_memchr_headers},
+    {"framing/delimited/headers", 1, false, run_framing_headers},
+    {"server_tick/idle", 10, false, run_server_tick_idle},
+    {"server_tick/ping", 100, true, run_server_tick_ping},
+};
+
+/* Fixture */
+
+static bool fixture_on_accept(ah_error_code error_code,
+                              ah_socket* socket,
+                              const ah_address* address)
+{
+  (void)address;
+
+  micro_fixture* fixture = context_from_socket(socket)->user_data;
+  if (error_code != AH_ERR_OK || fixture->accepted) {
+    return true;
+  }
+
+  move_socket(&fixture->server_socket, socket);
+  fixture->server_dock.socket = &fixture->server_socket;
+  fixture->accepted = true;
+  return true;
+}
+
+static bool fixture_on_connect(ah_error_code error_code,
+                               ah_socket* socket,
+                               void* per_call_data)
+{
+  micro_fixture* fixture = per_call_data;
+  fixture->connect_done = true;
+  if (error_code != AH_ERR_OK) {
+    fprintf(stderr, "Connect failed with error code %d\n", error_code);
+    return true;
+  }
+
+  move_socket(&fixture->client_socket, socket);
+  fixture->client_dock.socket = &fixture->client_socket;
+  fixture->connected = true;
+  return true;
+}
+
+static void fixture_connect(micro_fixture* fixture)
+{
+  uint16_t port = fixture->options->port;
+  ah_address address =
+      address_from_ipv4((ah_ipv4_address) {{127, 0, 0, 1}, port});
+  set_socket_span(fixture->server, (ah_socket_span) {1, fixture->listener});
+  if (!create_socket(fixture->listener, &fixture->context, port)
+      || !create_acceptor(
+          fixture->acceptor, fixture->listener, fixture_on_accept))
+  {
+    return;
+  }
+
+  create_connector(fixture->connector, &fixture->context, fixture_on_connect);
+  if (!queue_connect_operation(fixture->connector, &address, NULL, fixture)) {
+    return;
+  }
+
+  for (uint32_t i = 0; i != CONNECT_TICK_LIMIT; ++i) {
+    if (fixture->connect_done && fixture->accepted) {
+      return;
+    }
+
+    start_timer(fixture->timer, 1);
+    if (!server_tick(fixture->server, NULL)) {
+      return;
+    }
+  }
+}
+
+static bool create_frame_stream(micro_fixture* fixture,
+                                frame_stream* stream,
+                                bool headers)
+{
+  static uint8_t delimiter[] = "\r\n\r\n";
+  stream->delimiter_length = headers ? 4 : 2;
+  if (!create_ring(&stream->ring, FRAME_RING_SIZE)) {
+    return false;
+  }
+
+  fill_frame_stream(stream, headers);
+  return create_delimited_framer(
+      &stream->framer,
+      NULL,
+      &stream->ring,
+      (ah_io_buffer) {stream->delimiter_length, delimiter},
+      0,
+      on_frame_count,
+      fixture);
+}
+
+static bool fixture_create(micro_fixture* fixture)
+{
+  fixture->server = bench_alloc(server_size(), server_alignment());
+  fixture->listener = bench_alloc(socket_size(), socket_alignment());
+  fixture->acceptor = bench_alloc(acceptor_size(), acceptor_alignment());
+  fixture->connector = bench_alloc(connector_size(), connector_alignment());
+  fixture->timer = bench_alloc(timer_size(), timer_alignment());
+  fixture->timers = bench_alloc(timer_size() * TIMER_COUNT, timer_alignment());
+  fixture->bump_buffer = bench_alloc(BUMP_BUFFER_SIZE, 64);
+  if (fixture->server == NULL || fixture->listener == NULL
+      || fixture->acceptor == NULL || fixture->connector == NULL
+      || fixture->timer == NULL || fixture->timers == NULL
+      || fixture->bump_buffer == NULL || !create_server(fixture->server)
+      || !create_frame_stream(fixture, &fixture->lines, false)
+      || !create_frame_stream(fixture, &fixture->headers, true))
+  {
+    return false;
+  }
+
+  fixture->context = (ah_context) {fixture->server, fixture};
+  create_timer(fixture->timer, fixture->server, on_timer_noop, NULL);
+  for (uint32_t i = 0; i != TIMER_COUNT; ++i) {
+    ah_timer* timer = (ah_timer*)(fixture->timers + i * timer_size());
+    create_timer(timer, fixture->server, on_timer_noop, NULL);
+  }
+
+  /* Only the cases exercising the network need the connection, so the rest
+   * still run if it can't be made */
+  fixture_connect(fixture);
+  stop_timer(fixture->timer);
+  return true;
+}
+
+static void fixture_destroy(micro_fixture* fixture)
+{
+  if (fixture->connected) {
+    destroy_socket(&fixture->client_socket);
+  }
+  if (fixture->accepted) {
+    destroy_socket(&fixture->server_socket);
+  }
+
+  if (fixture->server != NULL) {
+    destroy_connector(fixture->connector);
+    destroy_server(fixture->server);
+  }
+  bench_free(fixture->server);
+  bench_free(fixture->listener);
+  bench_free(fixture->acceptor);
+  bench_free(fixture->connector);
+  bench_free(fixture->timer);
+  bench_free(fixture->timers);
+  bench_free(fixture->bump_buffer);
+  destroy_ring(&fixture->lines.ring);
+  destroy_ring(&fixture->headers.ring);
+}
+
+/* Driver */
+
+typedef struct micro_result {
+  const micro_case* test_case;
+  uint64_t iterations;
+  bool skipped;
+  double min;
+  double median;
+} micro_result;
+
+static int compare_doubles(const void* lhs, const void* rhs)
+{
+  double left = *(const double*)lhs;
+  double right = *(const double*)rhs;
+  return (left > right) - (left < right);
+}
+
+static void run_case(micro_fixture* fixture,
+                     const micro_case* test_case,
+                     micro_result* result)
+{
+  const micro_options* options = fixture->options;
+  uint64_t iterations = options->iterations / test_case->divisor;
+  if (iterations == 0) {
+    iterations = 1;
+  }
+
+  *result = (micro_result) {test_case, iterations, false, 0.0, 0.0};
+  if (test_case->needs_connection
+      && !(fixture->accepted && fixture->connected))
+  {
+    result->skipped = true;
+    return;
+  }
+
+  /* Warms up the caches and the branch predictors */
+  test_case->run(fixture, iterations);
+
+  double samples[MAX_REPETITIONS];
+  for (uint32_t i = 0; i != options->repetitions; ++i) {
+    uint64_t start = bench_cycles();
+    test_case->run(fixture, iterations);
+    uint64_t elapsed = bench_cycles() - start;
+    samples[i] = (double)elapsed / (double)iterations;
+  }
+
+  qsort(samples, options->repetitions, sizeof(double), compare_doubles);
+  result->min = samples[0];
+  result->median = samples[options->repetitions / 2];
+}
+
+static void print_usage(void)
+{
+  fputs(
+      "Usage: adhoc-server_micro [options]\n"
+      "  --iterations N   operations per repetition (default: 1000000)\n"
+      "  --repetitions N  repetitions of every case, at most 101 (default: "
+      "11)\n"
+      "  --core N         core to pin the thread to (default: 0)\n"
+      "  --no-pin         do not pin the thread\n"
+      "  --port N         port of the loopback connection (default: 1340)\n"
+      "  --filter TEXT    only run cases whose name contains TEXT\n"
+      "  --output FILE    write the results as JSON to FILE\n"
+      "  --label TEXT     label stored in the JSON results\n",
+      stderr);
+}
+
+static bool parse_options(int argc, const char* argv[], micro_options* options)
+{
+  unsigned long port = options->port;
+  for (int i = 1; i < argc; ++i) {
+    const char* name = argv[i];
+    if (strcmp(name, "--no-pin") == 0) {
+      options->pin = false;
+      continue;
+    }
+
+    if (i + 1 == argc) {
+      return false;
+    }
+    const char* value = argv[++i];
+    if (strcmp(name, "--iterations") == 0) {
+      options->iterations = strtoull(value, NULL, 10);
+    } else if (strcmp(name, "--repetitions") == 0) {
+      options->repetitions = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--core") == 0) {
+      options->core = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--port") == 0) {
+      port = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "--filter") == 0) {
+      options->filter = value;
+    } else if (strcmp(name, "--output") == 0) {
+      options->output = value;
+    } else if (strcmp(name, "--label") == 0) {
+      options->label = value;
+    } else {
+      return false;
+    }
+  }
+
+  options->port = (uint16_t)port;
+  return port != 0 && port <= UINT16_MAX && options->iterations != 0
+      && options->repetitions != 0 && options->repetitions <= MAX_REPETITIONS;
+}
+
+static void write_results(const micro_options* options,
+                          bool pinned,
+                          const micro_result* results,
+                          size_t count,
+                          FILE* file)
+{
+  fprintf(file,
+          "{\n"
+          "  \"benchmark\": \"micro\",\n"
+          "  \"label\": \"%s\",\n"
+          "  \"backend\": \"%s\",\n"
+          "  \"framing_isa\": \"%s\",\n"
+          "  \"unit\": \"%s\",\n"
+          "  \"pinned_core\": %ld,\n"
+          "  \"repetitions\": %u,\n"
+          "  \"cases\": [",
+          options->label,
+          server_backend_name(),
+          framing_isa_name(),
+          bench_cycles_unit(),
+          pinned ? (long)options->core : -1L,
+          options->repetitions);
+  for (size_t i = 0; i != count; ++i) {
+    const micro_result* result = &results[i];
+    fprintf(file,
+            "%s\n    {\"name\": \"%s\", \"iterations\": %llu, ",
+            i == 0 ? "" : ",",
+            result->test_case->name,
+            (unsigned long long)result->iterations);
+    if (result->skipped) {
+      fputs("\"skipped\": true}", file);
+    } else {
+      fprintf(file,
+              "\"min\": %.2f, \"median\": %.2f}",
+              result->min,
+              result->median);
+    }
+  }
+  fputs("\n  ]\n}\n", file);
+}
+
+int main(int argc, const char* argv[])
+{
+  micro_options options = {
+      .iterations = 1000000,
+      .repetitions = 11,
+      .core = 0,
+      .pin = true,
+      .port = 1340,
+      .label = "",
+  };
+  if (!parse_options(argc, argv, &options)) {
+    print_usage();
+    return 2;
+  }
+
+  bool pinned = options.pin && bench_pin_to_core(options.core);
+  if (options.pin && !pinned) {
+    fprintf(stderr, "Could not pin the thread to core %u\n", options.core);
+  }
+
+  int exit_code = 0;
+  micro_fixture* fixture = calloc(1, sizeof(micro_fixture));
+  if (fixture == NULL) {
+    return 1;
+  }
+
+  fixture->options = &options;
+  if (!fixture_create(fixture)) {
+    fixture_destroy(fixture);
+    free(fixture);
+    return 1;
+  }
+
+  size_t count = 0;
+  micro_result results[sizeof(micro_cases) / sizeof(micro_case)];
+  for (size_t i = 0; i != sizeof(micro_cases) / sizeof(micro_case); ++i) {
+    const micro_case* test_case = &micro_cases[i];
+    if (options.filter != NULL
+        && strstr(test_case->name, options.filter) == NULL)
+    {
+      continue;
+    }
+
+    run_case(fixture, test_case, &results[count++]);
+    if (fixture->failed) {
+      fprintf(stderr, "Case %s failed\n", test_case->name);
+      exit_code = 1;
+      break;
+    }
+  }
+
+  write_results(&options, pinned, results, count, stdout);
+  if (options.output != NULL) {
+    FILE* file = fopen(options.output, "w");
+    if (file == NULL) {
+      perror("fopen");
+      exit_code = 1;
+    } else {
+      write_results(&options, pinned, results, count, file);
+      fclose(file);
+    }
+  }
+
+  fixture_destroy(fixture);
+  free(fixture);
+  return exit_code;
+}
@@ -3,6 +3,11 @@ if(BUILD_TESTING)
   add_subdirectory(test)
 endif()
 
+option(BUILD_BENCHMARKS "Build the benchmarks and add them as tests" OFF)
+if(BUILD_BENCHMARKS)
+  add_subdirectory(bench)
+endif()
+
 add_custom_target(
     run_exe
     COMMAND "$<TARGET_FILE:adhoc-server_adhoc-server>"
@@ -4,42 +4,48 @@
 static struct error_tuple {
   const char* name;
   int value;
+  const char* error_class;
 } tuples[] = {
-    {"OK", 0},
-    {"ACCESS_DENIED", WSAEACCES},
-    {"ADDRESS_FAMILY_NOT_SUPPORTED", WSAEAFNOSUPPORT},
-    {"ADDRESS_IN_USE", WSAEADDRINUSE},
-    {"ALREADY_CONNECTED", WSAEISCONN},
-    {"ALREADY_STARTED", WSAEALREADY},
-    {"BROKEN_PIPE", ERROR_BROKEN_PIPE},
-    {"CONNECTION_ABORTED", WSAECONNABORTED},
-    {"CONNECTION_REFUSED", WSAECONNREFUSED},
-    {"CONNECTION_RESET", WSAECONNRESET},
-    {"BAD_DESCRIPTOR", WSAEBADF},
-    {"FAULT", WSAEFAULT},
-    {"HOST_UNREACHABLE", WSAEHOSTUNREACH},
-    {"IN_PROGRESS", WSAEINPROGRESS},
-    {"INTERRUPTED", WSAEINTR},
-    {"INVALID_ARGUMENT", WSAEINVAL},
-    {"MESSAGE_SIZE", WSAEMSGSIZE},
-    {"NAME_TOO_LONG", WSAENAMETOOLONG},
-    {"NETWORK_DOWN", WSAENETDOWN},
-    {"NETWORK_RESET", WSAENETRESET},
-    {"NETWORK_UNREACHABLE", WSAENETUNREACH},
-    {"NO_DESCRIPTORS", WSAEMFILE},
-    {"NO_BUFFER_SPACE", WSAENOBUFS},
-    {"NO_MEMORY", ERROR_OUTOFMEMORY},
-    {"NO_PERMISSION", ERROR_ACCESS_DENIED},
-    {"NO_PROTOCOL_OPTION", WSAENOPROTOOPT},
-    {"NO_SUCH_DEVICE", ERROR_BAD_UNIT},
-    {"NOT_CONNECTED", WSAENOTCONN},
-    {"NOT_SOCKET", WSAENOTSOCK},
-    {"OPERATION_ABORTED", ERROR_OPERATION_ABORTED},
-    {"OPERATION_NOT_SUPPORTED", WSAEOPNOTSUPP},
-    {"SHUT_DOWN", WSAESHUTDOWN},
-    {"TIMED_OUT", WSAETIMEDOUT},
-    {"TRY_AGAIN", ERROR_RETRY},
-    {"WOULD_BLOCK", WSAEWOULDBLOCK},
+    {"OK", 0, "NONE"},
+    {"ACCESS_DENIED", WSAEACCES, "FATAL"},
+    {"ADDRESS_FAMILY_NOT_SUPPORTED", WSAEAFNOSUPPORT, "FATAL"},
+    {"ADDRESS_IN_USE", WSAEADDRINUSE, "FATAL"},
+    {"ADDRESS_NOT_AVAILABLE", WSAEADDRNOTAVAIL, "RESOURCE_EXHAUSTED"},
+    {"ALREADY_CONNECTED", WSAEISCONN, "FATAL"},
+    {"ALREADY_STARTED", WSAEALREADY, "FATAL"},
+    {"BROKEN_PIPE", ERROR_BROKEN_PIPE, "PEER_CLOSED"},
+    {"CONNECTION_ABORTED", WSAECONNABORTED, "PEER_CLOSED"},
+    {"CONNECTION_REFUSED", WSAECONNREFUSED, "PEER_CLOSED"},
+    {"CONNECTION_RESET", WSAECONNRESET, "PEER_CLOSED"},
+    {"BAD_DESCRIPTOR", WSAEBADF, "FATAL"},
+    {"FAULT", WSAEFAULT, "FATAL"},
+    {"HOST_UNREACHABLE", WSAEHOSTUNREACH, "PEER_CLOSED"},
+    {"IN_PROGRESS", WSAEINPROGRESS, "FATAL"},
+    {"INTERRUPTED", WSAEINTR, "RETRYABLE"},
+    {"INVALID_ARGUMENT", WSAEINVAL, "FATAL"},
+    {"IO_ERROR", ERROR_IO_DEVICE, "FATAL"},
+    {"IS_DIRECTORY", ERROR_DIRECTORY, "FATAL"},
+    {"MESSAGE_SIZE", WSAEMSGSIZE, "FATAL"},
+    {"NAME_TOO_LONG", WSAENAMETOOLONG, "FATAL"},
+    {"NETWORK_DOWN", WSAENETDOWN, "PEER_CLOSED"},
+    {"NETWORK_RESET", WSAENETRESET, "PEER_CLOSED"},
+    {"NETWORK_UNREACHABLE", WSAENETUNREACH, "PEER_CLOSED"},
+    {"NO_DESCRIPTORS", WSAEMFILE, "RESOURCE_EXHAUSTED"},
+    {"NO_BUFFER_SPACE", WSAENOBUFS, "RESOURCE_EXHAUSTED"},
+    {"NO_MEMORY", ERROR_OUTOFMEMORY, "RESOURCE_EXHAUSTED"},
+    {"NO_PERMISSION", ERROR_ACCESS_DENIED, "FATAL"},
+    {"NO_PROTOCOL_OPTION", WSAENOPROTOOPT, "FATAL"},
+    {"NO_SUCH_DEVICE", ERROR_BAD_UNIT, "FATAL"},
+    {"NOT_CONNECTED", WSAENOTCONN, "PEER_CLOSED"},
+    {"NOT_FOUND", ERROR_FILE_NOT_FOUND, "FATAL"},
+    {"NOT_SOCKET", WSAENOTSOCK, "FATAL"},
+    {"OPERATION_ABORTED", ERROR_OPERATION_ABORTED, "PEER_CLOSED"},
+    {"OPERATION_NOT_SUPPORTED", WSAEOPNOTSUPP, "FATAL"},
+    {"PROTOCOL_ERROR", ERROR_INVALID_DATA, "PEER_CLOSED"},
+    {"SHUT_DOWN", WSAESHUTDOWN, "PEER_CLOSED"},
+    {"TIMED_OUT", WSAETIMEDOUT, "PEER_CLOSED"},
+    {"TRY_AGAIN", ERROR_RETRY, "RETRYABLE"},
+    {"WOULD_BLOCK", WSAEWOULDBLOCK, "RETRYABLE"},
 };
 
 int main(int argc, const char* argv[])
@@ -50,7 +56,11 @@ int main(int argc, const char* argv[])
   char separator[2] = {0};
   for (int i = 0; i < sizeof(tuples) / sizeof(struct error_tuple); ++i) {
     struct error_tuple tuple = tuples[i];
-    printf("%s%s\\;%d", separator, tuple.name, tuple.value);
+    printf("%s%s\\;%d\\;%s",
+           separator,
+           tuple.name,
+           tuple.value,
+           tuple.error_class);
     separator[0] = ';';
   }
 
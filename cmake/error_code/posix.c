@@ -4,42 +4,48 @@
 static struct error_tuple {
   const char* name;
   int value;
+  const char* error_class;
 } tuples[] = {
-    {"OK", 0},
-    {"ACCESS_DENIED", EACCES},
-    {"ADDRESS_FAMILY_NOT_SUPPORTED", EAFNOSUPPORT},
-    {"ADDRESS_IN_USE", EADDRINUSE},
-    {"ALREADY_CONNECTED", EISCONN},
-    {"ALREADY_STARTED", EALREADY},
-    {"BROKEN_PIPE", EPIPE},
-    {"CONNECTION_ABORTED", ECONNABORTED},
-    {"CONNECTION_REFUSED", ECONNREFUSED},
-    {"CONNECTION_RESET", ECONNRESET},
-    {"BAD_DESCRIPTOR", EBADF},
-    {"FAULT", EFAULT},
-    {"HOST_UNREACHABLE", EHOSTUNREACH},
-    {"IN_PROGRESS", EINPROGRESS},
-    {"INTERRUPTED", EINTR},
-    {"INVALID_ARGUMENT", EINVAL},
-    {"MESSAGE_SIZE", EMSGSIZE},
-    {"NAME_TOO_LONG", ENAMETOOLONG},
-    {"NETWORK_DOWN", ENETDOWN},
-    {"NETWORK_RESET", ENETRESET},
-    {"NETWORK_UNREACHABLE", ENETUNREACH},
-    {"NO_DESCRIPTORS", EMFILE},
-    {"NO_BUFFER_SPACE", ENOBUFS},
-    {"NO_MEMORY", ENOMEM},
-    {"NO_PERMISSION", EPERM},
-    {"NO_PROTOCOL_OPTION", ENOPROTOOPT},
-    {"NO_SUCH_DEVICE", ENODEV},
-    {"NOT_CONNECTED", ENOTCONN},
-    {"NOT_SOCKET", ENOTSOCK},
-    {"OPERATION_ABORTED", ECANCELED},
-    {"OPERATION_NOT_SUPPORTED", EOPNOTSUPP},
-    {"SHUT_DOWN", ESHUTDOWN},
-    {"TIMED_OUT", ETIMEDOUT},
-    {"TRY_AGAIN", EAGAIN},
-    {"WOULD_BLOCK", EWOULDBLOCK},
+    {"OK", 0, "NONE"},
+    {"ACCESS_DENIED", EACCES, "FATAL"},
+    {"ADDRESS_FAMILY_NOT_SUPPORTED", EAFNOSUPPORT, "FATAL"},
+    {"ADDRESS_IN_USE", EADDRINUSE, "FATAL"},
+    {"ADDRESS_NOT_AVAILABLE", EADDRNOTAVAIL, "RESOURCE_EXHAUSTED"},
+    {"ALREADY_CONNECTED", EISCONN, "FATAL"},
+    {"ALREADY_STARTED", EALREADY, "FATAL"},
+    {"BROKEN_PIPE", EPIPE, "PEER_CLOSED"},
+    {"CONNECTION_ABORTED", ECONNABORTED, "PEER_CLOSED"},
+    {"CONNECTION_REFUSED", ECONNREFUSED, "PEER_CLOSED"},
+    {"CONNECTION_RESET", ECONNRESET, "PEER_CLOSED"},
+    {"BAD_DESCRIPTOR", EBADF, "FATAL"},
+    {"FAULT", EFAULT, "FATAL"},
+    {"HOST_UNREACHABLE", EHOSTUNREACH, "PEER_CLOSED"},
+    {"IN_PROGRESS", EINPROGRESS, "FATAL"},
+    {"INTERRUPTED", EINTR, "RETRYABLE"},
+    {"INVALID_ARGUMENT", EINVAL, "FATAL"},
+    {"IO_ERROR", EIO, "FATAL"},
+    {"IS_DIRECTORY", EISDIR, "FATAL"},
+    {"MESSAGE_SIZE", EMSGSIZE, "FATAL"},
+    {"NAME_TOO_LONG", ENAMETOOLONG, "FATAL"},
+    {"NETWORK_DOWN", ENETDOWN, "PEER_CLOSED"},
+    {"NETWORK_RESET", ENETRESET, "PEER_CLOSED"},
+    {"NETWORK_UNREACHABLE", ENETUNREACH, "PEER_CLOSED"},
+    {"NO_DESCRIPTORS", EMFILE, "RESOURCE_EXHAUSTED"},
+    {"NO_BUFFER_SPACE", ENOBUFS, "RESOURCE_EXHAUSTED"},
+    {"NO_MEMORY", ENOMEM, "RESOURCE_EXHAUSTED"},
+    {"NO_PERMISSION", EPERM, "FATAL"},
+    {"NO_PROTOCOL_OPTION", ENOPROTOOPT, "FATAL"},
+    {"NO_SUCH_DEVICE", ENODEV, "FATAL"},
+    {"NOT_CONNECTED", ENOTCONN, "PEER_CLOSED"},
+    {"NOT_FOUND", ENOENT, "FATAL"},
+    {"NOT_SOCKET", ENOTSOCK, "FATAL"},
+    {"OPERATION_ABORTED", ECANCELED, "PEER_CLOSED"},
+    {"OPERATION_NOT_SUPPORTED", EOPNOTSUPP, "FATAL"},
+    {"PROTOCOL_ERROR", EPROTO, "PEER_CLOSED"},
+    {"SHUT_DOWN", ESHUTDOWN, "PEER_CLOSED"},
+    {"TIMED_OUT", ETIMEDOUT, "PEER_CLOSED"},
+    {"TRY_AGAIN", EAGAIN, "RETRYABLE"},
+    {"WOULD_BLOCK", EWOULDBLOCK, "RETRYABLE"},
 };
 
 int main(int argc, const char* argv[])
@@ -50,7 +56,11 @@ int main(int argc, const char* argv[])
   char separator[2] = {0};
   for (int i = 0; i < sizeof(tuples) / sizeof(struct error_tuple); ++i) {
     struct error_tuple tuple = tuples[i];
-    printf("%s%s\\;%d", separator, tuple.name, tuple.value);
+    printf("%s%s\\;%d\\;%s",
+           separator,
+           tuple.name,
+           tuple.value,
+           tuple.error_class);
     separator[0] = ';';
   }
 
@@ -37,11 +37,44 @@ function(generate_error_codes source)
     message(FATAL_ERROR "Running the error code generator failed")
   endif()
 
-  list(JOIN output ",\n  AH_ERR_" enums)
-  string(REPLACE ";" " = " enums "${enums}")
+  # The generator prints NAME;value;class triples. Codes can share a value
+  # (e.g. EAGAIN and EWOULDBLOCK), so the class table only gets one
+  # designated initializer per value, which must agree on the class.
+  set(enums "")
+  set(classes "")
+  set(table_size 1)
+  foreach(entry IN LISTS output)
+    list(GET entry 0 name)
+    list(GET entry 1 value)
+    list(GET entry 2 class)
+    string(APPEND enums "\n  AH_ERR_${name} = ${value},")
+    if(DEFINED "error_class_${value}")
+      if(NOT error_class_${value} STREQUAL class)
+        message(
+            FATAL_ERROR
+            "AH_ERR_${name} has the same value as a code of class "
+            "${error_class_${value}}, but its class is ${class}"
+        )
+      endif()
+      continue()
+    endif()
+    set("error_class_${value}" "${class}")
+    if(NOT value LESS table_size)
+      math(EXPR table_size "${value} + 1")
+    endif()
+    if(NOT class STREQUAL "NONE")
+      string(APPEND classes "    [${value}] = AH_ERROR_CLASS_${class},\n")
+    endif()
+  endforeach()
+
   configure_file(
       cmake/error_code/error_code.h.in
       generated/error_code/server/error_code.h
       @ONLY
   )
+  configure_file(
+      cmake/error_code/error_classes.inc.in
+      generated/error_code/server/error_classes.inc
+      @ONLY
+  )
 endfunction()
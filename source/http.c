@@ -0,0 +1,1343 @@
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The long runs of a request, i.e. the target and the header values, are
+ * scanned 16 bytes at a time by comparing against the ranges of bytes that
+ * end them, in the spirit of picohttpparser. SSE2 is part of every x86-64
+ * target, so no runtime detection is needed. */
+
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define AH_HTTP_SSE2 1
+#  include <emmintrin.h>
+#  if defined(_MSC_VER) && !defined(__clang__)
+#    include <intrin.h>
+#  endif
+#else
+#  define AH_HTTP_SSE2 0
+#endif
+
+#define HTTP_MAX_HEAD 160
+#define HTTP_CLOSE_TIMEOUT_MS 5000
+#define HTTP_MAX_CONTENT_LENGTH_DIGITS 19
+
+/* Parser */
+
+static const uint8_t token_table[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static uint8_t* skip_token(uint8_t* begin, uint8_t* end)
+{
+  while (begin != end && token_table[*begin] != 0) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+/* The target ends at the first space, control byte or DEL */
+static bool ends_target(uint8_t c)
+{
+  return c <= 0x20 || c == 0x7F;
+}
+
+/* Header values may contain HTAB and obs-text, but no other control bytes */
+static bool ends_value(uint8_t c)
+{
+  return (c < 0x20 && c != '\t') || c == 0x7F;
+}
+
+#if AH_HTTP_SSE2
+
+static uint32_t lowest_bit(uint32_t mask)
+{
+#  if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (uint32_t)index;
+#  else
+  return (uint32_t)__builtin_ctz(mask);
+#  endif
+}
+
+/* Returns the mask of the bytes in the block that are below or equal to
+ * \c limit or are DEL */
+static uint32_t range_mask(__m128i block, __m128i limit)
+{
+  __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(block, limit), block);
+  __m128i del = _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7F));
+  return (uint32_t)_mm_movemask_epi8(_mm_or_si128(low, del));
+}
+
+static uint8_t* find_target_end(uint8_t* begin, uint8_t* end)
+{
+  __m128i limit = _mm_set1_epi8(0x20);
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(const void*)begin);
+    uint32_t mask = range_mask(block, limit);
+    if (mask != 0) {
+      return begin + lowest_bit(mask);
+    }
+  }
+
+  while (begin != end && !ends_target(*begin)) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+static uint8_t* find_value_end(uint8_t* begin, uint8_t* end)
+{
+  __m128i limit = _mm_set1_epi8(0x1F);
+  __m128i tab = _mm_set1_epi8('\t');
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(const void*)begin);
+    uint32_t tabs = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, tab));
+    uint32_t mask = range_mask(block, limit) & ~tabs;
+    if (mask != 0) {
+      return begin + lowest_bit(mask);
+    }
+  }
+
+  while (begin != end && !ends_value(*begin)) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+#else
+
+static uint8_t* find_target_end(uint8_t* begin, uint8_t* end)
+{
+  while (begin != end && !ends_target(*begin)) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+static uint8_t* find_value_end(uint8_t* begin, uint8_t* end)
+{
+  while (begin != end && !ends_value(*begin)) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+#endif
+
+static uint8_t to_lower(uint8_t c)
+{
+  return c >= 'A' && c <= 'Z' ? (uint8_t)(c | 0x20) : c;
+}
+
+static bool equals_ignoring_case(const uint8_t* data,
+                                 size_t length,
+                                 const char* lowercase)
+{
+  if (length != strlen(lowercase)) {
+    return false;
+  }
+
+  for (size_t i = 0; i != length; ++i) {
+    if (to_lower(data[i]) != (uint8_t)lowercase[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool is_optional_whitespace(uint8_t c)
+{
+  return c == ' ' || c == '\t';
+}
+
+static void interpret_connection(ah_http_request* request, ah_io_buffer value)
+{
+  uint8_t* begin = value.buffer;
+  uint8_t* end = begin + value.buffer_length;
+  while (begin != end) {
+    uint8_t* option = begin;
+    while (begin != end && *begin != ',') {
+      ++begin;
+    }
+
+    uint8_t* option_end = begin;
+    while (option_end != option && is_optional_whitespace(option_end[-1])) {
+      --option_end;
+    }
+    while (option != option_end && is_optional_whitespace(*option)) {
+      ++option;
+    }
+
+    size_t length = (size_t)(option_end - option);
+    if (equals_ignoring_case(option, length, "close")) {
+      request->keep_alive = false;
+    } else if (equals_ignoring_case(option, length, "keep-alive")) {
+      request->keep_alive = true;
+    }
+
+    if (begin != end) {
+      ++begin;
+    }
+  }
+}
+
+static bool interpret_content_length(ah_http_request* request,
+                                     bool* has_content_length,
+                                     ah_io_buffer value)
+{
+  const uint8_t* digits = value.buffer;
+  uint32_t length = value.buffer_length;
+  if (length == 0 || length > HTTP_MAX_CONTENT_LENGTH_DIGITS) {
+    return false;
+  }
+
+  uint64_t content_length = 0;
+  for (uint32_t i = 0; i != length; ++i) {
+    if (digits[i] < '0' || digits[i] > '9') {
+      return false;
+    }
+    content_length = content_length * 10 + (uint64_t)(digits[i] - '0');
+  }
+
+  /* Differing lengths make the framing ambiguous, which is how requests get
+   * smuggled past intermediaries */
+  if (*has_content_length && content_length != request->content_length) {
+    return false;
+  }
+
+  *has_content_length = true;
+  request->content_length = content_length;
+  return true;
+}
+
+static bool interpret_header(ah_http_request* request,
+                             bool* has_content_length,
+                             ah_http_header header)
+{
+  const uint8_t* name = header.name.buffer;
+  size_t length = header.name.buffer_length;
+  switch (length) {
+    case 10:
+      if (equals_ignoring_case(name, length, "connection")) {
+        interpret_connection(request, header.value);
+      }
+      break;
+    case 14:
+      if (equals_ignoring_case(name, length, "content-length")) {
+        return interpret_content_length(
+            request, has_content_length, header.value);
+      }
+      break;
+    case 17:
+      if (equals_ignoring_case(name, length, "transfer-encoding")) {
+        request->has_transfer_encoding = true;
+      }
+      break;
+  }
+
+  return true;
+}
+
+static ah_io_buffer span(uint8_t* begin, uint8_t* end)
+{
+  return (ah_io_buffer) {(uint32_t)(end - begin), begin};
+}
+
+static ah_http_parse_result parse_version(uint8_t* begin,
+                                          uint8_t* end,
+                                          ah_http_request* request)
+{
+  static const char prefix[] = "HTTP/1.";
+  size_t available = (size_t)(end - begin);
+  size_t compared = available < 7 ? available : 7;
+  if (memcmp(begin, prefix, compared) != 0) {
+    return AH_HTTP_PARSE_INVALID;
+  }
+  if (available < 10) {
+    return AH_HTTP_PARSE_INCOMPLETE;
+  }
+
+  if ((begin[7] != '0' && begin[7] != '1') || begin[8] != '\r'
+      || begin[9] != '\n')
+  {
+    return AH_HTTP_PARSE_INVALID;
+  }
+
+  request->minor_version = (uint8_t)(begin[7] - '0');
+  return AH_HTTP_PARSE_COMPLETE;
+}
+
+ah_http_parse_result parse_http_request(uint8_t* data,
+                                        uint32_t size,
+                                        ah_http_request* result_request,
+                                        uint32_t* header_length_out)
+{
+  ah_http_request* request = result_request;
+  uint8_t* p = data;
+  uint8_t* end = data + size;
+
+  /* Empty lines before the request line are ignored for robustness */
+  while (end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+    p += 2;
+  }
+  if (end - p == 1 && *p == '\r') {
+    return AH_HTTP_PARSE_INCOMPLETE;
+  }
+
+  uint8_t* begin = p;
+  p = skip_token(p, end);
+  if (p == end) {
+    return AH_HTTP_PARSE_INCOMPLETE;
+  }
+  if (p == begin || *p != ' ') {
+    return AH_HTTP_PARSE_INVALID;
+  }
+  request->method = span(begin, p++);
+
+  begin = p;
+  p = find_target_end(p, end);
+  if (p == end) {
+    return AH_HTTP_PARSE_INCOMPLETE;
+  }
+  if (p == begin || *p != ' ') {
+    return AH_HTTP_PARSE_INVALID;
+  }
+  request->target = span(begin, p++);
+
+  ah_http_parse_result result = parse_version(p, end, request);
+  if (result != AH_HTTP_PARSE_COMPLETE) {
+    return result;
+  }
+  p += 10;
+
+  request->keep_alive = request->minor_version != 0;
+  request->has_transfer_encoding = false;
+  request->content_length = 0;
+  request->body = (ah_io_buffer) {0};
+  request->header_count = 0;
+  bool has_content_length = false;
+  while (1) {
+    if (p == end) {
+      return AH_HTTP_PARSE_INCOMPLETE;
+    }
+    if (*p == '\r') {
+      if (end - p < 2) {
+        return AH_HTTP_PARSE_INCOMPLETE;
+      }
+      if (p[1] != '\n') {
+        return AH_HTTP_PARSE_INVALID;
+      }
+      p += 2;
+      break;
+    }
+
+    if (request->header_count == AH_HTTP_MAX_HEADERS) {
+      return AH_HTTP_PARSE_INVALID;
+    }
+
+    begin = p;
+    p = skip_token(p, end);
+    if (p == end) {
+      return AH_HTTP_PARSE_INCOMPLETE;
+    }
+    if (p == begin || *p != ':') {
+      return AH_HTTP_PARSE_INVALID;
+    }
+    ah_http_header header = {span(begin, p++), {0}};
+
+    while (p != end && is_optional_whitespace(*p)) {
+      ++p;
+    }
+
+    begin = p;
+    p = find_value_end(p, end);
+    if (p == end) {
+      return AH_HTTP_PARSE_INCOMPLETE;
+    }
+    if (*p != '\r') {
+      return AH_HTTP_PARSE_INVALID;
+    }
+    if (end - p < 2) {
+      return AH_HTTP_PARSE_INCOMPLETE;
+    }
+    if (p[1] != '\n') {
+      return AH_HTTP_PARSE_INVALID;
+    }
+
+    uint8_t* value_end = p;
+    while (value_end != begin && is_optional_whitespace(value_end[-1])) {
+      --value_end;
+    }
+    header.value = span(begin, value_end);
+    p += 2;
+
+    if (!interpret_header(request, &has_content_length, header)) {
+      return AH_HTTP_PARSE_INVALID;
+    }
+    request->headers[request->header_count++] = header;
+  }
+
+  *header_length_out = (uint32_t)(p - data);
+  return AH_HTTP_PARSE_COMPLETE;
+}
+
+/* Date header */
+
+static const char weekday_names[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+static const char month_names[12][4] = {"Jan",
+                                        "Feb",
+                                        "Mar",
+                                        "Apr",
+                                        "May",
+                                        "Jun",
+                                        "Jul",
+                                        "Aug",
+                                        "Sep",
+                                        "Oct",
+                                        "Nov",
+                                        "Dec"};
+
+static char* write_digits(char* out, uint32_t value, uint32_t width)
+{
+  for (uint32_t i = width; i != 0; --i) {
+    out[i - 1] = (char)('0' + value % 10);
+    value /= 10;
+  }
+
+  return out + width;
+}
+
+/* Formats the IMF-fixdate of RFC 9110 without going through the locale
+ * dependent C library functions */
+static char* format_imf_date(char* out, int64_t seconds)
+{
+  int64_t days = seconds / 86400;
+  uint32_t second_of_day = (uint32_t)(seconds % 86400);
+  uint32_t weekday = (uint32_t)((days + 4) % 7);
+
+  /* The civil from days algorithm of Howard Hinnant */
+  int64_t z = days + 719468;
+  int64_t era = z / 146097;
+  uint32_t day_of_era = (uint32_t)(z - era * 146097);
+  uint32_t year_of_era = (day_of_era - day_of_era / 1460
+                          + day_of_era / 36524 - day_of_era / 146096)
+      / 365;
+  uint32_t day_of_year = day_of_era
+      - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  uint32_t shifted_month = (5 * day_of_year + 2) / 153;
+  uint32_t day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+  uint32_t month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+  uint32_t year = (uint32_t)(year_of_era + era * 400) + (month <= 2);
+
+  memcpy(out, weekday_names[weekday], 3);
+  char* p = out + 3;
+  *p++ = ',';
+  *p++ = ' ';
+  p = write_digits(p, day, 2);
+  *p++ = ' ';
+  memcpy(p, month_names[month - 1], 3);
+  p += 3;
+  *p++ = ' ';
+  p = write_digits(p, year, 4);
+  *p++ = ' ';
+  p = write_digits(p, second_of_day / 3600, 2);
+  *p++ = ':';
+  p = write_digits(p, second_of_day / 60 % 60, 2);
+  *p++ = ':';
+  p = write_digits(p, second_of_day % 60, 2);
+  memcpy(p, " GMT", 4);
+  return p + 4;
+}
+
+static void format_date(char* out, int64_t seconds)
+{
+  memcpy(out, "Date: ", 6);
+  char* p = format_imf_date(out + 6, seconds);
+  memcpy(p, "\r\n", 2);
+}
+
+/* The timer is re-armed for just past the next second boundary instead of
+ * running every second, so the cached date does not drift */
+static bool refresh_date(ah_timer* timer, void* user_data)
+{
+  ah_http_server* server = user_data;
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  format_date(server->date, (int64_t)now.tv_sec);
+
+  uint32_t elapsed_ms = (uint32_t)(now.tv_nsec / 1000000);
+  start_timer(timer, 1000 - elapsed_ms + 1);
+  return true;
+}
+
+/* Connections */
+
+typedef enum exchange_state
+{
+  EXCHANGE_FREE,
+  EXCHANGE_HANDLER,
+  EXCHANGE_READY,
+  EXCHANGE_QUEUED,
+} exchange_state;
+
+#define EXCHANGE_WRITES 4
+
+struct ah_http_exchange {
+  ah_http_connection* connection;
+  exchange_state state;
+  bool keep_alive;
+  bool is_head;
+  ah_http_on_sent on_sent;
+  void* per_call_data;
+  ah_io_buffer body;
+  ah_cached_file* file;
+  ah_write_request* last_request;
+  ah_write_request requests[EXCHANGE_WRITES];
+  uint8_t head[HTTP_MAX_HEAD];
+};
+
+/* The exchanges form a ring in the order of the requests. Those from the head
+ * that are queued are in the write queue of the connection already. */
+struct ah_http_connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  ah_http_server* server;
+  ah_http_connection* previous;
+  ah_http_connection* next;
+  void* closer_memory;
+  ah_closer* closer;
+  ah_ring ring;
+  ah_write_queue queue;
+  uint32_t head;
+  uint32_t count;
+  uint32_t queued;
+  bool open;
+  bool closed;
+  bool reading;
+  bool stop_parsing;
+  bool peer_closed;
+  ah_http_exchange exchanges[AH_HTTP_MAX_PIPELINE];
+};
+
+static ah_http_exchange* exchange_at(ah_http_connection* connection,
+                                     uint32_t offset)
+{
+  uint32_t index = (connection->head + offset) % AH_HTTP_MAX_PIPELINE;
+  return &connection->exchanges[index];
+}
+
+static void link_connection(ah_http_connection** list,
+                            ah_http_connection* connection)
+{
+  connection->previous = NULL;
+  connection->next = *list;
+  if (*list != NULL) {
+    (*list)->previous = connection;
+  }
+  *list = connection;
+}
+
+static void unlink_connection(ah_http_connection** list,
+                              ah_http_connection* connection)
+{
+  if (connection->previous == NULL) {
+    *list = connection->next;
+  } else {
+    connection->previous->next = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->previous = connection->previous;
+  }
+}
+
+static bool on_http_close(ah_error_code error_code,
+                          ah_closer* closer,
+                          void* per_call_data);
+
+static ah_http_connection* take_connection(ah_http_server* server)
+{
+  ah_http_connection* connection = server->free_connections;
+  if (connection != NULL) {
+    unlink_connection(&server->free_connections, connection);
+    return connection;
+  }
+
+  connection = calloc(1, sizeof(ah_http_connection));
+  if (connection == NULL) {
+    return NULL;
+  }
+
+  connection->closer_memory = malloc(closer_size());
+  if (connection->closer_memory == NULL
+      || !create_ring(&connection->ring, AH_HTTP_RECEIVE_BUFFER_SIZE))
+  {
+    free(connection->closer_memory);
+    free(connection);
+    return NULL;
+  }
+
+  connection->server = server;
+  connection->closer = connection->closer_memory;
+  create_closer(connection->closer, on_http_close);
+  for (uint32_t i = 0; i != AH_HTTP_MAX_PIPELINE; ++i) {
+    connection->exchanges[i].connection = connection;
+  }
+
+  return connection;
+}
+
+static void free_connection(ah_http_connection* connection)
+{
+  for (uint32_t i = 0; i != AH_HTTP_MAX_PIPELINE; ++i) {
+    if (connection->exchanges[i].file != NULL) {
+      release_cached_file(connection->exchanges[i].file);
+    }
+  }
+
+  destroy_ring(&connection->ring);
+  free(connection->closer_memory);
+  free(connection);
+}
+
+/* The docks of closed sockets may still have their ports parked with epoll,
+ * so the state is wiped before the connection is reused */
+static void release_connection(ah_http_connection* connection)
+{
+  ah_http_server* server = connection->server;
+  unlink_connection(&server->connections, connection);
+
+  connection->dock = (ah_io_dock) {0};
+  connection->head = 0;
+  connection->count = 0;
+  connection->queued = 0;
+  connection->open = false;
+  connection->closed = false;
+  connection->reading = false;
+  connection->stop_parsing = false;
+  connection->peer_closed = false;
+  ring_consume(&connection->ring, connection->ring.size);
+  link_connection(&server->free_connections, connection);
+}
+
+static bool close_connection(ah_http_connection* connection,
+                             ah_close_mode mode)
+{
+  if (!connection->open) {
+    return true;
+  }
+
+  connection->open = false;
+  return queue_close_operation(connection->closer,
+                               &connection->socket,
+                               mode,
+                               HTTP_CLOSE_TIMEOUT_MS,
+                               connection);
+}
+
+static bool process_requests(ah_http_connection* connection);
+static bool queue_http_read(ah_http_connection* connection);
+
+/* Retires the exchange at the head of the ring */
+static bool finish_exchange(ah_http_connection* connection,
+                            ah_error_code error_code)
+{
+  ah_http_exchange* exchange = exchange_at(connection, 0);
+  bool was_full = connection->count == AH_HTTP_MAX_PIPELINE;
+  if (exchange->state == EXCHANGE_QUEUED) {
+    --connection->queued;
+  }
+  exchange->state = EXCHANGE_FREE;
+  connection->head = (connection->head + 1) % AH_HTTP_MAX_PIPELINE;
+  --connection->count;
+
+  if (exchange->file != NULL) {
+    release_cached_file(exchange->file);
+    exchange->file = NULL;
+  }
+
+  ah_http_on_sent on_sent = exchange->on_sent;
+  if (on_sent != NULL
+      && !on_sent(error_code, exchange->body, exchange->per_call_data))
+  {
+    return false;
+  }
+
+  if (!connection->open) {
+    return true;
+  }
+  if (error_code != AH_ERR_OK) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+  if (!exchange->keep_alive
+      || (connection->peer_closed && connection->count == 0))
+  {
+    return close_connection(connection, AH_CLOSE_GRACEFUL);
+  }
+  if (!was_full) {
+    return true;
+  }
+
+  return process_requests(connection) && queue_http_read(connection);
+}
+
+/* Responses of a closed connection fail in order as their handlers finish,
+ * and the connection goes back to the pool after the last one */
+static bool drain_closed_connection(ah_http_connection* connection)
+{
+  while (connection->count != 0
+         && exchange_at(connection, 0)->state != EXCHANGE_HANDLER)
+  {
+    if (!finish_exchange(connection, AH_ERR_OPERATION_ABORTED)) {
+      return false;
+    }
+  }
+
+  if (connection->count == 0) {
+    release_connection(connection);
+  }
+
+  return true;
+}
+
+static bool on_http_close(ah_error_code error_code,
+                          ah_closer* closer,
+                          void* per_call_data)
+{
+  (void)error_code;
+  (void)closer;
+
+  ah_http_connection* connection = per_call_data;
+  connection->closed = true;
+  return drain_closed_connection(connection);
+}
+
+static bool on_response_written(ah_error_code error_code,
+                                ah_write_request* request,
+                                void* per_call_data)
+{
+  ah_http_exchange* exchange = per_call_data;
+  if (request != exchange->last_request) {
+    return true;
+  }
+
+  return finish_exchange(exchange->connection, error_code);
+}
+
+static bool queue_response(ah_http_connection* connection,
+                           ah_http_exchange* exchange)
+{
+  ah_http_server* server = exchange->connection->server;
+  ah_io_buffer buffers[EXCHANGE_WRITES] = {
+      exchange->requests[0].buffer,
+      exchange->requests[1].buffer,
+      {server->static_headers_length, server->static_headers},
+      exchange->body,
+  };
+  if (exchange->is_head) {
+    buffers[3].buffer_length = 0;
+  }
+
+  exchange->state = EXCHANGE_QUEUED;
+  ++connection->queued;
+  for (uint32_t i = EXCHANGE_WRITES; i != 0; --i) {
+    if (buffers[i - 1].buffer_length != 0) {
+      exchange->last_request = &exchange->requests[i - 1];
+      break;
+    }
+  }
+
+  /* The body of a file is sent from the file instead of the buffer */
+  uint32_t buffer_count = EXCHANGE_WRITES;
+  if (exchange->file != NULL) {
+    buffer_count = EXCHANGE_WRITES - 1;
+  }
+
+  for (uint32_t i = 0; i != buffer_count; ++i) {
+    if (buffers[i].buffer_length != 0
+        && !queue_write_request(&connection->queue,
+                                &exchange->requests[i],
+                                buffers[i],
+                                on_response_written,
+                                exchange))
+    {
+      return false;
+    }
+  }
+
+  uint32_t body_length = buffers[EXCHANGE_WRITES - 1].buffer_length;
+  if (buffer_count == EXCHANGE_WRITES || body_length == 0) {
+    return true;
+  }
+
+  return queue_file_write_request(&connection->queue,
+                                  &exchange->requests[EXCHANGE_WRITES - 1],
+                                  exchange->file,
+                                  0,
+                                  body_length,
+                                  on_response_written,
+                                  exchange);
+}
+
+static bool flush_responses(ah_http_connection* connection)
+{
+  if (connection->closed) {
+    return drain_closed_connection(connection);
+  }
+
+  while (connection->open && connection->queued != connection->count) {
+    ah_http_exchange* exchange = exchange_at(connection, connection->queued);
+    if (exchange->state != EXCHANGE_READY) {
+      break;
+    }
+
+    if (!queue_response(connection, exchange)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static const char* reason_phrase(uint16_t status)
+{
+  switch (status) {
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 202:
+      return "Accepted";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 303:
+      return "See Other";
+    case 304:
+      return "Not Modified";
+    case 307:
+      return "Temporary Redirect";
+    case 308:
+      return "Permanent Redirect";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 408:
+      return "Request Timeout";
+    case 409:
+      return "Conflict";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Content Too Large";
+    case 414:
+      return "URI Too Long";
+    case 429:
+      return "Too Many Requests";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+    case 505:
+      return "HTTP Version Not Supported";
+    default:
+      return "";
+  }
+}
+
+static uint32_t format_decimal(char* out, uint32_t value)
+{
+  char digits[10];
+  uint32_t length = 0;
+  do {
+    digits[length++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  for (uint32_t i = 0; i != length; ++i) {
+    out[i] = digits[length - 1 - i];
+  }
+
+  return length;
+}
+
+/* Writes the status line and the headers that change with every response */
+static uint32_t format_head(ah_http_exchange* exchange,
+                            uint16_t status,
+                            uint32_t content_length)
+{
+  char* begin = (char*)exchange->head;
+  char* p = begin;
+  memcpy(p, "HTTP/1.1 ", 9);
+  p += 9;
+  p = write_digits(p, status, 3);
+  *p++ = ' ';
+  const char* reason = reason_phrase(status);
+  size_t reason_length = strlen(reason);
+  memcpy(p, reason, reason_length);
+  p += reason_length;
+  *p++ = '\r';
+  *p++ = '\n';
+
+  memcpy(p, exchange->connection->server->date, AH_HTTP_DATE_LENGTH);
+  p += AH_HTTP_DATE_LENGTH;
+
+  if (status != 204 && status != 304) {
+    memcpy(p, "Content-Length: ", 16);
+    p += 16;
+    p += format_decimal(p, content_length);
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+
+  if (!exchange->keep_alive) {
+    memcpy(p, "Connection: close\r\n", 19);
+    p += 19;
+  }
+
+  return (uint32_t)(p - begin);
+}
+
+bool http_respond(ah_http_exchange* exchange,
+                  uint16_t status,
+                  ah_io_buffer headers,
+                  ah_io_buffer body,
+                  ah_http_on_sent on_sent,
+                  void* per_call_data)
+{
+  if (exchange->state != EXCHANGE_HANDLER || status < 200 || status > 999
+      || body.buffer_length > (uint32_t)INT32_MAX)
+  {
+    return false;
+  }
+
+  if (status == 204 || status == 304) {
+    exchange->is_head = true;
+  }
+
+  uint32_t head_length = format_head(exchange, status, body.buffer_length);
+  exchange->requests[0].buffer = (ah_io_buffer) {head_length, exchange->head};
+  exchange->requests[1].buffer = headers;
+  exchange->on_sent = on_sent;
+  exchange->per_call_data = per_call_data;
+  exchange->body = body;
+  exchange->state = EXCHANGE_READY;
+  return flush_responses(exchange->connection);
+}
+
+/* Static files */
+
+#define HTTP_INDEX_FILE "index.html"
+#define HTTP_INDEX_FILE_LENGTH 10
+
+typedef struct content_type {
+  const char* extension;
+  const char* type;
+} content_type;
+
+static const content_type content_types[] = {
+    {"css", "text/css"},
+    {"gif", "image/gif"},
+    {"htm", "text/html; charset=utf-8"},
+    {"html", "text/html; charset=utf-8"},
+    {"ico", "image/x-icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"wasm", "application/wasm"},
+    {"webp", "image/webp"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+};
+
+static const char* content_type_from_path(const char* path,
+                                          uint32_t path_length)
+{
+  const char* end = path + path_length;
+  const char* extension = end;
+  while (extension != path && extension[-1] != '.' && extension[-1] != '/') {
+    --extension;
+  }
+
+  if (extension != path && extension[-1] == '.') {
+    size_t length = (size_t)(end - extension);
+    size_t count = sizeof(content_types) / sizeof(content_type);
+    for (size_t i = 0; i != count; ++i) {
+      if (equals_ignoring_case(
+              (const uint8_t*)extension, length, content_types[i].extension))
+      {
+        return content_types[i].type;
+      }
+    }
+  }
+
+  return "application/octet-stream";
+}
+
+/* The headers derived from the file are formatted once per open instead of
+ * once per response */
+static bool format_file_headers(ah_cached_file* file, void* user_data)
+{
+  (void)user_data;
+
+  const char* type = content_type_from_path(file->path, file->path_length);
+  size_t type_length = strlen(type);
+  char* begin = (char*)file->headers;
+  char* p = begin;
+  memcpy(p, "Last-Modified: ", 15);
+  p = format_imf_date(p + 15, file->modified);
+  memcpy(p, "\r\nContent-Type: ", 16);
+  p += 16;
+  memcpy(p, type, type_length);
+  p += type_length;
+  memcpy(p, "\r\n", 2);
+  p += 2;
+
+  file->headers_length = (uint32_t)(p - begin);
+  return true;
+}
+
+bool create_http_file_cache(ah_file_cache* result_cache,
+                            ah_server* server,
+                            const char* root,
+                            uint32_t capacity)
+{
+  return create_file_cache(
+      result_cache, server, root, capacity, format_file_headers, NULL);
+}
+
+static uint16_t status_from_file_error(ah_error_code error_code)
+{
+  switch (error_code) {
+    case AH_ERR_INVALID_ARGUMENT:
+    case AH_ERR_IS_DIRECTORY:
+    case AH_ERR_NOT_FOUND:
+      return 404;
+    case AH_ERR_ACCESS_DENIED:
+    case AH_ERR_NO_PERMISSION:
+      return 403;
+    default:
+      return 500;
+  }
+}
+
+bool http_respond_file(ah_http_exchange* exchange,
+                       ah_file_cache* cache,
+                       ah_io_buffer target)
+{
+  if (exchange->state != EXCHANGE_HANDLER) {
+    return false;
+  }
+
+  uint8_t* begin = target.buffer;
+  uint8_t* end = begin + target.buffer_length;
+  uint8_t* query = memchr(begin, '?', target.buffer_length);
+  if (query != NULL) {
+    end = query;
+  }
+
+  /* Only the origin form of the target names a file */
+  uint32_t length = (uint32_t)(end - begin);
+  char path[AH_FILE_MAX_PATH];
+  ah_error_code error_code = AH_ERR_NOT_FOUND;
+  ah_cached_file* file = NULL;
+  if (length != 0 && begin[0] == '/'
+      && length - 1 <= AH_FILE_MAX_PATH - HTTP_INDEX_FILE_LENGTH)
+  {
+    memcpy(path, begin + 1, length - 1);
+    if (end[-1] == '/') {
+      memcpy(&path[length - 1], HTTP_INDEX_FILE, HTTP_INDEX_FILE_LENGTH);
+      length += HTTP_INDEX_FILE_LENGTH;
+    }
+
+    ah_io_buffer buffer = {length - 1, path};
+    if (!acquire_cached_file(cache, buffer, &file, &error_code)) {
+      return false;
+    }
+  }
+
+  if (file != NULL && file->size > (uint64_t)INT32_MAX) {
+    release_cached_file(file);
+    file = NULL;
+    error_code = AH_ERR_MESSAGE_SIZE;
+  }
+
+  if (file == NULL) {
+    return http_respond(exchange,
+                        status_from_file_error(error_code),
+                        (ah_io_buffer) {0},
+                        (ah_io_buffer) {0},
+                        NULL,
+                        NULL);
+  }
+
+  exchange->file = file;
+  ah_io_buffer headers = {file->headers_length, file->headers};
+  ah_io_buffer body = {(uint32_t)file->size, NULL};
+  return http_respond(exchange, 200, headers, body, NULL, NULL);
+}
+
+static ah_http_exchange* begin_exchange(ah_http_connection* connection,
+                                        bool keep_alive,
+                                        bool is_head)
+{
+  ah_http_exchange* exchange = exchange_at(connection, connection->count++);
+  exchange->state = EXCHANGE_HANDLER;
+  exchange->keep_alive = keep_alive;
+  exchange->is_head = is_head;
+  if (!keep_alive) {
+    connection->stop_parsing = true;
+  }
+
+  return exchange;
+}
+
+/* Answers a request that cannot be served and closes the connection, because
+ * the start of the next request cannot be found reliably */
+static bool reject_request(ah_http_connection* connection, uint16_t status)
+{
+  ah_http_exchange* exchange = begin_exchange(connection, false, false);
+  return http_respond(exchange, status, (ah_io_buffer) {0},
+                      (ah_io_buffer) {0}, NULL, NULL);
+}
+
+static bool process_requests(ah_http_connection* connection)
+{
+  ah_http_server* server = connection->server;
+  ah_ring* ring = &connection->ring;
+  ah_http_request request;
+  while (connection->open && !connection->stop_parsing
+         && connection->count != AH_HTTP_MAX_PIPELINE && ring->size != 0)
+  {
+    ah_io_buffer unread = ring_read_buffer(ring);
+    uint8_t* data = unread.buffer;
+    uint32_t header_length = 0;
+    switch (parse_http_request(
+        data, unread.buffer_length, &request, &header_length))
+    {
+      case AH_HTTP_PARSE_INCOMPLETE:
+        return ring->size != ring->capacity
+            || reject_request(connection, 431);
+      case AH_HTTP_PARSE_INVALID:
+        return reject_request(connection, 400);
+      case AH_HTTP_PARSE_COMPLETE:
+        break;
+    }
+
+    if (request.has_transfer_encoding) {
+      return reject_request(connection, 501);
+    }
+    if (request.content_length > ring->capacity - header_length) {
+      return reject_request(connection, 413);
+    }
+
+    uint32_t content_length = (uint32_t)request.content_length;
+    if (unread.buffer_length - header_length < content_length) {
+      return true;
+    }
+
+    request.body = (ah_io_buffer) {content_length, data + header_length};
+    bool is_head = request.method.buffer_length == 4
+        && memcmp(request.method.buffer, "HEAD", 4) == 0;
+    ah_http_exchange* exchange =
+        begin_exchange(connection, request.keep_alive, is_head);
+    bool result = server->on_request(exchange, &request, server->user_data);
+    ring_consume(ring, header_length + content_length);
+    if (!result) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool on_http_read(ah_error_code error_code,
+                         ah_io_operation* operation,
+                         uint32_t bytes_transferred,
+                         void* per_call_data)
+{
+  (void)operation;
+
+  ah_http_connection* connection = per_call_data;
+  connection->reading = false;
+  if (!connection->open) {
+    return true;
+  }
+
+  if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+    return queue_http_read(connection);
+  }
+  if (error_code != AH_ERR_OK) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+
+  /* The responses to the complete requests are still sent after the peer
+   * shut down its sending side */
+  if (bytes_transferred == 0) {
+    connection->peer_closed = true;
+    return connection->count != 0
+        || close_connection(connection, AH_CLOSE_GRACEFUL);
+  }
+
+  ring_produce(&connection->ring, bytes_transferred);
+  return process_requests(connection) && queue_http_read(connection);
+}
+
+static bool queue_http_read(ah_http_connection* connection)
+{
+  if (!connection->open || connection->stop_parsing
+      || connection->peer_closed || connection->reading
+      || connection->count == AH_HTTP_MAX_PIPELINE)
+  {
+    return true;
+  }
+
+  ah_io_buffer buffer = ring_write_buffer(&connection->ring);
+  if (buffer.buffer_length == 0) {
+    return true;
+  }
+
+  connection->reading = true;
+  return queue_read_operation(
+      &connection->dock, buffer, on_http_read, connection);
+}
+
+bool http_accept(ah_http_server* server, ah_socket* socket)
+{
+  /* The socket is closed after the accept handler returns if it could not be
+   * taken */
+  ah_http_connection* connection = take_connection(server);
+  if (connection == NULL) {
+    return true;
+  }
+
+  link_connection(&server->connections, connection);
+  move_socket(&connection->socket, socket);
+  connection->dock.socket = &connection->socket;
+  create_write_queue(&connection->queue, &connection->dock);
+  connection->open = true;
+  return queue_http_read(connection);
+}
+
+/* Server */
+
+bool create_http_server(ah_http_server* result_server,
+                        ah_server* server,
+                        ah_io_buffer static_headers,
+                        ah_http_on_request on_request,
+                        void* user_data)
+{
+  *result_server = (ah_http_server) {
+      .server = server,
+      .on_request = on_request,
+      .user_data = user_data,
+  };
+
+  /* The closers are allocated with malloc, which only guarantees the
+   * alignment of the fundamental types */
+  if (closer_alignment() > _Alignof(max_align_t)
+      || timer_alignment() > _Alignof(max_align_t)
+      || static_headers.buffer_length > UINT32_MAX - 2)
+  {
+    return false;
+  }
+
+  /* The empty line ending the head is sent along with the static headers */
+  uint32_t length = static_headers.buffer_length;
+  uint8_t* headers = malloc(length + 2);
+  ah_timer* timer = malloc(timer_size());
+  if (headers == NULL || timer == NULL) {
+    free(headers);
+    free(timer);
+    return false;
+  }
+
+  if (length != 0) {
+    memcpy(headers, static_headers.buffer, length);
+  }
+  memcpy(headers + length, "\r\n", 2);
+  result_server->static_headers = headers;
+  result_server->static_headers_length = length + 2;
+
+  result_server->date_timer = timer;
+  create_timer(timer, server, refresh_date, result_server);
+  return refresh_date(timer, result_server);
+}
+
+void destroy_http_server(ah_http_server* server)
+{
+  while (server->connections != NULL) {
+    ah_http_connection* connection = server->connections;
+    unlink_connection(&server->connections, connection);
+    if (connection->open) {
+      destroy_socket(&connection->socket);
+    } else if (!connection->closed) {
+      destroy_closer(connection->closer);
+    }
+    free_connection(connection);
+  }
+
+  while (server->free_connections != NULL) {
+    ah_http_connection* connection = server->free_connections;
+    unlink_connection(&server->free_connections, connection);
+    free_connection(connection);
+  }
+
+  if (server->date_timer != NULL) {
+    stop_timer(server->date_timer);
+    free(server->date_timer);
+  }
+  free(server->static_headers);
+  *server = (ah_http_server) {0};
+}
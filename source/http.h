@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * @file
+ *
+ * HTTP/1.1 server on top of the acceptor and dock primitives. Requests are
+ * parsed in place from the receive ring of the connection, pipelined requests
+ * are answered in order and responses are written through the write queue of
+ * the connection, so nothing is allocated per request once the connection
+ * pool is warm.
+ */
+
+#define AH_HTTP_MAX_HEADERS 32
+
+/**
+ * @brief The number of requests of a connection that can wait for their
+ * response at the same time.
+ *
+ * Reading from a connection stops while this many are waiting.
+ */
+#define AH_HTTP_MAX_PIPELINE 16
+
+/**
+ * @brief The size of the receive buffer of a connection, which limits the
+ * size of the request head and body together.
+ */
+#define AH_HTTP_RECEIVE_BUFFER_SIZE (16 * 1024)
+
+#define AH_HTTP_DATE_LENGTH 37
+
+typedef struct ah_http_header {
+  ah_io_buffer name;
+  ah_io_buffer value;
+} ah_http_header;
+
+/**
+ * @brief A parsed request, whose buffers point into the parsed data.
+ *
+ * The optional whitespace around the header values is not part of them.
+ */
+typedef struct ah_http_request {
+  ah_io_buffer method;
+  ah_io_buffer target;
+  uint8_t minor_version;
+  bool keep_alive;
+  bool has_transfer_encoding;
+  uint64_t content_length;
+  ah_io_buffer body;
+  uint32_t header_count;
+  ah_http_header headers[AH_HTTP_MAX_HEADERS];
+} ah_http_request;
+
+typedef enum ah_http_parse_result
+{
+  AH_HTTP_PARSE_COMPLETE,
+  AH_HTTP_PARSE_INCOMPLETE,
+  AH_HTTP_PARSE_INVALID,
+} ah_http_parse_result;
+
+typedef struct ah_http_server ah_http_server;
+typedef struct ah_http_connection ah_http_connection;
+typedef struct ah_http_exchange ah_http_exchange;
+
+/**
+ * @brief Callback type for the requests of an ::ah_http_server.
+ *
+ * The request points into the receive buffer of the connection and is only
+ * valid until the callback returns. The response can be sent with
+ * ::http_respond from inside the callback or at any later time, and the
+ * responses of pipelined requests are sent in the order of the requests
+ * regardless.
+ */
+typedef bool (*ah_http_on_request)(ah_http_exchange* exchange,
+                                   const ah_http_request* request,
+                                   void* user_data);
+
+/**
+ * @brief Callback type for finished responses.
+ *
+ * Called once the response was handed to the kernel or failed to be, after
+ * which the buffers passed to ::http_respond can be reused.
+ */
+typedef bool (*ah_http_on_sent)(ah_error_code error_code,
+                                ah_io_buffer body,
+                                void* per_call_data);
+
+/**
+ * @brief HTTP/1.1 server that serves the sockets handed to ::http_accept.
+ *
+ * The members are managed by the HTTP functions.
+ */
+struct ah_http_server {
+  ah_server* server;
+  ah_timer* date_timer;
+  ah_http_on_request on_request;
+  void* user_data;
+  uint8_t* static_headers;
+  uint32_t static_headers_length;
+  ah_http_connection* connections;
+  ah_http_connection* free_connections;
+  char date[AH_HTTP_DATE_LENGTH];
+};
+
+/**
+ * @brief Parses the head of a request from \c data.
+ *
+ * On success \c header_length_out receives the size of the request line and
+ * the headers including the empty line after them, which is where the body
+ * starts. Only HTTP/1.0 and HTTP/1.1 requests with CRLF line endings are
+ * accepted. The \c Connection, \c Content-Length and \c Transfer-Encoding
+ * headers are interpreted while parsing.
+ */
+ah_http_parse_result parse_http_request(uint8_t* data,
+                                        uint32_t size,
+                                        ah_http_request* result_request,
+                                        uint32_t* header_length_out);
+
+/**
+ * @brief Initializes an HTTP server running on the event loop of \c server.
+ *
+ * The \c static_headers are copied and sent with every response. They must
+ * be complete header lines, each terminated by CRLF, e.g.
+ * <tt>"Server: adhoc\r\n"</tt>, and may be empty. The \c Date header is
+ * formatted once per second and added to every response along with the
+ * \c Content-Length header. Servers that respond with files should leave
+ * \c Content-Type out of them, because it is sent along with each file.
+ */
+bool create_http_server(ah_http_server* result_server,
+                        ah_server* server,
+                        ah_io_buffer static_headers,
+                        ah_http_on_request on_request,
+                        void* user_data);
+
+/**
+ * @brief Takes ownership of a socket from an accept handler and starts
+ * serving requests on it.
+ */
+bool http_accept(ah_http_server* server, ah_socket* socket);
+
+/**
+ * @brief Sends the response to the request of the exchange.
+ *
+ * \c headers are additional pre-serialized header lines like the static
+ * headers of the server and may be empty. Neither \c headers nor \c body are
+ * copied, so they must stay alive until \c on_sent is called, which may be
+ * \c NULL if they are static. The body is not sent in response to \c HEAD
+ * requests and for status codes without a body. The exchange must not be
+ * used after this call.
+ */
+bool http_respond(ah_http_exchange* exchange,
+                  uint16_t status,
+                  ah_io_buffer headers,
+                  ah_io_buffer body,
+                  ah_http_on_sent on_sent,
+                  void* per_call_data);
+
+/**
+ * @brief Initializes a file cache for ::http_respond_file, whose files carry
+ * their \c Last-Modified and \c Content-Type headers.
+ *
+ * The content type is derived from the extension of the file name.
+ */
+bool create_http_file_cache(ah_file_cache* result_cache,
+                            ah_server* server,
+                            const char* root,
+                            uint32_t capacity);
+
+/**
+ * @brief Responds with the file named by the request target, which is looked
+ * up in \c cache.
+ *
+ * The query is ignored and \c index.html is served for targets ending in a
+ * slash. Targets are not percent-decoded. Files that cannot be found or whose
+ * path is not acceptable to the cache are answered with 404, files that may
+ * not be read with 403 and files larger than \c INT32_MAX bytes or any other
+ * failure with 500. The file stays referenced until the response was sent.
+ * The exchange must not be used after this call.
+ */
+bool http_respond_file(ah_http_exchange* exchange,
+                       ah_file_cache* cache,
+                       ah_io_buffer target);
+
+/**
+ * @brief Resets every connection of the server and frees the connection
+ * pool.
+ *
+ * The callbacks of the responses not yet sent are not called.
+ */
+void destroy_http_server(ah_http_server* server);
@@ -1,9 +1,9 @@
 #include "lib.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "memcached.h"
 #include "server.h"
 
 #define KILOBYTES(n) (1024 * (n))
@@ -29,7 +29,7 @@ typedef struct io_session {
   ah_io_dock dock;
   size_t state;
   ah_socket_accepted socket;
-  ah_ipv4_address address;
+  ah_address address;
   uint32_t bytes_read;
   uint8_t buffer[KILOBYTES(8)];
 } io_session;
@@ -42,14 +42,10 @@ static bool finish_session(io_session* session)
   *stop_server = true;
 
   bool result = destroy_socket(socket);
-  ah_ipv4_address address = session->address;
+  char address[AH_ADDRESS_MAX_STRING];
+  format_address(&session->address, address);
 
-  printf("Connection closed (%hhu.%hhu.%hhu.%hhu:%hu)\n",
-         address.address[0],
-         address.address[1],
-         address.address[2],
-         address.address[3],
-         address.port);
+  ah_log("Connection closed (%s)\n", address);
 
   free(session);
   return result;
@@ -71,7 +67,7 @@ static bool coroutine(ah_error_code error_code,
     case 1: {
       if (operation == &dock->read_port) {
         session->bytes_read = bytes_transferred;
-        fwrite(session->buffer, 1, bytes_transferred, stdout);
+        ah_log_bytes(session->buffer, bytes_transferred);
       }
       if (session->state == 2) {
         ah_io_buffer buffer = {session->bytes_read, session->buffer};
@@ -91,16 +87,13 @@ static bool coroutine(ah_error_code error_code,
 
 static bool on_accept(ah_error_code error_code,
                       ah_socket* socket,
-                      ah_ipv4_address address)
+                      const ah_address* address)
 {
   (void)error_code;
 
-  printf("New connection from %hhu.%hhu.%hhu.%hhu:%hu\n",
-         address.address[0],
-         address.address[1],
-         address.address[2],
-         address.address[3],
-         address.port);
+  char address_string[AH_ADDRESS_MAX_STRING];
+  format_address(address, address_string);
+  ah_log("New connection from %s\n", address_string);
 
   io_session* session = calloc(1, sizeof(io_session));
   if (session == NULL) {
@@ -109,7 +102,7 @@ static bool on_accept(ah_error_code error_code,
 
   move_socket(&session->socket, socket);
   session->dock.socket = &session->socket;
-  session->address = address;
+  session->address = *address;
 
   return queue_write_operation(
              &session->dock, BUFFER_FROM_STR("Accepted\r\n"), coroutine)
@@ -119,6 +112,10 @@ static bool on_accept(ah_error_code error_code,
 
 library create_library()
 {
+  /* Keeps a slow stdout from stalling the event loop. If the thread can't be
+   * started, then messages are simply written synchronously. */
+  ah_log_start(AH_LOG_BACKGROUND);
+
   ah_server* server = ez_malloc(server_size(), server_alignment());
   if (!create_server(server)) {
     goto exit;
@@ -148,6 +145,57 @@ library create_library()
 
 exit:
   destroy_server(server);
+  ah_log_stop();
   ez_buffer_pointer = ez_buffer;
   return (library) {"adhoc-server"};
 }
+
+static bool on_memcached_accept(ah_error_code error_code,
+                                ah_socket* socket,
+                                const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK) {
+    return true;
+  }
+
+  return memcached_accept(context_from_socket(socket)->user_data, socket);
+}
+
+bool run_memcached_service(uint16_t port, uint64_t memory_limit)
+{
+  ah_log_start(AH_LOG_BACKGROUND);
+
+  bool result = false;
+  ah_memcached_server cache;
+  ah_server* server = ez_malloc(server_size(), server_alignment());
+  if (!create_server(server)) {
+    goto exit;
+  }
+
+  if (!create_memcached_server(&cache, server, memory_limit)) {
+    goto exit;
+  }
+
+  ah_socket* socket = ez_malloc(socket_size(), socket_alignment());
+  set_socket_span(server, (ah_socket_span) {1, socket});
+  ah_context context = {server, &cache};
+  ah_acceptor* acceptor = ez_malloc(acceptor_size(), acceptor_alignment());
+  if (create_socket(socket, &context, port)
+      && create_acceptor(acceptor, socket, on_memcached_accept))
+  {
+    ah_log("Serving memcached on port %u\n", (unsigned)port);
+    result = true;
+    while (server_tick(server, NULL)) {
+    }
+  }
+
+  destroy_memcached_server(&cache);
+
+exit:
+  destroy_server(server);
+  ah_log_stop();
+  ez_buffer_pointer = ez_buffer;
+  return result;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /**
  * @brief Simply initializes the name member to the name of the project
  */
@@ -11,3 +14,11 @@ typedef struct library {
  * @brief Creates an instance of library with the name of the project
  */
 library create_library(void);
+
+/**
+ * @brief Serves the memcached text protocol on \c port with at most
+ * \c memory_limit bytes of items until the event loop fails.
+ *
+ * Returns false if the cache or the listener could not be created.
+ */
+bool run_memcached_service(uint16_t port, uint64_t memory_limit);
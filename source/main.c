@@ -2,15 +2,36 @@
 #  include <fcntl.h>
 #  include <io.h>
 #endif
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lib.h"
 
-int main(int argc, const char* argv[])
+#define MEMCACHED_DEFAULT_PORT 11211
+#define MEMCACHED_DEFAULT_MEGABYTES 64
+
+static const char usage[] =
+    "Usage: adhoc-server [--service memcached [--port PORT] [--memory MB]]\n";
+
+/* Parses a whole decimal number between 1 and maximum */
+static bool parse_number(const char* text, uint64_t maximum, uint64_t* result)
 {
-  (void)argc;
-  (void)argv;
+  char* end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (*text < '0' || *text > '9' || *end != '\0' || value == 0
+      || value > maximum)
+  {
+    return false;
+  }
 
+  *result = value;
+  return true;
+}
+
+int main(int argc, const char* argv[])
+{
 #ifdef _WIN32
   /* The library will report errors from the TCP server to stderr, but the
    * messages are retrieved using FormatMessageW and if the system language
@@ -19,7 +40,39 @@ int main(int argc, const char* argv[])
   _setmode(_fileno(stderr), _O_U16TEXT);
 #endif
 
-  library lib = create_library();
-  printf("Hello from %s!", lib.name);
-  return 0;
+  const char* service = NULL;
+  uint64_t port = MEMCACHED_DEFAULT_PORT;
+  uint64_t megabytes = MEMCACHED_DEFAULT_MEGABYTES;
+  for (int i = 1; i != argc; i += 2) {
+    const char* value = i + 1 != argc ? argv[i + 1] : NULL;
+    bool ok = value != NULL;
+    if (ok && strcmp(argv[i], "--service") == 0) {
+      service = value;
+    } else if (ok && strcmp(argv[i], "--port") == 0) {
+      ok = parse_number(value, UINT16_MAX, &port);
+    } else if (ok && strcmp(argv[i], "--memory") == 0) {
+      ok = parse_number(value, UINT64_MAX / (1024 * 1024), &megabytes);
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      fputs(usage, stderr);
+      return 2;
+    }
+  }
+
+  if (service == NULL) {
+    library lib = create_library();
+    printf("Hello from %s!", lib.name);
+    return 0;
+  }
+
+  if (strcmp(service, "memcached") != 0) {
+    fputs(usage, stderr);
+    return 2;
+  }
+
+  return run_memcached_service((uint16_t)port, megabytes * 1024 * 1024) ? 0
+                                                                        : 1;
 }
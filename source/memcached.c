@@ -0,0 +1,1323 @@
+#include "memcached.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MEMCACHED_CLOSE_TIMEOUT_MS 5000
+#define MEMCACHED_SMALLEST_CHUNK 64
+#define MEMCACHED_INITIAL_SLOTS 1024
+#define MEMCACHED_MIGRATE_STEP 8
+#define MEMCACHED_RELATIVE_LIMIT (60 * 60 * 24 * 30)
+#define MEMCACHED_RESPONSE_TEXT 320
+#define MEMCACHED_MAX_TOKENS (AH_MEMCACHED_MAX_KEYS + 1)
+#define MEMCACHED_MAX_DIGITS 20
+
+#define STRING_LENGTH(str) ((uint32_t)sizeof(str) - 1)
+
+/* Items */
+
+typedef enum item_state
+{
+  ITEM_FREE,
+  ITEM_PENDING,
+  ITEM_LINKED,
+  ITEM_UNLINKED,
+} item_state;
+
+/* The key is followed by the value and a CRLF, so the value is sent together
+ * with the end of its line. Items that are not linked anymore are freed once
+ * the last response sending them is done. */
+struct ah_memcached_item {
+  ah_memcached_item* next_free;
+  uint64_t cas;
+  uint32_t hash;
+  uint32_t flags;
+  uint32_t expires;
+  uint32_t value_length;
+  uint32_t references;
+  uint8_t key_length;
+  uint8_t state;
+  uint8_t class_index;
+  bool visited;
+  uint8_t data[];
+};
+
+struct ah_memcached_class {
+  uint32_t chunk_size;
+  uint32_t chunks_per_page;
+  uint8_t** pages;
+  uint32_t page_count;
+  uint32_t page_capacity;
+  ah_memcached_item* free_items;
+  uint32_t hand;
+};
+
+static uint32_t now_seconds(void)
+{
+  return (uint32_t)time(NULL);
+}
+
+static bool is_expired(const ah_memcached_item* item, uint32_t now)
+{
+  return item->expires != 0 && item->expires <= now;
+}
+
+static uint8_t* item_value(ah_memcached_item* item)
+{
+  return item->data + item->key_length;
+}
+
+static uint32_t item_size(uint32_t key_length, uint32_t value_length)
+{
+  return (uint32_t)sizeof(ah_memcached_item) + key_length + value_length + 2;
+}
+
+/* The chunk sizes grow by a factor of 1.25, which wastes at most a fifth of
+ * each chunk, and the last class takes a whole page */
+static uint32_t next_chunk_size(uint32_t size)
+{
+  uint32_t alignment = (uint32_t)_Alignof(ah_memcached_item);
+  uint32_t next = size + size / 4;
+  return (next + alignment - 1) / alignment * alignment;
+}
+
+static bool create_classes(ah_memcached_server* server)
+{
+  uint32_t count = 1;
+  for (uint32_t size = MEMCACHED_SMALLEST_CHUNK;
+       size <= AH_MEMCACHED_PAGE_SIZE / 2;
+       size = next_chunk_size(size))
+  {
+    ++count;
+  }
+
+  server->classes = calloc(count, sizeof(ah_memcached_class));
+  if (server->classes == NULL) {
+    return false;
+  }
+
+  uint32_t size = MEMCACHED_SMALLEST_CHUNK;
+  for (uint32_t i = 0; i != count; ++i) {
+    if (i == count - 1) {
+      size = AH_MEMCACHED_PAGE_SIZE;
+    }
+    server->classes[i].chunk_size = size;
+    server->classes[i].chunks_per_page = AH_MEMCACHED_PAGE_SIZE / size;
+    size = next_chunk_size(size);
+  }
+
+  server->class_count = count;
+  return true;
+}
+
+static ah_memcached_item* chunk_at(ah_memcached_class* class, uint32_t index)
+{
+  uint8_t* page = class->pages[index / class->chunks_per_page];
+  size_t offset = (size_t)(index % class->chunks_per_page) * class->chunk_size;
+  return (ah_memcached_item*)(void*)(page + offset);
+}
+
+static void free_item(ah_memcached_server* server, ah_memcached_item* item)
+{
+  ah_memcached_class* class = &server->classes[item->class_index];
+  item->state = ITEM_FREE;
+  item->next_free = class->free_items;
+  class->free_items = item;
+}
+
+static bool add_page(ah_memcached_server* server, uint32_t class_index)
+{
+  ah_memcached_class* class = &server->classes[class_index];
+  if (class->page_count == class->page_capacity) {
+    uint32_t capacity =
+        class->page_capacity == 0 ? 4 : class->page_capacity * 2;
+    uint8_t** pages = realloc(class->pages, capacity * sizeof(uint8_t*));
+    if (pages == NULL) {
+      return false;
+    }
+
+    class->pages = pages;
+    class->page_capacity = capacity;
+  }
+
+  uint8_t* page = malloc(AH_MEMCACHED_PAGE_SIZE);
+  if (page == NULL) {
+    return false;
+  }
+
+  class->pages[class->page_count++] = page;
+  ++server->page_count;
+  uint32_t first = (class->page_count - 1) * class->chunks_per_page;
+  for (uint32_t i = class->chunks_per_page; i != 0; --i) {
+    ah_memcached_item* item = chunk_at(class, first + i - 1);
+    item->class_index = (uint8_t)class_index;
+    free_item(server, item);
+  }
+
+  return true;
+}
+
+static void unlink_item(ah_memcached_server* server, ah_memcached_item* item);
+
+/* The hand sweeps the chunks of the class and clears the visited mark of the
+ * items it passes, so an item is only evicted if it was not read for a whole
+ * turn. Items being sent or still being received are skipped. */
+static bool evict_item(ah_memcached_server* server, uint32_t class_index)
+{
+  ah_memcached_class* class = &server->classes[class_index];
+  uint32_t total = class->page_count * class->chunks_per_page;
+  uint32_t now = now_seconds();
+  for (uint32_t i = 0; i != total * 2; ++i) {
+    ah_memcached_item* item = chunk_at(class, class->hand);
+    class->hand = (class->hand + 1) % total;
+    if (item->state != ITEM_LINKED || item->references != 0) {
+      continue;
+    }
+
+    bool expired = is_expired(item, now);
+    if (item->visited && !expired) {
+      item->visited = false;
+      continue;
+    }
+
+    if (!expired) {
+      ++server->evictions;
+    }
+    unlink_item(server, item);
+    return true;
+  }
+
+  return false;
+}
+
+static ah_memcached_item* allocate_item(ah_memcached_server* server,
+                                        uint32_t size)
+{
+  uint32_t class_index = 0;
+  while (server->classes[class_index].chunk_size < size) {
+    if (++class_index == server->class_count) {
+      return NULL;
+    }
+  }
+
+  ah_memcached_class* class = &server->classes[class_index];
+  if (class->free_items == NULL) {
+    bool has_room = server->page_count < server->page_limit
+        && add_page(server, class_index);
+    if (!has_room
+        && (class->page_count == 0 || !evict_item(server, class_index)))
+    {
+      return NULL;
+    }
+  }
+
+  ah_memcached_item* item = class->free_items;
+  class->free_items = item->next_free;
+  item->state = ITEM_PENDING;
+  item->references = 0;
+  item->visited = false;
+  return item;
+}
+
+static void release_item(ah_memcached_server* server, ah_memcached_item* item)
+{
+  if (--item->references == 0 && item->state == ITEM_UNLINKED) {
+    free_item(server, item);
+  }
+}
+
+/* Index */
+
+/* FNV-1a */
+static uint32_t hash_key(const uint8_t* key, uint32_t length)
+{
+  uint32_t hash = 2166136261U;
+  for (uint32_t i = 0; i != length; ++i) {
+    hash = (hash ^ key[i]) * 16777619U;
+  }
+
+  return hash;
+}
+
+/* Returns the slot of the key, or the empty slot where it would be */
+static uint32_t probe(const ah_memcached_table* table,
+                      uint32_t hash,
+                      const uint8_t* key,
+                      uint32_t length)
+{
+  uint32_t index = hash & table->mask;
+  while (true) {
+    const ah_memcached_slot* slot = &table->slots[index];
+    if (slot->item == NULL
+        || (slot->hash == hash && slot->item->key_length == length
+            && memcmp(slot->item->data, key, length) == 0))
+    {
+      return index;
+    }
+
+    index = (index + 1) & table->mask;
+  }
+}
+
+static void insert_slot(ah_memcached_table* table, ah_memcached_slot slot)
+{
+  uint32_t index = slot.hash & table->mask;
+  while (table->slots[index].item != NULL) {
+    index = (index + 1) & table->mask;
+  }
+
+  table->slots[index] = slot;
+  ++table->count;
+}
+
+/* Linear probing allows deleting without tombstones: the entries after the
+ * hole that would not be found past it anymore are shifted back into it */
+static void remove_slot(ah_memcached_table* table, uint32_t hole)
+{
+  uint32_t mask = table->mask;
+  uint32_t index = hole;
+  while (true) {
+    index = (index + 1) & mask;
+    ah_memcached_slot* slot = &table->slots[index];
+    if (slot->item == NULL) {
+      break;
+    }
+
+    uint32_t home = slot->hash & mask;
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      table->slots[hole] = *slot;
+      hole = index;
+    }
+  }
+
+  table->slots[hole] = (ah_memcached_slot) {0};
+  --table->count;
+}
+
+/* The old table is emptied from the front, and removing a slot may shift the
+ * next one of its cluster into it, so the cursor only moves on once the slot
+ * stays empty. This keeps the front of the old table empty, which means no
+ * cluster can wrap around into the part already visited. */
+static void migrate_slots(ah_memcached_server* server, uint32_t steps)
+{
+  ah_memcached_table* old_index = &server->old_index;
+  if (old_index->slots == NULL) {
+    return;
+  }
+
+  while (steps-- != 0 && server->migrated <= old_index->mask) {
+    ah_memcached_slot slot = old_index->slots[server->migrated];
+    if (slot.item == NULL) {
+      ++server->migrated;
+      continue;
+    }
+
+    insert_slot(&server->index, slot);
+    remove_slot(old_index, server->migrated);
+  }
+
+  if (server->migrated > old_index->mask) {
+    free(old_index->slots);
+    *old_index = (ah_memcached_table) {0};
+  }
+}
+
+/* The index grows once it is half full. A resize that cannot be allocated is
+ * retried with the next store, and the table is used up to 7/8 until then. */
+static bool reserve_slot(ah_memcached_server* server)
+{
+  ah_memcached_table* index = &server->index;
+  uint32_t capacity = index->mask + 1;
+  if ((index->count + 1) * 2 <= capacity) {
+    return true;
+  }
+
+  if (server->old_index.slots != NULL) {
+    migrate_slots(server, UINT32_MAX);
+  }
+
+  ah_memcached_slot* slots = calloc((size_t)capacity * 2, sizeof(*slots));
+  if (slots == NULL) {
+    return (uint64_t)(index->count + 1) * 8 <= (uint64_t)capacity * 7;
+  }
+
+  server->old_index = *index;
+  server->migrated = 0;
+  *index = (ah_memcached_table) {slots, capacity * 2 - 1, 0};
+  return true;
+}
+
+static ah_memcached_item* find_item(ah_memcached_server* server,
+                                    const uint8_t* key,
+                                    uint32_t length)
+{
+  uint32_t hash = hash_key(key, length);
+  ah_memcached_table* index = &server->index;
+  ah_memcached_item* item = index->slots[probe(index, hash, key, length)].item;
+  ah_memcached_table* old_index = &server->old_index;
+  if (item != NULL || old_index->slots == NULL) {
+    return item;
+  }
+
+  return old_index->slots[probe(old_index, hash, key, length)].item;
+}
+
+/* Expired items are removed when they are looked up */
+static ah_memcached_item* find_live_item(ah_memcached_server* server,
+                                         const uint8_t* key,
+                                         uint32_t length)
+{
+  ah_memcached_item* item = find_item(server, key, length);
+  if (item != NULL && is_expired(item, now_seconds())) {
+    unlink_item(server, item);
+    return NULL;
+  }
+
+  return item;
+}
+
+static void unlink_item(ah_memcached_server* server, ah_memcached_item* item)
+{
+  const uint8_t* key = item->data;
+  ah_memcached_table* table = &server->index;
+  uint32_t slot = probe(table, item->hash, key, item->key_length);
+  if (table->slots[slot].item != item) {
+    table = &server->old_index;
+    slot = probe(table, item->hash, key, item->key_length);
+  }
+
+  remove_slot(table, slot);
+  item->state = ITEM_UNLINKED;
+  if (item->references == 0) {
+    free_item(server, item);
+  }
+}
+
+/* Replaces the item with the same key, if any */
+static bool link_item(ah_memcached_server* server, ah_memcached_item* item)
+{
+  ah_memcached_item* existing =
+      find_item(server, item->data, item->key_length);
+  if (existing != NULL) {
+    unlink_item(server, existing);
+  }
+
+  migrate_slots(server, MEMCACHED_MIGRATE_STEP);
+  if (!reserve_slot(server)) {
+    return false;
+  }
+
+  item->state = ITEM_LINKED;
+  item->cas = ++server->cas;
+  insert_slot(&server->index, (ah_memcached_slot) {item->hash, item});
+  return true;
+}
+
+static ah_memcached_item* create_item(ah_memcached_server* server,
+                                      const uint8_t* key,
+                                      uint32_t key_length,
+                                      uint32_t flags,
+                                      uint32_t expires,
+                                      uint32_t value_length)
+{
+  ah_memcached_item* item =
+      allocate_item(server, item_size(key_length, value_length));
+  if (item == NULL) {
+    return NULL;
+  }
+
+  item->hash = hash_key(key, key_length);
+  item->flags = flags;
+  item->expires = expires;
+  item->value_length = value_length;
+  item->key_length = (uint8_t)key_length;
+  memcpy(item->data, key, key_length);
+  return item;
+}
+
+/* Connections */
+
+/* A response is some text optionally followed by the value of an item */
+typedef struct response {
+  ah_write_request requests[2];
+  ah_memcached_item* item;
+  uint32_t length;
+  uint8_t text[MEMCACHED_RESPONSE_TEXT];
+} response;
+
+/* The responses form a ring in the order of the commands. Those from the head
+ * that are queued are in the write queue of the connection already. */
+struct ah_memcached_connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  ah_memcached_server* server;
+  ah_memcached_connection* previous;
+  ah_memcached_connection* next;
+  void* closer_memory;
+  ah_closer* closer;
+  ah_ring ring;
+  ah_write_queue queue;
+  ah_memcached_item* storing;
+  uint32_t store_remaining;
+  uint32_t head;
+  uint32_t count;
+  uint32_t queued;
+  bool open;
+  bool closed;
+  bool reading;
+  bool swallowing;
+  bool store_noreply;
+  bool peer_closed;
+  response responses[AH_MEMCACHED_MAX_RESPONSES];
+};
+
+static void link_connection(ah_memcached_connection** list,
+                            ah_memcached_connection* connection)
+{
+  connection->previous = NULL;
+  connection->next = *list;
+  if (*list != NULL) {
+    (*list)->previous = connection;
+  }
+  *list = connection;
+}
+
+static void unlink_connection(ah_memcached_connection** list,
+                              ah_memcached_connection* connection)
+{
+  if (connection->previous == NULL) {
+    *list = connection->next;
+  } else {
+    connection->previous->next = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->previous = connection->previous;
+  }
+}
+
+static bool on_memcached_close(ah_error_code error_code,
+                               ah_closer* closer,
+                               void* per_call_data);
+
+static ah_memcached_connection* take_connection(ah_memcached_server* server)
+{
+  ah_memcached_connection* connection = server->free_connections;
+  if (connection != NULL) {
+    unlink_connection(&server->free_connections, connection);
+    return connection;
+  }
+
+  connection = calloc(1, sizeof(ah_memcached_connection));
+  if (connection == NULL) {
+    return NULL;
+  }
+
+  connection->closer_memory = malloc(closer_size());
+  if (connection->closer_memory == NULL
+      || !create_ring(&connection->ring, AH_MEMCACHED_RECEIVE_BUFFER_SIZE))
+  {
+    free(connection->closer_memory);
+    free(connection);
+    return NULL;
+  }
+
+  connection->server = server;
+  connection->closer = connection->closer_memory;
+  create_closer(connection->closer, on_memcached_close);
+  return connection;
+}
+
+static void free_connection(ah_memcached_connection* connection)
+{
+  destroy_ring(&connection->ring);
+  free(connection->closer_memory);
+  free(connection);
+}
+
+/* The docks of closed sockets may still have their ports parked with epoll,
+ * so the state is wiped before the connection is reused */
+static void release_connection(ah_memcached_connection* connection)
+{
+  ah_memcached_server* server = connection->server;
+  unlink_connection(&server->connections, connection);
+
+  connection->dock = (ah_io_dock) {0};
+  connection->head = 0;
+  connection->count = 0;
+  connection->queued = 0;
+  connection->open = false;
+  connection->closed = false;
+  connection->reading = false;
+  connection->peer_closed = false;
+  ring_consume(&connection->ring, connection->ring.size);
+  link_connection(&server->free_connections, connection);
+}
+
+static response* response_at(ah_memcached_connection* connection,
+                             uint32_t offset)
+{
+  uint32_t index = (connection->head + offset) % AH_MEMCACHED_MAX_RESPONSES;
+  return &connection->responses[index];
+}
+
+static void retire_response(ah_memcached_connection* connection)
+{
+  response* retired = response_at(connection, 0);
+  if (retired->item != NULL) {
+    release_item(connection->server, retired->item);
+    retired->item = NULL;
+  }
+
+  connection->head = (connection->head + 1) % AH_MEMCACHED_MAX_RESPONSES;
+  --connection->count;
+  --connection->queued;
+}
+
+/* The responses not handed to the write queue yet are dropped from the back,
+ * while those in it are retired by their completions */
+static void drop_unqueued_responses(ah_memcached_connection* connection)
+{
+  while (connection->count != connection->queued) {
+    response* dropped = response_at(connection, --connection->count);
+    if (dropped->item != NULL) {
+      release_item(connection->server, dropped->item);
+      dropped->item = NULL;
+    }
+  }
+}
+
+static void abandon_store(ah_memcached_connection* connection)
+{
+  if (connection->storing != NULL) {
+    free_item(connection->server, connection->storing);
+    connection->storing = NULL;
+  }
+
+  connection->swallowing = false;
+}
+
+static bool close_connection(ah_memcached_connection* connection,
+                             ah_close_mode mode)
+{
+  if (!connection->open) {
+    return true;
+  }
+
+  connection->open = false;
+  abandon_store(connection);
+  drop_unqueued_responses(connection);
+  return queue_close_operation(connection->closer,
+                               &connection->socket,
+                               mode,
+                               MEMCACHED_CLOSE_TIMEOUT_MS,
+                               connection);
+}
+
+/* The responses that were not sent yet still hold their items, which are
+ * released by cancelling them. With IOCP a send in progress completes them
+ * later instead, and the connection goes back to the pool after that. */
+static bool on_memcached_close(ah_error_code error_code,
+                               ah_closer* closer,
+                               void* per_call_data)
+{
+  (void)error_code;
+  (void)closer;
+
+  ah_memcached_connection* connection = per_call_data;
+  if (!cancel_write_queue(&connection->queue)) {
+    return false;
+  }
+
+  connection->closed = true;
+  if (connection->count == 0) {
+    release_connection(connection);
+  }
+
+  return true;
+}
+
+/* Status lines following each other are merged into one response */
+static response* reserve_text(ah_memcached_connection* connection,
+                              uint32_t length)
+{
+  if (connection->count != connection->queued) {
+    response* last = response_at(connection, connection->count - 1);
+    if (last->item == NULL
+        && last->length + length <= MEMCACHED_RESPONSE_TEXT)
+    {
+      return last;
+    }
+  }
+
+  response* next = response_at(connection, connection->count++);
+  next->length = 0;
+  return next;
+}
+
+static void append_text(ah_memcached_connection* connection,
+                        const void* text,
+                        uint32_t length)
+{
+  response* last = reserve_text(connection, length);
+  memcpy(last->text + last->length, text, length);
+  last->length += length;
+}
+
+#define APPEND_STRING(connection, str) \
+  append_text((connection), (str), STRING_LENGTH(str))
+
+static uint8_t* format_decimal(uint8_t* out, uint64_t value)
+{
+  uint8_t digits[MEMCACHED_MAX_DIGITS];
+  uint32_t count = 0;
+  do {
+    digits[count++] = (uint8_t)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (count != 0) {
+    *out++ = digits[--count];
+  }
+
+  return out;
+}
+
+/* Appends the VALUE line of the item and the value itself */
+static void append_value(ah_memcached_connection* connection,
+                         ah_memcached_item* item,
+                         bool with_cas)
+{
+  uint8_t line[MEMCACHED_RESPONSE_TEXT];
+  uint8_t* out = line;
+  memcpy(out, "VALUE ", 6);
+  out += 6;
+  memcpy(out, item->data, item->key_length);
+  out += item->key_length;
+  *out++ = ' ';
+  out = format_decimal(out, item->flags);
+  *out++ = ' ';
+  out = format_decimal(out, item->value_length);
+  if (with_cas) {
+    *out++ = ' ';
+    out = format_decimal(out, item->cas);
+  }
+  *out++ = '\r';
+  *out++ = '\n';
+
+  append_text(connection, line, (uint32_t)(out - line));
+  response* last = response_at(connection, connection->count - 1);
+  last->item = item;
+  ++item->references;
+  item->visited = true;
+}
+
+static bool process_commands(ah_memcached_connection* connection);
+static bool queue_memcached_read(ah_memcached_connection* connection);
+
+static bool on_response_written(ah_error_code error_code,
+                                ah_write_request* request,
+                                void* per_call_data)
+{
+  ah_memcached_connection* connection = per_call_data;
+  response* first = response_at(connection, 0);
+  if (first->item != NULL && request == &first->requests[0]) {
+    return true;
+  }
+
+  retire_response(connection);
+  if (connection->closed) {
+    if (connection->count == 0) {
+      release_connection(connection);
+    }
+    return true;
+  }
+
+  if (!connection->open) {
+    return true;
+  }
+  if (error_code != AH_ERR_OK) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+  if (connection->peer_closed && connection->count == 0) {
+    return close_connection(connection, AH_CLOSE_GRACEFUL);
+  }
+
+  /* Processing may have stopped for lack of responses, and the commands
+   * that arrived since then are answered together */
+  return process_commands(connection) && queue_memcached_read(connection);
+}
+
+static bool flush_responses(ah_memcached_connection* connection)
+{
+  while (connection->open && connection->queued != connection->count) {
+    response* next = response_at(connection, connection->queued++);
+    ah_io_buffer text = {next->length, next->text};
+    if (!queue_write_request(&connection->queue,
+                             &next->requests[0],
+                             text,
+                             on_response_written,
+                             connection))
+    {
+      return false;
+    }
+
+    ah_memcached_item* item = next->item;
+    if (item == NULL) {
+      continue;
+    }
+
+    ah_io_buffer value = {item->value_length + 2, item_value(item)};
+    if (!queue_write_request(&connection->queue,
+                             &next->requests[1],
+                             value,
+                             on_response_written,
+                             connection))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Commands */
+
+typedef struct token {
+  uint8_t* data;
+  uint32_t length;
+} token;
+
+static bool token_equals(token value, const char* text, uint32_t length)
+{
+  return value.length == length && memcmp(value.data, text, length) == 0;
+}
+
+#define TOKEN_IS(value, str) token_equals((value), (str), STRING_LENGTH(str))
+
+static bool parse_number(token value, uint64_t* result)
+{
+  if (value.length == 0 || value.length > MEMCACHED_MAX_DIGITS) {
+    return false;
+  }
+
+  uint64_t number = 0;
+  for (uint32_t i = 0; i != value.length; ++i) {
+    uint8_t digit = (uint8_t)(value.data[i] - '0');
+    if (digit > 9 || number > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    number = number * 10 + digit;
+  }
+
+  *result = number;
+  return true;
+}
+
+/* Returns the number of tokens, or more than \c capacity if they do not fit */
+static uint32_t split_line(uint8_t* begin,
+                           uint8_t* end,
+                           token* tokens,
+                           uint32_t capacity)
+{
+  uint32_t count = 0;
+  while (begin != end) {
+    if (*begin == ' ') {
+      ++begin;
+      continue;
+    }
+
+    uint8_t* start = begin;
+    while (begin != end && *begin != ' ') {
+      ++begin;
+    }
+    if (count == capacity) {
+      return capacity + 1;
+    }
+    tokens[count++] = (token) {start, (uint32_t)(begin - start)};
+  }
+
+  return count;
+}
+
+static bool is_valid_key(token key)
+{
+  return key.length <= AH_MEMCACHED_MAX_KEY;
+}
+
+static bool is_noreply(const token* tokens, uint32_t count, uint32_t index)
+{
+  return count == index + 1 && TOKEN_IS(tokens[index], "noreply");
+}
+
+static void retrieve(ah_memcached_connection* connection,
+                     const token* tokens,
+                     uint32_t count,
+                     bool with_cas)
+{
+  ah_memcached_server* server = connection->server;
+  for (uint32_t i = 1; i != count; ++i) {
+    if (!is_valid_key(tokens[i])) {
+      APPEND_STRING(connection, "CLIENT_ERROR bad command line format\r\n");
+      return;
+    }
+  }
+
+  for (uint32_t i = 1; i != count; ++i) {
+    ah_memcached_item* item =
+        find_live_item(server, tokens[i].data, tokens[i].length);
+    if (item == NULL) {
+      ++server->misses;
+    } else {
+      ++server->hits;
+      append_value(connection, item, with_cas);
+    }
+  }
+
+  APPEND_STRING(connection, "END\r\n");
+}
+
+/* Times up to 30 days are relative, longer ones are absolute Unix times and
+ * negative ones expire the item right away */
+static uint32_t expiration_time(int64_t exptime)
+{
+  if (exptime == 0) {
+    return 0;
+  }
+
+  int64_t now = now_seconds();
+  int64_t expires = exptime;
+  if (exptime > 0 && exptime <= MEMCACHED_RELATIVE_LIMIT) {
+    expires += now;
+  }
+
+  if (expires <= 0 || expires > UINT32_MAX) {
+    return expires <= 0 ? 1 : UINT32_MAX;
+  }
+
+  return (uint32_t)expires;
+}
+
+/* The value is received into the item after the command line, or discarded if
+ * it cannot be stored */
+static void begin_store(ah_memcached_connection* connection,
+                        const token* tokens,
+                        uint32_t count)
+{
+  uint64_t flags;
+  uint64_t exptime;
+  uint64_t length;
+  token exptime_token = tokens[3];
+  bool negative = exptime_token.length != 0 && exptime_token.data[0] == '-';
+  if (negative) {
+    ++exptime_token.data;
+    --exptime_token.length;
+  }
+
+  if ((count != 5 && !is_noreply(tokens, count, 5))
+      || !is_valid_key(tokens[1]) || !parse_number(tokens[2], &flags)
+      || flags > UINT32_MAX || !parse_number(exptime_token, &exptime)
+      || exptime > INT32_MAX || !parse_number(tokens[4], &length)
+      || length > INT32_MAX)
+  {
+    APPEND_STRING(connection, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+
+  connection->store_noreply = count == 6;
+  connection->store_remaining = (uint32_t)length + 2;
+  connection->storing = NULL;
+  connection->swallowing = true;
+  if (item_size(tokens[1].length, (uint32_t)length) > AH_MEMCACHED_PAGE_SIZE)
+  {
+    APPEND_STRING(connection, "SERVER_ERROR object too large for cache\r\n");
+    return;
+  }
+
+  int64_t signed_exptime = negative ? -(int64_t)exptime : (int64_t)exptime;
+  connection->storing = create_item(connection->server,
+                                    tokens[1].data,
+                                    tokens[1].length,
+                                    (uint32_t)flags,
+                                    expiration_time(signed_exptime),
+                                    (uint32_t)length);
+  if (connection->storing == NULL) {
+    APPEND_STRING(connection, "SERVER_ERROR out of memory storing object\r\n");
+  }
+}
+
+/* Returns false while the value is incomplete */
+static bool continue_store(ah_memcached_connection* connection)
+{
+  ah_ring* ring = &connection->ring;
+  uint32_t available = ring->size < connection->store_remaining
+      ? ring->size
+      : connection->store_remaining;
+  ah_memcached_item* item = connection->storing;
+  if (item != NULL) {
+    uint32_t total = item->value_length + 2;
+    uint32_t offset = total - connection->store_remaining;
+    memcpy(item_value(item) + offset, ring_read_buffer(ring).buffer, available);
+  }
+
+  ring_consume(ring, available);
+  connection->store_remaining -= available;
+  if (connection->store_remaining != 0) {
+    return false;
+  }
+
+  connection->swallowing = false;
+  connection->storing = NULL;
+  if (item == NULL) {
+    return true;
+  }
+
+  uint8_t* end = item_value(item) + item->value_length;
+  if (end[0] != '\r' || end[1] != '\n') {
+    free_item(connection->server, item);
+    APPEND_STRING(connection, "CLIENT_ERROR bad data chunk\r\n");
+  } else if (!link_item(connection->server, item)) {
+    free_item(connection->server, item);
+    APPEND_STRING(connection, "SERVER_ERROR out of memory storing object\r\n");
+  } else if (!connection->store_noreply) {
+    APPEND_STRING(connection, "STORED\r\n");
+  }
+
+  return true;
+}
+
+static void delete_item(ah_memcached_connection* connection,
+                        const token* tokens,
+                        uint32_t count)
+{
+  if ((count != 2 && !is_noreply(tokens, count, 2))
+      || !is_valid_key(tokens[1]))
+  {
+    APPEND_STRING(connection, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+
+  ah_memcached_server* server = connection->server;
+  ah_memcached_item* item =
+      find_live_item(server, tokens[1].data, tokens[1].length);
+  if (item != NULL) {
+    unlink_item(server, item);
+  }
+
+  if (count == 3) {
+    return;
+  }
+
+  if (item == NULL) {
+    APPEND_STRING(connection, "NOT_FOUND\r\n");
+  } else {
+    APPEND_STRING(connection, "DELETED\r\n");
+  }
+}
+
+/* The new value is stored as a new item, because its length may differ and
+ * the old one may still be being sent. Increments wrap around at 64 bits and
+ * decrements stop at 0. */
+static void add_delta(ah_memcached_connection* connection,
+                      const token* tokens,
+                      uint32_t count,
+                      bool increment)
+{
+  uint64_t delta;
+  if ((count != 3 && !is_noreply(tokens, count, 3))
+      || !is_valid_key(tokens[1]))
+  {
+    APPEND_STRING(connection, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+  if (!parse_number(tokens[2], &delta)) {
+    APPEND_STRING(connection,
+                  "CLIENT_ERROR invalid numeric delta argument\r\n");
+    return;
+  }
+
+  ah_memcached_server* server = connection->server;
+  ah_memcached_item* item =
+      find_live_item(server, tokens[1].data, tokens[1].length);
+  if (item == NULL) {
+    if (count == 3) {
+      APPEND_STRING(connection, "NOT_FOUND\r\n");
+    }
+    return;
+  }
+
+  uint64_t value;
+  token current = {item_value(item), item->value_length};
+  if (!parse_number(current, &value)) {
+    APPEND_STRING(
+        connection,
+        "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+    return;
+  }
+
+  if (increment) {
+    value += delta;
+  } else {
+    value = value < delta ? 0 : value - delta;
+  }
+
+  uint8_t digits[MEMCACHED_MAX_DIGITS + 2];
+  uint32_t length = (uint32_t)(format_decimal(digits, value) - digits);
+  ah_memcached_item* result = create_item(server,
+                                          item->data,
+                                          item->key_length,
+                                          item->flags,
+                                          item->expires,
+                                          length);
+  if (result == NULL) {
+    APPEND_STRING(connection, "SERVER_ERROR out of memory\r\n");
+    return;
+  }
+
+  memcpy(item_value(result), digits, length);
+  memcpy(item_value(result) + length, "\r\n", 2);
+  if (!link_item(server, result)) {
+    free_item(server, result);
+    APPEND_STRING(connection, "SERVER_ERROR out of memory\r\n");
+    return;
+  }
+
+  if (count == 3) {
+    memcpy(digits + length, "\r\n", 2);
+    append_text(connection, digits, length + 2);
+  }
+}
+
+/* Returns the number of responses the command might need at most */
+static uint32_t responses_needed(const token* tokens, uint32_t count)
+{
+  if (count > 1 && (TOKEN_IS(tokens[0], "get") || TOKEN_IS(tokens[0], "gets")))
+  {
+    return count;
+  }
+
+  return 1;
+}
+
+/* Returns false if the connection is to be closed */
+static bool execute_command(ah_memcached_connection* connection,
+                            token* tokens,
+                            uint32_t count)
+{
+  if (count > MEMCACHED_MAX_TOKENS) {
+    APPEND_STRING(connection, "CLIENT_ERROR too many keys\r\n");
+  } else if (count == 0) {
+    APPEND_STRING(connection, "ERROR\r\n");
+  } else if (TOKEN_IS(tokens[0], "get") && count > 1) {
+    retrieve(connection, tokens, count, false);
+  } else if (TOKEN_IS(tokens[0], "gets") && count > 1) {
+    retrieve(connection, tokens, count, true);
+  } else if (TOKEN_IS(tokens[0], "set") && count > 4) {
+    begin_store(connection, tokens, count);
+  } else if (TOKEN_IS(tokens[0], "delete") && count > 1) {
+    delete_item(connection, tokens, count);
+  } else if (TOKEN_IS(tokens[0], "incr") && count > 2) {
+    add_delta(connection, tokens, count, true);
+  } else if (TOKEN_IS(tokens[0], "decr") && count > 2) {
+    add_delta(connection, tokens, count, false);
+  } else if (TOKEN_IS(tokens[0], "quit") && count == 1) {
+    return false;
+  } else {
+    APPEND_STRING(connection, "ERROR\r\n");
+  }
+
+  return true;
+}
+
+/* Stops while there might not be enough responses left for the next
+ * command. The responses are queued once everything in the ring is
+ * processed, so a batch of commands is answered with a single send. */
+static bool process_commands(ah_memcached_connection* connection)
+{
+  ah_ring* ring = &connection->ring;
+  token tokens[MEMCACHED_MAX_TOKENS];
+  while (connection->open) {
+    if (connection->swallowing) {
+      if (!continue_store(connection)) {
+        break;
+      }
+      continue;
+    }
+
+    ah_io_buffer unread = ring_read_buffer(ring);
+    uint8_t* begin = unread.buffer;
+    uint8_t* newline = unread.buffer_length == 0
+        ? NULL
+        : memchr(begin, '\n', unread.buffer_length);
+    if (newline == NULL) {
+      if (ring->size != ring->capacity) {
+        break;
+      }
+
+      APPEND_STRING(connection, "CLIENT_ERROR line too long\r\n");
+      return flush_responses(connection)
+          && close_connection(connection, AH_CLOSE_GRACEFUL);
+    }
+
+    uint8_t* end = newline != begin && newline[-1] == '\r' ? newline - 1
+                                                            : newline;
+    uint32_t count =
+        split_line(begin, end, tokens, MEMCACHED_MAX_TOKENS);
+    uint32_t needed = count > MEMCACHED_MAX_TOKENS
+        ? 1
+        : responses_needed(tokens, count);
+    if (AH_MEMCACHED_MAX_RESPONSES - connection->count < needed) {
+      break;
+    }
+
+    bool keep_open = execute_command(connection, tokens, count);
+    ring_consume(ring, (uint32_t)(newline - begin) + 1);
+    if (!keep_open) {
+      return flush_responses(connection)
+          && close_connection(connection, AH_CLOSE_GRACEFUL);
+    }
+  }
+
+  return flush_responses(connection);
+}
+
+static bool on_memcached_read(ah_error_code error_code,
+                              ah_io_operation* operation,
+                              uint32_t bytes_transferred,
+                              void* per_call_data)
+{
+  (void)operation;
+
+  ah_memcached_connection* connection = per_call_data;
+  connection->reading = false;
+  if (!connection->open) {
+    return true;
+  }
+
+  if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+    return queue_memcached_read(connection);
+  }
+  if (error_code != AH_ERR_OK) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+
+  /* The responses to the complete commands are still sent after the peer
+   * shut down its sending side */
+  if (bytes_transferred == 0) {
+    connection->peer_closed = true;
+    return connection->count != 0
+        || close_connection(connection, AH_CLOSE_GRACEFUL);
+  }
+
+  ring_produce(&connection->ring, bytes_transferred);
+  return process_commands(connection) && queue_memcached_read(connection);
+}
+
+static bool queue_memcached_read(ah_memcached_connection* connection)
+{
+  if (!connection->open || connection->peer_closed || connection->reading) {
+    return true;
+  }
+
+  ah_io_buffer buffer = ring_write_buffer(&connection->ring);
+  if (buffer.buffer_length == 0) {
+    return true;
+  }
+
+  connection->reading = true;
+  return queue_read_operation(
+      &connection->dock, buffer, on_memcached_read, connection);
+}
+
+bool memcached_accept(ah_memcached_server* server, ah_socket* socket)
+{
+  /* The socket is closed after the accept handler returns if it could not be
+   * taken */
+  ah_memcached_connection* connection = take_connection(server);
+  if (connection == NULL) {
+    return true;
+  }
+
+  link_connection(&server->connections, connection);
+  move_socket(&connection->socket, socket);
+  connection->dock.socket = &connection->socket;
+  create_write_queue(&connection->queue, &connection->dock);
+  connection->open = true;
+  return queue_memcached_read(connection);
+}
+
+uint32_t memcached_item_count(ah_memcached_server* server)
+{
+  return server->index.count + server->old_index.count;
+}
+
+/* Server */
+
+bool create_memcached_server(ah_memcached_server* result_server,
+                             ah_server* server,
+                             uint64_t memory_limit)
+{
+  *result_server = (ah_memcached_server) {
+      .server = server,
+      .page_limit = (uint32_t)(memory_limit / AH_MEMCACHED_PAGE_SIZE),
+  };
+
+  /* The closers are allocated with malloc, which only guarantees the
+   * alignment of the fundamental types */
+  if (closer_alignment() > _Alignof(max_align_t)
+      || memory_limit < AH_MEMCACHED_PAGE_SIZE
+      || memory_limit / AH_MEMCACHED_PAGE_SIZE > UINT32_MAX)
+  {
+    return false;
+  }
+
+  ah_memcached_slot* slots =
+      calloc(MEMCACHED_INITIAL_SLOTS, sizeof(ah_memcached_slot));
+  if (slots == NULL || !create_classes(result_server)) {
+    free(slots);
+    return false;
+  }
+
+  result_server->index =
+      (ah_memcached_table) {slots, MEMCACHED_INITIAL_SLOTS - 1, 0};
+  return true;
+}
+
+void destroy_memcached_server(ah_memcached_server* server)
+{
+  while (server->connections != NULL) {
+    ah_memcached_connection* connection = server->connections;
+    unlink_connection(&server->connections, connection);
+    if (connection->open) {
+      connection->open = false;
+      abandon_store(connection);
+      drop_unqueued_responses(connection);
+      destroy_socket(&connection->socket);
+    } else if (!connection->closed) {
+      destroy_closer(connection->closer);
+    }
+    if (!connection->closed) {
+      cancel_write_queue(&connection->queue);
+    }
+    free_connection(connection);
+  }
+
+  while (server->free_connections != NULL) {
+    ah_memcached_connection* connection = server->free_connections;
+    unlink_connection(&server->free_connections, connection);
+    free_connection(connection);
+  }
+
+  for (uint32_t i = 0; i != server->class_count; ++i) {
+    ah_memcached_class* class = &server->classes[i];
+    for (uint32_t j = 0; j != class->page_count; ++j) {
+      free(class->pages[j]);
+    }
+    free(class->pages);
+  }
+
+  free(server->classes);
+  free(server->index.slots);
+  free(server->old_index.slots);
+  *server = (ah_memcached_server) {0};
+}
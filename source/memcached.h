@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * @file
+ *
+ * In-memory cache speaking the text protocol of memcached on top of the
+ * acceptor and dock primitives. The \c get, \c gets, \c set, \c delete,
+ * \c incr and \c decr commands are supported, including retrievals of many
+ * keys at once and \c noreply. Pipelined commands are answered through the
+ * write queue of the connection, and values are sent straight from the items,
+ * so every response that arrives in a single read is sent with a single
+ * system call without copying any value.
+ *
+ * Items are allocated from slab classes of growing chunk sizes carved from
+ * pages of ::AH_MEMCACHED_PAGE_SIZE bytes. Once the memory limit is reached,
+ * the classes evict their items in CLOCK order to make room: items read since
+ * the hand last passed them get a second chance. Pages are not moved between
+ * classes, so a class that has no page by then cannot store anything.
+ */
+
+/**
+ * @brief The longest key in bytes.
+ */
+#define AH_MEMCACHED_MAX_KEY 250
+
+/**
+ * @brief The size of the pages the items are allocated from, which limits
+ * the size of an item including its key and a header of a few dozen bytes.
+ */
+#define AH_MEMCACHED_PAGE_SIZE (1024 * 1024)
+
+/**
+ * @brief The number of responses of a connection that can wait to be sent.
+ *
+ * A value and the text before it make up one response, while the status
+ * lines following each other share one. Commands are not processed while
+ * there might be too few left for their response.
+ */
+#define AH_MEMCACHED_MAX_RESPONSES 128
+
+/**
+ * @brief The most keys a retrieval command can ask for.
+ */
+#define AH_MEMCACHED_MAX_KEYS (AH_MEMCACHED_MAX_RESPONSES - 1)
+
+/**
+ * @brief The size of the receive buffer of a connection, which limits the
+ * length of a command line.
+ *
+ * Values are copied into their item as they arrive, so they are only limited
+ * by the page size.
+ */
+#define AH_MEMCACHED_RECEIVE_BUFFER_SIZE (64 * 1024)
+
+typedef struct ah_memcached_connection ah_memcached_connection;
+typedef struct ah_memcached_item ah_memcached_item;
+typedef struct ah_memcached_class ah_memcached_class;
+
+/**
+ * @brief A slot of the hash index.
+ */
+typedef struct ah_memcached_slot {
+  uint32_t hash;
+  ah_memcached_item* item;
+} ah_memcached_slot;
+
+/**
+ * @brief Open addressing hash table with linear probing.
+ */
+typedef struct ah_memcached_table {
+  ah_memcached_slot* slots;
+  uint32_t mask;
+  uint32_t count;
+} ah_memcached_table;
+
+/**
+ * @brief Cache that serves the sockets handed to ::memcached_accept.
+ *
+ * The index grows by moving the slots of the old table into the new one a
+ * few at a time with every store, so no single command pays for the whole
+ * rehash. Until the old table is empty, lookups search both. The statistics
+ * count the retrieved keys that were found and those that were not, and the
+ * items evicted to make room for new ones. The other members are managed by
+ * the memcached functions.
+ */
+typedef struct ah_memcached_server {
+  ah_server* server;
+  ah_memcached_class* classes;
+  uint32_t class_count;
+  uint32_t page_count;
+  uint32_t page_limit;
+  ah_memcached_table index;
+  ah_memcached_table old_index;
+  uint32_t migrated;
+  uint64_t cas;
+  ah_memcached_connection* connections;
+  ah_memcached_connection* free_connections;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} ah_memcached_server;
+
+/**
+ * @brief Initializes a cache running on the event loop of \c server that
+ * allocates at most \c memory_limit bytes for its items.
+ *
+ * The limit is rounded down to whole pages and must be at least one page.
+ * The index and the connections are allocated on top of it.
+ */
+bool create_memcached_server(ah_memcached_server* result_server,
+                             ah_server* server,
+                             uint64_t memory_limit);
+
+/**
+ * @brief Takes ownership of a socket from an accept handler and starts
+ * serving commands on it.
+ */
+bool memcached_accept(ah_memcached_server* server, ah_socket* socket);
+
+/**
+ * @brief Returns the number of items in the cache, including expired ones
+ * not yet removed.
+ */
+uint32_t memcached_item_count(ah_memcached_server* server);
+
+/**
+ * @brief Resets every connection of the cache and frees the items, the index
+ * and the connection pool.
+ */
+void destroy_memcached_server(ah_memcached_server* server);
@@ -0,0 +1,631 @@
+#include "pubsub.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PUBSUB_CLOSE_TIMEOUT_MS 5000
+#define PUBSUB_HEADER_LENGTH 4
+#define PUBSUB_INITIAL_SLOTS 16
+#define PUBSUB_INITIAL_SUBSCRIBERS 4
+
+/* The topic and the connection refer to each other's entries by index, so
+ * both sides can be removed from their dense arrays in constant time by
+ * moving the last entry into the hole */
+
+typedef struct subscriber {
+  ah_pubsub_connection* connection;
+  uint32_t subscription;
+} subscriber;
+
+typedef struct subscription {
+  ah_pubsub_topic* topic;
+  uint32_t subscriber;
+} subscription;
+
+struct ah_pubsub_topic {
+  uint32_t hash;
+  uint32_t count;
+  uint32_t capacity;
+  subscriber* subscribers;
+  uint8_t name_length;
+  uint8_t name[AH_PUBSUB_MAX_TOPIC];
+};
+
+/* The messages waiting to be sent form a ring of write requests, which the
+ * write queue completes in order */
+struct ah_pubsub_connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  ah_pubsub_server* server;
+  ah_pubsub_connection* previous;
+  ah_pubsub_connection* next;
+  void* closer_memory;
+  ah_closer* closer;
+  ah_ring ring;
+  ah_framer framer;
+  ah_write_queue queue;
+  uint32_t pending_head;
+  uint32_t pending_count;
+  uint32_t subscription_count;
+  bool open;
+  bool closed;
+  subscription subscriptions[AH_PUBSUB_MAX_SUBSCRIPTIONS];
+  ah_write_request requests[AH_PUBSUB_MAX_PENDING];
+};
+
+/* Topics */
+
+/* FNV-1a, which is plenty for names this short */
+static uint32_t hash_name(const uint8_t* name, uint32_t length)
+{
+  uint32_t hash = 2166136261U;
+  for (uint32_t i = 0; i != length; ++i) {
+    hash = (hash ^ name[i]) * 16777619U;
+  }
+
+  return hash;
+}
+
+/* Returns the slot of the topic, or the empty slot where it would be */
+static uint32_t find_slot(ah_pubsub_server* server,
+                          uint32_t hash,
+                          const uint8_t* name,
+                          uint32_t length)
+{
+  uint32_t index = hash & server->slot_mask;
+  while (true) {
+    ah_pubsub_slot* slot = &server->slots[index];
+    if (slot->topic == NULL
+        || (slot->hash == hash && slot->topic->name_length == length
+            && memcmp(slot->topic->name, name, length) == 0))
+    {
+      return index;
+    }
+
+    index = (index + 1) & server->slot_mask;
+  }
+}
+
+static ah_pubsub_topic* find_topic(ah_pubsub_server* server,
+                                   const uint8_t* name,
+                                   uint32_t length)
+{
+  uint32_t hash = hash_name(name, length);
+  return server->slots[find_slot(server, hash, name, length)].topic;
+}
+
+/* The table is kept at most half full, so probe sequences stay short */
+static bool grow_slots(ah_pubsub_server* server)
+{
+  uint32_t capacity = (server->slot_mask + 1) * 2;
+  ah_pubsub_slot* slots = calloc(capacity, sizeof(ah_pubsub_slot));
+  if (slots == NULL) {
+    return false;
+  }
+
+  ah_pubsub_slot* old_slots = server->slots;
+  uint32_t old_capacity = server->slot_mask + 1;
+  server->slots = slots;
+  server->slot_mask = capacity - 1;
+  for (uint32_t i = 0; i != old_capacity; ++i) {
+    if (old_slots[i].topic == NULL) {
+      continue;
+    }
+
+    uint32_t index = old_slots[i].hash & server->slot_mask;
+    while (slots[index].topic != NULL) {
+      index = (index + 1) & server->slot_mask;
+    }
+    slots[index] = old_slots[i];
+  }
+
+  free(old_slots);
+  return true;
+}
+
+static ah_pubsub_topic* create_topic(ah_pubsub_server* server,
+                                     const uint8_t* name,
+                                     uint32_t length)
+{
+  if ((server->topic_count + 1) * 2 > server->slot_mask + 1
+      && !grow_slots(server))
+  {
+    return NULL;
+  }
+
+  ah_pubsub_topic* topic = malloc(sizeof(ah_pubsub_topic));
+  subscriber* subscribers =
+      malloc(PUBSUB_INITIAL_SUBSCRIBERS * sizeof(subscriber));
+  if (topic == NULL || subscribers == NULL) {
+    free(topic);
+    free(subscribers);
+    return NULL;
+  }
+
+  *topic = (ah_pubsub_topic) {
+      .hash = hash_name(name, length),
+      .capacity = PUBSUB_INITIAL_SUBSCRIBERS,
+      .subscribers = subscribers,
+      .name_length = (uint8_t)length,
+  };
+  memcpy(topic->name, name, length);
+
+  uint32_t index = find_slot(server, topic->hash, name, length);
+  server->slots[index] = (ah_pubsub_slot) {topic->hash, topic};
+  ++server->topic_count;
+  return topic;
+}
+
+/* Linear probing allows deleting without tombstones: the entries after the
+ * hole that would not be found past it anymore are shifted back into it */
+static void remove_topic(ah_pubsub_server* server, ah_pubsub_topic* topic)
+{
+  uint32_t mask = server->slot_mask;
+  uint32_t hole =
+      find_slot(server, topic->hash, topic->name, topic->name_length);
+  uint32_t index = hole;
+  while (true) {
+    index = (index + 1) & mask;
+    ah_pubsub_slot* slot = &server->slots[index];
+    if (slot->topic == NULL) {
+      break;
+    }
+
+    uint32_t home = slot->hash & mask;
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      server->slots[hole] = *slot;
+      hole = index;
+    }
+  }
+
+  server->slots[hole] = (ah_pubsub_slot) {0};
+  --server->topic_count;
+  free(topic->subscribers);
+  free(topic);
+}
+
+/* Subscriptions */
+
+static bool subscribe(ah_pubsub_connection* connection,
+                      const uint8_t* name,
+                      uint32_t length)
+{
+  ah_pubsub_server* server = connection->server;
+  ah_pubsub_topic* topic = find_topic(server, name, length);
+  if (topic == NULL) {
+    topic = create_topic(server, name, length);
+    if (topic == NULL) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i != connection->subscription_count; ++i) {
+    if (connection->subscriptions[i].topic == topic) {
+      return true;
+    }
+  }
+
+  if (topic->count == topic->capacity) {
+    subscriber* subscribers =
+        realloc(topic->subscribers, topic->capacity * 2 * sizeof(subscriber));
+    if (subscribers == NULL) {
+      return false;
+    }
+
+    topic->subscribers = subscribers;
+    topic->capacity *= 2;
+  }
+
+  uint32_t index = connection->subscription_count++;
+  topic->subscribers[topic->count] = (subscriber) {connection, index};
+  connection->subscriptions[index] = (subscription) {topic, topic->count};
+  ++topic->count;
+  return true;
+}
+
+/* The topic of a message being published is removed by the publisher once it
+ * is done with the subscribers */
+static void unsubscribe_at(ah_pubsub_connection* connection, uint32_t index)
+{
+  ah_pubsub_server* server = connection->server;
+  subscription removed = connection->subscriptions[index];
+  ah_pubsub_topic* topic = removed.topic;
+
+  subscriber last = topic->subscribers[--topic->count];
+  if (removed.subscriber != topic->count) {
+    topic->subscribers[removed.subscriber] = last;
+    last.connection->subscriptions[last.subscription].subscriber =
+        removed.subscriber;
+  }
+
+  subscription moved =
+      connection->subscriptions[--connection->subscription_count];
+  if (index != connection->subscription_count) {
+    connection->subscriptions[index] = moved;
+    moved.topic->subscribers[moved.subscriber].subscription = index;
+  }
+
+  if (topic->count == 0 && topic != server->publishing) {
+    remove_topic(server, topic);
+  }
+}
+
+static void unsubscribe(ah_pubsub_connection* connection,
+                        const uint8_t* name,
+                        uint32_t length)
+{
+  ah_pubsub_topic* topic = find_topic(connection->server, name, length);
+  for (uint32_t i = 0; i != connection->subscription_count; ++i) {
+    if (connection->subscriptions[i].topic == topic) {
+      unsubscribe_at(connection, i);
+      return;
+    }
+  }
+}
+
+/* Connections */
+
+static void link_connection(ah_pubsub_connection** list,
+                            ah_pubsub_connection* connection)
+{
+  connection->previous = NULL;
+  connection->next = *list;
+  if (*list != NULL) {
+    (*list)->previous = connection;
+  }
+  *list = connection;
+}
+
+static void unlink_connection(ah_pubsub_connection** list,
+                              ah_pubsub_connection* connection)
+{
+  if (connection->previous == NULL) {
+    *list = connection->next;
+  } else {
+    connection->previous->next = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->previous = connection->previous;
+  }
+}
+
+static bool on_pubsub_close(ah_error_code error_code,
+                            ah_closer* closer,
+                            void* per_call_data);
+
+static ah_pubsub_connection* take_connection(ah_pubsub_server* server)
+{
+  ah_pubsub_connection* connection = server->free_connections;
+  if (connection != NULL) {
+    unlink_connection(&server->free_connections, connection);
+    return connection;
+  }
+
+  connection = calloc(1, sizeof(ah_pubsub_connection));
+  if (connection == NULL) {
+    return NULL;
+  }
+
+  connection->closer_memory = malloc(closer_size());
+  if (connection->closer_memory == NULL
+      || !create_ring(&connection->ring, AH_PUBSUB_RECEIVE_BUFFER_SIZE))
+  {
+    free(connection->closer_memory);
+    free(connection);
+    return NULL;
+  }
+
+  connection->server = server;
+  connection->closer = connection->closer_memory;
+  create_closer(connection->closer, on_pubsub_close);
+  return connection;
+}
+
+static void free_connection(ah_pubsub_connection* connection)
+{
+  destroy_ring(&connection->ring);
+  free(connection->closer_memory);
+  free(connection);
+}
+
+/* The docks of closed sockets may still have their ports parked with epoll,
+ * so the state is wiped before the connection is reused */
+static void release_connection(ah_pubsub_connection* connection)
+{
+  ah_pubsub_server* server = connection->server;
+  unlink_connection(&server->connections, connection);
+
+  connection->dock = (ah_io_dock) {0};
+  connection->pending_head = 0;
+  connection->pending_count = 0;
+  connection->open = false;
+  connection->closed = false;
+  ring_consume(&connection->ring, connection->ring.size);
+  link_connection(&server->free_connections, connection);
+}
+
+/* A closed connection no longer receives messages, so it leaves its topics
+ * right away instead of once the close operation completes */
+static bool close_connection(ah_pubsub_connection* connection,
+                             ah_close_mode mode)
+{
+  if (!connection->open) {
+    return true;
+  }
+
+  connection->open = false;
+  while (connection->subscription_count != 0) {
+    unsubscribe_at(connection, connection->subscription_count - 1);
+  }
+
+  stop_framer(&connection->framer);
+  return queue_close_operation(connection->closer,
+                               &connection->socket,
+                               mode,
+                               PUBSUB_CLOSE_TIMEOUT_MS,
+                               connection);
+}
+
+/* The messages that were not sent yet still hold their buffers, which are
+ * released by cancelling them. With IOCP a send in progress completes them
+ * later instead, and the connection goes back to the pool after that. */
+static bool on_pubsub_close(ah_error_code error_code,
+                            ah_closer* closer,
+                            void* per_call_data)
+{
+  (void)error_code;
+  (void)closer;
+
+  ah_pubsub_connection* connection = per_call_data;
+  if (!cancel_write_queue(&connection->queue)) {
+    return false;
+  }
+
+  connection->closed = true;
+  if (connection->pending_count == 0) {
+    release_connection(connection);
+  }
+
+  return true;
+}
+
+static bool on_message_written(ah_error_code error_code,
+                               ah_write_request* request,
+                               void* per_call_data)
+{
+  (void)request;
+
+  ah_pubsub_connection* connection = per_call_data;
+  connection->pending_head =
+      (connection->pending_head + 1) % AH_PUBSUB_MAX_PENDING;
+  --connection->pending_count;
+  if (connection->closed) {
+    if (connection->pending_count == 0) {
+      release_connection(connection);
+    }
+    return true;
+  }
+
+  if (error_code != AH_ERR_OK) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+
+  return true;
+}
+
+static bool is_slow(ah_pubsub_connection* connection)
+{
+  return connection->pending_count == AH_PUBSUB_MAX_PENDING
+      || connection->queue.reads_paused;
+}
+
+static bool deliver_message(ah_pubsub_connection* connection,
+                            ah_shared_buf* message)
+{
+  uint32_t index = (connection->pending_head + connection->pending_count)
+      % AH_PUBSUB_MAX_PENDING;
+  ++connection->pending_count;
+  return queue_shared_write_request(&connection->queue,
+                                    &connection->requests[index],
+                                    message,
+                                    0,
+                                    message->length,
+                                    on_message_written,
+                                    connection);
+}
+
+/* The subscribers are visited from the back, so those disconnected on the way
+ * only move ones already visited */
+static bool publish(ah_pubsub_connection* connection, ah_io_buffer frame)
+{
+  ah_pubsub_server* server = connection->server;
+  uint8_t* data = frame.buffer;
+  ++server->published;
+  ah_pubsub_topic* topic = find_topic(server, data + 2, data[1]);
+  if (topic == NULL) {
+    return true;
+  }
+
+  ah_shared_buf* message =
+      create_shared_buf(PUBSUB_HEADER_LENGTH + frame.buffer_length);
+  if (message == NULL) {
+    server->dropped += topic->count;
+    return true;
+  }
+
+  uint32_t length = frame.buffer_length;
+  message->data[0] = (uint8_t)(length >> 24);
+  message->data[1] = (uint8_t)(length >> 16);
+  message->data[2] = (uint8_t)(length >> 8);
+  message->data[3] = (uint8_t)length;
+  memcpy(message->data + PUBSUB_HEADER_LENGTH, data, length);
+  message->data[PUBSUB_HEADER_LENGTH] = 'M';
+
+  bool result = true;
+  server->publishing = topic;
+  for (uint32_t i = topic->count; i != 0 && result; --i) {
+    ah_pubsub_connection* target = topic->subscribers[i - 1].connection;
+    if (!is_slow(target)) {
+      ++server->delivered;
+      result = deliver_message(target, message);
+    } else {
+      ++server->dropped;
+      if (server->policy == AH_PUBSUB_DISCONNECT) {
+        result = close_connection(target, AH_CLOSE_ABORTIVE);
+      }
+    }
+  }
+  server->publishing = NULL;
+
+  release_shared_buf(message);
+  if (topic->count == 0) {
+    remove_topic(server, topic);
+  }
+
+  return result;
+}
+
+static bool on_pubsub_frame(ah_error_code error_code,
+                            ah_framer* framer,
+                            ah_io_buffer frame,
+                            void* user_data)
+{
+  (void)framer;
+
+  ah_pubsub_connection* connection = user_data;
+  if (error_code != AH_ERR_OK) {
+    ah_close_mode mode = error_code == AH_ERR_SHUT_DOWN ? AH_CLOSE_GRACEFUL
+                                                         : AH_CLOSE_ABORTIVE;
+    return close_connection(connection, mode);
+  }
+
+  uint8_t* data = frame.buffer;
+  uint32_t name_length = frame.buffer_length < 2 ? 0 : data[1];
+  if (name_length == 0 || frame.buffer_length - 2 < name_length) {
+    return close_connection(connection, AH_CLOSE_ABORTIVE);
+  }
+
+  bool has_payload = frame.buffer_length != 2 + name_length;
+  switch (data[0]) {
+    case 'P':
+      return publish(connection, frame);
+    case 'S':
+      if (!has_payload
+          && connection->subscription_count != AH_PUBSUB_MAX_SUBSCRIPTIONS
+          && subscribe(connection, data + 2, name_length))
+      {
+        return true;
+      }
+      break;
+    case 'U':
+      if (!has_payload) {
+        unsubscribe(connection, data + 2, name_length);
+        return true;
+      }
+      break;
+  }
+
+  return close_connection(connection, AH_CLOSE_ABORTIVE);
+}
+
+bool pubsub_accept(ah_pubsub_server* server, ah_socket* socket)
+{
+  /* The socket is closed after the accept handler returns if it could not be
+   * taken */
+  ah_pubsub_connection* connection = take_connection(server);
+  if (connection == NULL) {
+    return true;
+  }
+
+  link_connection(&server->connections, connection);
+  move_socket(&connection->socket, socket);
+  connection->dock.socket = &connection->socket;
+  create_write_queue(&connection->queue, &connection->dock);
+  set_write_queue_watermarks(&connection->queue,
+                             server->low_watermark,
+                             server->high_watermark,
+                             NULL,
+                             NULL);
+  create_length_prefixed_framer(&connection->framer,
+                                &connection->dock,
+                                &connection->ring,
+                                PUBSUB_HEADER_LENGTH,
+                                0,
+                                on_pubsub_frame,
+                                connection);
+  connection->open = true;
+  return start_framer(&connection->framer);
+}
+
+uint32_t pubsub_subscriber_count(ah_pubsub_server* server, ah_io_buffer name)
+{
+  if (name.buffer_length > AH_PUBSUB_MAX_TOPIC) {
+    return 0;
+  }
+
+  ah_pubsub_topic* topic =
+      find_topic(server, name.buffer, name.buffer_length);
+  return topic == NULL ? 0 : topic->count;
+}
+
+/* Server */
+
+bool create_pubsub_server(ah_pubsub_server* result_server,
+                          ah_server* server,
+                          ah_pubsub_slow_policy policy,
+                          uint32_t low_watermark,
+                          uint32_t high_watermark)
+{
+  *result_server = (ah_pubsub_server) {
+      .server = server,
+      .policy = policy,
+      .low_watermark = low_watermark,
+      .high_watermark = high_watermark,
+  };
+
+  /* The closers are allocated with malloc, which only guarantees the
+   * alignment of the fundamental types */
+  if (closer_alignment() > _Alignof(max_align_t)
+      || low_watermark > high_watermark)
+  {
+    return false;
+  }
+
+  result_server->slots = calloc(PUBSUB_INITIAL_SLOTS, sizeof(ah_pubsub_slot));
+  if (result_server->slots == NULL) {
+    return false;
+  }
+
+  result_server->slot_mask = PUBSUB_INITIAL_SLOTS - 1;
+  return true;
+}
+
+void destroy_pubsub_server(ah_pubsub_server* server)
+{
+  while (server->connections != NULL) {
+    ah_pubsub_connection* connection = server->connections;
+    unlink_connection(&server->connections, connection);
+    if (connection->open) {
+      while (connection->subscription_count != 0) {
+        unsubscribe_at(connection, connection->subscription_count - 1);
+      }
+      connection->open = false;
+      destroy_socket(&connection->socket);
+    } else if (!connection->closed) {
+      destroy_closer(connection->closer);
+    }
+    if (!connection->closed) {
+      cancel_write_queue(&connection->queue);
+    }
+    free_connection(connection);
+  }
+
+  while (server->free_connections != NULL) {
+    ah_pubsub_connection* connection = server->free_connections;
+    unlink_connection(&server->free_connections, connection);
+    free_connection(connection);
+  }
+
+  free(server->slots);
+  *server = (ah_pubsub_server) {0};
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * @file
+ *
+ * Publish/subscribe broker on top of the acceptor and dock primitives.
+ *
+ * Every frame in either direction is preceded by its length as a 4 byte big
+ * endian integer. The frame starts with an operation byte and the length of
+ * the topic name as 1 byte, followed by the 1 to ::AH_PUBSUB_MAX_TOPIC bytes
+ * of the name:
+ *
+ * - \c 'S' subscribes the connection to the topic,
+ * - \c 'U' unsubscribes it,
+ * - \c 'P' publishes the rest of the frame as the payload of a message.
+ *
+ * Each subscriber of the topic receives the message as an \c 'M' frame that
+ * is otherwise identical to the \c 'P' frame, including for the publisher
+ * itself if it is subscribed. A message is copied once into a shared buffer,
+ * which the write queues of all subscribers send from. Malformed frames
+ * reset the connection.
+ */
+
+/**
+ * @brief The longest topic name in bytes.
+ */
+#define AH_PUBSUB_MAX_TOPIC 255
+
+/**
+ * @brief The number of topics a connection can be subscribed to at the same
+ * time.
+ *
+ * Subscribing to more topics resets the connection.
+ */
+#define AH_PUBSUB_MAX_SUBSCRIPTIONS 16
+
+/**
+ * @brief The number of messages that can wait to be sent to a subscriber.
+ *
+ * A subscriber with this many messages pending is treated as slow regardless
+ * of the watermarks.
+ */
+#define AH_PUBSUB_MAX_PENDING 64
+
+/**
+ * @brief The size of the receive buffer of a connection, which limits the
+ * size of the frames it can send.
+ */
+#define AH_PUBSUB_RECEIVE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @brief What happens to the messages of a subscriber that does not keep up.
+ */
+typedef enum ah_pubsub_slow_policy
+{
+  /**
+   * @brief Messages are not delivered to the subscriber until its pending
+   * bytes fall to the low watermark again.
+   */
+  AH_PUBSUB_DROP_MESSAGES,
+  /**
+   * @brief The subscriber is disconnected, so it knows that it missed
+   * messages.
+   */
+  AH_PUBSUB_DISCONNECT,
+} ah_pubsub_slow_policy;
+
+typedef struct ah_pubsub_connection ah_pubsub_connection;
+typedef struct ah_pubsub_topic ah_pubsub_topic;
+
+/**
+ * @brief A slot of the topic table.
+ *
+ * The hash is kept next to the topic, so a lookup only touches the topics
+ * whose hash matches.
+ */
+typedef struct ah_pubsub_slot {
+  uint32_t hash;
+  ah_pubsub_topic* topic;
+} ah_pubsub_slot;
+
+/**
+ * @brief Broker that serves the sockets handed to ::pubsub_accept.
+ *
+ * The topics are kept in an open addressing hash table with linear probing
+ * and exist as long as they have subscribers. The statistics count the
+ * published messages, the messages handed to the write queues of the
+ * subscribers and those that were not because of the slow subscriber policy.
+ * The other members are managed by the pub/sub functions.
+ */
+typedef struct ah_pubsub_server {
+  ah_server* server;
+  ah_pubsub_slow_policy policy;
+  uint32_t low_watermark;
+  uint32_t high_watermark;
+  ah_pubsub_slot* slots;
+  uint32_t slot_mask;
+  uint32_t topic_count;
+  ah_pubsub_connection* connections;
+  ah_pubsub_connection* free_connections;
+  ah_pubsub_topic* publishing;
+  uint64_t published;
+  uint64_t delivered;
+  uint64_t dropped;
+} ah_pubsub_server;
+
+/**
+ * @brief Initializes a broker running on the event loop of \c server.
+ *
+ * A subscriber is slow once the bytes waiting to be sent to it reach
+ * \c high_watermark, and stays slow until they fall to \c low_watermark.
+ * Reading from a slow connection is paused as well, so it can neither publish
+ * nor change its subscriptions until it caught up.
+ */
+bool create_pubsub_server(ah_pubsub_server* result_server,
+                          ah_server* server,
+                          ah_pubsub_slow_policy policy,
+                          uint32_t low_watermark,
+                          uint32_t high_watermark);
+
+/**
+ * @brief Takes ownership of a socket from an accept handler and starts
+ * serving frames on it.
+ */
+bool pubsub_accept(ah_pubsub_server* server, ah_socket* socket);
+
+/**
+ * @brief Returns the number of subscribers of the topic named by \c name.
+ */
+uint32_t pubsub_subscriber_count(ah_pubsub_server* server, ah_io_buffer name);
+
+/**
+ * @brief Resets every connection of the broker and frees the topics and the
+ * connection pool.
+ */
+void destroy_pubsub_server(ah_pubsub_server* server);
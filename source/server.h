@@ -9,12 +9,44 @@
 typedef struct ah_server ah_server;
 typedef struct ah_socket ah_socket;
 typedef struct ah_acceptor ah_acceptor;
+typedef struct ah_connector ah_connector;
+typedef struct ah_closer ah_closer;
+typedef struct ah_handoff ah_handoff;
+typedef struct ah_timer ah_timer;
+typedef struct ah_tcp_info_sampler ah_tcp_info_sampler;
+typedef struct ah_file_cache ah_file_cache;
+typedef struct ah_cached_file ah_cached_file;
+typedef struct ah_upstream_pool ah_upstream_pool;
+typedef struct ah_relay ah_relay;
+typedef struct ah_sockmap ah_sockmap;
+typedef struct ah_datagram_socket ah_datagram_socket;
 
 typedef struct ah_context {
   ah_server* server;
   void* user_data;
 } ah_context;
 
+/**
+ * @brief Where the output of the logging functions is written from.
+ */
+typedef enum ah_log_mode
+{
+  AH_LOG_SYNCHRONOUS,
+  AH_LOG_BACKGROUND,
+  AH_LOG_EVENT_LOOP,
+} ah_log_mode;
+
+#define AH_LOG_MAX_MESSAGE 512
+
+/**
+ * @brief How ::queue_close_operation ends a connection.
+ */
+typedef enum ah_close_mode
+{
+  AH_CLOSE_GRACEFUL,
+  AH_CLOSE_ABORTIVE,
+} ah_close_mode;
+
 typedef struct ah_socket_span {
   size_t size;
   ah_socket* sockets;
@@ -25,6 +57,39 @@ typedef struct ah_ipv4_address {
   uint16_t port;
 } ah_ipv4_address;
 
+/**
+ * @brief Family of an ::ah_address.
+ */
+typedef enum ah_address_family
+{
+  AH_ADDRESS_NONE = 0,
+  AH_ADDRESS_IPV4,
+  AH_ADDRESS_IPV6,
+} ah_address_family;
+
+/**
+ * @brief An IPv4 or IPv6 address along with a port.
+ *
+ * The address and the port are kept in network byte order, IPv4 addresses in
+ * the first 4 bytes, and are only converted when asked for by
+ * ::port_from_address, ::ipv4_from_address or ::format_address. IPv4 peers of
+ * dual-stack sockets arrive as IPv4-mapped IPv6 addresses. Peers without an
+ * IP address, e.g. of Unix domain sockets, have the family
+ * ::AH_ADDRESS_NONE. ::address_from_ipv4 makes one out of an
+ * ::ah_ipv4_address, IPv6 addresses are filled in directly.
+ */
+typedef struct ah_address {
+  uint8_t bytes[16];
+  uint8_t port[2];
+  uint8_t family;
+} ah_address;
+
+/**
+ * @brief Buffer size that fits every address formatted by ::format_address,
+ * including the terminating null character.
+ */
+#define AH_ADDRESS_MAX_STRING 48
+
 typedef struct ah_socket_accepted {
   _Alignas(
       AH_SOCKET_ACCEPTED_ALIGNMENT) uint8_t reserved[AH_SOCKET_ACCEPTED_SIZE];
@@ -45,16 +110,397 @@ typedef struct ah_io_buffer {
   void* buffer;
 } ah_io_buffer;
 
+/**
+ * @brief Immutable, reference counted bytes that can be queued on many
+ * write queues at once.
+ *
+ * The bytes follow the header in the same allocation. They are written by the
+ * creator before the buffer is first queued and must not change afterwards.
+ * Every write request queued from the buffer holds a reference until its
+ * callback returns, so the payload is stored once no matter how many
+ * connections it is sent to. The count is not atomic, so the buffer belongs
+ * to the thread of one event loop.
+ */
+typedef struct ah_shared_buf {
+  uint32_t references;
+  uint32_t length;
+  uint8_t data[];
+} ah_shared_buf;
+
+typedef struct ah_write_request ah_write_request;
+
+/**
+ * @brief Callback type for the requests of an ::ah_write_queue.
+ *
+ * The \c bytes_transferred member of the request holds how much of its buffer
+ * was written, which is the whole buffer if there was no error. The request
+ * is already removed from the queue, so it can be reused or freed.
+ */
+typedef bool (*ah_on_write_request)(ah_error_code error_code,
+                                    ah_write_request* request,
+                                    void* per_call_data);
+
+/**
+ * @brief Node of an ::ah_write_queue.
+ *
+ * The members are managed by the queue. The request and its buffer must stay
+ * alive until the callback is called. Requests sending from a file that is not
+ * mapped into memory have \c file set and a \c NULL buffer, whose length is
+ * the number of bytes to send from \c file_offset. Requests sending a slice
+ * of a shared buffer have \c shared set and release it after the callback.
+ */
+struct ah_write_request {
+  ah_write_request* next;
+  ah_io_buffer buffer;
+  uint32_t bytes_transferred;
+  ah_on_write_request on_complete;
+  void* per_call_data;
+  ah_cached_file* file;
+  uint64_t file_offset;
+  ah_shared_buf* shared;
+};
+
+typedef struct ah_write_queue ah_write_queue;
+
+/**
+ * @brief Callback type for the watermarks of an ::ah_write_queue.
+ *
+ * Called with \c paused set to \c true when the pending bytes reach the high
+ * watermark and with \c false when they fall to the low watermark again.
+ */
+typedef bool (*ah_on_write_pressure)(ah_write_queue* queue,
+                                     bool paused,
+                                     void* user_data);
+
+/**
+ * @brief Unbounded FIFO of writes using the write port of a dock.
+ *
+ * The members are managed by the queue. Everything queued by the time the
+ * socket becomes writable is sent using a single system call and the callbacks
+ * of the completed requests are called in order. The write port of the dock
+ * must not be used directly while the queue has requests pending.
+ */
+struct ah_write_queue {
+  ah_io_dock* dock;
+  ah_write_request* head;
+  ah_write_request* tail;
+  uint64_t pending_bytes;
+  uint64_t low_watermark;
+  uint64_t high_watermark;
+  ah_on_write_pressure on_pressure;
+  void* user_data;
+  bool reads_paused;
+};
+
+/**
+ * @brief Byte FIFO whose storage is mapped twice back to back.
+ *
+ * The second mapping mirrors the first, so both the unread bytes and the free
+ * space are contiguous in memory, even when they wrap around the end of the
+ * storage. Data can be read into ::ring_write_buffer and parsed straight from
+ * ::ring_read_buffer without moving leftover bytes to the front. The members
+ * are managed by the ring functions.
+ *
+ * If the storage cannot be mapped, then it is a plain buffer with \c mirrored
+ * set to \c false. The buffers handed out are contiguous all the same, but
+ * the unread bytes are moved to the front to make room for writes.
+ */
+typedef struct ah_ring {
+  uint8_t* data;
+  uint32_t capacity;
+  uint32_t read_offset;
+  uint32_t size;
+  bool mirrored;
+} ah_ring;
+
+#define AH_FRAME_MAX_DELIMITER 8
+
+typedef struct ah_framer ah_framer;
+
+/**
+ * @brief Callback type for the frames of an ::ah_framer.
+ *
+ * The frame excludes the delimiter or the length header. It points into the
+ * ring and is only valid until the callback returns, after which it is
+ * consumed from the ring. When framing stops because of an error, the callback
+ * is called one last time with the error code and an empty frame.
+ */
+typedef bool (*ah_on_frame)(ah_error_code error_code,
+                            ah_framer* framer,
+                            ah_io_buffer frame,
+                            void* user_data);
+
+typedef const uint8_t* (*ah_delimiter_scanner)(const uint8_t* begin,
+                                                const uint8_t* end,
+                                                const uint8_t* delimiter,
+                                                uint32_t delimiter_length);
+
+/**
+ * @brief Splits the bytes read from a dock into a ring into frames.
+ *
+ * Frames are either terminated by a delimiter or preceded by their length.
+ * Because the ring is double-mapped, every frame is delivered as one buffer
+ * without being copied. The members are managed by the framer functions.
+ */
+struct ah_framer {
+  ah_io_dock* dock;
+  ah_ring* ring;
+  ah_delimiter_scanner scanner;
+  uint32_t max_frame_length;
+  uint32_t scanned;
+  uint8_t delimiter_length;
+  uint8_t header_length;
+  uint8_t delimiter[AH_FRAME_MAX_DELIMITER];
+  bool stopped;
+  ah_on_frame on_frame;
+  void* user_data;
+};
+
+/**
+ * @brief Files up to this size are mapped into memory when they are opened
+ * and sent from the mapping, larger ones are sent by the kernel from the open
+ * file.
+ */
+#define AH_FILE_MAP_LIMIT (256 * 1024)
+
+#define AH_FILE_MAX_PATH 1024
+#define AH_FILE_HEADERS_SIZE 192
+
+/**
+ * @brief Callback type for files opened by an ::ah_file_cache.
+ *
+ * Called once per open, before the file is cached, so metadata derived from
+ * the file, e.g. protocol headers, can be stored in its \c headers member.
+ * Returning \c false fails the lookup that opened the file.
+ */
+typedef bool (*ah_on_file_open)(ah_cached_file* file, void* user_data);
+
+/**
+ * @brief Open file of an ::ah_file_cache along with its metadata.
+ *
+ * The members are managed by the file cache. \c mapping holds the contents of
+ * the file if it is mapped into memory and is \c NULL otherwise. \c modified
+ * is the last modification time in seconds since the Unix epoch. The file
+ * stays open while it is referenced, even if it gets evicted or invalidated
+ * in the meantime.
+ */
+struct ah_cached_file {
+  ah_file_cache* cache;
+  ah_cached_file* hash_next;
+  ah_cached_file* watch_next;
+  ah_cached_file* lru_previous;
+  ah_cached_file* lru_next;
+  intptr_t handle;
+  void* mapping;
+  uint64_t size;
+  int64_t modified;
+  int32_t watch;
+  uint32_t hash;
+  uint32_t references;
+  bool cached;
+  uint32_t path_length;
+  char* path;
+  uint32_t headers_length;
+  uint8_t headers[AH_FILE_HEADERS_SIZE];
+};
+
+/**
+ * @brief How often the idle connections of an ::ah_upstream_pool are checked.
+ */
+#define AH_UPSTREAM_CHECK_INTERVAL_MS 1000
+
+typedef struct ah_upstream_request ah_upstream_request;
+
+/**
+ * @brief Callback type for ::acquire_upstream.
+ *
+ * On success the connection is in the \c socket member of the request, which
+ * belongs to the caller from now on and can be copied elsewhere.
+ */
+typedef bool (*ah_on_upstream)(ah_error_code error_code,
+                               ah_upstream_request* request,
+                               void* per_call_data);
+
+/**
+ * @brief A request for a connection from an ::ah_upstream_pool.
+ *
+ * The members are managed by the pool. The request must stay alive until the
+ * callback is called. \c reused tells whether the connection was taken from
+ * the idle connections of the pool instead of being established for this
+ * request.
+ */
+struct ah_upstream_request {
+  ah_socket_accepted socket;
+  ah_upstream_pool* pool;
+  ah_connector* connector;
+  ah_address address;
+  bool reused;
+  ah_on_upstream on_ready;
+  void* per_call_data;
+};
+
+/**
+ * @brief Callback type for the end of an ::ah_relay.
+ *
+ * Called with ::AH_ERR_OK once the end of file was forwarded in both
+ * directions, or with the error that stopped the relay. The relay is already
+ * stopped, so it can be freed from inside the callback, while the sockets of
+ * the docks are left with the caller.
+ */
+typedef bool (*ah_on_relay_done)(ah_error_code error_code,
+                                 ah_relay* relay,
+                                 void* user_data);
+
+/**
+ * @brief The number of bytes an ::ah_relay delivered in each direction.
+ */
+typedef struct ah_relay_counters {
+  uint64_t client_to_upstream;
+  uint64_t upstream_to_client;
+} ah_relay_counters;
+
+/**
+ * @brief Options of ::create_datagram_socket.
+ */
+typedef enum ah_datagram_flag
+{
+  /**
+   * Lets the kernel coalesce datagrams of the same flow into one buffer,
+   * which takes a kernel with \c UDP_GRO.
+   */
+  AH_DATAGRAM_GRO = 1 << 0,
+} ah_datagram_flag;
+
+/**
+ * @brief A datagram in the array of a batch queued on an
+ * ::ah_datagram_socket.
+ *
+ * When receiving, the buffer length is replaced with the number of bytes
+ * received, \c address with the sender and \c segment_size with the size of
+ * the datagrams coalesced into the buffer, or 0 if it holds just one. Bytes
+ * not fitting into the buffer are discarded. When sending, \c address is the
+ * destination and a nonzero \c segment_size makes the buffer go out as
+ * datagrams of that size, the last of which may be shorter. Senders are
+ * reported like the peers of listeners, so IPv4 senders arrive as IPv4-mapped
+ * addresses unless the system has no IPv6 stack.
+ */
+typedef struct ah_datagram {
+  ah_io_buffer buffer;
+  ah_address address;
+  uint16_t segment_size;
+} ah_datagram;
+
+/**
+ * @brief Callback type for the batches of an ::ah_datagram_socket.
+ *
+ * \c count is the number of datagrams at the front of the array that were
+ * received or sent, which may be nonzero along with an error when sending.
+ */
+typedef bool (*ah_on_datagrams)(ah_error_code error_code,
+                                ah_datagram_socket* socket,
+                                ah_datagram* datagrams,
+                                uint32_t count,
+                                void* per_call_data);
+
+/**
+ * @brief Counters collected by the server while it is running.
+ *
+ * The receive queueing delay is the time between the kernel timestamping an
+ * incoming packet and the read handler picking the data up. Only reads on
+ * sockets that had ::enable_rx_timestamps called on them are accounted for.
+ */
+typedef struct ah_server_stats {
+  uint64_t rx_timestamped_reads;
+  uint64_t rx_queue_delay_total_ns;
+  uint64_t rx_queue_delay_max_ns;
+  uint64_t tcp_info_samples;
+  uint64_t tcp_info_rtt_total_us;
+  uint64_t tcp_info_rtt_max_us;
+} ah_server_stats;
+
+/**
+ * @brief Snapshot of the kernel's view of a TCP connection.
+ *
+ * The congestion window, the unacknowledged data and the retransmissions are
+ * counted in segments of \c mss bytes.
+ */
+typedef struct ah_tcp_info {
+  uint32_t rtt_us;
+  uint32_t rtt_variance_us;
+  uint32_t mss;
+  uint32_t congestion_window;
+  uint32_t unacked;
+  uint32_t total_retransmits;
+  uint32_t notsent_bytes;
+} ah_tcp_info;
+
+/**
+ * @brief Per connection registration in an ::ah_tcp_info_sampler.
+ *
+ * The members are managed by the sampler, except for \c user_data. The
+ * \c info member holds the most recent sample taken at \c sampled_at_ms on
+ * the server's monotonic clock.
+ */
+typedef struct ah_tcp_info_slot {
+  struct ah_tcp_info_slot* previous;
+  struct ah_tcp_info_slot* next;
+  ah_tcp_info_sampler* sampler;
+  ah_socket_accepted* socket;
+  void* user_data;
+  uint64_t sampled_at_ms;
+  ah_tcp_info info;
+} ah_tcp_info_slot;
+
+/**
+ * @brief The process on the other end of a Unix domain socket.
+ */
+typedef struct ah_peer_credentials {
+  uint32_t pid;
+  uint32_t uid;
+  uint32_t gid;
+} ah_peer_credentials;
+
 /**
  * @brief Callback type for async accept operation.
  *
  * The \c socket parameter must be taken ownership of using the ::move_socket
  * function to perform async I/O operations on it. Failing to take ownership of
- * the socket will result in its closure after the callback returns.
+ * the socket will result in its closure after the callback returns. The
+ * address is only valid until the callback returns.
  */
 typedef bool (*ah_on_accept)(ah_error_code error_code,
                              ah_socket* socket,
-                             ah_ipv4_address address);
+                             const ah_address* address);
+
+/**
+ * @brief Callback type for async connect operation.
+ *
+ * The \c socket parameter must be taken ownership of using the ::move_socket
+ * function just like in an ::ah_on_accept callback. The connector can be used
+ * to queue another connect operation from inside the callback, or it can be
+ * freed.
+ */
+typedef bool (*ah_on_connect)(ah_error_code error_code,
+                              ah_socket* socket,
+                              void* per_call_data);
+
+/**
+ * @brief Callback type for async close operation.
+ *
+ * The descriptor of the socket is already released when this is called, so
+ * the closer can be reused or freed from inside the callback.
+ */
+typedef bool (*ah_on_close)(ah_error_code error_code,
+                            ah_closer* closer,
+                            void* per_call_data);
+
+/**
+ * @brief Callback type for the steps of handing off the listening sockets to
+ * a successor.
+ *
+ * See ::create_handoff and ::receive_handoff for when it is called.
+ */
+typedef bool (*ah_on_handoff)(ah_handoff* handoff, void* user_data);
 
 /**
  * @brief Callback type for the async I/O operations.
@@ -68,6 +514,20 @@ typedef bool (*ah_on_io_complete)(ah_error_code error_code,
                                   uint32_t bytes_transferred,
                                   void* per_call_data);
 
+/**
+ * @brief Callback type for timers.
+ */
+typedef bool (*ah_on_timer)(ah_timer* timer, void* user_data);
+
+/**
+ * @brief Callback type for the samples taken by an ::ah_tcp_info_sampler.
+ *
+ * The fresh sample is available in the \c info member of the slot. The
+ * callback may remove slots from the sampler, but it must not destroy the
+ * sampler itself.
+ */
+typedef bool (*ah_on_tcp_info)(ah_tcp_info_slot* slot, void* user_data);
+
 /**
  * @brief Returns the size of the ::ah_server object.
  */
@@ -99,12 +559,31 @@ size_t socket_size(void);
 size_t socket_alignment(void);
 
 /**
- * @brief Creates a TCP/IPv4 socket bound to and listening on \c port.
+ * @brief Creates a TCP socket bound to and listening on \c port.
+ *
+ * The socket accepts IPv6 and IPv4 peers alike, the latter as IPv4-mapped
+ * addresses. Without IPv6 support in the system it falls back to IPv4 only.
  */
 bool create_socket(ah_socket* result_socket,
                    ah_context* context,
                    uint16_t port);
 
+/**
+ * @brief Creates a Unix domain stream socket bound to and listening on
+ * \c path.
+ *
+ * A \c path starting with \c @ names a socket in the abstract namespace,
+ * which disappears with the last socket referring to it. Otherwise the socket
+ * file is created by this call, so it must not exist yet, and it is left
+ * behind when the socket is closed. The accepted sockets are used the same way
+ * as TCP ones, except that they report an address of the family
+ * ::AH_ADDRESS_NONE to the ::ah_on_accept callback. Only supported on POSIX
+ * systems.
+ */
+bool create_unix_socket(ah_socket* result_socket,
+                        ah_context* context,
+                        const char* path);
+
 /**
  * @brief Closes the provided socket.
  */
@@ -113,6 +592,10 @@ bool destroy_socket_base(ah_socket* socket);
 /**
  * @brief Closes the provided socket that was taken ownership of in an accept
  * handler.
+ *
+ * The descriptor is released right away and the kernel sends the buffered data
+ * in the background. Use ::queue_close_operation to find out whether the peer
+ * closed its side as well, or to reset the connection instead.
  */
 bool destroy_socket_accepted(ah_socket_accepted* socket);
 
@@ -138,6 +621,36 @@ void set_socket_span(ah_server* server, ah_socket_span span);
  */
 ah_socket* span_get_socket(ah_server* server, size_t index);
 
+/**
+ * @brief Returns the port of the address in host byte order.
+ */
+uint16_t port_from_address(const ah_address* address);
+
+/**
+ * @brief Extracts an IPv4 address, which IPv4-mapped IPv6 addresses hold as
+ * well.
+ *
+ * Returns \c false for other addresses.
+ */
+bool ipv4_from_address(const ah_address* address,
+                       ah_ipv4_address* result_address);
+
+/**
+ * @brief Returns the IPv4 address as an ::ah_address of the family
+ * ::AH_ADDRESS_IPV4.
+ */
+ah_address address_from_ipv4(ah_ipv4_address address);
+
+/**
+ * @brief Writes the address as \c 192.0.2.1:80 or \c [2001:db8::1]:80 into
+ * \c result_string, which must have room for ::AH_ADDRESS_MAX_STRING
+ * characters.
+ *
+ * IPv6 addresses are written in the canonical form of RFC 5952. Returns the
+ * length of the string, which is empty for ::AH_ADDRESS_NONE.
+ */
+size_t format_address(const ah_address* address, char* result_string);
+
 /**
  * @brief Returns the size of the ::ah_acceptor object.
  */
@@ -156,87 +669,1050 @@ bool create_acceptor(ah_acceptor* result_acceptor,
                      ah_on_accept on_accept);
 
 /**
- * @brief Drives the <tt>server</tt>'s event loop and calls the event handlers.
+ * @brief Returns the size of the ::ah_connector object.
+ */
+size_t connector_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_connector object.
+ */
+size_t connector_alignment(void);
+
+/**
+ * @brief Creates a connector that can queue outbound connect operations in the
+ * server.
+ */
+void create_connector(ah_connector* result_connector,
+                      ah_context* context,
+                      ah_on_connect on_connect);
+
+/**
+ * @brief Queues a TCP connect operation to \c address.
  *
- * This function calls the platform dependent event loop function to dequeue
- * events and dispatches on those events. If this function fails, then the OS
- * native error code will be returned via the \c error_code_out parameter. If
- * \c error_code_out is \c NULL, then the error will be printed to stderr.
+ * IPv4 addresses, IPv4-mapped ones included, are connected to over IPv4 and
+ * the rest over IPv6. If \c local_address is not \c NULL, then the socket is
+ * bound to it before connecting, which allows picking the source address. An
+ * address of the family ::AH_ADDRESS_NONE is rejected. Only one connect
+ * operation can be active on a connector at a time.
  */
-bool server_tick(ah_server* server, int* error_code_out);
+bool queue_connect_operation(ah_connector* connector,
+                             const ah_address* address,
+                             const ah_address* local_address,
+                             void* per_call_data);
 
 /**
- * @brief Takes the ownership of an accepted socket from the server in an
- * ::ah_on_accept callback.
+ * @brief Closes the socket of the connect operation in progress, if any.
+ *
+ * The callback of the cancelled operation is not called. With IOCP the
+ * cancelled operation still completes later, so the connector must stay alive
+ * until the event loop ran again.
  */
-void move_socket(ah_socket_accepted* result_socket, ah_socket* socket);
+bool destroy_connector(ah_connector* connector);
 
 /**
- * @brief Returns the ::ah_context pointer from the socket.
+ * @brief Returns the size of the ::ah_upstream_pool object.
  */
-ah_context* context_from_socket_base(ah_socket* socket);
+size_t upstream_pool_size(void);
 
 /**
- * @brief Returns the ::ah_context pointer from the accepted socket.
+ * @brief Returns the alignment of the ::ah_upstream_pool object.
  */
-ah_context* context_from_socket_accepted(ah_socket_accepted* socket);
+size_t upstream_pool_alignment(void);
 
-/* clang-format off */
+/**
+ * @brief Initializes a pool of idle connections to upstream servers, keyed by
+ * the address of the upstream.
+ *
+ * An IPv4-mapped address is the same upstream as the IPv4 address it holds.
+ *
+ * At most \c max_idle connections are kept in total and at most
+ * \c max_idle_per_upstream per address, beyond which the connection idle for
+ * the longest time is closed. Every ::AH_UPSTREAM_CHECK_INTERVAL_MS
+ * milliseconds the idle connections are checked and the ones idle for at
+ * least \c idle_timeout_ms milliseconds, or closed by the upstream, are
+ * closed.
+ */
+bool create_upstream_pool(ah_upstream_pool* result_pool,
+                          ah_context* context,
+                          uint32_t max_idle,
+                          uint32_t max_idle_per_upstream,
+                          uint32_t idle_timeout_ms);
 
 /**
- * @brief Type generic macro function that returns the context from the socket.
+ * @brief Requests a connection to \c address.
+ *
+ * The most recently released idle connection to \c address is reused if it
+ * is still usable, in which case \c on_ready is called from inside this call.
+ * Otherwise a new connection is established using an ::ah_connector and the
+ * callback is called from the event loop. Requests cannot be cancelled, but
+ * a connection that is not needed anymore can be released to the pool.
  */
-#define context_from_socket(socket) \
-  _Generic((socket), \
-           ah_socket*: context_from_socket_base, \
-           ah_socket_accepted*: context_from_socket_accepted)(socket)
+bool acquire_upstream(ah_upstream_pool* pool,
+                      ah_upstream_request* request,
+                      const ah_address* address,
+                      ah_on_upstream on_ready,
+                      void* per_call_data);
 
-/* clang-format on */
+/**
+ * @brief Gives the connection to \c address to the pool for reuse.
+ *
+ * The connection must not have I/O operations pending and must be at a
+ * message boundary, i.e. a connection with unread data or an end of file
+ * pending is closed instead. The pool takes ownership of \c socket either
+ * way, so the caller must not use or destroy it afterwards.
+ */
+bool release_upstream(ah_upstream_pool* pool,
+                      ah_socket_accepted* socket,
+                      const ah_address* address);
 
 /**
- * @brief Returns whether the I/O operation is parked in a dock, i.e. active.
+ * @brief Closes every idle connection of the pool.
  *
- * User code must call this function before queueing any I/O operation. A
- * recommended way to deal with multiple operations of the same kind is to have
- * a FIFO queue in user code for storing the excess.
+ * The pool must not have requests pending.
  */
-bool is_io_operation_active(ah_io_operation* operation);
+bool destroy_upstream_pool(ah_upstream_pool* pool);
 
 /**
- * @brief Returns the queued buffer.
+ * @brief Returns the size of the ::ah_closer object.
  */
-ah_io_buffer buffer_from_io_operation(ah_io_operation* operation);
+size_t closer_size(void);
 
 /**
- * @brief Returns the dock corresponding to the I/O operation.
+ * @brief Returns the alignment of the ::ah_closer object.
  */
-ah_io_dock* dock_from_operation(ah_io_operation* operation);
+size_t closer_alignment(void);
 
 /**
- * @brief Queues a read operation into the provided buffer.
+ * @brief Creates a closer that can queue close operations in the server.
+ */
+void create_closer(ah_closer* result_closer, ah_on_close on_close);
+
+/**
+ * @brief Closes the accepted socket without blocking the event loop.
  *
- * The buffer must stay alive for the duration of the operation. The provided
- * buffer's length MUST NOT be greater than \c INT32_MAX (2147483647). The
- * callback will also not receive a value greater than that for the number of
- * bytes transferred.
+ * ::AH_CLOSE_GRACEFUL shuts down the sending side of the connection, so the
+ * peer receives the data still in the send buffer followed by an end of file,
+ * then discards incoming data until the peer closes its side as well. If that
+ * does not happen within \c timeout_ms milliseconds, then the connection is
+ * reset and the callback receives ::AH_ERR_TIMED_OUT. ::AH_CLOSE_ABORTIVE
+ * resets the connection right away and discards the unsent data, which is
+ * the cheapest way to shed connections under load.
+ *
+ * The closer takes ownership of the socket and the callback is always called
+ * from the event loop. The I/O operations queued on the socket are abandoned,
+ * but their dock must stay alive until the callback is called: with IOCP they
+ * complete with ::AH_ERR_OPERATION_ABORTED, with epoll they never complete.
+ * Only one close operation can be active on a closer at a time.
  */
-bool queue_read_operation4(ah_io_dock* dock,
-                           ah_io_buffer buffer,
-                           ah_on_io_complete on_complete,
+bool queue_close_operation(ah_closer* closer,
+                           ah_socket_accepted* socket,
+                           ah_close_mode mode,
+                           uint32_t timeout_ms,
                            void* per_call_data);
 
 /**
- * @brief Queues a write operation from the provided buffer.
+ * @brief Resets the connection of the close operation in progress, if any.
  *
- * The buffer must stay alive for the duration of the operation. The provided
- * buffer's length MUST NOT be greater than \c INT32_MAX (2147483647). The
- * callback will also not receive a value greater than that for the number of
- * bytes transferred.
+ * The callback of the cancelled operation is not called.
  */
-bool queue_write_operation4(ah_io_dock* dock,
-                            ah_io_buffer buffer,
-                            ah_on_io_complete on_complete,
-                            void* per_call_data);
+bool destroy_closer(ah_closer* closer);
+
+/**
+ * @brief Returns the size of the ::ah_handoff object.
+ */
+size_t handoff_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_handoff object.
+ */
+size_t handoff_alignment(void);
+
+/**
+ * @brief Waits for a successor process to connect to the Unix socket at
+ * \c path and take over the listening sockets of the server.
+ *
+ * When a process of the same user connects, the listening sockets in the
+ * socket span of the server are sent to it using \c SCM_RIGHTS from the event
+ * loop. Once they are sent, this process closes its copies of them, so it
+ * stops accepting while the kernel keeps queueing connections for the
+ * successor, and \c on_handoff is called. The open connections are then
+ * either handed off with ::handoff_socket or drained with
+ * ::drain_handoff_socket from inside the callback. \c on_drained is called
+ * when everything is sent and the drained connections are closed, after which
+ * the process can exit. A file already at \c path is replaced.
+ *
+ * If the successor goes away or stalls for a few seconds before it has the
+ * listening sockets, then this process keeps them and waits for the next
+ * successor.
+ */
+bool create_handoff(ah_handoff* result_handoff,
+                    ah_context* context,
+                    const char* path,
+                    ah_on_handoff on_handoff,
+                    ah_on_handoff on_drained,
+                    void* user_data);
+
+/**
+ * @brief Hands off an idle accepted socket to the successor.
+ *
+ * This can only be called from the \c on_handoff callback of
+ * ::create_handoff. The socket is closed in this process and the I/O
+ * operations queued on it are abandoned like with ::queue_close_operation.
+ */
+bool handoff_socket(ah_handoff* handoff, ah_socket_accepted* socket);
+
+/**
+ * @brief Closes a connection that is still busy with ::AH_CLOSE_GRACEFUL and
+ * holds back the \c on_drained callback of ::create_handoff until it is
+ * closed.
+ *
+ * This can only be called from the \c on_handoff callback. \c closer is
+ * created by this call, and it is done when \c on_drained is called.
+ */
+bool drain_handoff_socket(ah_handoff* handoff,
+                          ah_closer* closer,
+                          ah_socket_accepted* socket,
+                          uint32_t timeout_ms);
+
+/**
+ * @brief Stops the handoff and removes the Unix socket if no successor
+ * connected yet.
+ *
+ * The closers of ::drain_handoff_socket refer to the handoff, so it must not
+ * be destroyed while they are draining.
+ */
+bool destroy_handoff(ah_handoff* handoff);
+
+/**
+ * @brief Takes over the listening sockets from the process waiting in
+ * ::create_handoff at \c path.
+ *
+ * The \c size of the span is the number of sockets it has room for. The
+ * sockets are received from the event loop, and \c on_received is called
+ * once the other process is done, with the \c size of the span set to the
+ * number of listening sockets received. The span can be installed using
+ * ::set_socket_span from inside the callback, then acceptors can be created
+ * for its sockets. Idle connections handed off as well are passed to
+ * \c on_accept before that, as if they were just accepted. If the other
+ * process goes away or stalls for a few seconds, then the callback is called
+ * with what was received until then.
+ */
+bool receive_handoff(ah_handoff* result_handoff,
+                     ah_context* context,
+                     const char* path,
+                     ah_socket_span* span,
+                     ah_on_accept on_accept,
+                     ah_on_handoff on_received,
+                     void* user_data);
+
+/**
+ * @brief Returns the name of the event notification mechanism used by the
+ * server, e.g. \c "epoll" or \c "iocp".
+ */
+const char* server_backend_name(void);
+
+/**
+ * @brief Drives the <tt>server</tt>'s event loop and calls the event handlers.
+ *
+ * This function calls the platform dependent event loop function to dequeue
+ * events and dispatches on those events. If this function fails, then the OS
+ * native error code will be returned via the \c error_code_out parameter. If
+ * \c error_code_out is \c NULL, then the error will be printed to stderr.
+ */
+bool server_tick(ah_server* server, int* error_code_out);
+
+/**
+ * @brief Returns a copy of the counters collected by the server.
+ */
+ah_server_stats stats_from_server(ah_server* server);
+
+/**
+ * @brief Returns the size of the ::ah_timer object.
+ */
+size_t timer_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_timer object.
+ */
+size_t timer_alignment(void);
+
+/**
+ * @brief Initializes a stopped timer that fires on the <tt>server</tt>'s event
+ * loop.
+ */
+void create_timer(ah_timer* result_timer,
+                  ah_server* server,
+                  ah_on_timer on_timer,
+                  void* user_data);
+
+/**
+ * @brief Arms the timer to fire once after \c timeout_ms milliseconds.
+ *
+ * Starting an already active timer moves its deadline. Periodic timers can be
+ * implemented by starting the timer again from its callback. The timer is
+ * processed by ::server_tick after the I/O events, so it might fire later than
+ * requested if the event loop is busy.
+ */
+void start_timer(ah_timer* timer, uint32_t timeout_ms);
+
+/**
+ * @brief Disarms the timer if it is active.
+ */
+void stop_timer(ah_timer* timer);
+
+/**
+ * @brief Returns whether the timer is armed.
+ */
+bool is_timer_active(ah_timer* timer);
+
+/**
+ * @brief Returns the credentials of the process that connected to a Unix
+ * domain socket, as they were at the time it connected.
+ *
+ * Meant to be called from the ::ah_on_accept callback to decide whether to
+ * take the socket. Returns \c false for sockets of other families.
+ */
+bool peer_credentials_from_socket(ah_socket* socket,
+                                  ah_peer_credentials* result_credentials);
+
+/**
+ * @brief Returns the address the socket is bound to.
+ *
+ * A listener created with port 0 is bound to a port picked by the kernel,
+ * which can be read back this way.
+ */
+bool local_address_from_socket(ah_socket* socket, ah_address* result_address);
+
+/**
+ * @brief Queries the kernel for the TCP state of the accepted socket.
+ *
+ * This is a single system call, but it should still not be called for every
+ * I/O operation. Use an ::ah_tcp_info_sampler for periodic sampling.
+ */
+bool tcp_info_from_socket(ah_socket_accepted* socket,
+                          ah_tcp_info* result_info);
+
+/**
+ * @brief Returns the size of the ::ah_tcp_info_sampler object.
+ */
+size_t tcp_info_sampler_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_tcp_info_sampler object.
+ */
+size_t tcp_info_sampler_alignment(void);
+
+/**
+ * @brief Creates a sampler that periodically collects ::ah_tcp_info for the
+ * connections added to it.
+ *
+ * Every \c interval_ms milliseconds at most \c samples_per_interval
+ * connections are sampled in a round-robin fashion, so a connection is
+ * sampled at most once per interval. Samples are accounted for in the
+ * ::ah_server_stats of the server and are reported to \c on_sample, if it is
+ * not \c NULL.
+ */
+void create_tcp_info_sampler(ah_tcp_info_sampler* result_sampler,
+                             ah_server* server,
+                             uint32_t interval_ms,
+                             uint32_t samples_per_interval,
+                             ah_on_tcp_info on_sample,
+                             void* user_data);
+
+/**
+ * @brief Stops the sampler and detaches all of its slots.
+ */
+void destroy_tcp_info_sampler(ah_tcp_info_sampler* sampler);
+
+/**
+ * @brief Adds the accepted socket to the sampler using the provided slot.
+ *
+ * The slot must stay alive until it is removed using ::remove_tcp_info_slot,
+ * which must happen before the socket is destroyed.
+ */
+void add_tcp_info_slot(ah_tcp_info_sampler* sampler,
+                       ah_tcp_info_slot* slot,
+                       ah_socket_accepted* socket,
+                       void* user_data);
+
+/**
+ * @brief Removes the slot from its sampler, if it was added to one.
+ */
+void remove_tcp_info_slot(ah_tcp_info_slot* slot);
+
+/* clang-format off */
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define AH_PRINTF_FORMAT(x, y) __attribute__((format(printf, x, y)))
+#else
+#  define AH_PRINTF_FORMAT(x, y)
+#endif
+
+/* clang-format on */
+
+/**
+ * @brief Switches the logging functions to deferred output.
+ *
+ * Until this is called, messages are written before the logging functions
+ * return. Afterwards, they are copied into a ring buffer owned by the calling
+ * thread and written by a background thread for ::AH_LOG_BACKGROUND, or at
+ * the end of every ::server_tick for ::AH_LOG_EVENT_LOOP. Logging never
+ * blocks in the deferred modes: if the ring of the thread is full, then the
+ * message is dropped and counted.
+ */
+bool ah_log_start(ah_log_mode mode);
+
+/**
+ * @brief Writes out the pending messages and switches back to synchronous
+ * output.
+ *
+ * The threads that log should be done logging when this is called, otherwise
+ * their messages might only be written after the next ::ah_log_start.
+ */
+void ah_log_stop(void);
+
+/**
+ * @brief Writes out the pending messages of every thread, unless another
+ * thread is already doing that.
+ */
+void ah_log_flush(void);
+
+/**
+ * @brief Returns the number of messages dropped, because the ring buffer of
+ * the logging thread was full.
+ */
+uint64_t ah_log_dropped(void);
+
+/**
+ * @brief Formats a message for stdout.
+ *
+ * Messages longer than ::AH_LOG_MAX_MESSAGE bytes are truncated.
+ */
+void ah_log(const char* format, ...) AH_PRINTF_FORMAT(1, 2);
+
+/**
+ * @brief Writes raw bytes to stdout.
+ */
+void ah_log_bytes(const void* data, size_t size);
+
+/**
+ * @brief Reports a failed call to \c function on stderr.
+ *
+ * \c error_code is the OS native error code. Converting it to a message is
+ * deferred to the thread writing the message out.
+ */
+void ah_log_error(const char* function, int error_code);
+
+/**
+ * @brief Reports a failed call to \c function on stderr with a message that
+ * was already formatted, e.g. by a library with its own error codes.
+ *
+ * The message is truncated to fit ::AH_LOG_MAX_MESSAGE bytes along with the
+ * function name.
+ */
+void ah_log_error_message(const char* function, const char* message);
+
+/**
+ * @brief Takes the ownership of an accepted socket from the server in an
+ * ::ah_on_accept callback.
+ */
+void move_socket(ah_socket_accepted* result_socket, ah_socket* socket);
+
+/**
+ * @brief Enables kernel software receive timestamps on the accepted socket.
+ *
+ * Once enabled, read operations on this socket fetch the arrival time of the
+ * received data alongside the data itself, which can be retrieved using
+ * ::rx_timestamp_from_io_operation in the completion callback. The queueing
+ * delay is also accounted for in the ::ah_server_stats of the server. The
+ * kernel may take a moment to start stamping packets after the first socket
+ * of the process enabled it. This is not supported on every platform, in
+ * which case \c false is returned.
+ */
+bool enable_rx_timestamps(ah_socket_accepted* socket);
+
+typedef enum ah_tls_cipher
+{
+  AH_TLS_AES_128_GCM,
+  AH_TLS_AES_256_GCM,
+  AH_TLS_CHACHA20_POLY1305,
+} ah_tls_cipher;
+
+/**
+ * @brief The traffic keys of one direction of a TLS 1.3 connection.
+ *
+ * \c key holds as many bytes as the cipher uses, \c iv is the full 12 byte
+ * nonce before it is combined with \c sequence, the number of the next
+ * record.
+ */
+typedef struct ah_tls_keys {
+  ah_tls_cipher cipher;
+  uint8_t key[32];
+  uint8_t iv[12];
+  uint64_t sequence;
+} ah_tls_keys;
+
+/**
+ * @brief Hands the sending side of the record layer of a TLS 1.3 connection
+ * over to the kernel.
+ *
+ * Every byte queued to the socket before this call must have been handed to
+ * the kernel already. Afterwards writes take plaintext and are encrypted by
+ * the kernel, while reads still return the records as they arrive. The
+ * receiving side is not offloaded, because the kernel fails reads of records
+ * other than application data, such as alerts and key updates. This is only
+ * supported by Linux with the \c tls module available, otherwise \c false is
+ * returned without reporting an error and the socket is unchanged.
+ */
+bool enable_kernel_tls(ah_socket_accepted* socket, const ah_tls_keys* keys);
+
+/**
+ * @brief Returns the ::ah_context pointer from the socket.
+ */
+ah_context* context_from_socket_base(ah_socket* socket);
+
+/**
+ * @brief Returns the ::ah_context pointer from the accepted socket.
+ */
+ah_context* context_from_socket_accepted(ah_socket_accepted* socket);
+
+/* clang-format off */
+
+/**
+ * @brief Type generic macro function that returns the context from the socket.
+ */
+#define context_from_socket(socket) \
+  _Generic((socket), \
+           ah_socket*: context_from_socket_base, \
+           ah_socket_accepted*: context_from_socket_accepted)(socket)
+
+/* clang-format on */
+
+/**
+ * @brief Returns whether the I/O operation is parked in a dock, i.e. active.
+ *
+ * User code must call this function before queueing any I/O operation. Writes
+ * in excess can be queued using an ::ah_write_queue instead.
+ */
+bool is_io_operation_active(ah_io_operation* operation);
+
+/**
+ * @brief Returns the queued buffer.
+ */
+ah_io_buffer buffer_from_io_operation(ah_io_operation* operation);
+
+/**
+ * @brief Returns the kernel arrival timestamp of the data read by the
+ * operation in nanoseconds since the Unix epoch.
+ *
+ * This can only be called from the completion callback of a read operation,
+ * the returned value is 0 anywhere else or if the socket did not have
+ * ::enable_rx_timestamps called on it. For stream sockets the timestamp
+ * belongs to the most recent packet whose data was read.
+ */
+uint64_t rx_timestamp_from_io_operation(ah_io_operation* operation);
+
+/**
+ * @brief Returns the dock corresponding to the I/O operation.
+ */
+ah_io_dock* dock_from_operation(ah_io_operation* operation);
+
+/**
+ * @brief Queues a read operation into the provided buffer.
+ *
+ * The buffer must stay alive for the duration of the operation. The provided
+ * buffer's length MUST NOT be greater than \c INT32_MAX (2147483647). The
+ * callback will also not receive a value greater than that for the number of
+ * bytes transferred.
+ */
+bool queue_read_operation4(ah_io_dock* dock,
+                           ah_io_buffer buffer,
+                           ah_on_io_complete on_complete,
+                           void* per_call_data);
+
+/**
+ * @brief Queues a write operation from the provided buffer.
+ *
+ * The buffer must stay alive for the duration of the operation. The provided
+ * buffer's length MUST NOT be greater than \c INT32_MAX (2147483647). The
+ * callback will also not receive a value greater than that for the number of
+ * bytes transferred.
+ */
+bool queue_write_operation4(ah_io_dock* dock,
+                            ah_io_buffer buffer,
+                            ah_on_io_complete on_complete,
+                            void* per_call_data);
+
+/**
+ * @brief Initializes an empty write queue that uses the write port of
+ * \c dock.
+ */
+void create_write_queue(ah_write_queue* result_queue, ah_io_dock* dock);
+
+/**
+ * @brief Appends a write of \c buffer to the queue.
+ *
+ * The provided buffer's length MUST NOT be greater than \c INT32_MAX
+ * (2147483647). This fails if the write port of the dock is in use by a write
+ * operation queued with ::queue_write_operation4.
+ */
+bool queue_write_request(ah_write_queue* queue,
+                         ah_write_request* request,
+                         ah_io_buffer buffer,
+                         ah_on_write_request on_complete,
+                         void* per_call_data);
+
+/**
+ * @brief Bounds the memory a slow reader can make the connection hold.
+ *
+ * Once the pending bytes of the queue reach \c high_watermark, the read port
+ * of the dock is paused: a queued read operation does not complete until the
+ * pending bytes fall to \c low_watermark. \c on_pressure is called on both
+ * transitions, so producers other than the read handler can stop as well. It
+ * may be called from inside ::queue_write_request, in which case its return
+ * value is returned from there, but the request is queued either way. A
+ * \c high_watermark of 0 disables the watermarks. The new values take effect
+ * the next time the pending bytes change.
+ */
+void set_write_queue_watermarks(ah_write_queue* queue,
+                                uint64_t low_watermark,
+                                uint64_t high_watermark,
+                                ah_on_write_pressure on_pressure,
+                                void* user_data);
+
+/**
+ * @brief Holds back partial segments while \c corked is \c true.
+ *
+ * Cork the queue while a response is being assembled from many requests,
+ * then uncork it to send the remainder right away. Without corking, partial
+ * segments are only held back while the queue has more requests than fit into
+ * a single system call. This is a no-op on platforms without \c TCP_CORK.
+ */
+bool cork_write_queue(ah_write_queue* queue, bool corked);
+
+/**
+ * @brief Appends a write of \c length bytes of \c file from \c offset to the
+ * queue.
+ *
+ * Mapped files are sent from their mapping like any other buffer, the rest
+ * are sent by the kernel straight from the page cache using \c sendfile or
+ * \c TransmitFile. The caller must hold a reference to the file until the
+ * callback is called. \c length MUST NOT be greater than \c INT32_MAX
+ * (2147483647).
+ */
+bool queue_file_write_request(ah_write_queue* queue,
+                              ah_write_request* request,
+                              ah_cached_file* file,
+                              uint64_t offset,
+                              uint32_t length,
+                              ah_on_write_request on_complete,
+                              void* per_call_data);
+
+/**
+ * @brief Allocates a shared buffer of \c length bytes holding one reference,
+ * which belongs to the caller.
+ *
+ * Returns \c NULL if the allocation fails or \c length is greater than
+ * \c INT32_MAX (2147483647).
+ */
+ah_shared_buf* create_shared_buf(uint32_t length);
+
+/**
+ * @brief Takes another reference to the buffer.
+ */
+void retain_shared_buf(ah_shared_buf* buffer);
+
+/**
+ * @brief Drops a reference to the buffer and frees it with the last one.
+ */
+void release_shared_buf(ah_shared_buf* buffer);
+
+/**
+ * @brief Appends a write of \c length bytes of \c buffer from \c offset to
+ * the queue.
+ *
+ * The request takes a reference to the buffer, which it drops once its
+ * callback returned, so the caller may release its own reference right
+ * away.
+ */
+bool queue_shared_write_request(ah_write_queue* queue,
+                                ah_write_request* request,
+                                ah_shared_buf* buffer,
+                                uint32_t offset,
+                                uint32_t length,
+                                ah_on_write_request on_complete,
+                                void* per_call_data);
+
+/**
+ * @brief Queues the same slice of \c buffer on \c count queues, using the
+ * request at the same index for each.
+ *
+ * This behaves like calling ::queue_shared_write_request for every queue, so
+ * the bytes are not copied and the only memory per connection is its request.
+ * A queue that fails does not stop the others from being queued, but makes
+ * the function return \c false.
+ */
+bool broadcast_shared_buf(ah_shared_buf* buffer,
+                          uint32_t offset,
+                          uint32_t length,
+                          ah_write_queue* const* queues,
+                          ah_write_request* requests,
+                          uint32_t count,
+                          ah_on_write_request on_complete,
+                          void* per_call_data);
+
+/**
+ * @brief Detaches every request of the queue and calls their callbacks with
+ * ::AH_ERR_OPERATION_ABORTED.
+ *
+ * Meant to be called after the socket of the dock was destroyed, because
+ * nothing else completes the requests left in the queue then. This is what
+ * releases the shared buffers they hold. With IOCP a send in flight fails
+ * because of the closed socket and completes the requests instead, so the
+ * queue must stay alive until then.
+ */
+bool cancel_write_queue(ah_write_queue* queue);
+
+/**
+ * @brief Returns the size of the ::ah_relay object.
+ */
+size_t relay_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_relay object.
+ */
+size_t relay_alignment(void);
+
+/**
+ * @brief Forwards the bytes arriving on either dock to the other one until
+ * both peers shut down their sending side.
+ *
+ * On Linux the bytes are moved with \c splice through a pipe per direction,
+ * so they never reach user space, elsewhere they are copied through a buffer
+ * per direction. A direction reads again only once everything read before was
+ * delivered, so a slow peer applies backpressure to the other one. An end of
+ * file is forwarded by shutting down the sending side of the other socket.
+ *
+ * Neither dock may have I/O operations pending and their ports must not be
+ * used until the relay is stopped. Bytes already read from a dock, e.g. to
+ * pick the upstream, have to be written to the other one before starting.
+ */
+bool start_relay(ah_relay* result_relay,
+                 ah_io_dock* client,
+                 ah_io_dock* upstream,
+                 ah_on_relay_done on_done,
+                 void* user_data);
+
+/**
+ * @brief Returns the number of bytes delivered in each direction so far.
+ */
+ah_relay_counters counters_from_relay(ah_relay* relay);
+
+/**
+ * @brief Stops the relay without calling the callback, discarding the bytes
+ * that were read but not delivered yet.
+ *
+ * With IOCP the operations in flight still complete later, which they do
+ * once the sockets of the docks are closed, and the relay must stay alive
+ * until then.
+ */
+bool destroy_relay(ah_relay* relay);
+
+/**
+ * @brief Returns the size of the ::ah_sockmap object.
+ */
+size_t sockmap_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_sockmap object.
+ */
+size_t sockmap_alignment(void);
+
+/**
+ * @brief Creates the BPF maps and the verdict program that let the kernel
+ * forward the bytes of up to \c max_relays relays at a time.
+ *
+ * Returns \c false if BPF is not available, which is the case on platforms
+ * other than Linux and for processes lacking \c CAP_BPF and
+ * \c CAP_NET_ADMIN. Relays are then started with ::start_relay, or with
+ * ::start_sockmap_relay given \c NULL.
+ */
+bool create_sockmap(ah_sockmap* result_sockmap, uint32_t max_relays);
+
+/**
+ * @brief Starts a relay like ::start_relay, with the kernel forwarding the
+ * bytes if possible.
+ *
+ * The sockets of the docks are added to the maps of \c sockmap, where the
+ * verdict program redirects every segment arriving on one of them to the send
+ * queue of the other one, so the event loop only handles the end of file and
+ * errors. If \c sockmap is \c NULL or full, or the maps do not accept the
+ * sockets, the relay is started by ::start_relay instead. The kernel applies
+ * no backpressure to the redirected bytes beyond the socket buffers.
+ */
+bool start_sockmap_relay(ah_sockmap* sockmap,
+                         ah_relay* result_relay,
+                         ah_io_dock* client,
+                         ah_io_dock* upstream,
+                         ah_on_relay_done on_done,
+                         void* user_data);
+
+/**
+ * @brief Returns whether the bytes of the relay are forwarded by the kernel.
+ */
+bool is_relay_in_kernel(ah_relay* relay);
+
+/**
+ * @brief Frees the maps and the program, which must not be used by any relay
+ * anymore.
+ */
+void destroy_sockmap(ah_sockmap* sockmap);
+
+/**
+ * @brief Returns the size of the ::ah_datagram_socket object.
+ */
+size_t datagram_socket_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_datagram_socket object.
+ */
+size_t datagram_socket_alignment(void);
+
+/**
+ * @brief Creates a UDP socket bound to \c port on every interface.
+ *
+ * The socket is dual-stack, so it exchanges datagrams with IPv4 and IPv6
+ * peers alike, unless the system has no IPv6 stack, in which case IPv6
+ * destinations fail the send. \c flags is a combination of
+ * ::ah_datagram_flag values. Requesting a feature the kernel does not have
+ * fails the creation.
+ */
+bool create_datagram_socket(ah_datagram_socket* result_socket,
+                            ah_context* context,
+                            uint16_t port,
+                            uint32_t flags);
+
+/**
+ * @brief Returns the address the datagram socket is bound to.
+ */
+bool local_address_from_datagram_socket(ah_datagram_socket* socket,
+                                        ah_address* result_address);
+
+/**
+ * @brief Returns the context the socket was created with.
+ */
+ah_context* context_from_datagram_socket(ah_datagram_socket* socket);
+
+/**
+ * @brief Queues a receive into the first \c count datagrams of the array.
+ *
+ * The callback is called once at least one datagram arrived, with as many
+ * as a single \c recvmmsg call returned. With IOCP every batch is a single
+ * datagram and GRO is not available. The array and its buffers must stay
+ * alive for the duration of the operation, and only one receive may be
+ * queued at a time.
+ */
+bool queue_datagram_receive(ah_datagram_socket* socket,
+                            ah_datagram* datagrams,
+                            uint32_t count,
+                            ah_on_datagrams on_complete,
+                            void* per_call_data);
+
+/**
+ * @brief Queues sending the \c count datagrams of the array.
+ *
+ * The datagrams are handed to \c sendmmsg in as few calls as the socket
+ * buffer allows and the callback is called once all of them were sent or
+ * one failed. A nonzero \c segment_size uses \c UDP_SEGMENT, so the kernel or
+ * the network card does the splitting. With IOCP every datagram takes a
+ * call of its own and segments are split before sending. Only one send may be
+ * queued at a time, and a destination of the family ::AH_ADDRESS_NONE
+ * rejects the whole batch.
+ */
+bool queue_datagram_send(ah_datagram_socket* socket,
+                         ah_datagram* datagrams,
+                         uint32_t count,
+                         ah_on_datagrams on_complete,
+                         void* per_call_data);
+
+/**
+ * @brief Closes the socket without calling the callbacks of the queued
+ * operations.
+ *
+ * With IOCP the operations in flight still complete later and the socket
+ * object must stay alive until then.
+ */
+bool destroy_datagram_socket(ah_datagram_socket* socket);
+
+/**
+ * @brief Initializes an empty ring of at least \c minimum_capacity bytes.
+ *
+ * The capacity is rounded up to a multiple of the page size, or of the
+ * allocation granularity on Windows, and must not exceed 1 GiB.
+ *
+ * Every mirrored ring takes two memory mappings. On Linux this limits a
+ * process to about half of \c vm.max_map_count rings, which is roughly 32k
+ * with the default of 65530, less the mappings the process needs otherwise.
+ * Rings created past that limit fall back to a plain buffer, so raise the
+ * limit for servers expecting more connections.
+ */
+bool create_ring(ah_ring* result_ring, uint32_t minimum_capacity);
+
+/**
+ * @brief Releases the storage of the ring.
+ */
+void destroy_ring(ah_ring* ring);
+
+/**
+ * @brief Returns the unread bytes as one contiguous buffer.
+ */
+ah_io_buffer ring_read_buffer(ah_ring* ring);
+
+/**
+ * @brief Returns the free space as one contiguous buffer.
+ *
+ * The buffer can be passed to ::queue_read_operation4 as is. Call
+ * ::ring_produce with the number of bytes transferred once the read
+ * completes. For a ring that is not mirrored this may move the unread bytes,
+ * so the buffers returned by ::ring_read_buffer before are invalidated.
+ */
+ah_io_buffer ring_write_buffer(ah_ring* ring);
+
+/**
+ * @brief Appends \c bytes bytes written into ::ring_write_buffer to the
+ * unread bytes.
+ */
+bool ring_produce(ah_ring* ring, uint32_t bytes);
+
+/**
+ * @brief Discards \c bytes bytes from the front of the unread bytes.
+ *
+ * Bytes still being written from with ::queue_write_operation4 or a write
+ * queue must not be consumed before the write completes.
+ */
+bool ring_consume(ah_ring* ring, uint32_t bytes);
+
+/**
+ * @brief Initializes a framer for frames terminated by \c delimiter.
+ *
+ * The delimiter is copied and must be 1 to ::AH_FRAME_MAX_DELIMITER bytes
+ * long. It is searched for with the widest SIMD instructions the CPU
+ * supports. A \c max_frame_length of 0 limits frames only by the capacity of
+ * the ring.
+ */
+bool create_delimited_framer(ah_framer* result_framer,
+                             ah_io_dock* dock,
+                             ah_ring* ring,
+                             ah_io_buffer delimiter,
+                             uint32_t max_frame_length,
+                             ah_on_frame on_frame,
+                             void* user_data);
+
+/**
+ * @brief Initializes a framer for frames preceded by their length.
+ *
+ * A \c header_length of 1, 2 or 4 reads the length as a big endian integer
+ * of that many bytes, while 0 reads it as an unsigned LEB128 varint of at
+ * most 5 bytes. A \c max_frame_length of 0 limits frames only by the
+ * capacity of the ring.
+ */
+bool create_length_prefixed_framer(ah_framer* result_framer,
+                                   ah_io_dock* dock,
+                                   ah_ring* ring,
+                                   uint8_t header_length,
+                                   uint32_t max_frame_length,
+                                   ah_on_frame on_frame,
+                                   void* user_data);
+
+/**
+ * @brief Delivers the frames already in the ring, then keeps reading from the
+ * dock into the ring and delivering frames until stopped.
+ *
+ * Framing stops with ::AH_ERR_MESSAGE_SIZE if a frame is too long, with
+ * ::AH_ERR_SHUT_DOWN once the peer has shut down its side, or with the error
+ * of a failed read. The read port of the dock must not be used directly while
+ * the framer is running.
+ */
+bool start_framer(ah_framer* framer);
+
+/**
+ * @brief Stops delivering frames, e.g. from inside the frame callback.
+ *
+ * The framer and the ring must not be freed from inside the frame callback. A
+ * read already queued by the framer still completes and must find the framer
+ * alive, unless the socket is destroyed before that.
+ */
+void stop_framer(ah_framer* framer);
+
+/**
+ * @brief Delivers the complete frames in the ring without reading from the
+ * dock.
+ *
+ * This is useful if the bytes were put into the ring some other way, e.g. by
+ * a decryption layer.
+ */
+bool deliver_frames(ah_framer* framer);
+
+/**
+ * @brief Returns the name of the instruction set used to search for
+ * delimiters, e.g. \c "avx2", \c "sse2" or \c "scalar".
+ */
+const char* framing_isa_name(void);
+
+/**
+ * @brief Returns the size of the ::ah_file_cache object.
+ */
+size_t file_cache_size(void);
+
+/**
+ * @brief Returns the alignment of the ::ah_file_cache object.
+ */
+size_t file_cache_alignment(void);
+
+/**
+ * @brief Initializes a cache of at most \c capacity open files below the
+ * \c root directory.
+ *
+ * The least recently used file is evicted to make room for a new one. Cached
+ * files are watched for changes using the event loop of \c server, i.e. with
+ * inotify on Linux and a directory change notification on Windows, and are
+ * dropped from the cache when they change. \c on_open may be \c NULL.
+ */
+bool create_file_cache(ah_file_cache* result_cache,
+                       ah_server* server,
+                       const char* root,
+                       uint32_t capacity,
+                       ah_on_file_open on_open,
+                       void* user_data);
+
+/**
+ * @brief Looks up the file at \c path relative to the root of the cache and
+ * takes a reference to it, opening it on a miss.
+ *
+ * Paths use forward slashes and must not be absolute or contain empty, \c "."
+ * or \c ".." segments, otherwise ::AH_ERR_INVALID_ARGUMENT is returned in
+ * \c error_code_out. Missing files fail with ::AH_ERR_NOT_FOUND and
+ * directories with ::AH_ERR_IS_DIRECTORY. In these cases \c result_file is set
+ * to \c NULL and \c true is returned, while \c false is reserved for
+ * allocation failures and \c on_open returning \c false. Opening a file on a
+ * miss blocks the event loop like any other file system access.
+ */
+bool acquire_cached_file(ah_file_cache* cache,
+                         ah_io_buffer path,
+                         ah_cached_file** result_file,
+                         ah_error_code* error_code_out);
+
+/**
+ * @brief Drops a reference taken with ::acquire_cached_file.
+ */
+void release_cached_file(ah_cached_file* file);
+
+/**
+ * @brief Closes every file that is not referenced and stops watching them.
+ *
+ * Files still referenced are closed when they are released.
+ */
+void destroy_file_cache(ah_file_cache* cache);
 
 /**
  * @brief Dispatches to ::queue_read_operation4 with the 4th argument as
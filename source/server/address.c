@@ -0,0 +1,160 @@
+#include <string.h>
+
+#include "server/detail.h"
+
+/* The addresses are formatted by hand, because neither platform offers a
+ * function that writes the port and the brackets as well */
+
+static const uint8_t ipv4_mapped_prefix[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+static bool is_ipv4_mapped(const ah_address* address)
+{
+  return address->family == AH_ADDRESS_IPV6
+      && memcmp(address->bytes, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix))
+      == 0;
+}
+
+uint16_t port_from_address(const ah_address* address)
+{
+  return (uint16_t)(address->port[0] << 8 | address->port[1]);
+}
+
+bool ipv4_from_address(const ah_address* address,
+                       ah_ipv4_address* result_address)
+{
+  const uint8_t* bytes = NULL;
+  if (address->family == AH_ADDRESS_IPV4) {
+    bytes = address->bytes;
+  } else if (is_ipv4_mapped(address)) {
+    bytes = address->bytes + sizeof(ipv4_mapped_prefix);
+  } else {
+    return false;
+  }
+
+  memcpy(result_address->address, bytes, sizeof(result_address->address));
+  result_address->port = port_from_address(address);
+  return true;
+}
+
+ah_address address_from_ipv4(ah_ipv4_address address)
+{
+  ah_address result = {.family = AH_ADDRESS_IPV4};
+  memcpy(result.bytes, address.address, sizeof(address.address));
+  result.port[0] = (uint8_t)(address.port >> 8);
+  result.port[1] = (uint8_t)(address.port & 0xFF);
+  return result;
+}
+
+static char* format_decimal(char* out, uint32_t value)
+{
+  char digits[10];
+  uint32_t count = 0;
+  do {
+    digits[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (count != 0) {
+    *out++ = digits[--count];
+  }
+
+  return out;
+}
+
+static char* format_ipv4(char* out, const uint8_t* bytes)
+{
+  for (uint32_t i = 0; i != 4; ++i) {
+    if (i != 0) {
+      *out++ = '.';
+    }
+    out = format_decimal(out, bytes[i]);
+  }
+
+  return out;
+}
+
+/* Groups are written in lowercase without leading zeros */
+static char* format_group(char* out, uint32_t group)
+{
+  static const char digits[] = "0123456789abcdef";
+  int shift = 12;
+  while (shift != 0 && group >> shift == 0) {
+    shift -= 4;
+  }
+
+  for (; shift >= 0; shift -= 4) {
+    *out++ = digits[group >> shift & 0xF];
+  }
+
+  return out;
+}
+
+/* The longest run of at least two zero groups, the first one of equally long
+ * runs, is shortened to "::" */
+static char* format_ipv6(char* out, const uint8_t* bytes)
+{
+  uint32_t groups[8];
+  for (uint32_t i = 0; i != 8; ++i) {
+    groups[i] = (uint32_t)bytes[i * 2] << 8 | bytes[i * 2 + 1];
+  }
+
+  uint32_t best_start = 8;
+  uint32_t best_length = 1;
+  for (uint32_t i = 0; i != 8;) {
+    uint32_t length = 0;
+    while (i + length != 8 && groups[i + length] == 0) {
+      ++length;
+    }
+
+    if (length > best_length) {
+      best_start = i;
+      best_length = length;
+    }
+    i += length == 0 ? 1 : length;
+  }
+
+  uint32_t best_end = best_start + best_length;
+  for (uint32_t i = 0; i != 8;) {
+    if (i == best_start) {
+      *out++ = ':';
+      *out++ = ':';
+      i = best_end;
+      continue;
+    }
+
+    if (i != 0 && i != best_end) {
+      *out++ = ':';
+    }
+    out = format_group(out, groups[i]);
+    ++i;
+  }
+
+  return out;
+}
+
+size_t format_address(const ah_address* address, char* result_string)
+{
+  char* out = result_string;
+  if (address->family == AH_ADDRESS_IPV4) {
+    out = format_ipv4(out, address->bytes);
+  } else if (is_ipv4_mapped(address)) {
+    static const char prefix[] = "[::ffff:";
+    memcpy(out, prefix, sizeof(prefix) - 1);
+    out = format_ipv4(out + sizeof(prefix) - 1,
+                      address->bytes + sizeof(ipv4_mapped_prefix));
+    *out++ = ']';
+  } else if (address->family == AH_ADDRESS_IPV6) {
+    *out++ = '[';
+    out = format_ipv6(out, address->bytes);
+    *out++ = ']';
+  }
+
+  if (address->family != AH_ADDRESS_NONE) {
+    *out++ = ':';
+    out = format_decimal(out, port_from_address(address));
+  }
+
+  *out = '\0';
+  return (size_t)(out - result_string);
+}
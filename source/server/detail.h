@@ -14,3 +14,224 @@
   (type*)((char*)(pointer) - offsetof(type, member))
 
 /* clang-format on */
+
+typedef struct ah_timer {
+  ah_timer* previous;
+  ah_timer* next;
+  ah_server* server;
+  uint64_t deadline;
+  uint64_t started_in_run;
+  ah_on_timer on_timer;
+  void* user_data;
+  bool active;
+} ah_timer;
+
+/**
+ * @brief Intrusive list of the active timers of a server, sorted by deadline.
+ */
+typedef struct ah_timer_list {
+  ah_timer* head;
+  ah_timer* tail;
+  uint64_t run;
+} ah_timer_list;
+
+/**
+ * @brief State shared by the platform dependent server implementations.
+ */
+typedef struct ah_server_core {
+  ah_server_stats stats;
+  ah_timer_list timers;
+} ah_server_core;
+
+/**
+ * @brief Returns the platform independent part of the server.
+ */
+ah_server_core* core_from_server(ah_server* server);
+
+/**
+ * @brief Returns the value of the platform's monotonic clock in milliseconds.
+ */
+uint64_t monotonic_time_ms(void);
+
+/**
+ * @brief Returns the number of milliseconds the event loop may block for
+ * before the earliest timer expires, or -1 if there are no active timers.
+ */
+int next_timer_timeout(ah_timer_list* list);
+
+/**
+ * @brief Calls the callbacks of the timers whose deadline has passed.
+ *
+ * Timers started again from a callback will not fire in the same call.
+ */
+bool run_expired_timers(ah_timer_list* list);
+
+/**
+ * @brief Writes the OS native error code of the failed call to \c function
+ * to stderr.
+ */
+void write_error_message(const char* function, int error_code);
+
+typedef void (*ah_thread_function)(void* argument);
+
+/**
+ * @brief Starts a thread calling \c function with \c argument.
+ */
+bool start_thread(ah_thread_function function,
+                  void* argument,
+                  void** result_handle);
+
+/**
+ * @brief Waits for the thread started with ::start_thread to finish.
+ */
+void join_thread(void* handle);
+
+/**
+ * @brief A function to call when a thread exits, see ::call_at_thread_exit.
+ */
+typedef struct ah_thread_exit {
+  ah_thread_function function;
+  void* argument;
+} ah_thread_exit;
+
+/**
+ * @brief Calls the function of \c hook with its argument once the calling
+ * thread exits, replacing the hook set before.
+ *
+ * The hook must stay alive until then. It is not called for the threads still
+ * running when the process exits. Nothing is logged on failure, so this can
+ * be used by the logger itself.
+ */
+bool call_at_thread_exit(ah_thread_exit* hook);
+
+/**
+ * @brief Suspends the calling thread for at least \c milliseconds.
+ */
+void sleep_ms(uint32_t milliseconds);
+
+/**
+ * @brief Writes out the pending log messages if the logger is in
+ * ::AH_LOG_EVENT_LOOP mode.
+ */
+void flush_log_from_event_loop(void);
+
+/**
+ * @brief Appends the initialized request to the queue without touching the
+ * dock.
+ */
+void append_write_request(ah_write_queue* queue, ah_write_request* request);
+
+/**
+ * @brief Appends the initialized request to the queue and starts sending if
+ * the write port of the dock is idle.
+ */
+bool enqueue_write_request(ah_write_queue* queue, ah_write_request* request);
+
+/**
+ * @brief Accounts for \c bytes_transferred bytes written from the front of the
+ * queue and detaches the requests that were written completely.
+ *
+ * The detached requests are returned as a list, which should be passed to
+ * ::finish_write_requests once the port is updated.
+ */
+ah_write_request* complete_write_requests(ah_write_queue* queue,
+                                          uint64_t bytes_transferred);
+
+/**
+ * @brief Detaches every request from the queue.
+ */
+ah_write_request* take_write_requests(ah_write_queue* queue);
+
+/**
+ * @brief Pauses or resumes reads based on the pending bytes of the queue and
+ * the watermarks, calling the pressure callback on transitions.
+ */
+bool update_write_pressure(ah_write_queue* queue);
+
+/**
+ * @brief Calls the callbacks of the detached requests in order.
+ */
+bool finish_write_requests(ah_write_request* requests,
+                           ah_error_code error_code);
+
+/**
+ * @brief Returns the granularity the storage of rings is allocated with.
+ */
+size_t ring_granularity(void);
+
+/**
+ * @brief Maps \c size bytes of shared memory twice back to back and returns
+ * the address of the first mapping, or \c NULL on failure.
+ *
+ * Failing because the process ran out of mappings is not reported, because
+ * ::create_ring falls back to a plain buffer then.
+ */
+void* map_ring_memory(size_t size);
+
+/**
+ * @brief Unmaps both mappings created by ::map_ring_memory.
+ */
+void unmap_ring_memory(void* data, size_t size);
+
+typedef struct ah_file_watcher ah_file_watcher;
+
+/**
+ * @brief Callback type for the changes reported by an ::ah_file_watcher.
+ *
+ * \c watch identifies the changed file as set by ::watch_cached_file, or is -1
+ * if every watched file has to be assumed changed.
+ */
+typedef bool (*ah_on_file_change)(int32_t watch, void* user_data);
+
+/**
+ * @brief Opens the directory the paths of a file cache are relative to.
+ */
+bool open_file_root(const char* path, intptr_t* result_root);
+
+/**
+ * @brief Closes the directory opened with ::open_file_root.
+ */
+void close_file_root(intptr_t root);
+
+/**
+ * @brief Opens the regular file at the path of \c file below \c root and fills
+ * in its handle, metadata and mapping.
+ */
+ah_error_code open_cached_file(intptr_t root, ah_cached_file* file);
+
+/**
+ * @brief Unmaps and closes the file opened with ::open_cached_file.
+ */
+void close_cached_file(ah_cached_file* file);
+
+/**
+ * @brief Starts watching for changes to the files below \c root, which are
+ * reported from the event loop of \c server.
+ */
+ah_file_watcher* create_file_watcher(ah_server* server,
+                                     intptr_t root,
+                                     ah_on_file_change on_change,
+                                     void* user_data);
+
+/**
+ * @brief Registers the open file with the watcher and sets its \c watch
+ * member, which is -1 if the watcher can only report changes to every file at
+ * once.
+ */
+bool watch_cached_file(ah_file_watcher* watcher, ah_cached_file* file);
+
+/**
+ * @brief Stops reporting changes for \c watch once no cached file uses it.
+ */
+void unwatch_cached_file(ah_file_watcher* watcher, int32_t watch);
+
+/**
+ * @brief Stops watching and frees the watcher.
+ */
+void destroy_file_watcher(ah_file_watcher* watcher);
+
+/**
+ * @brief Returns whether the idle connection has neither unread data nor an
+ * end of file or an error pending, i.e. whether it can be reused.
+ */
+bool is_idle_socket_usable(ah_socket_accepted* socket);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string.h>
+
+#include "server/detail.h"
+
+/**
+ * @file
+ *
+ * Internals of the epoll backend that the microbenchmarks measure in
+ * isolation.
+ */
+
+/**
+ * @brief The state of an ::ah_io_operation of a dock.
+ *
+ * The write port of a dock drained by a write queue or relay points to the
+ * queue or relay through \c per_call_data.
+ */
+typedef struct ah_io_port {
+  bool active;
+  bool is_read_port;
+  bool is_write_queue;
+  bool is_relay;
+  uint32_t buffer_length;
+  void* buffer;
+  ah_on_io_complete on_complete;
+  void* per_call_data;
+} ah_io_port;
+
+_Static_assert(
+    _Alignof(ah_io_port) == _Alignof(ah_io_operation),
+    "AH_IO_OPERATION_ALIGNMENT does not match the internal alignment");
+
+_Static_assert(sizeof(ah_io_port) == sizeof(ah_io_operation),
+               "AH_IO_OPERATION_SIZE does not match the internal size");
+
+static inline void init_io_port(ah_io_port* port,
+                                bool is_read_port,
+                                ah_io_buffer buffer,
+                                ah_on_io_complete on_complete,
+                                void* per_call_data)
+{
+  ah_io_port new_port = {
+      .active = true,
+      is_read_port,
+      .buffer_length = buffer.buffer_length,
+      buffer.buffer,
+      on_complete,
+      per_call_data,
+  };
+  memcpy(port, &new_port, sizeof(ah_io_port));
+}
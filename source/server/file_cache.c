@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/detail.h"
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+typedef struct ah_file_cache {
+  ah_server* server;
+  intptr_t root;
+  ah_file_watcher* watcher;
+  ah_on_file_open on_open;
+  void* user_data;
+  ah_cached_file** buckets;
+  ah_cached_file** watches;
+  uint32_t bucket_mask;
+  uint32_t capacity;
+  uint32_t count;
+  ah_cached_file* lru_head;
+  ah_cached_file* lru_tail;
+} ah_file_cache;
+
+size_t file_cache_size()
+{
+  return sizeof(ah_file_cache);
+}
+
+size_t file_cache_alignment()
+{
+  return _Alignof(ah_file_cache);
+}
+
+/* Paths are looked up as they are, so anything that could name a file
+ * outside of the root or the same file in two different ways is rejected */
+static bool is_valid_path(ah_io_buffer path)
+{
+  if (path.buffer_length == 0 || path.buffer_length > AH_FILE_MAX_PATH) {
+    return false;
+  }
+
+  uint8_t* begin = path.buffer;
+  uint8_t* end = begin + path.buffer_length;
+  for (uint8_t* segment = begin; segment <= end;) {
+    uint8_t* p = segment;
+    while (p != end && *p != '/') {
+      if (*p == '\0' || *p == '\\') {
+        return false;
+      }
+      ++p;
+    }
+
+    size_t length = (size_t)(p - segment);
+    if (length == 0 || (length == 1 && segment[0] == '.')
+        || (length == 2 && segment[0] == '.' && segment[1] == '.'))
+    {
+      return false;
+    }
+
+    segment = p + 1;
+  }
+
+  return true;
+}
+
+static uint32_t hash_path(ah_io_buffer path)
+{
+  uint8_t* data = path.buffer;
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for (uint32_t i = 0; i != path.buffer_length; ++i) {
+    hash = (hash ^ data[i]) * FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static ah_cached_file** watch_bucket(ah_file_cache* cache, int32_t watch)
+{
+  return &cache->watches[(uint32_t)watch & cache->bucket_mask];
+}
+
+static void unlink_file(ah_cached_file** bucket,
+                        ah_cached_file* file,
+                        size_t next_offset)
+{
+  ah_cached_file** link = bucket;
+  while (*link != file) {
+    link = (ah_cached_file**)((char*)*link + next_offset);
+  }
+
+  *link = *(ah_cached_file**)((char*)file + next_offset);
+}
+
+static void free_file(ah_cached_file* file)
+{
+  close_cached_file(file);
+  free(file);
+}
+
+/* Removes the file from the cache, after which it lives only as long as it is
+ * referenced */
+static void detach_file(ah_file_cache* cache, ah_cached_file* file)
+{
+  unlink_file(&cache->buckets[file->hash & cache->bucket_mask],
+              file,
+              offsetof(ah_cached_file, hash_next));
+
+  if (file->lru_previous == NULL) {
+    cache->lru_head = file->lru_next;
+  } else {
+    file->lru_previous->lru_next = file->lru_next;
+  }
+  if (file->lru_next == NULL) {
+    cache->lru_tail = file->lru_previous;
+  } else {
+    file->lru_next->lru_previous = file->lru_previous;
+  }
+
+  /* Paths naming the same file share the watch, which can only be removed
+   * along with the last of them */
+  if (file->watch != -1) {
+    ah_cached_file** bucket = watch_bucket(cache, file->watch);
+    unlink_file(bucket, file, offsetof(ah_cached_file, watch_next));
+    ah_cached_file* other = *bucket;
+    while (other != NULL && other->watch != file->watch) {
+      other = other->watch_next;
+    }
+    if (other == NULL) {
+      unwatch_cached_file(cache->watcher, file->watch);
+    }
+  }
+
+  file->cached = false;
+  --cache->count;
+  if (file->references == 0) {
+    free_file(file);
+  }
+}
+
+static void detach_every_file(ah_file_cache* cache)
+{
+  while (cache->lru_head != NULL) {
+    detach_file(cache, cache->lru_head);
+  }
+}
+
+static bool on_file_change(int32_t watch, void* user_data)
+{
+  ah_file_cache* cache = user_data;
+  if (watch == -1) {
+    detach_every_file(cache);
+    return true;
+  }
+
+  ah_cached_file** bucket = watch_bucket(cache, watch);
+  for (ah_cached_file* file = *bucket; file != NULL;) {
+    ah_cached_file* next = file->watch_next;
+    if (file->watch == watch) {
+      detach_file(cache, file);
+      /* Detaching can free the successor if it shared the watch */
+      next = *bucket;
+    }
+    file = next;
+  }
+
+  return true;
+}
+
+static void attach_file(ah_file_cache* cache, ah_cached_file* file)
+{
+  ah_cached_file** bucket = &cache->buckets[file->hash & cache->bucket_mask];
+  file->hash_next = *bucket;
+  *bucket = file;
+
+  if (file->watch != -1) {
+    bucket = watch_bucket(cache, file->watch);
+    file->watch_next = *bucket;
+    *bucket = file;
+  }
+
+  file->lru_next = cache->lru_head;
+  if (cache->lru_head == NULL) {
+    cache->lru_tail = file;
+  } else {
+    cache->lru_head->lru_previous = file;
+  }
+  cache->lru_head = file;
+
+  file->cached = true;
+
+  /* The file is linked first, so evicting another path of it keeps the watch
+   * they share */
+  if (++cache->count > cache->capacity) {
+    detach_file(cache, cache->lru_tail);
+  }
+}
+
+static void touch_file(ah_file_cache* cache, ah_cached_file* file)
+{
+  if (file->lru_previous == NULL) {
+    return;
+  }
+
+  file->lru_previous->lru_next = file->lru_next;
+  if (file->lru_next == NULL) {
+    cache->lru_tail = file->lru_previous;
+  } else {
+    file->lru_next->lru_previous = file->lru_previous;
+  }
+
+  file->lru_previous = NULL;
+  file->lru_next = cache->lru_head;
+  cache->lru_head->lru_previous = file;
+  cache->lru_head = file;
+}
+
+bool create_file_cache(ah_file_cache* result_cache,
+                       ah_server* server,
+                       const char* root,
+                       uint32_t capacity,
+                       ah_on_file_open on_open,
+                       void* user_data)
+{
+  if (capacity > (UINT32_C(1) << 24)) {
+    return false;
+  }
+
+  uint32_t bucket_count = 1;
+  while (bucket_count < capacity) {
+    bucket_count <<= 1;
+  }
+
+  *result_cache = (ah_file_cache) {
+      .server = server,
+      .on_open = on_open,
+      .user_data = user_data,
+      .bucket_mask = bucket_count - 1,
+      .capacity = capacity,
+  };
+
+  if (!open_file_root(root, &result_cache->root)) {
+    return false;
+  }
+
+  result_cache->buckets = calloc(bucket_count, sizeof(ah_cached_file*));
+  result_cache->watches = calloc(bucket_count, sizeof(ah_cached_file*));
+  if (result_cache->buckets == NULL || result_cache->watches == NULL) {
+    goto fail;
+  }
+
+  /* Nothing is cached without a capacity, so there is nothing to watch */
+  if (capacity != 0) {
+    result_cache->watcher = create_file_watcher(
+        server, result_cache->root, on_file_change, result_cache);
+    if (result_cache->watcher == NULL) {
+      goto fail;
+    }
+  }
+
+  return true;
+
+fail:
+  free(result_cache->watches);
+  free(result_cache->buckets);
+  close_file_root(result_cache->root);
+  return false;
+}
+
+bool acquire_cached_file(ah_file_cache* cache,
+                         ah_io_buffer path,
+                         ah_cached_file** result_file,
+                         ah_error_code* error_code_out)
+{
+  *result_file = NULL;
+  if (!is_valid_path(path)) {
+    *error_code_out = AH_ERR_INVALID_ARGUMENT;
+    return true;
+  }
+
+  uint32_t hash = hash_path(path);
+  for (ah_cached_file* file = cache->buckets[hash & cache->bucket_mask];
+       file != NULL;
+       file = file->hash_next)
+  {
+    if (file->hash == hash && file->path_length == path.buffer_length
+        && memcmp(file->path, path.buffer, path.buffer_length) == 0)
+    {
+      touch_file(cache, file);
+      ++file->references;
+      *result_file = file;
+      *error_code_out = AH_ERR_OK;
+      return true;
+    }
+  }
+
+  ah_cached_file* file =
+      malloc(sizeof(ah_cached_file) + path.buffer_length + 1);
+  if (file == NULL) {
+    return false;
+  }
+
+  *file = (ah_cached_file) {
+      .cache = cache,
+      .watch = -1,
+      .hash = hash,
+      .references = 1,
+      .path_length = path.buffer_length,
+      .path = (char*)(file + 1),
+  };
+  memcpy(file->path, path.buffer, path.buffer_length);
+  file->path[path.buffer_length] = '\0';
+
+  ah_error_code error_code = open_cached_file(cache->root, file);
+  if (error_code != AH_ERR_OK) {
+    free(file);
+    *error_code_out = error_code;
+    return true;
+  }
+
+  if (cache->on_open != NULL && !cache->on_open(file, cache->user_data)) {
+    free_file(file);
+    return false;
+  }
+
+  /* A file that cannot be watched could go stale, so it is only used for the
+   * lookup that opened it */
+  if (cache->capacity != 0 && watch_cached_file(cache->watcher, file)) {
+    attach_file(cache, file);
+  }
+
+  *result_file = file;
+  *error_code_out = AH_ERR_OK;
+  return true;
+}
+
+void release_cached_file(ah_cached_file* file)
+{
+  if (--file->references == 0 && !file->cached) {
+    free_file(file);
+  }
+}
+
+void destroy_file_cache(ah_file_cache* cache)
+{
+  detach_every_file(cache);
+  if (cache->watcher != NULL) {
+    destroy_file_watcher(cache->watcher);
+  }
+
+  close_file_root(cache->root);
+  free(cache->watches);
+  free(cache->buckets);
+  *cache = (ah_file_cache) {0};
+}
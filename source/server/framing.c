@@ -0,0 +1,544 @@
+#include <string.h>
+
+#include "server/detail.h"
+
+/* Delimiters are found by comparing blocks of the input against both the first
+ * and the last byte of the delimiter, so only positions where both match need
+ * a full comparison. The widest implementation the CPU supports is picked at
+ * runtime when a framer is created. */
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) \
+    || defined(_M_IX86)
+#  define AH_FRAMING_X86 1
+#  include <immintrin.h>
+#  if defined(_MSC_VER) && !defined(__clang__)
+#    include <intrin.h>
+#    define AH_TARGET(isa)
+#  else
+#    define AH_TARGET(isa) __attribute__((target(isa)))
+#  endif
+#else
+#  define AH_FRAMING_X86 0
+#endif
+
+#define VARINT_MAX_LENGTH 5
+
+typedef enum frame_status
+{
+  FRAME_INCOMPLETE,
+  FRAME_COMPLETE,
+  FRAME_TOO_LONG,
+} frame_status;
+
+static const uint8_t* find_delimiter_scalar(const uint8_t* begin,
+                                            const uint8_t* end,
+                                            const uint8_t* delimiter,
+                                            uint32_t delimiter_length)
+{
+  while ((size_t)(end - begin) >= delimiter_length) {
+    size_t candidates = (size_t)(end - begin) - delimiter_length + 1;
+    const uint8_t* match = memchr(begin, delimiter[0], candidates);
+    if (match == NULL) {
+      return NULL;
+    }
+
+    if (memcmp(match + 1, delimiter + 1, delimiter_length - 1) == 0) {
+      return match;
+    }
+
+    begin = match + 1;
+  }
+
+  return NULL;
+}
+
+#if AH_FRAMING_X86
+
+static uint32_t lowest_bit(uint32_t mask)
+{
+#  if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (uint32_t)index;
+#  else
+  return (uint32_t)__builtin_ctz(mask);
+#  endif
+}
+
+/* The candidates of the mask are at block + bit, where the first byte of the
+ * delimiter and the last one of longer delimiters are already known to
+ * match */
+static const uint8_t* match_candidates(const uint8_t* block,
+                                       uint32_t mask,
+                                       const uint8_t* delimiter,
+                                       uint32_t delimiter_length)
+{
+  while (mask != 0) {
+    const uint8_t* candidate = block + lowest_bit(mask);
+    /* Line breaks are the common case, which saves calling memcmp */
+    bool matches = delimiter_length <= 2
+        ? candidate[delimiter_length - 1] == delimiter[delimiter_length - 1]
+        : memcmp(candidate + 1, delimiter + 1, delimiter_length - 2) == 0;
+    if (matches) {
+      return candidate;
+    }
+
+    mask &= mask - 1;
+  }
+
+  return NULL;
+}
+
+AH_TARGET("sse2")
+static const uint8_t* scan_sse2(const uint8_t* begin,
+                                const uint8_t* end,
+                                const uint8_t* delimiter,
+                                uint32_t delimiter_length,
+                                bool compare_last)
+{
+  __m128i first = _mm_set1_epi8((char)delimiter[0]);
+  __m128i last = _mm_set1_epi8((char)delimiter[delimiter_length - 1]);
+  uint32_t offset = delimiter_length - 1;
+  while ((size_t)(end - begin) >= 16 + offset) {
+    __m128i head = _mm_loadu_si128((const __m128i*)begin);
+    __m128i matches = _mm_cmpeq_epi8(head, first);
+    if (compare_last) {
+      __m128i tail = _mm_loadu_si128((const __m128i*)(begin + offset));
+      matches = _mm_and_si128(matches, _mm_cmpeq_epi8(tail, last));
+    }
+
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(matches);
+    const uint8_t* match =
+        match_candidates(begin, mask, delimiter, delimiter_length);
+    if (match != NULL) {
+      return match;
+    }
+
+    begin += 16;
+  }
+
+  return find_delimiter_scalar(begin, end, delimiter, delimiter_length);
+}
+
+/* The branches on the constant argument are gone after inlining, which leaves
+ * a separate loop for each kind of delimiter */
+AH_TARGET("sse2")
+static const uint8_t* find_delimiter_sse2(const uint8_t* begin,
+                                          const uint8_t* end,
+                                          const uint8_t* delimiter,
+                                          uint32_t delimiter_length)
+{
+  return delimiter_length > 2
+      ? scan_sse2(begin, end, delimiter, delimiter_length, true)
+      : scan_sse2(begin, end, delimiter, delimiter_length, false);
+}
+
+AH_TARGET("avx2")
+static uint32_t match_block_avx2(const uint8_t* block,
+                                 uint32_t offset,
+                                 bool compare_last,
+                                 __m256i first,
+                                 __m256i last)
+{
+  __m256i head = _mm256_loadu_si256((const __m256i*)block);
+  __m256i matches = _mm256_cmpeq_epi8(head, first);
+  if (compare_last) {
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(block + offset));
+    matches = _mm256_and_si256(matches, _mm256_cmpeq_epi8(tail, last));
+  }
+
+  return (uint32_t)_mm256_movemask_epi8(matches);
+}
+
+AH_TARGET("avx2")
+static const uint8_t* scan_avx2(const uint8_t* begin,
+                                const uint8_t* end,
+                                const uint8_t* delimiter,
+                                uint32_t delimiter_length,
+                                bool compare_last)
+{
+  __m256i first = _mm256_set1_epi8((char)delimiter[0]);
+  __m256i last = _mm256_set1_epi8((char)delimiter[delimiter_length - 1]);
+  uint32_t offset = delimiter_length - 1;
+
+  /* Two blocks are tested per iteration to halve the branches taken */
+  while ((size_t)(end - begin) >= 64 + offset) {
+    uint32_t low =
+        match_block_avx2(begin, offset, compare_last, first, last);
+    uint32_t high =
+        match_block_avx2(begin + 32, offset, compare_last, first, last);
+    if ((low | high) != 0) {
+      const uint8_t* match =
+          match_candidates(begin, low, delimiter, delimiter_length);
+      if (match == NULL) {
+        match =
+            match_candidates(begin + 32, high, delimiter, delimiter_length);
+      }
+      if (match != NULL) {
+        return match;
+      }
+    }
+
+    begin += 64;
+  }
+
+  return find_delimiter_sse2(begin, end, delimiter, delimiter_length);
+}
+
+AH_TARGET("avx2")
+static const uint8_t* find_delimiter_avx2(const uint8_t* begin,
+                                          const uint8_t* end,
+                                          const uint8_t* delimiter,
+                                          uint32_t delimiter_length)
+{
+  return delimiter_length > 2
+      ? scan_avx2(begin, end, delimiter, delimiter_length, true)
+      : scan_avx2(begin, end, delimiter, delimiter_length, false);
+}
+
+#  if defined(_MSC_VER) && !defined(__clang__)
+
+static bool cpu_has_sse2(void)
+{
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+}
+
+static bool cpu_has_avx2(void)
+{
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+
+  /* The OS must also save the upper halves of the YMM registers */
+  __cpuid(info, 1);
+  int osxsave_avx = (1 << 27) | (1 << 28);
+  if ((info[2] & osxsave_avx) != osxsave_avx || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+}
+
+#  else
+
+/* These check the OS support for the registers as well */
+
+static bool cpu_has_sse2(void)
+{
+  return __builtin_cpu_supports("sse2") != 0;
+}
+
+static bool cpu_has_avx2(void)
+{
+  return __builtin_cpu_supports("avx2") != 0;
+}
+
+#  endif
+
+static ah_delimiter_scanner select_scanner(const char** name_out)
+{
+  if (cpu_has_avx2()) {
+    *name_out = "avx2";
+    return find_delimiter_avx2;
+  }
+
+  if (cpu_has_sse2()) {
+    *name_out = "sse2";
+    return find_delimiter_sse2;
+  }
+
+  *name_out = "scalar";
+  return find_delimiter_scalar;
+}
+
+#else
+
+static ah_delimiter_scanner select_scanner(const char** name_out)
+{
+  *name_out = "scalar";
+  return find_delimiter_scalar;
+}
+
+#endif
+
+const char* framing_isa_name(void)
+{
+  const char* name;
+  select_scanner(&name);
+  return name;
+}
+
+static void init_framer(ah_framer* framer,
+                        ah_io_dock* dock,
+                        ah_ring* ring,
+                        uint32_t max_frame_length,
+                        uint32_t overhead,
+                        ah_on_frame on_frame,
+                        void* user_data)
+{
+  /* A frame that can't fit into the ring would never complete */
+  uint32_t limit = ring->capacity - overhead;
+  if (max_frame_length == 0 || max_frame_length > limit) {
+    max_frame_length = limit;
+  }
+
+  *framer = (ah_framer) {
+      .dock = dock,
+      .ring = ring,
+      .max_frame_length = max_frame_length,
+      .on_frame = on_frame,
+      .user_data = user_data,
+  };
+}
+
+bool create_delimited_framer(ah_framer* result_framer,
+                             ah_io_dock* dock,
+                             ah_ring* ring,
+                             ah_io_buffer delimiter,
+                             uint32_t max_frame_length,
+                             ah_on_frame on_frame,
+                             void* user_data)
+{
+  uint32_t length = delimiter.buffer_length;
+  if (length == 0 || length > AH_FRAME_MAX_DELIMITER
+      || ring->capacity <= length)
+  {
+    return false;
+  }
+
+  init_framer(result_framer,
+              dock,
+              ring,
+              max_frame_length,
+              length,
+              on_frame,
+              user_data);
+
+  const char* name;
+  result_framer->scanner = select_scanner(&name);
+  result_framer->delimiter_length = (uint8_t)length;
+  memcpy(result_framer->delimiter, delimiter.buffer, length);
+  return true;
+}
+
+bool create_length_prefixed_framer(ah_framer* result_framer,
+                                   ah_io_dock* dock,
+                                   ah_ring* ring,
+                                   uint8_t header_length,
+                                   uint32_t max_frame_length,
+                                   ah_on_frame on_frame,
+                                   void* user_data)
+{
+  if (header_length != 0 && header_length != 1 && header_length != 2
+      && header_length != 4)
+  {
+    return false;
+  }
+
+  uint32_t overhead = header_length == 0 ? VARINT_MAX_LENGTH : header_length;
+  if (ring->capacity <= overhead) {
+    return false;
+  }
+
+  init_framer(result_framer,
+              dock,
+              ring,
+              max_frame_length,
+              overhead,
+              on_frame,
+              user_data);
+  result_framer->header_length = header_length;
+  return true;
+}
+
+static frame_status find_delimited_frame(ah_framer* framer,
+                                         ah_io_buffer unread,
+                                         ah_io_buffer* frame_out,
+                                         uint32_t* span_out)
+{
+  const uint8_t* begin = unread.buffer;
+  const uint8_t* end = begin + unread.buffer_length;
+  const uint8_t* match = framer->scanner(begin + framer->scanned,
+                                         end,
+                                         framer->delimiter,
+                                         framer->delimiter_length);
+  if (match == NULL) {
+    /* The last bytes might be the start of a delimiter, so they are searched
+     * again once more bytes arrive */
+    uint32_t unsearched = framer->delimiter_length - 1U;
+    framer->scanned = unread.buffer_length > unsearched
+        ? unread.buffer_length - unsearched
+        : 0;
+    return framer->scanned > framer->max_frame_length ? FRAME_TOO_LONG
+                                                      : FRAME_INCOMPLETE;
+  }
+
+  uint32_t length = (uint32_t)(match - begin);
+  if (length > framer->max_frame_length) {
+    return FRAME_TOO_LONG;
+  }
+
+  *frame_out = (ah_io_buffer) {length, unread.buffer};
+  *span_out = length + framer->delimiter_length;
+  return FRAME_COMPLETE;
+}
+
+static frame_status read_varint(const uint8_t* bytes,
+                                uint32_t size,
+                                uint64_t* value_out,
+                                uint32_t* header_length_out)
+{
+  uint64_t value = 0;
+  for (uint32_t i = 0; i != VARINT_MAX_LENGTH; ++i) {
+    if (i == size) {
+      return FRAME_INCOMPLETE;
+    }
+
+    value |= (uint64_t)(bytes[i] & 0x7FU) << (7U * i);
+    if ((bytes[i] & 0x80U) == 0) {
+      *value_out = value;
+      *header_length_out = i + 1U;
+      return FRAME_COMPLETE;
+    }
+  }
+
+  return FRAME_TOO_LONG;
+}
+
+static frame_status find_length_prefixed_frame(ah_framer* framer,
+                                                ah_io_buffer unread,
+                                                ah_io_buffer* frame_out,
+                                                uint32_t* span_out)
+{
+  uint8_t* bytes = unread.buffer;
+  uint64_t length = 0;
+  uint32_t header_length = framer->header_length;
+  if (header_length == 0) {
+    frame_status status =
+        read_varint(bytes, unread.buffer_length, &length, &header_length);
+    if (status != FRAME_COMPLETE) {
+      return status;
+    }
+  } else {
+    if (unread.buffer_length < header_length) {
+      return FRAME_INCOMPLETE;
+    }
+
+    for (uint32_t i = 0; i != header_length; ++i) {
+      length = length << 8U | bytes[i];
+    }
+  }
+
+  if (length > framer->max_frame_length) {
+    return FRAME_TOO_LONG;
+  }
+
+  if (unread.buffer_length - header_length < length) {
+    return FRAME_INCOMPLETE;
+  }
+
+  *frame_out = (ah_io_buffer) {(uint32_t)length, bytes + header_length};
+  *span_out = header_length + (uint32_t)length;
+  return FRAME_COMPLETE;
+}
+
+static bool fail_framer(ah_framer* framer, ah_error_code error_code)
+{
+  framer->stopped = true;
+  return framer->on_frame(
+      error_code, framer, (ah_io_buffer) {0, NULL}, framer->user_data);
+}
+
+bool deliver_frames(ah_framer* framer)
+{
+  bool delimited = framer->delimiter_length != 0;
+  while (true) {
+    ah_io_buffer unread = ring_read_buffer(framer->ring);
+    ah_io_buffer frame;
+    uint32_t span;
+    frame_status status = delimited
+        ? find_delimited_frame(framer, unread, &frame, &span)
+        : find_length_prefixed_frame(framer, unread, &frame, &span);
+    if (status == FRAME_INCOMPLETE) {
+      return true;
+    }
+
+    if (status == FRAME_TOO_LONG) {
+      return fail_framer(framer, AH_ERR_MESSAGE_SIZE);
+    }
+
+    framer->scanned = 0;
+    bool result =
+        framer->on_frame(AH_ERR_OK, framer, frame, framer->user_data);
+    ring_consume(framer->ring, span);
+    if (!result || framer->stopped) {
+      return result;
+    }
+  }
+}
+
+static bool on_framer_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data);
+
+static bool queue_framer_read(ah_framer* framer)
+{
+  /* Frames are limited to the capacity of the ring, so this only happens if
+   * the ring was filled by other means */
+  ah_io_buffer free_space = ring_write_buffer(framer->ring);
+  if (free_space.buffer_length == 0) {
+    return fail_framer(framer, AH_ERR_MESSAGE_SIZE);
+  }
+
+  return queue_read_operation4(
+      framer->dock, free_space, on_framer_read, framer);
+}
+
+static bool on_framer_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data)
+{
+  (void)operation;
+
+  ah_framer* framer = per_call_data;
+  if (framer->stopped) {
+    return true;
+  }
+
+  if (error_code != AH_ERR_OK) {
+    return fail_framer(framer, error_code);
+  }
+
+  if (bytes_transferred == 0) {
+    return fail_framer(framer, AH_ERR_SHUT_DOWN);
+  }
+
+  ring_produce(framer->ring, bytes_transferred);
+  if (!deliver_frames(framer)) {
+    return false;
+  }
+
+  return framer->stopped || queue_framer_read(framer);
+}
+
+bool start_framer(ah_framer* framer)
+{
+  framer->stopped = false;
+  if (!deliver_frames(framer)) {
+    return false;
+  }
+
+  return framer->stopped || queue_framer_read(framer);
+}
+
+void stop_framer(ah_framer* framer)
+{
+  framer->stopped = true;
+}
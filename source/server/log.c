@@ -0,0 +1,476 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/detail.h"
+
+/* Every thread that logs in a deferred mode gets its own single producer,
+ * single consumer ring of variable length records. The rings are pushed onto
+ * a global list the first time a thread logs. Only one thread consumes at a
+ * time, which is ensured by a flag that consumers try to take, so the
+ * consumer can walk the list without locking. A thread marks its ring as
+ * exited when it exits, and the consumer unlinks and frees the ring after
+ * draining it. Producers only ever touch the head of the list. */
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#  include <intrin.h>
+
+#  define AH_THREAD_LOCAL __declspec(thread)
+
+typedef volatile long atomic_position;
+typedef volatile long atomic_flag_value;
+typedef volatile __int64 atomic_counter;
+typedef void* volatile atomic_pointer;
+
+static uint32_t load_position(atomic_position* position)
+{
+  return (uint32_t)_InterlockedCompareExchange(position, 0, 0);
+}
+
+static void store_position(atomic_position* position, uint32_t value)
+{
+  _InterlockedExchange(position, (long)value);
+}
+
+static int exchange_flag(atomic_flag_value* flag, int value)
+{
+  return (int)_InterlockedExchange(flag, value);
+}
+
+static int load_flag(atomic_flag_value* flag)
+{
+  return (int)_InterlockedCompareExchange(flag, 0, 0);
+}
+
+static void increment_counter(atomic_counter* counter)
+{
+  __int64 value = *counter;
+  while (1) {
+    __int64 previous = _InterlockedCompareExchange64(counter, value + 1, value);
+    if (previous == value) {
+      break;
+    }
+    value = previous;
+  }
+}
+
+static uint64_t load_counter(atomic_counter* counter)
+{
+  return (uint64_t)_InterlockedCompareExchange64(counter, 0, 0);
+}
+
+static void* load_pointer(atomic_pointer* pointer)
+{
+  return _InterlockedCompareExchangePointer(pointer, NULL, NULL);
+}
+
+static bool compare_exchange_pointer(atomic_pointer* pointer,
+                                     void* expected,
+                                     void* desired)
+{
+  return _InterlockedCompareExchangePointer(pointer, desired, expected)
+      == expected;
+}
+
+#else
+#  include <stdatomic.h>
+
+#  define AH_THREAD_LOCAL _Thread_local
+
+typedef _Atomic uint32_t atomic_position;
+typedef atomic_int atomic_flag_value;
+typedef _Atomic uint64_t atomic_counter;
+typedef _Atomic(void*) atomic_pointer;
+
+static uint32_t load_position(atomic_position* position)
+{
+  return atomic_load_explicit(position, memory_order_acquire);
+}
+
+static void store_position(atomic_position* position, uint32_t value)
+{
+  atomic_store_explicit(position, value, memory_order_release);
+}
+
+static int exchange_flag(atomic_flag_value* flag, int value)
+{
+  return atomic_exchange_explicit(flag, value, memory_order_acq_rel);
+}
+
+static int load_flag(atomic_flag_value* flag)
+{
+  return atomic_load_explicit(flag, memory_order_acquire);
+}
+
+static void increment_counter(atomic_counter* counter)
+{
+  atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static uint64_t load_counter(atomic_counter* counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void* load_pointer(atomic_pointer* pointer)
+{
+  return atomic_load_explicit(pointer, memory_order_acquire);
+}
+
+static bool compare_exchange_pointer(atomic_pointer* pointer,
+                                     void* expected,
+                                     void* desired)
+{
+  return atomic_compare_exchange_strong_explicit(
+      pointer, &expected, desired, memory_order_acq_rel, memory_order_acquire);
+}
+
+#endif
+
+#define LOG_RING_SIZE (64U * 1024U)
+#define LOG_RING_MASK (LOG_RING_SIZE - 1U)
+#define LOG_ALIGNMENT 8U
+#define LOG_MAX_CHUNK 4096U
+#define LOG_MAX_FUNCTION_NAME 128U
+#define LOG_FLUSH_INTERVAL_MS 5
+
+enum
+{
+  LOG_PADDING,
+  LOG_TEXT,
+  LOG_BYTES,
+  LOG_ERROR,
+  LOG_ERROR_TEXT,
+};
+
+typedef struct log_record {
+  uint32_t size;
+  uint32_t kind;
+} log_record;
+
+typedef struct log_ring {
+  struct log_ring* next;
+  ah_thread_exit exit_hook;
+  atomic_flag_value exited;
+  atomic_position head;
+  atomic_position tail;
+  _Alignas(LOG_ALIGNMENT) uint8_t data[LOG_RING_SIZE];
+} log_ring;
+
+static atomic_flag_value log_mode;
+static atomic_flag_value log_flushing;
+static atomic_flag_value log_stop_requested;
+static atomic_counter log_dropped;
+static atomic_pointer log_rings;
+static void* log_thread;
+
+static AH_THREAD_LOCAL log_ring* thread_ring;
+
+static uint32_t record_span(uint32_t size)
+{
+  uint32_t span = (uint32_t)sizeof(log_record) + size;
+  return (span + LOG_ALIGNMENT - 1U) & ~(LOG_ALIGNMENT - 1U);
+}
+
+/* Runs on the exiting thread, after which it never pushes to the ring */
+static void release_thread_ring(void* argument)
+{
+  log_ring* ring = argument;
+  thread_ring = NULL;
+  exchange_flag(&ring->exited, 1);
+}
+
+static log_ring* ring_for_thread(void)
+{
+  log_ring* ring = thread_ring;
+  if (ring != NULL) {
+    return ring;
+  }
+
+  ring = calloc(1, sizeof(log_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  /* If the exit of the thread cannot be hooked, the ring stays for the
+   * lifetime of the process */
+  ring->exit_hook = (ah_thread_exit) {release_thread_ring, ring};
+  (void)call_at_thread_exit(&ring->exit_hook);
+
+  do {
+    ring->next = load_pointer(&log_rings);
+  } while (!compare_exchange_pointer(&log_rings, ring->next, ring));
+
+  thread_ring = ring;
+  return ring;
+}
+
+static void write_header(log_ring* ring,
+                         uint32_t offset,
+                         uint32_t kind,
+                         uint32_t size)
+{
+  log_record record = {size, kind};
+  memcpy(&ring->data[offset], &record, sizeof(log_record));
+}
+
+static void push_record(uint32_t kind,
+                        const void* prefix,
+                        uint32_t prefix_size,
+                        const void* data,
+                        uint32_t size)
+{
+  log_ring* ring = ring_for_thread();
+  if (ring == NULL) {
+    increment_counter(&log_dropped);
+    return;
+  }
+
+  /* Only this thread moves the head, so its own view of it is current */
+  uint32_t head = load_position(&ring->head);
+  uint32_t tail = load_position(&ring->tail);
+  uint32_t span = record_span(prefix_size + size);
+  uint32_t offset = head & LOG_RING_MASK;
+  uint32_t contiguous = LOG_RING_SIZE - offset;
+  uint32_t padding = contiguous < span ? contiguous : 0;
+  if (span + padding > LOG_RING_SIZE - (head - tail)) {
+    increment_counter(&log_dropped);
+    return;
+  }
+
+  /* Records are never split, so the end of the ring is skipped if the record
+   * would not fit there */
+  if (padding != 0) {
+    write_header(
+        ring, offset, LOG_PADDING, padding - (uint32_t)sizeof(log_record));
+    offset = 0;
+  }
+
+  write_header(ring, offset, kind, prefix_size + size);
+  uint8_t* payload = &ring->data[offset + sizeof(log_record)];
+  if (prefix_size != 0) {
+    memcpy(payload, prefix, prefix_size);
+  }
+  memcpy(payload + prefix_size, data, size);
+
+  store_position(&ring->head, head + padding + span);
+}
+
+static bool drain_ring(log_ring* ring)
+{
+  uint32_t tail = load_position(&ring->tail);
+  uint32_t head = load_position(&ring->head);
+  bool wrote_output = tail != head;
+  while (tail != head) {
+    uint32_t offset = tail & LOG_RING_MASK;
+    log_record record;
+    memcpy(&record, &ring->data[offset], sizeof(log_record));
+    const uint8_t* payload = &ring->data[offset + sizeof(log_record)];
+
+    if (record.kind == LOG_TEXT || record.kind == LOG_BYTES) {
+      fwrite(payload, 1, record.size, stdout);
+    } else if (record.kind == LOG_ERROR) {
+      int error_code;
+      memcpy(&error_code, payload, sizeof(int));
+      write_error_message((const char*)payload + sizeof(int), error_code);
+    } else if (record.kind == LOG_ERROR_TEXT) {
+      fwrite(payload, 1, record.size, stderr);
+    }
+
+    tail += record_span(record.size);
+    store_position(&ring->tail, tail);
+  }
+
+  return wrote_output;
+}
+
+/* The head of the list may have moved on since the walk started, in which
+ * case the ring is left for the next flush */
+static bool unlink_ring(log_ring* previous, log_ring* ring)
+{
+  if (previous != NULL) {
+    previous->next = ring->next;
+    return true;
+  }
+
+  return compare_exchange_pointer(&log_rings, ring, ring->next);
+}
+
+static bool flush_rings(bool wait)
+{
+  while (exchange_flag(&log_flushing, 1) != 0) {
+    if (!wait) {
+      return false;
+    }
+    sleep_ms(1);
+  }
+
+  /* The flag is read before draining, so everything the thread logged
+   * before it exited is written out */
+  bool wrote_output = false;
+  log_ring* previous = NULL;
+  log_ring* ring = load_pointer(&log_rings);
+  while (ring != NULL) {
+    log_ring* next = ring->next;
+    bool exited = load_flag(&ring->exited) != 0;
+    wrote_output = drain_ring(ring) || wrote_output;
+    if (exited && unlink_ring(previous, ring)) {
+      free(ring);
+    } else {
+      previous = ring;
+    }
+    ring = next;
+  }
+
+  if (wrote_output) {
+    fflush(stdout);
+  }
+
+  exchange_flag(&log_flushing, 0);
+  return wrote_output;
+}
+
+static void log_thread_main(void* argument)
+{
+  (void)argument;
+
+  while (load_flag(&log_stop_requested) == 0) {
+    if (!flush_rings(false)) {
+      sleep_ms(LOG_FLUSH_INTERVAL_MS);
+    }
+  }
+}
+
+bool ah_log_start(ah_log_mode mode)
+{
+  if (mode == AH_LOG_SYNCHRONOUS) {
+    ah_log_stop();
+    return true;
+  }
+
+  if (load_flag(&log_mode) != AH_LOG_SYNCHRONOUS) {
+    return false;
+  }
+
+  if (mode == AH_LOG_BACKGROUND) {
+    exchange_flag(&log_stop_requested, 0);
+    if (!start_thread(log_thread_main, NULL, &log_thread)) {
+      return false;
+    }
+  }
+
+  exchange_flag(&log_mode, (int)mode);
+  return true;
+}
+
+void ah_log_stop(void)
+{
+  int mode = exchange_flag(&log_mode, AH_LOG_SYNCHRONOUS);
+  if (mode == AH_LOG_BACKGROUND) {
+    exchange_flag(&log_stop_requested, 1);
+    join_thread(log_thread);
+    log_thread = NULL;
+  }
+
+  flush_rings(true);
+}
+
+void ah_log_flush(void)
+{
+  flush_rings(false);
+}
+
+void flush_log_from_event_loop(void)
+{
+  if (load_flag(&log_mode) == AH_LOG_EVENT_LOOP) {
+    flush_rings(false);
+  }
+}
+
+uint64_t ah_log_dropped(void)
+{
+  return load_counter(&log_dropped);
+}
+
+void ah_log(const char* format, ...)
+{
+  va_list arguments;
+  va_start(arguments, format);
+  if (load_flag(&log_mode) == AH_LOG_SYNCHRONOUS) {
+    vfprintf(stdout, format, arguments);
+    va_end(arguments);
+    return;
+  }
+
+  char message[AH_LOG_MAX_MESSAGE];
+  int length = vsnprintf(message, sizeof(message), format, arguments);
+  va_end(arguments);
+  if (length < 0) {
+    return;
+  }
+
+  uint32_t size = (size_t)length < sizeof(message)
+      ? (uint32_t)length
+      : (uint32_t)sizeof(message) - 1U;
+  push_record(LOG_TEXT, NULL, 0, message, size);
+}
+
+void ah_log_bytes(const void* data, size_t size)
+{
+  if (load_flag(&log_mode) == AH_LOG_SYNCHRONOUS) {
+    fwrite(data, 1, size, stdout);
+    return;
+  }
+
+  /* Large writes are split, so a record never takes up a big part of the
+   * ring */
+  const uint8_t* bytes = data;
+  while (size != 0) {
+    uint32_t chunk = size < LOG_MAX_CHUNK ? (uint32_t)size : LOG_MAX_CHUNK;
+    push_record(LOG_BYTES, NULL, 0, bytes, chunk);
+    bytes += chunk;
+    size -= chunk;
+  }
+}
+
+void ah_log_error(const char* function, int error_code)
+{
+  if (load_flag(&log_mode) == AH_LOG_SYNCHRONOUS) {
+    write_error_message(function, error_code);
+    return;
+  }
+
+  char name[LOG_MAX_FUNCTION_NAME];
+  size_t length = strlen(function);
+  if (length >= sizeof(name)) {
+    length = sizeof(name) - 1;
+  }
+  memcpy(name, function, length);
+  name[length] = '\0';
+
+  push_record(LOG_ERROR,
+              &error_code,
+              (uint32_t)sizeof(int),
+              name,
+              (uint32_t)length + 1U);
+}
+
+void ah_log_error_message(const char* function, const char* message)
+{
+  if (load_flag(&log_mode) == AH_LOG_SYNCHRONOUS) {
+    fprintf(stderr, "%s: %s\n", function, message);
+    return;
+  }
+
+  char text[AH_LOG_MAX_MESSAGE];
+  int length = snprintf(text, sizeof(text), "%s: %s\n", function, message);
+  if (length < 0) {
+    return;
+  }
+
+  uint32_t size = (size_t)length < sizeof(text)
+      ? (uint32_t)length
+      : (uint32_t)sizeof(text) - 1U;
+  push_record(LOG_ERROR_TEXT, NULL, 0, text, size);
+}
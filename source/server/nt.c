@@ -1,6 +1,11 @@
 #include <WinSock2.h>
+#include <WS2tcpip.h>
 #include <assert.h>
+#include <limits.h>
+#include <mstcpip.h>
+#include <process.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <wctype.h>
 
@@ -20,7 +25,7 @@ static void wide_trim_end(const wchar_t* begin, wchar_t* end)
   }
 }
 
-static void print_error(const char* function, int error_code)
+void write_error_message(const char* function, int error_code)
 {
   wchar_t error_message[ERROR_MESSAGE_SIZE];
   error_message[0] = L'\0';
@@ -49,6 +54,7 @@ static void print_error(const char* function, int error_code)
 /* Server creation */
 
 typedef struct ah_server {
+  ah_server_core core;
   bool server_started;
   HANDLE completion_port;
   ah_socket_span socket_span;
@@ -69,6 +75,96 @@ size_t server_alignment()
   return _Alignof(ah_server);
 }
 
+ah_server_core* core_from_server(ah_server* server)
+{
+  return &server->core;
+}
+
+uint64_t monotonic_time_ms()
+{
+  return GetTickCount64();
+}
+
+typedef struct thread_start {
+  ah_thread_function function;
+  void* argument;
+} thread_start;
+
+static unsigned __stdcall thread_entry(void* argument)
+{
+  thread_start start = *(thread_start*)argument;
+  free(argument);
+  start.function(start.argument);
+  return 0;
+}
+
+bool start_thread(ah_thread_function function,
+                  void* argument,
+                  void** result_handle)
+{
+  thread_start* start = malloc(sizeof(thread_start));
+  if (start == NULL) {
+    return false;
+  }
+
+  *start = (thread_start) {function, argument};
+  uintptr_t handle = _beginthreadex(NULL, 0, thread_entry, start, 0, NULL);
+  if (handle == 0) {
+    ah_log_error("_beginthreadex", (int)GetLastError());
+    free(start);
+    return false;
+  }
+
+  *result_handle = (void*)handle;
+  return true;
+}
+
+void join_thread(void* handle)
+{
+  if (WaitForSingleObject(handle, INFINITE) == WAIT_FAILED) {
+    ah_log_error("WaitForSingleObject", (int)GetLastError());
+  }
+  if (CloseHandle(handle) == FALSE) {
+    ah_log_error("CloseHandle", (int)GetLastError());
+  }
+}
+
+static INIT_ONCE thread_exit_once = INIT_ONCE_STATIC_INIT;
+static DWORD thread_exit_index = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI run_thread_exit(PVOID value)
+{
+  ah_thread_exit* hook = value;
+  if (hook != NULL) {
+    hook->function(hook->argument);
+  }
+}
+
+static BOOL CALLBACK allocate_thread_exit_index(PINIT_ONCE once,
+                                                PVOID parameter,
+                                                PVOID* context)
+{
+  (void)once;
+  (void)parameter;
+  (void)context;
+
+  thread_exit_index = FlsAlloc(run_thread_exit);
+  return thread_exit_index != FLS_OUT_OF_INDEXES;
+}
+
+bool call_at_thread_exit(ah_thread_exit* hook)
+{
+  return InitOnceExecuteOnce(
+             &thread_exit_once, allocate_thread_exit_index, NULL, NULL)
+      != FALSE
+      && FlsSetValue(thread_exit_index, hook) != FALSE;
+}
+
+void sleep_ms(uint32_t milliseconds)
+{
+  Sleep(milliseconds);
+}
+
 static ah_server_slot startup(ah_server_slot slot)
 {
   if (!slot.ok) {
@@ -78,7 +174,7 @@ static ah_server_slot startup(ah_server_slot slot)
   WSADATA wsa_data;
   int startup_result = WSAStartup(MAKEWORD(2, 2), &wsa_data);
   if (startup_result != 0) {
-    print_error("WSAStartup", startup_result);
+    ah_log_error("WSAStartup", startup_result);
     slot.ok = false;
   } else {
     slot.server.server_started = true;
@@ -108,7 +204,7 @@ static ah_server_slot create_completion_port(ah_server_slot slot)
   HANDLE completion_port =
       CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
   if (completion_port == NULL) {
-    print_error("CreateIoCompletionPort", (int)GetLastError());
+    ah_log_error("CreateIoCompletionPort", (int)GetLastError());
     slot.ok = false;
   } else {
     slot.server.completion_port = completion_port;
@@ -183,17 +279,20 @@ size_t socket_alignment()
 }
 
 static ah_socket_slot create_unbound_socket(ah_socket_slot slot,
+                                            int family,
+                                            int type,
                                             int* error_code)
 {
   if (!slot.ok) {
     return slot;
   }
 
-  SOCKET unbound_socket = WSASocket(
-      AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+  int protocol = type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP;
+  SOCKET unbound_socket =
+      WSASocket(family, type, protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
   if (unbound_socket == INVALID_SOCKET) {
     if (error_code == NULL) {
-      print_error("WSASocket", WSAGetLastError());
+      ah_log_error("WSASocket", WSAGetLastError());
     } else {
       *error_code = WSAGetLastError();
     }
@@ -223,7 +322,7 @@ static ah_socket_slot register_socket(ah_socket_slot slot,
   HANDLE result = CreateIoCompletionPort(socket_handle, completion_port, 0, 0);
   if (result == NULL) {
     if (error_code == NULL) {
-      print_error("CreateIoCompletionPort", (int)GetLastError());
+      ah_log_error("CreateIoCompletionPort", (int)GetLastError());
     } else {
       *error_code = (int)GetLastError();
     }
@@ -247,28 +346,134 @@ static ah_socket_slot socket_enable_address_reuse(ah_socket_slot slot)
                           (const char*)&enable,
                           sizeof(enable));
   if (result == SOCKET_ERROR) {
-    print_error("setsockopt", WSAGetLastError());
+    ah_log_error("setsockopt", WSAGetLastError());
     slot.ok = false;
   }
 
   return slot;
 }
 
-static ah_socket_slot bind_socket(ah_socket_slot slot, uint16_t port)
+/* IPv4 addresses are written in the IPv4-mapped form for IPv6 sockets and
+ * IPv4-mapped ones as plain IPv4 for the others. Returns 0 for addresses
+ * without a family. */
+static int sockaddr_from_address(const ah_address* address,
+                                 bool ipv6_socket,
+                                 struct sockaddr_storage* result)
+{
+  memset(result, 0, sizeof(*result));
+  if (address->family == AH_ADDRESS_NONE) {
+    return 0;
+  }
+
+  ah_ipv4_address ipv4;
+  bool is_ipv4 = ipv4_from_address(address, &ipv4);
+  if (is_ipv4 && !ipv6_socket) {
+    struct sockaddr_in* ipv4_result = (struct sockaddr_in*)result;
+    ipv4_result->sin_family = AF_INET;
+    memcpy(&ipv4_result->sin_addr, ipv4.address, sizeof(ipv4.address));
+    memcpy(&ipv4_result->sin_port, address->port, sizeof(address->port));
+    return sizeof(*ipv4_result);
+  }
+
+  struct sockaddr_in6* ipv6_result = (struct sockaddr_in6*)result;
+  ipv6_result->sin6_family = AF_INET6;
+  uint8_t* bytes = ipv6_result->sin6_addr.s6_addr;
+  if (address->family == AH_ADDRESS_IPV4) {
+    bytes[10] = 0xFF;
+    bytes[11] = 0xFF;
+    memcpy(bytes + 12, ipv4.address, sizeof(ipv4.address));
+  } else {
+    memcpy(bytes, address->bytes, sizeof(address->bytes));
+  }
+  memcpy(&ipv6_result->sin6_port, address->port, sizeof(address->port));
+  return sizeof(*ipv6_result);
+}
+
+static ah_address address_from_sockaddr(const struct sockaddr* address)
+{
+  ah_address result = {0};
+  if (address->sa_family == AF_INET) {
+    const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)address;
+    memcpy(result.bytes, &ipv4->sin_addr, sizeof(ipv4->sin_addr));
+    memcpy(result.port, &ipv4->sin_port, sizeof(result.port));
+    result.family = AH_ADDRESS_IPV4;
+  } else if (address->sa_family == AF_INET6) {
+    const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*)address;
+    memcpy(result.bytes, &ipv6->sin6_addr, sizeof(result.bytes));
+    memcpy(result.port, &ipv6->sin6_port, sizeof(result.port));
+    result.family = AH_ADDRESS_IPV6;
+  }
+
+  return result;
+}
+
+static ah_socket_slot bind_socket_to_sockaddr(ah_socket_slot slot,
+                                              const void* address,
+                                              int address_length)
 {
   if (!slot.ok) {
     return slot;
   }
 
+  if (bind(slot.socket.socket, address, address_length) == SOCKET_ERROR) {
+    ah_log_error("bind", WSAGetLastError());
+    slot.ok = false;
+  }
+
+  return slot;
+}
+
+/* Binds to every interface of the family the socket was created with */
+static ah_socket_slot bind_socket(ah_socket_slot slot,
+                                  int family,
+                                  uint16_t port)
+{
+  if (family == AF_INET6) {
+    struct sockaddr_in6 address = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = IN6ADDR_ANY_INIT,
+    };
+    return bind_socket_to_sockaddr(slot, &address, sizeof(address));
+  }
+
   struct sockaddr_in address = {
       .sin_family = AF_INET,
       .sin_port = htons(port),
       .sin_addr = {.s_addr = htonl(INADDR_ANY)},
   };
-  int result = bind(
-      slot.socket.socket, (const struct sockaddr*)&address, sizeof(address));
+  return bind_socket_to_sockaddr(slot, &address, sizeof(address));
+}
+
+/* IPv4 peers are accepted as IPv4-mapped addresses, so one socket serves
+ * both families, unless the system has no IPv6 stack */
+static ah_socket_slot create_dual_stack_socket(ah_socket_slot slot,
+                                               int type,
+                                               int* family)
+{
+  int error_code = 0;
+  *family = AF_INET6;
+  slot = create_unbound_socket(slot, AF_INET6, type, &error_code);
+  if (error_code == WSAEAFNOSUPPORT) {
+    *family = AF_INET;
+    slot.ok = true;
+    return create_unbound_socket(slot, AF_INET, type, NULL);
+  }
+  if (error_code != 0) {
+    ah_log_error("WSASocket", error_code);
+  }
+  if (!slot.ok) {
+    return slot;
+  }
+
+  DWORD disable = FALSE;
+  int result = setsockopt(slot.socket.socket,
+                          IPPROTO_IPV6,
+                          IPV6_V6ONLY,
+                          (const char*)&disable,
+                          sizeof(disable));
   if (result == SOCKET_ERROR) {
-    print_error("bind", WSAGetLastError());
+    ah_log_error("setsockopt", WSAGetLastError());
     slot.ok = false;
   }
 
@@ -282,7 +487,7 @@ static ah_socket_slot listen_on_socket(ah_socket_slot slot)
   }
 
   if (listen(slot.socket.socket, SOMAXCONN) == SOCKET_ERROR) {
-    print_error("listen", WSAGetLastError());
+    ah_log_error("listen", WSAGetLastError());
     slot.ok = false;
   }
 
@@ -296,17 +501,30 @@ static ah_socket make_socket(ah_context* context)
 
 bool create_socket(ah_socket* result_socket, ah_context* context, uint16_t port)
 {
+  int family;
   ah_socket_slot slot = {true, make_socket(context)};
-  slot = create_unbound_socket(slot, NULL);
+  slot = create_dual_stack_socket(slot, SOCK_STREAM, &family);
   slot = register_socket(slot, context, NULL);
   slot = socket_enable_address_reuse(slot);
-  slot = bind_socket(slot, port);
+  slot = bind_socket(slot, family, port);
   slot = listen_on_socket(slot);
 
   memcpy(result_socket, &slot.socket, socket_size());
   return slot.ok;
 }
 
+/* Windows only reports the process ID of the peer of a Unix domain socket, so
+ * listening on them is only supported by the POSIX implementation */
+bool create_unix_socket(ah_socket* result_socket,
+                        ah_context* context,
+                        const char* path)
+{
+  (void)path;
+
+  *result_socket = make_socket(context);
+  return false;
+}
+
 /* Server destruction */
 
 bool destroy_server(ah_server* server)
@@ -321,12 +539,12 @@ bool destroy_server(ah_server* server)
   if (server->completion_port != INVALID_HANDLE_VALUE
       && CloseHandle(server->completion_port) == 0)
   {
-    print_error("CloseHandle", (int)GetLastError());
+    ah_log_error("CloseHandle", (int)GetLastError());
     result = false;
   }
 
   if (server->server_started && WSACleanup() == SOCKET_ERROR) {
-    print_error("WSACleanup", WSAGetLastError());
+    ah_log_error("WSACleanup", WSAGetLastError());
     result = false;
   }
 
@@ -356,7 +574,7 @@ bool destroy_socket_base(ah_socket* socket)
   }
 
   if (closesocket(socket->socket) == SOCKET_ERROR) {
-    print_error("closesocket", WSAGetLastError());
+    ah_log_error("closesocket", WSAGetLastError());
     return false;
   }
 
@@ -369,14 +587,105 @@ bool destroy_socket_accepted(ah_socket_accepted* socket)
   return destroy_socket_base((ah_socket*)socket);
 }
 
+/* Socket options */
+
+bool enable_rx_timestamps(ah_socket_accepted* socket)
+{
+  (void)socket;
+
+  ah_log_error("enable_rx_timestamps", WSAEOPNOTSUPP);
+  return false;
+}
+
+bool enable_kernel_tls(ah_socket_accepted* socket, const ah_tls_keys* keys)
+{
+  (void)socket;
+  (void)keys;
+
+  return false;
+}
+
+bool tcp_info_from_socket(ah_socket_accepted* socket, ah_tcp_info* result_info)
+{
+  DWORD version = 0;
+  TCP_INFO_v0 info;
+  DWORD bytes_returned;
+  int result = WSAIoctl(((ah_socket*)socket)->socket,
+                        SIO_TCP_INFO,
+                        &version,
+                        sizeof(version),
+                        &info,
+                        sizeof(info),
+                        &bytes_returned,
+                        NULL,
+                        NULL);
+  if (result == SOCKET_ERROR) {
+    ah_log_error("WSAIoctl", WSAGetLastError());
+    return false;
+  }
+
+  /* Windows reports these in bytes, so they are converted to segments to
+   * match the other platforms */
+  ULONG mss = info.Mss == 0 ? 1 : info.Mss;
+  *result_info = (ah_tcp_info) {
+      info.RttUs,
+      0,
+      info.Mss,
+      info.Cwnd / mss,
+      info.BytesInFlight / mss,
+      (uint32_t)(info.BytesRetrans / mss),
+      0,
+  };
+  return true;
+}
+
+bool peer_credentials_from_socket(ah_socket* socket,
+                                  ah_peer_credentials* result_credentials)
+{
+  (void)socket;
+  (void)result_credentials;
+
+  return false;
+}
+
+bool local_address_from_socket(ah_socket* socket, ah_address* result_address)
+{
+  SOCKADDR_STORAGE address;
+  int length = sizeof(address);
+  if (getsockname(socket->socket, (struct sockaddr*)&address, &length)
+      == SOCKET_ERROR)
+  {
+    ah_log_error("getsockname", WSAGetLastError());
+    return false;
+  }
+
+  *result_address = address_from_sockaddr((struct sockaddr*)&address);
+  return true;
+}
+
+bool is_idle_socket_usable(ah_socket_accepted* socket)
+{
+  /* An idle connection is not expected to become readable, so anything that
+   * wakes up a poll, be it data, an end of file or an error, rules it out */
+  WSAPOLLFD descriptor = {((ah_socket*)socket)->socket, POLLRDNORM, 0};
+  int result = WSAPoll(&descriptor, 1, 0);
+  if (result == SOCKET_ERROR) {
+    ah_log_error("WSAPoll", WSAGetLastError());
+  }
+
+  return result == 0;
+}
+
 /* Acceptor creation */
 
-#define ADDRESS_LENGTH ((DWORD)(sizeof(SOCKADDR_IN) + 16))
+/* Big enough for the addresses of either family */
+#define ADDRESS_LENGTH ((DWORD)(sizeof(SOCKADDR_IN6) + 16))
 
 typedef struct ah_acceptor {
   ah_overlapped_base base;
   ah_socket listening_socket;
   ah_on_accept on_accept;
+  int family;
   ah_socket socket;
   uint8_t output_buffer[ADDRESS_LENGTH * 2];
 } ah_acceptor;
@@ -400,8 +709,9 @@ static bool accept_on_error(ah_acceptor* acceptor, int error_code)
 {
   ah_context* context = acceptor->listening_socket.context;
   ah_socket_slot slot = {false, make_socket(context)};
+  ah_address address = {0};
   return acceptor->on_accept(
-      (ah_error_code)error_code, &slot.socket, (ah_ipv4_address) {0});
+      (ah_error_code)error_code, &slot.socket, &address);
 }
 
 static bool accept_error_handler(ah_acceptor* acceptor,
@@ -412,7 +722,7 @@ static bool accept_error_handler(ah_acceptor* acceptor,
     return accept_on_error(acceptor, error_code);
   }
 
-  print_error(function, error_code);
+  ah_log_error(function, error_code);
   return false;
 }
 
@@ -446,28 +756,21 @@ static bool accept_handler(LPOVERLAPPED overlapped)
     acceptor->socket = slot.socket;
   }
 
-  LPSOCKADDR_IN local_address;
+  LPSOCKADDR local_address;
   int local_address_length;
-  LPSOCKADDR_IN remote_address;
+  LPSOCKADDR remote_address;
   int remote_address_length;
   GetAcceptExSockaddrs(acceptor->output_buffer,
                        0,
                        ADDRESS_LENGTH,
                        ADDRESS_LENGTH,
-                       (LPSOCKADDR*)&local_address,
+                       &local_address,
                        &local_address_length,
-                       (LPSOCKADDR*)&remote_address,
+                       &remote_address,
                        &remote_address_length);
-  uint32_t address_raw = ntohl(remote_address->sin_addr.s_addr);
-  ah_ipv4_address address = {
-      {address_raw >> 24 & 0xFF,
-       address_raw >> 16 & 0xFF,
-       address_raw >> 8 & 0xFF,
-       address_raw & 0xFF},
-      ntohs(remote_address->sin_port),
-  };
+  ah_address address = address_from_sockaddr(remote_address);
   ah_socket_slot slot = {true, acceptor->socket};
-  bool result = acceptor->on_accept(AH_ERR_OK, &slot.socket, address);
+  bool result = acceptor->on_accept(AH_ERR_OK, &slot.socket, &address);
   /* If ownership of the socket wasn't taken by the handler, then it gets
    * destroyed */
   if (slot.ok) {
@@ -481,7 +784,7 @@ static bool queue_overlapped(HANDLE completion_port, LPOVERLAPPED overlapped)
 {
   BOOL result = PostQueuedCompletionStatus(completion_port, 0, 0, overlapped);
   if (result == FALSE) {
-    print_error("PostQueuedCompletionStatus", (int)GetLastError());
+    ah_log_error("PostQueuedCompletionStatus", (int)GetLastError());
     return false;
   }
 
@@ -504,7 +807,10 @@ static bool do_accept(LPOVERLAPPED overlapped)
   {
     int error_code;
     ah_socket_slot slot = create_unbound_socket(
-        (ah_socket_slot) {true, make_socket(context)}, &error_code);
+        (ah_socket_slot) {true, make_socket(context)},
+        acceptor->family,
+        SOCK_STREAM,
+        &error_code);
     if (!slot.ok) {
       bool result = destroy_socket(&slot.socket);
       result =
@@ -528,14 +834,15 @@ static bool do_accept(LPOVERLAPPED overlapped)
     int error_code = map_error_code(WSAGetLastError());
     if (error_code != ERROR_IO_PENDING) {
       if (!is_ah_error_code(error_code)) {
-        print_error("AcceptEx", error_code);
+        ah_log_error("AcceptEx", error_code);
         destroy_socket(&acceptor->socket);
         return false;
       }
 
       ah_socket_slot slot = {false, make_socket(context)};
+      ah_address address = {0};
       bool result = acceptor->on_accept(
-          (ah_error_code)error_code, &slot.socket, (ah_ipv4_address) {0});
+          (ah_error_code)error_code, &slot.socket, &address);
       result = destroy_socket(&acceptor->socket) && result;
       if (!result) {
         return false;
@@ -554,176 +861,1820 @@ bool create_acceptor(ah_acceptor* result_acceptor,
                      ah_socket* listening_socket,
                      ah_on_accept on_accept)
 {
-  *result_acceptor = (ah_acceptor) {.base = {0}, *listening_socket, on_accept};
+  /* The accepted sockets are created in the family of the listener */
+  SOCKADDR_STORAGE local_address = {0};
+  int local_address_length = sizeof(local_address);
+  if (getsockname(listening_socket->socket,
+                  (struct sockaddr*)&local_address,
+                  &local_address_length)
+      == SOCKET_ERROR)
+  {
+    ah_log_error("getsockname", WSAGetLastError());
+    return false;
+  }
+
+  *result_acceptor = (ah_acceptor) {
+      .base = {0},
+      *listening_socket,
+      on_accept,
+      local_address.ss_family,
+  };
   return do_accept(&result_acceptor->base.overlapped);
 }
 
-/* I/O */
-
-void move_socket(ah_socket_accepted* result_socket, ah_socket* socket)
-{
-  ah_socket_slot* slot = parentof(socket, ah_socket_slot, socket);
-  if (slot->ok) {
-    memcpy(result_socket, socket, socket_size());
-    slot->ok = false;
-  }
-}
+/* Connector creation */
 
-typedef struct ah_io_port {
-  bool active;
-  bool is_read_port;
-  uint32_t buffer_length;
-  void* buffer;
-  ah_on_io_complete on_complete;
-  void* per_call_data;
+typedef struct ah_connector {
   ah_overlapped_base base;
-} ah_io_port;
-
-_Static_assert(
-    _Alignof(ah_io_port) == _Alignof(ah_io_operation),
-    "AH_IO_OPERATION_ALIGNMENT does not match the internal alignment");
+  ah_socket socket;
+  ah_on_connect on_connect;
+  void* per_call_data;
+  LPFN_CONNECTEX connect_ex;
+  bool pending;
+  bool cancelled;
+} ah_connector;
 
-_Static_assert(sizeof(ah_io_port) == sizeof(ah_io_operation),
-               "AH_IO_OPERATION_SIZE does not match the internal size");
+static ah_connector* connector_from_overlapped(LPOVERLAPPED overlapped)
+{
+  return parentof(base_from_overlapped(overlapped), ah_connector, base);
+}
 
-bool is_io_operation_active(ah_io_operation* operation)
+size_t connector_size()
 {
-  return ((ah_io_port*)operation)->active;
+  return sizeof(ah_connector);
 }
 
-ah_io_buffer buffer_from_io_operation(ah_io_operation* operation)
+size_t connector_alignment()
 {
-  ah_io_port* port = (ah_io_port*)operation;
-  return (ah_io_buffer) {port->buffer_length, port->buffer};
+  return _Alignof(ah_connector);
 }
 
-ah_io_dock* dock_from_operation(ah_io_operation* operation)
+void create_connector(ah_connector* result_connector,
+                      ah_context* context,
+                      ah_on_connect on_connect)
 {
-  ah_io_port* port = (ah_io_port*)operation;
-  return port->is_read_port ? parentof(port, ah_io_dock, read_port)
-                            : parentof(port, ah_io_dock, write_port);
+  *result_connector = (ah_connector) {
+      .socket = make_socket(context),
+      .on_connect = on_connect,
+  };
 }
 
-static ah_io_port* port_from_overlapped(LPOVERLAPPED overlapped)
+static bool connect_on_error(ah_connector* connector,
+                             int error_code,
+                             const char* function)
 {
-  return parentof(base_from_overlapped(overlapped), ah_io_port, base);
+  if (!is_ah_error_code(error_code)) {
+    ah_log_error(function, error_code);
+    return false;
+  }
+
+  ah_socket_slot slot = {false, make_socket(connector->socket.context)};
+  return connector->on_connect(
+      (ah_error_code)error_code, &slot.socket, connector->per_call_data);
 }
 
-static bool io_handler(LPOVERLAPPED overlapped)
+static bool connect_handler(LPOVERLAPPED overlapped)
 {
-  ah_io_port* port = port_from_overlapped(overlapped);
-  ah_error_code error_code = (ah_error_code)(int)overlapped->Offset;
-  ah_io_operation* op = (ah_io_operation*)port;
-  uint32_t bytes_transferred = overlapped->OffsetHigh;
+  ah_connector* connector = connector_from_overlapped(overlapped);
+  connector->pending = false;
+  /* The socket of a cancelled operation is already closed */
+  if (connector->cancelled) {
+    return true;
+  }
 
-  port->active = false;
-  return port->on_complete(
-      error_code, op, bytes_transferred, port->per_call_data);
+  /* The connector is released before calling back, so the callback can queue
+   * the next connect operation */
+  ah_socket_slot slot = {true, connector->socket};
+  connector->socket.socket = INVALID_SOCKET;
+
+  int error_code = (int)overlapped->Offset;
+  if (error_code == 0) {
+    /* Without this the socket does not know its addresses, and shutdown fails
+     * on it */
+    int result = setsockopt(
+        slot.socket.socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+    if (result == SOCKET_ERROR) {
+      error_code = WSAGetLastError();
+    }
+  }
+
+  if (error_code != 0) {
+    bool destroyed = destroy_socket(&slot.socket);
+    return connect_on_error(connector, error_code, "ConnectEx") && destroyed;
+  }
+
+  bool callback_result =
+      connector->on_connect(AH_ERR_OK, &slot.socket, connector->per_call_data);
+  /* If ownership of the socket wasn't taken by the handler, then it gets
+   * destroyed */
+  if (slot.ok) {
+    callback_result = destroy_socket(&slot.socket) && callback_result;
+  }
+
+  return callback_result;
 }
 
-static void init_io_port(ah_io_port* port,
-                         bool is_read_port,
-                         ah_io_buffer buffer,
-                         ah_on_io_complete on_complete,
-                         void* per_call_data)
+static ah_socket_slot load_connect_ex(ah_socket_slot slot,
+                                      ah_connector* connector)
 {
-  ah_io_port new_port = {
-      .active = true,
-      is_read_port,
-      buffer.buffer_length,
-      buffer.buffer,
-      on_complete,
-      per_call_data,
-      .base = {.handler = io_handler},
-  };
-  memcpy(port, &new_port, sizeof(ah_io_port));
+  if (!slot.ok || connector->connect_ex != NULL) {
+    return slot;
+  }
+
+  GUID guid = WSAID_CONNECTEX;
+  DWORD bytes_returned;
+  int result = WSAIoctl(slot.socket.socket,
+                        SIO_GET_EXTENSION_FUNCTION_POINTER,
+                        &guid,
+                        sizeof(guid),
+                        &connector->connect_ex,
+                        sizeof(connector->connect_ex),
+                        &bytes_returned,
+                        NULL,
+                        NULL);
+  if (result == SOCKET_ERROR) {
+    ah_log_error("WSAIoctl", WSAGetLastError());
+    slot.ok = false;
+  }
+
+  return slot;
 }
 
-bool queue_read_operation4(ah_io_dock* dock,
-                           ah_io_buffer buffer,
-                           ah_on_io_complete on_complete,
-                           void* per_call_data)
+bool queue_connect_operation(ah_connector* connector,
+                             const ah_address* address,
+                             const ah_address* local_address,
+                             void* per_call_data)
 {
-  ah_io_port* port = (ah_io_port*)&dock->read_port;
-  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+  /* A cancelled operation still owns the overlapped until it completes */
+  if (connector->socket.socket != INVALID_SOCKET || connector->pending) {
     return false;
   }
 
-  init_io_port(port, true, buffer, on_complete, per_call_data);
+  ah_ipv4_address ipv4;
+  bool ipv6 = !ipv4_from_address(address, &ipv4);
+  int family = ipv6 ? AF_INET6 : AF_INET;
+  struct sockaddr_storage remote_address;
+  int remote_length = sockaddr_from_address(address, ipv6, &remote_address);
+  if (remote_length == 0) {
+    return false;
+  }
 
-  ah_socket* socket = (ah_socket*)dock->socket;
-  LPOVERLAPPED overlapped = &port->base.overlapped;
-  WSABUF wsa_buffer = {buffer.buffer_length, buffer.buffer};
-  DWORD flags = 0;
-  int result =
-      WSARecv(socket->socket, &wsa_buffer, 1, NULL, &flags, overlapped, NULL);
-  if (result == SOCKET_ERROR) {
+  ah_context* context = connector->socket.context;
+  ah_socket_slot slot = {true, make_socket(context)};
+  slot = create_unbound_socket(slot, family, SOCK_STREAM, NULL);
+  slot = register_socket(slot, context, NULL);
+  slot = load_connect_ex(slot, connector);
+  /* ConnectEx only works on bound sockets */
+  if (local_address != NULL) {
+    struct sockaddr_storage bound_address;
+    int bound_length =
+        sockaddr_from_address(local_address, ipv6, &bound_address);
+    slot.ok = slot.ok && bound_length != 0;
+    slot = bind_socket_to_sockaddr(slot, &bound_address, bound_length);
+  } else {
+    slot = bind_socket(slot, family, 0);
+  }
+
+  if (!slot.ok) {
+    destroy_socket(&slot.socket);
+    return false;
+  }
+
+  connector->per_call_data = per_call_data;
+  connector->cancelled = false;
+  clear_overlapped(&connector->base.overlapped);
+  connector->base.handler = connect_handler;
+  BOOL result = connector->connect_ex(slot.socket.socket,
+                                      (const struct sockaddr*)&remote_address,
+                                      remote_length,
+                                      NULL,
+                                      0,
+                                      NULL,
+                                      &connector->base.overlapped);
+  if (result == FALSE) {
     int error_code = map_error_code(WSAGetLastError());
     if (error_code != WSA_IO_PENDING) {
-      if (is_ah_error_code(error_code)) {
-        ah_io_operation* op = (ah_io_operation*)port;
-        port->active = false;
-        return on_complete((ah_error_code)error_code, op, 0, per_call_data);
-      }
-
-      print_error("WSARecv", error_code);
-      return false;
+      bool destroyed = destroy_socket(&slot.socket);
+      return connect_on_error(connector, error_code, "ConnectEx") && destroyed;
     }
   }
 
+  /* Even an immediately established connection is reported through the
+   * completion port, so the callback is never called from inside this
+   * function on success */
+  connector->socket = slot.socket;
+  connector->pending = true;
   return true;
 }
 
-bool queue_write_operation4(ah_io_dock* dock,
-                            ah_io_buffer buffer,
-                            ah_on_io_complete on_complete,
-                            void* per_call_data)
+bool destroy_connector(ah_connector* connector)
 {
-  ah_io_port* port = (ah_io_port*)&dock->write_port;
-  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
-    return false;
+  if (connector->socket.socket == INVALID_SOCKET) {
+    return true;
   }
 
-  init_io_port(port, false, buffer, on_complete, per_call_data);
+  /* The cancelled operation still completes later, but without a callback */
+  connector->cancelled = true;
+  return destroy_socket(&connector->socket);
+}
 
-  ah_socket* socket = (ah_socket*)dock->socket;
-  LPOVERLAPPED overlapped = &port->base.overlapped;
-  WSABUF wsa_buffer = {buffer.buffer_length, buffer.buffer};
-  int result =
+/* Asynchronous close */
+
+#define CLOSE_DRAIN_BUFFER_SIZE 4096
+
+typedef struct ah_closer {
+  ah_overlapped_base base;
+  ah_socket socket;
+  ah_timer timer;
+  ah_on_close on_close;
+  void* per_call_data;
+  int error_code;
+  bool draining;
+  bool cancelled;
+  uint8_t buffer[CLOSE_DRAIN_BUFFER_SIZE];
+} ah_closer;
+
+static ah_closer* closer_from_overlapped(LPOVERLAPPED overlapped)
+{
+  return parentof(base_from_overlapped(overlapped), ah_closer, base);
+}
+
+size_t closer_size()
+{
+  return sizeof(ah_closer);
+}
+
+size_t closer_alignment()
+{
+  return _Alignof(ah_closer);
+}
+
+void create_closer(ah_closer* result_closer, ah_on_close on_close)
+{
+  *result_closer = (ah_closer) {
+      .socket = make_socket(NULL),
+      .on_close = on_close,
+  };
+}
+
+static bool reset_socket(ah_socket* socket)
+{
+  /* A zero linger timeout makes closesocket send a RST and drop the send
+   * buffer */
+  LINGER linger = {.l_onoff = 1, .l_linger = 0};
+  int result = setsockopt(socket->socket,
+                          SOL_SOCKET,
+                          SO_LINGER,
+                          (const char*)&linger,
+                          sizeof(linger));
+  if (result == SOCKET_ERROR) {
+    ah_log_error("setsockopt", WSAGetLastError());
+  }
+
+  return destroy_socket(socket) && result != SOCKET_ERROR;
+}
+
+static bool report_close(ah_closer* closer)
+{
+  return closer->on_close(
+      (ah_error_code)closer->error_code, closer, closer->per_call_data);
+}
+
+static bool close_timeout_handler(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+
+  ah_closer* closer = user_data;
+  if (!closer->draining) {
+    return report_close(closer);
+  }
+
+  /* The pending receive completes with an error once the socket is closed,
+   * and the callback is only called from there, because the closer must stay
+   * alive until then */
+  closer->error_code = (int)AH_ERR_TIMED_OUT;
+  return reset_socket(&closer->socket);
+}
+
+static bool queue_drain(ah_closer* closer);
+
+static bool drain_handler(LPOVERLAPPED overlapped)
+{
+  ah_closer* closer = closer_from_overlapped(overlapped);
+  int error_code = (int)overlapped->Offset;
+  if (closer->socket.socket == INVALID_SOCKET) {
+    closer->draining = false;
+    return closer->cancelled || report_close(closer);
+  }
+
+  if (error_code == 0 && overlapped->OffsetHigh != 0) {
+    return queue_drain(closer);
+  }
+
+  closer->draining = false;
+  closer->error_code = error_code;
+  stop_timer(&closer->timer);
+  bool result = destroy_socket(&closer->socket);
+  return report_close(closer) && result;
+}
+
+static bool queue_drain(ah_closer* closer)
+{
+  clear_overlapped(&closer->base.overlapped);
+  closer->base.handler = drain_handler;
+  WSABUF wsa_buffer = {sizeof(closer->buffer), closer->buffer};
+  DWORD flags = 0;
+  int result = WSARecv(closer->socket.socket,
+                       &wsa_buffer,
+                       1,
+                       NULL,
+                       &flags,
+                       &closer->base.overlapped,
+                       NULL);
+  if (result == SOCKET_ERROR) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      /* Failures are reported through the completion port as well, so the
+       * callback is called from the same place */
+      closer->base.overlapped.Offset = (DWORD)error_code;
+      HANDLE completion_port =
+          closer->socket.context->server->completion_port;
+      return queue_overlapped(completion_port, &closer->base.overlapped);
+    }
+  }
+
+  return true;
+}
+
+bool queue_close_operation(ah_closer* closer,
+                           ah_socket_accepted* socket,
+                           ah_close_mode mode,
+                           uint32_t timeout_ms,
+                           void* per_call_data)
+{
+  ah_socket* base = (ah_socket*)socket;
+  if (closer->socket.socket != INVALID_SOCKET || closer->draining
+      || is_timer_active(&closer->timer) || base->socket == INVALID_SOCKET)
+  {
+    return false;
+  }
+
+  ah_server* server = base->context->server;
+  closer->socket = *base;
+  closer->per_call_data = per_call_data;
+  closer->error_code = 0;
+  closer->cancelled = false;
+  base->socket = INVALID_SOCKET;
+  create_timer(&closer->timer, server, close_timeout_handler, closer);
+
+  if (mode == AH_CLOSE_ABORTIVE) {
+    if (!reset_socket(&closer->socket)) {
+      return false;
+    }
+
+    start_timer(&closer->timer, 0);
+    return true;
+  }
+
+  if (shutdown(closer->socket.socket, SD_SEND) == SOCKET_ERROR) {
+    int error_code = WSAGetLastError();
+    /* There is nothing to wait for if the connection is gone already */
+    if (error_code != WSAENOTCONN) {
+      ah_log_error("shutdown", error_code);
+      reset_socket(&closer->socket);
+      return false;
+    }
+
+    if (!destroy_socket(&closer->socket)) {
+      return false;
+    }
+
+    start_timer(&closer->timer, 0);
+    return true;
+  }
+
+  /* The operations of the dock would compete with the drain for the incoming
+   * data, so they are cancelled */
+  HANDLE socket_handle = NULL;
+  memcpy(&socket_handle, &closer->socket.socket, sizeof(SOCKET));
+  if (CancelIoEx(socket_handle, NULL) == FALSE
+      && GetLastError() != ERROR_NOT_FOUND)
+  {
+    ah_log_error("CancelIoEx", (int)GetLastError());
+  }
+
+  closer->draining = true;
+  start_timer(&closer->timer, timeout_ms);
+  return queue_drain(closer);
+}
+
+bool destroy_closer(ah_closer* closer)
+{
+  stop_timer(&closer->timer);
+  if (closer->socket.socket == INVALID_SOCKET) {
+    return true;
+  }
+
+  /* The cancelled receive still completes later, but without a callback */
+  closer->cancelled = true;
+  return reset_socket(&closer->socket);
+}
+
+/* Hot restart */
+
+typedef struct ah_handoff {
+  ah_context* context;
+  ah_on_handoff on_handoff;
+  void* user_data;
+} ah_handoff;
+
+size_t handoff_size()
+{
+  return sizeof(ah_handoff);
+}
+
+size_t handoff_alignment()
+{
+  return _Alignof(ah_handoff);
+}
+
+/* Sockets can be duplicated into another process using WSADuplicateSocket,
+ * but the process has to be known up front, which does not fit the Unix
+ * socket based protocol of the other platforms */
+
+bool create_handoff(ah_handoff* result_handoff,
+                    ah_context* context,
+                    const char* path,
+                    ah_on_handoff on_handoff,
+                    ah_on_handoff on_drained,
+                    void* user_data)
+{
+  (void)path;
+  (void)on_drained;
+
+  *result_handoff = (ah_handoff) {context, on_handoff, user_data};
+  ah_log_error("create_handoff", WSAEOPNOTSUPP);
+  return false;
+}
+
+bool handoff_socket(ah_handoff* handoff, ah_socket_accepted* socket)
+{
+  (void)handoff;
+  (void)socket;
+
+  return false;
+}
+
+bool drain_handoff_socket(ah_handoff* handoff,
+                          ah_closer* closer,
+                          ah_socket_accepted* socket,
+                          uint32_t timeout_ms)
+{
+  (void)handoff;
+  (void)closer;
+  (void)socket;
+  (void)timeout_ms;
+
+  return false;
+}
+
+bool destroy_handoff(ah_handoff* handoff)
+{
+  (void)handoff;
+
+  return true;
+}
+
+bool receive_handoff(ah_handoff* result_handoff,
+                     ah_context* context,
+                     const char* path,
+                     ah_socket_span* span,
+                     ah_on_accept on_accept,
+                     ah_on_handoff on_received,
+                     void* user_data)
+{
+  (void)path;
+  (void)on_accept;
+
+  *result_handoff = (ah_handoff) {context, on_received, user_data};
+  span->size = 0;
+  ah_log_error("receive_handoff", WSAEOPNOTSUPP);
+  return false;
+}
+
+/* I/O */
+
+void move_socket(ah_socket_accepted* result_socket, ah_socket* socket)
+{
+  ah_socket_slot* slot = parentof(socket, ah_socket_slot, socket);
+  if (slot->ok) {
+    memcpy(result_socket, socket, socket_size());
+    slot->ok = false;
+  }
+}
+
+typedef struct ah_io_port {
+  bool active;
+  bool is_read_port;
+  bool is_write_queue;
+  bool is_deferred;
+  uint32_t buffer_length;
+  void* buffer;
+  ah_on_io_complete on_complete;
+  void* per_call_data;
+  ah_overlapped_base base;
+} ah_io_port;
+
+_Static_assert(
+    _Alignof(ah_io_port) == _Alignof(ah_io_operation),
+    "AH_IO_OPERATION_ALIGNMENT does not match the internal alignment");
+
+_Static_assert(sizeof(ah_io_port) == sizeof(ah_io_operation),
+               "AH_IO_OPERATION_SIZE does not match the internal size");
+
+bool is_io_operation_active(ah_io_operation* operation)
+{
+  return ((ah_io_port*)operation)->active;
+}
+
+ah_io_buffer buffer_from_io_operation(ah_io_operation* operation)
+{
+  ah_io_port* port = (ah_io_port*)operation;
+  return (ah_io_buffer) {port->buffer_length, port->buffer};
+}
+
+uint64_t rx_timestamp_from_io_operation(ah_io_operation* operation)
+{
+  (void)operation;
+
+  return 0;
+}
+
+ah_io_dock* dock_from_operation(ah_io_operation* operation)
+{
+  ah_io_port* port = (ah_io_port*)operation;
+  return port->is_read_port ? parentof(port, ah_io_dock, read_port)
+                            : parentof(port, ah_io_dock, write_port);
+}
+
+static ah_io_port* port_from_overlapped(LPOVERLAPPED overlapped)
+{
+  return parentof(base_from_overlapped(overlapped), ah_io_port, base);
+}
+
+static bool write_queue_handler(ah_io_port* port,
+                                ah_error_code error_code,
+                                uint32_t bytes_transferred);
+
+static bool io_handler(LPOVERLAPPED overlapped)
+{
+  ah_io_port* port = port_from_overlapped(overlapped);
+  ah_error_code error_code = (ah_error_code)(int)overlapped->Offset;
+  ah_io_operation* op = (ah_io_operation*)port;
+  uint32_t bytes_transferred = overlapped->OffsetHigh;
+  if (port->is_write_queue) {
+    return write_queue_handler(port, error_code, bytes_transferred);
+  }
+
+  port->active = false;
+  return port->on_complete(
+      error_code, op, bytes_transferred, port->per_call_data);
+}
+
+static void init_io_port(ah_io_port* port,
+                         bool is_read_port,
+                         ah_io_buffer buffer,
+                         ah_on_io_complete on_complete,
+                         void* per_call_data)
+{
+  ah_io_port new_port = {
+      .active = true,
+      is_read_port,
+      .buffer_length = buffer.buffer_length,
+      buffer.buffer,
+      on_complete,
+      per_call_data,
+      .base = {.handler = io_handler},
+  };
+  memcpy(port, &new_port, sizeof(ah_io_port));
+}
+
+static bool post_read(ah_io_dock* dock)
+{
+  ah_io_port* port = (ah_io_port*)&dock->read_port;
+  port->is_deferred = false;
+
+  ah_socket* socket = (ah_socket*)dock->socket;
+  LPOVERLAPPED overlapped = &port->base.overlapped;
+  WSABUF wsa_buffer = {port->buffer_length, port->buffer};
+  DWORD flags = 0;
+  int result =
+      WSARecv(socket->socket, &wsa_buffer, 1, NULL, &flags, overlapped, NULL);
+  if (result == SOCKET_ERROR) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      if (is_ah_error_code(error_code)) {
+        ah_io_operation* op = (ah_io_operation*)port;
+        port->active = false;
+        return port->on_complete(
+            (ah_error_code)error_code, op, 0, port->per_call_data);
+      }
+
+      ah_log_error("WSARecv", error_code);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool queue_read_operation4(ah_io_dock* dock,
+                           ah_io_buffer buffer,
+                           ah_on_io_complete on_complete,
+                           void* per_call_data)
+{
+  ah_io_port* port = (ah_io_port*)&dock->read_port;
+  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+    return false;
+  }
+
+  init_io_port(port, true, buffer, on_complete, per_call_data);
+
+  /* Reads paused by the watermarks of the write queue are posted once the
+   * queue drains, because a posted receive cannot be held back */
+  ah_io_port* write_port = (ah_io_port*)&dock->write_port;
+  if (write_port->active && write_port->is_write_queue
+      && ((ah_write_queue*)write_port->per_call_data)->reads_paused)
+  {
+    port->is_deferred = true;
+    return true;
+  }
+
+  return post_read(dock);
+}
+
+bool queue_write_operation4(ah_io_dock* dock,
+                            ah_io_buffer buffer,
+                            ah_on_io_complete on_complete,
+                            void* per_call_data)
+{
+  ah_io_port* port = (ah_io_port*)&dock->write_port;
+  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+    return false;
+  }
+
+  init_io_port(port, false, buffer, on_complete, per_call_data);
+
+  ah_socket* socket = (ah_socket*)dock->socket;
+  LPOVERLAPPED overlapped = &port->base.overlapped;
+  WSABUF wsa_buffer = {buffer.buffer_length, buffer.buffer};
+  int result =
       WSASend(socket->socket, &wsa_buffer, 1, NULL, 0, overlapped, NULL);
   if (result == SOCKET_ERROR) {
     int error_code = map_error_code(WSAGetLastError());
     if (error_code != WSA_IO_PENDING) {
-      if (is_ah_error_code(error_code)) {
-        ah_io_operation* op = (ah_io_operation*)port;
-        port->active = false;
-        return on_complete((ah_error_code)error_code, op, 0, per_call_data);
-      }
+      if (is_ah_error_code(error_code)) {
+        ah_io_operation* op = (ah_io_operation*)port;
+        port->active = false;
+        return on_complete((ah_error_code)error_code, op, 0, per_call_data);
+      }
+
+      ah_log_error("WSASend", error_code);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Write queue */
+
+#define WRITE_QUEUE_BUFFERS 64
+
+/* Requests queued while a send is in flight are sent together by the next
+ * one, which is how IOCP coalesces the writes */
+static bool update_deferred_read(ah_write_queue* queue)
+{
+  if (!update_write_pressure(queue)) {
+    return false;
+  }
+
+  ah_io_port* read_port = (ah_io_port*)&queue->dock->read_port;
+  if (queue->reads_paused || !read_port->is_deferred) {
+    return true;
+  }
+
+  return post_read(queue->dock);
+}
+
+static bool fail_write_queue(ah_write_queue* queue,
+                             const char* function,
+                             int error_code)
+{
+  ((ah_io_port*)&queue->dock->write_port)->active = false;
+  if (is_ah_error_code(error_code)) {
+    ah_write_request* failed = take_write_requests(queue);
+    return update_deferred_read(queue)
+        && finish_write_requests(failed, (ah_error_code)error_code);
+  }
+
+  ah_log_error(function, error_code);
+  return false;
+}
+
+/* TransmitFile reads from the file at the offset of the overlapped structure,
+ * so the position of the file handle is irrelevant and it can be shared by
+ * every connection sending it */
+static bool transmit_file_request(ah_write_queue* queue,
+                                  ah_socket* socket,
+                                  LPOVERLAPPED overlapped)
+{
+  ah_write_request* request = queue->head;
+  uint64_t offset = request->file_offset + request->bytes_transferred;
+  overlapped->Offset = (DWORD)offset;
+  overlapped->OffsetHigh = (DWORD)(offset >> 32);
+  BOOL result =
+      TransmitFile(socket->socket,
+                   (HANDLE)request->file->handle,
+                   request->buffer.buffer_length - request->bytes_transferred,
+                   0,
+                   overlapped,
+                   NULL,
+                   0);
+  if (result == FALSE) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      return fail_write_queue(queue, "TransmitFile", error_code);
+    }
+  }
+
+  return true;
+}
+
+static bool send_write_queue(ah_write_queue* queue)
+{
+  ah_io_port* port = (ah_io_port*)&queue->dock->write_port;
+  ah_io_port new_port = {
+      .active = true,
+      .is_write_queue = true,
+      .per_call_data = queue,
+      .base = {.handler = io_handler},
+  };
+  memcpy(port, &new_port, sizeof(ah_io_port));
+
+  ah_socket* socket = (ah_socket*)queue->dock->socket;
+  LPOVERLAPPED overlapped = &port->base.overlapped;
+  if (queue->head->file != NULL) {
+    return transmit_file_request(queue, socket, overlapped);
+  }
+
+  /* File requests are sent by their own TransmitFile call */
+  WSABUF wsa_buffers[WRITE_QUEUE_BUFFERS];
+  DWORD count = 0;
+  for (ah_write_request* request = queue->head;
+       request != NULL && request->file == NULL
+       && count != WRITE_QUEUE_BUFFERS;
+       request = request->next)
+  {
+    uint32_t offset = request->bytes_transferred;
+    wsa_buffers[count++] = (WSABUF) {
+        request->buffer.buffer_length - offset,
+        (char*)request->buffer.buffer + offset,
+    };
+  }
+
+  int result =
+      WSASend(socket->socket, wsa_buffers, count, NULL, 0, overlapped, NULL);
+  if (result == SOCKET_ERROR) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      return fail_write_queue(queue, "WSASend", error_code);
+    }
+  }
+
+  return true;
+}
+
+static bool write_queue_handler(ah_io_port* port,
+                                ah_error_code error_code,
+                                uint32_t bytes_transferred)
+{
+  ah_write_queue* queue = port->per_call_data;
+  port->active = false;
+  if (error_code != AH_ERR_OK) {
+    ah_write_request* failed = take_write_requests(queue);
+    return update_deferred_read(queue)
+        && finish_write_requests(failed, error_code);
+  }
+
+  ah_write_request* completed =
+      complete_write_requests(queue, bytes_transferred);
+  if (queue->head != NULL && !send_write_queue(queue)) {
+    return false;
+  }
+
+  return update_deferred_read(queue)
+      && finish_write_requests(completed, AH_ERR_OK);
+}
+
+bool enqueue_write_request(ah_write_queue* queue, ah_write_request* request)
+{
+  ah_io_port* port = (ah_io_port*)&queue->dock->write_port;
+  if (port->active && !port->is_write_queue) {
+    return false;
+  }
+
+  append_write_request(queue, request);
+
+  if (!port->active && !send_write_queue(queue)) {
+    return false;
+  }
+
+  return update_write_pressure(queue);
+}
+
+/* A send in flight fails once the socket is closed, which completes every
+ * request of the queue instead */
+bool cancel_write_queue(ah_write_queue* queue)
+{
+  if (((ah_io_port*)&queue->dock->write_port)->active) {
+    return true;
+  }
+
+  ah_write_request* cancelled = take_write_requests(queue);
+  return finish_write_requests(cancelled, AH_ERR_OPERATION_ABORTED);
+}
+
+bool cork_write_queue(ah_write_queue* queue, bool corked)
+{
+  (void)queue;
+  (void)corked;
+
+  return true;
+}
+
+/* Relay */
+
+/* IOCP has nothing like splice, so the bytes are copied through a buffer per
+ * direction using the ports of the docks */
+#define RELAY_BUFFER_SIZE (64 * 1024)
+
+typedef struct ah_relay_direction {
+  ah_relay* relay;
+  ah_io_dock* source;
+  ah_io_dock* sink;
+  uint8_t* buffer;
+  uint32_t buffered;
+  uint32_t written;
+  uint64_t bytes_transferred;
+  bool pending;
+  bool shut_down;
+} ah_relay_direction;
+
+typedef struct ah_relay {
+  ah_relay_direction directions[2];
+  ah_on_relay_done on_done;
+  void* user_data;
+  int error_code;
+  bool stopped;
+  bool cancelled;
+} ah_relay;
+
+size_t relay_size()
+{
+  return sizeof(ah_relay);
+}
+
+size_t relay_alignment()
+{
+  return _Alignof(ah_relay);
+}
+
+static void cancel_dock_io(ah_io_dock* dock)
+{
+  HANDLE socket_handle = NULL;
+  memcpy(&socket_handle, &((ah_socket*)dock->socket)->socket, sizeof(SOCKET));
+  if (CancelIoEx(socket_handle, NULL) == FALSE
+      && GetLastError() != ERROR_NOT_FOUND)
+  {
+    ah_log_error("CancelIoEx", (int)GetLastError());
+  }
+}
+
+static void free_relay_buffers(ah_relay* relay)
+{
+  for (uint32_t i = 0; i != 2; ++i) {
+    free(relay->directions[i].buffer);
+    relay->directions[i].buffer = NULL;
+  }
+}
+
+/* The buffers are only freed once neither direction has an operation in
+ * flight, after which the callback is called unless the relay was
+ * destroyed */
+static bool settle_relay(ah_relay* relay)
+{
+  if (relay->directions[0].pending || relay->directions[1].pending) {
+    return true;
+  }
+
+  free_relay_buffers(relay);
+  return relay->cancelled
+      || relay->on_done(
+          (ah_error_code)relay->error_code, relay, relay->user_data);
+}
+
+static bool fail_relay(ah_relay* relay, const char* function, int error_code)
+{
+  if (!is_ah_error_code(error_code)) {
+    ah_log_error(function, error_code);
+    return false;
+  }
+
+  relay->stopped = true;
+  relay->error_code = error_code;
+  cancel_dock_io(relay->directions[0].source);
+  cancel_dock_io(relay->directions[1].source);
+  return settle_relay(relay);
+}
+
+static bool on_relay_read(ah_error_code error_code,
+                          ah_io_operation* operation,
+                          uint32_t bytes_transferred,
+                          void* per_call_data);
+
+static bool on_relay_written(ah_error_code error_code,
+                             ah_io_operation* operation,
+                             uint32_t bytes_transferred,
+                             void* per_call_data);
+
+static bool queue_relay_read(ah_relay_direction* direction)
+{
+  direction->pending = true;
+  ah_io_buffer buffer = {RELAY_BUFFER_SIZE, direction->buffer};
+  return queue_read_operation4(
+      direction->source, buffer, on_relay_read, direction);
+}
+
+static bool queue_relay_write(ah_relay_direction* direction)
+{
+  direction->pending = true;
+  ah_io_buffer buffer = {
+      direction->buffered - direction->written,
+      direction->buffer + direction->written,
+  };
+  return queue_write_operation4(
+      direction->sink, buffer, on_relay_written, direction);
+}
+
+static bool on_relay_read(ah_error_code error_code,
+                          ah_io_operation* operation,
+                          uint32_t bytes_transferred,
+                          void* per_call_data)
+{
+  (void)operation;
+
+  ah_relay_direction* direction = per_call_data;
+  ah_relay* relay = direction->relay;
+  direction->pending = false;
+  if (relay->stopped) {
+    return settle_relay(relay);
+  }
+
+  if (error_code != AH_ERR_OK) {
+    return fail_relay(relay, "WSARecv", (int)error_code);
+  }
+
+  if (bytes_transferred != 0) {
+    direction->buffered = bytes_transferred;
+    direction->written = 0;
+    return queue_relay_write(direction);
+  }
+
+  direction->shut_down = true;
+  SOCKET sink = ((ah_socket*)direction->sink->socket)->socket;
+  if (shutdown(sink, SD_SEND) == SOCKET_ERROR) {
+    int shutdown_error = WSAGetLastError();
+    if (shutdown_error != WSAENOTCONN) {
+      return fail_relay(relay, "shutdown", shutdown_error);
+    }
+  }
+
+  if (relay->directions[0].shut_down && relay->directions[1].shut_down) {
+    relay->stopped = true;
+    return settle_relay(relay);
+  }
+
+  return true;
+}
+
+static bool on_relay_written(ah_error_code error_code,
+                             ah_io_operation* operation,
+                             uint32_t bytes_transferred,
+                             void* per_call_data)
+{
+  (void)operation;
+
+  ah_relay_direction* direction = per_call_data;
+  ah_relay* relay = direction->relay;
+  direction->pending = false;
+  if (relay->stopped) {
+    return settle_relay(relay);
+  }
+
+  if (error_code != AH_ERR_OK) {
+    return fail_relay(relay, "WSASend", (int)error_code);
+  }
+
+  direction->written += bytes_transferred;
+  direction->bytes_transferred += bytes_transferred;
+  return direction->written != direction->buffered
+      ? queue_relay_write(direction)
+      : queue_relay_read(direction);
+}
+
+bool start_relay(ah_relay* result_relay,
+                 ah_io_dock* client,
+                 ah_io_dock* upstream,
+                 ah_on_relay_done on_done,
+                 void* user_data)
+{
+  ah_io_dock* docks[2] = {client, upstream};
+  for (uint32_t i = 0; i != 2; ++i) {
+    if (is_io_operation_active(&docks[i]->read_port)
+        || is_io_operation_active(&docks[i]->write_port))
+    {
+      return false;
+    }
+  }
+
+  *result_relay = (ah_relay) {
+      .directions = {
+          {result_relay, client, upstream},
+          {result_relay, upstream, client},
+      },
+      .on_done = on_done,
+      .user_data = user_data,
+  };
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    result_relay->directions[i].buffer = malloc(RELAY_BUFFER_SIZE);
+    if (result_relay->directions[i].buffer == NULL) {
+      free_relay_buffers(result_relay);
+      return false;
+    }
+  }
+
+  return queue_relay_read(&result_relay->directions[0])
+      && queue_relay_read(&result_relay->directions[1]);
+}
+
+ah_relay_counters counters_from_relay(ah_relay* relay)
+{
+  return (ah_relay_counters) {
+      relay->directions[0].bytes_transferred,
+      relay->directions[1].bytes_transferred,
+  };
+}
+
+bool destroy_relay(ah_relay* relay)
+{
+  if (relay->stopped) {
+    relay->cancelled = true;
+    return true;
+  }
+
+  relay->stopped = true;
+  relay->cancelled = true;
+  cancel_dock_io(relay->directions[0].source);
+  cancel_dock_io(relay->directions[1].source);
+  return settle_relay(relay);
+}
+
+/* Kernel relay */
+
+/* Windows cannot redirect between sockets in the kernel, so every relay copies
+ * through its buffers */
+typedef struct ah_sockmap {
+  int unused;
+} ah_sockmap;
+
+size_t sockmap_size()
+{
+  return sizeof(ah_sockmap);
+}
+
+size_t sockmap_alignment()
+{
+  return _Alignof(ah_sockmap);
+}
+
+bool create_sockmap(ah_sockmap* result_sockmap, uint32_t max_relays)
+{
+  (void)max_relays;
+
+  *result_sockmap = (ah_sockmap) {0};
+  return false;
+}
+
+bool start_sockmap_relay(ah_sockmap* sockmap,
+                         ah_relay* result_relay,
+                         ah_io_dock* client,
+                         ah_io_dock* upstream,
+                         ah_on_relay_done on_done,
+                         void* user_data)
+{
+  (void)sockmap;
+
+  return start_relay(result_relay, client, upstream, on_done, user_data);
+}
+
+bool is_relay_in_kernel(ah_relay* relay)
+{
+  (void)relay;
+
+  return false;
+}
+
+void destroy_sockmap(ah_sockmap* sockmap)
+{
+  (void)sockmap;
+}
+
+/* Datagrams */
+
+/* IOCP has no batched receives, so every receive ends with the first
+ * datagram. Sends go out one datagram at a time, and buffers with a segment
+ * size one segment at a time. */
+typedef struct ah_datagram_batch {
+  ah_overlapped_base base;
+  ah_datagram_socket* socket;
+  bool active;
+  bool cancelled;
+  uint32_t count;
+  uint32_t done;
+  uint32_t offset;
+  ah_datagram* datagrams;
+  ah_on_datagrams on_complete;
+  void* per_call_data;
+  struct sockaddr_storage address;
+  INT address_length;
+  DWORD flags;
+} ah_datagram_batch;
+
+struct ah_datagram_socket {
+  ah_socket socket;
+  bool ipv6;
+  ah_datagram_batch receive;
+  ah_datagram_batch send;
+};
+
+size_t datagram_socket_size()
+{
+  return sizeof(ah_datagram_socket);
+}
+
+size_t datagram_socket_alignment()
+{
+  return _Alignof(ah_datagram_socket);
+}
+
+static ah_datagram_batch* batch_from_overlapped(LPOVERLAPPED overlapped)
+{
+  return parentof(base_from_overlapped(overlapped), ah_datagram_batch, base);
+}
+
+/* Windows coalesces received datagrams only through a socket option that
+ * cannot report the segment size per buffer, so GRO is not offered */
+bool create_datagram_socket(ah_datagram_socket* result_socket,
+                            ah_context* context,
+                            uint16_t port,
+                            uint32_t flags)
+{
+  *result_socket = (ah_datagram_socket) {.socket = make_socket(context)};
+  if ((flags & AH_DATAGRAM_GRO) != 0) {
+    return false;
+  }
+
+  int family;
+  ah_socket_slot slot = {true, make_socket(context)};
+  slot = create_dual_stack_socket(slot, SOCK_DGRAM, &family);
+  slot = register_socket(slot, context, NULL);
+  slot = bind_socket(slot, family, port);
+
+  result_socket->socket = slot.socket;
+  result_socket->ipv6 = family == AF_INET6;
+  return slot.ok;
+}
+
+bool local_address_from_datagram_socket(ah_datagram_socket* socket,
+                                        ah_address* result_address)
+{
+  return local_address_from_socket(&socket->socket, result_address);
+}
+
+ah_context* context_from_datagram_socket(ah_datagram_socket* socket)
+{
+  return socket->socket.context;
+}
+
+static bool complete_datagram_batch(ah_datagram_batch* batch, int error_code)
+{
+  batch->active = false;
+  return batch->on_complete((ah_error_code)error_code,
+                            batch->socket,
+                            batch->datagrams,
+                            batch->done,
+                            batch->per_call_data);
+}
+
+static bool fail_datagram_batch(ah_datagram_batch* batch,
+                                const char* function,
+                                int error_code)
+{
+  if (is_ah_error_code(error_code)) {
+    return complete_datagram_batch(batch, error_code);
+  }
+
+  ah_log_error(function, error_code);
+  return false;
+}
+
+static bool datagram_receive_handler(LPOVERLAPPED overlapped)
+{
+  ah_datagram_batch* batch = batch_from_overlapped(overlapped);
+  if (batch->cancelled) {
+    batch->active = false;
+    return true;
+  }
+
+  /* Truncated datagrams are delivered like recvmmsg does */
+  int error_code = (int)overlapped->Offset;
+  if (error_code != 0 && error_code != (int)AH_ERR_MESSAGE_SIZE) {
+    return complete_datagram_batch(batch, error_code);
+  }
+
+  ah_datagram* datagram = &batch->datagrams[0];
+  datagram->buffer.buffer_length = overlapped->OffsetHigh;
+  datagram->address =
+      address_from_sockaddr((const struct sockaddr*)&batch->address);
+  datagram->segment_size = 0;
+  batch->done = 1;
+  return complete_datagram_batch(batch, 0);
+}
+
+static bool post_datagram_send(ah_datagram_batch* batch)
+{
+  ah_datagram* datagram = &batch->datagrams[batch->done];
+  uint32_t length = datagram->buffer.buffer_length - batch->offset;
+  if (datagram->segment_size != 0 && length > datagram->segment_size) {
+    length = datagram->segment_size;
+  }
+
+  LPOVERLAPPED overlapped = &batch->base.overlapped;
+  clear_overlapped(overlapped);
+  batch->address_length = sockaddr_from_address(
+      &datagram->address, batch->socket->ipv6, &batch->address);
+  WSABUF wsa_buffer = {
+      length,
+      (char*)datagram->buffer.buffer + batch->offset,
+  };
+  int result = WSASendTo(batch->socket->socket.socket,
+                         &wsa_buffer,
+                         1,
+                         NULL,
+                         0,
+                         (const struct sockaddr*)&batch->address,
+                         batch->address_length,
+                         overlapped,
+                         NULL);
+  if (result == SOCKET_ERROR) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      return fail_datagram_batch(batch, "WSASendTo", error_code);
+    }
+  }
+
+  return true;
+}
+
+static bool datagram_send_handler(LPOVERLAPPED overlapped)
+{
+  ah_datagram_batch* batch = batch_from_overlapped(overlapped);
+  if (batch->cancelled) {
+    batch->active = false;
+    return true;
+  }
 
-      print_error("WSASend", error_code);
+  int error_code = (int)overlapped->Offset;
+  if (error_code != 0) {
+    return complete_datagram_batch(batch, error_code);
+  }
+
+  ah_datagram* datagram = &batch->datagrams[batch->done];
+  batch->offset += overlapped->OffsetHigh;
+  if (batch->offset >= datagram->buffer.buffer_length) {
+    batch->offset = 0;
+    ++batch->done;
+  }
+
+  return batch->done == batch->count ? complete_datagram_batch(batch, 0)
+                                     : post_datagram_send(batch);
+}
+
+static bool init_datagram_batch(ah_datagram_socket* socket,
+                                ah_datagram_batch* batch,
+                                bool (*handler)(LPOVERLAPPED),
+                                ah_datagram* datagrams,
+                                uint32_t count,
+                                ah_on_datagrams on_complete,
+                                void* per_call_data)
+{
+  /* A cancelled operation still owns the overlapped until it completes */
+  if (socket->socket.socket == INVALID_SOCKET || batch->active || count == 0)
+  {
+    return false;
+  }
+
+  *batch = (ah_datagram_batch) {
+      .base = {.handler = handler},
+      socket,
+      .active = true,
+      .count = count,
+      .datagrams = datagrams,
+      .on_complete = on_complete,
+      .per_call_data = per_call_data,
+  };
+  return true;
+}
+
+bool queue_datagram_receive(ah_datagram_socket* socket,
+                            ah_datagram* datagrams,
+                            uint32_t count,
+                            ah_on_datagrams on_complete,
+                            void* per_call_data)
+{
+  ah_datagram_batch* batch = &socket->receive;
+  if (!init_datagram_batch(socket,
+                           batch,
+                           datagram_receive_handler,
+                           datagrams,
+                           count,
+                           on_complete,
+                           per_call_data))
+  {
+    return false;
+  }
+
+  batch->address_length = sizeof(batch->address);
+  WSABUF wsa_buffer = {
+      datagrams[0].buffer.buffer_length,
+      datagrams[0].buffer.buffer,
+  };
+  int result = WSARecvFrom(socket->socket.socket,
+                           &wsa_buffer,
+                           1,
+                           NULL,
+                           &batch->flags,
+                           (struct sockaddr*)&batch->address,
+                           &batch->address_length,
+                           &batch->base.overlapped,
+                           NULL);
+  if (result == SOCKET_ERROR) {
+    int error_code = map_error_code(WSAGetLastError());
+    if (error_code != WSA_IO_PENDING) {
+      return fail_datagram_batch(batch, "WSARecvFrom", error_code);
+    }
+  }
+
+  return true;
+}
+
+bool queue_datagram_send(ah_datagram_socket* socket,
+                         ah_datagram* datagrams,
+                         uint32_t count,
+                         ah_on_datagrams on_complete,
+                         void* per_call_data)
+{
+  for (uint32_t i = 0; i != count; ++i) {
+    if (datagrams[i].address.family == AH_ADDRESS_NONE) {
       return false;
     }
   }
 
+  return init_datagram_batch(socket,
+                             &socket->send,
+                             datagram_send_handler,
+                             datagrams,
+                             count,
+                             on_complete,
+                             per_call_data)
+      && post_datagram_send(&socket->send);
+}
+
+/* The operations in flight complete with an error once the socket is
+ * closed, which their handlers drop */
+bool destroy_datagram_socket(ah_datagram_socket* socket)
+{
+  socket->receive.cancelled = socket->receive.active;
+  socket->send.cancelled = socket->send.active;
+  return destroy_socket_base(&socket->socket);
+}
+
+/* Ring buffers */
+
+/* Views can only be mapped at free addresses, so the range is found by
+ * reserving and releasing it, which leaves a window for another thread to take
+ * it before both views are in place. Losing that race is retried. */
+#define RING_MAP_ATTEMPTS 16
+
+size_t ring_granularity(void)
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+}
+
+static bool map_ring_views(HANDLE mapping, uint8_t* data, size_t size)
+{
+  void* first =
+      MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, data);
+  if (first == NULL) {
+    return false;
+  }
+
+  void* second =
+      MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, data + size);
+  if (second == NULL) {
+    DWORD error_code = GetLastError();
+    UnmapViewOfFile(first);
+    SetLastError(error_code);
+    return false;
+  }
+
+  return true;
+}
+
+void* map_ring_memory(size_t size)
+{
+  uint64_t mapping_size = size;
+  HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                      NULL,
+                                      PAGE_READWRITE,
+                                      (DWORD)(mapping_size >> 32),
+                                      (DWORD)mapping_size,
+                                      NULL);
+  if (mapping == NULL) {
+    ah_log_error("CreateFileMappingW", (int)GetLastError());
+    return NULL;
+  }
+
+  uint8_t* result = NULL;
+  DWORD error_code = ERROR_SUCCESS;
+  for (int i = 0; i != RING_MAP_ATTEMPTS; ++i) {
+    uint8_t* data = VirtualAlloc(NULL, size * 2, MEM_RESERVE, PAGE_NOACCESS);
+    if (data == NULL) {
+      ah_log_error("VirtualAlloc", (int)GetLastError());
+      break;
+    }
+
+    VirtualFree(data, 0, MEM_RELEASE);
+    if (map_ring_views(mapping, data, size)) {
+      result = data;
+      break;
+    }
+
+    error_code = GetLastError();
+  }
+
+  if (result == NULL && error_code != ERROR_SUCCESS) {
+    ah_log_error("MapViewOfFileEx", (int)error_code);
+  }
+
+  /* The views keep the section alive */
+  CloseHandle(mapping);
+  return result;
+}
+
+void unmap_ring_memory(void* data, size_t size)
+{
+  for (size_t i = 0; i != 2; ++i) {
+    if (!UnmapViewOfFile((uint8_t*)data + size * i)) {
+      ah_log_error("UnmapViewOfFile", (int)GetLastError());
+    }
+  }
+}
+
+/* File cache */
+
+#define FILE_WATCH_BUFFER_SIZE 4096
+#define FILE_TIME_UNIX_EPOCH 116444736000000000LL
+
+/* The root is kept as a path, because files can only be opened relative to a
+ * directory handle with the native API */
+typedef struct ah_file_root {
+  HANDLE directory;
+  uint32_t path_length;
+  wchar_t path[];
+} ah_file_root;
+
+static wchar_t* widen_path(const char* path, int length, wchar_t* result_path)
+{
+  int wide_length =
+      MultiByteToWideChar(CP_UTF8, 0, path, length, result_path, INT_MAX);
+  if (wide_length == 0) {
+    return NULL;
+  }
+
+  for (int i = 0; i != wide_length; ++i) {
+    if (result_path[i] == L'/') {
+      result_path[i] = L'\\';
+    }
+  }
+
+  return result_path + wide_length;
+}
+
+bool open_file_root(const char* path, intptr_t* result_root)
+{
+  int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  if (length == 0) {
+    ah_log_error("MultiByteToWideChar", (int)GetLastError());
+    return false;
+  }
+
+  ah_file_root* root =
+      malloc(sizeof(ah_file_root) + sizeof(wchar_t) * (size_t)length);
+  if (root == NULL) {
+    return false;
+  }
+
+  widen_path(path, -1, root->path);
+  root->path_length = (uint32_t)length - 1;
+  root->directory = CreateFileW(root->path,
+                                FILE_LIST_DIRECTORY,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE
+                                    | FILE_SHARE_DELETE,
+                                NULL,
+                                OPEN_EXISTING,
+                                FILE_FLAG_BACKUP_SEMANTICS
+                                    | FILE_FLAG_OVERLAPPED,
+                                NULL);
+  if (root->directory == INVALID_HANDLE_VALUE) {
+    ah_log_error("CreateFileW", (int)GetLastError());
+    free(root);
+    return false;
+  }
+
+  *result_root = (intptr_t)root;
+  return true;
+}
+
+void close_file_root(intptr_t root)
+{
+  ah_file_root* file_root = (ah_file_root*)root;
+  CloseHandle(file_root->directory);
+  free(file_root);
+}
+
+static ah_error_code file_error_code(int error_code)
+{
+  switch (error_code) {
+    case ERROR_PATH_NOT_FOUND:
+    case ERROR_INVALID_NAME:
+      return AH_ERR_NOT_FOUND;
+  }
+
+  return is_ah_error_code(error_code) ? (ah_error_code)error_code
+                                      : AH_ERR_IO_ERROR;
+}
+
+ah_error_code open_cached_file(intptr_t root, ah_cached_file* file)
+{
+  ah_file_root* file_root = (ah_file_root*)root;
+  size_t length = file_root->path_length + 1 + file->path_length + 1;
+  wchar_t* path = malloc(sizeof(wchar_t) * length);
+  if (path == NULL) {
+    return AH_ERR_NO_MEMORY;
+  }
+
+  memcpy(path, file_root->path, sizeof(wchar_t) * file_root->path_length);
+  path[file_root->path_length] = L'\\';
+  wchar_t* end = widen_path(
+      file->path, (int)file->path_length, &path[file_root->path_length + 1]);
+  if (end == NULL) {
+    free(path);
+    return AH_ERR_NOT_FOUND;
+  }
+
+  *end = L'\0';
+  HANDLE handle = CreateFileW(path,
+                              GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE
+                                  | FILE_SHARE_DELETE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_FLAG_BACKUP_SEMANTICS
+                                  | FILE_FLAG_SEQUENTIAL_SCAN,
+                              NULL);
+  free(path);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return file_error_code((int)GetLastError());
+  }
+
+  BY_HANDLE_FILE_INFORMATION info;
+  if (GetFileInformationByHandle(handle, &info) == FALSE) {
+    int error_code = (int)GetLastError();
+    CloseHandle(handle);
+    return file_error_code(error_code);
+  }
+
+  if ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+    CloseHandle(handle);
+    return AH_ERR_IS_DIRECTORY;
+  }
+
+  int64_t modified = (int64_t)info.ftLastWriteTime.dwHighDateTime << 32
+      | info.ftLastWriteTime.dwLowDateTime;
+  file->handle = (intptr_t)handle;
+  file->size = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+  file->modified = (modified - FILE_TIME_UNIX_EPOCH) / 10000000;
+  file->mapping = NULL;
+
+  /* Small files are sent from a view of the file. A failed mapping is not
+   * fatal, because the file can be sent using TransmitFile. */
+  if (file->size != 0 && file->size <= AH_FILE_MAP_LIMIT) {
+    HANDLE mapping =
+        CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+      file->mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      /* The view keeps the mapping object alive */
+      CloseHandle(mapping);
+    }
+  }
+
+  return AH_ERR_OK;
+}
+
+void close_cached_file(ah_cached_file* file)
+{
+  if (file->mapping != NULL) {
+    UnmapViewOfFile(file->mapping);
+  }
+
+  CloseHandle((HANDLE)file->handle);
+}
+
+/* Windows can only watch directories, so every change below the root is
+ * reported as a change to every file */
+typedef struct ah_file_watcher {
+  ah_overlapped_base base;
+  HANDLE directory;
+  bool closing;
+  ah_on_file_change on_change;
+  void* user_data;
+  _Alignas(DWORD) char buffer[FILE_WATCH_BUFFER_SIZE];
+} ah_file_watcher;
+
+static bool file_watch_handler(LPOVERLAPPED overlapped);
+
+static bool post_file_watch(ah_file_watcher* watcher)
+{
+  clear_overlapped(&watcher->base.overlapped);
+  BOOL result = ReadDirectoryChangesW(watcher->directory,
+                                      watcher->buffer,
+                                      sizeof(watcher->buffer),
+                                      TRUE,
+                                      FILE_NOTIFY_CHANGE_FILE_NAME
+                                          | FILE_NOTIFY_CHANGE_DIR_NAME
+                                          | FILE_NOTIFY_CHANGE_SIZE
+                                          | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                      NULL,
+                                      &watcher->base.overlapped,
+                                      NULL);
+  if (result == FALSE) {
+    ah_log_error("ReadDirectoryChangesW", (int)GetLastError());
+    return false;
+  }
+
+  return true;
+}
+
+static bool file_watch_handler(LPOVERLAPPED overlapped)
+{
+  ah_file_watcher* watcher =
+      parentof(base_from_overlapped(overlapped), ah_file_watcher, base);
+  if (watcher->closing) {
+    free(watcher);
+    return true;
+  }
+
+  ah_error_code error_code = (ah_error_code)(int)overlapped->Offset;
+  if (error_code != AH_ERR_OK) {
+    ah_log_error("ReadDirectoryChangesW", (int)error_code);
+    return false;
+  }
+
+  return post_file_watch(watcher)
+      && watcher->on_change(-1, watcher->user_data);
+}
+
+ah_file_watcher* create_file_watcher(ah_server* server,
+                                     intptr_t root,
+                                     ah_on_file_change on_change,
+                                     void* user_data)
+{
+  ah_file_watcher* watcher = malloc(sizeof(ah_file_watcher));
+  if (watcher == NULL) {
+    return NULL;
+  }
+
+  *watcher = (ah_file_watcher) {
+      .base = {.handler = file_watch_handler},
+      .directory = ((ah_file_root*)root)->directory,
+      .on_change = on_change,
+      .user_data = user_data,
+  };
+
+  if (CreateIoCompletionPort(watcher->directory, server->completion_port, 0, 0)
+      == NULL)
+  {
+    ah_log_error("CreateIoCompletionPort", (int)GetLastError());
+    free(watcher);
+    return NULL;
+  }
+
+  if (!post_file_watch(watcher)) {
+    free(watcher);
+    return NULL;
+  }
+
+  return watcher;
+}
+
+bool watch_cached_file(ah_file_watcher* watcher, ah_cached_file* file)
+{
+  (void)watcher;
+
+  file->watch = -1;
   return true;
 }
 
+void unwatch_cached_file(ah_file_watcher* watcher, int32_t watch)
+{
+  (void)watcher;
+  (void)watch;
+}
+
+/* The watcher is freed by the completion of the cancelled read */
+void destroy_file_watcher(ah_file_watcher* watcher)
+{
+  watcher->closing = true;
+  if (CancelIoEx(watcher->directory, &watcher->base.overlapped) == FALSE) {
+    free(watcher);
+  }
+}
+
 /* Event loop */
 
+const char* server_backend_name()
+{
+  return "iocp";
+}
+
 static int map_error_code(int error_code)
 {
   switch (error_code) {
     case ERROR_NETNAME_DELETED:
       return (int)AH_ERR_CONNECTION_RESET;
     case ERROR_PORT_UNREACHABLE:
+    case ERROR_CONNECTION_REFUSED:
       return (int)AH_ERR_CONNECTION_REFUSED;
+    case ERROR_NETWORK_UNREACHABLE:
+      return (int)AH_ERR_NETWORK_UNREACHABLE;
+    case ERROR_HOST_UNREACHABLE:
+      return (int)AH_ERR_HOST_UNREACHABLE;
+    case ERROR_SEM_TIMEOUT:
+      return (int)AH_ERR_TIMED_OUT;
+    /* A datagram was truncated to fit into the buffer */
+    case ERROR_MORE_DATA:
+      return (int)AH_ERR_MESSAGE_SIZE;
   }
 
   return error_code;
 }
 
+static bool finish_tick(ah_server* server)
+{
+  bool result = run_expired_timers(&server->core.timers);
+  /* Writing out deferred log messages is the lowest priority work of a tick */
+  flush_log_from_event_loop();
+  return result;
+}
+
 bool server_tick(ah_server* server, int* error_code_out)
 {
+  int timeout = next_timer_timeout(&server->core.timers);
   DWORD bytes_transferred;
   ULONG_PTR completion_key;
   LPOVERLAPPED overlapped;
@@ -731,8 +2682,23 @@ bool server_tick(ah_server* server, int* error_code_out)
                                           &bytes_transferred,
                                           &completion_key,
                                           &overlapped,
-                                          INFINITE);
-  assert(overlapped != NULL);
+                                          timeout == -1 ? INFINITE
+                                                        : (DWORD)timeout);
+  if (overlapped == NULL) {
+    int error_code = (int)GetLastError();
+    if (error_code == WAIT_TIMEOUT) {
+      return finish_tick(server);
+    }
+
+    if (error_code_out == NULL) {
+      ah_log_error("GetQueuedCompletionStatus", error_code);
+    } else {
+      *error_code_out = error_code;
+    }
+
+    return false;
+  }
+
   ah_overlapped_base* base = base_from_overlapped(overlapped);
   overlapped->OffsetHigh = bytes_transferred;
   overlapped->Offset = 0;
@@ -741,7 +2707,7 @@ bool server_tick(ah_server* server, int* error_code_out)
     int error_code = map_error_code((int)GetLastError());
     if (!is_ah_error_code(error_code)) {
       if (error_code_out == NULL) {
-        print_error("GetQueuedCompletionStatus", error_code);
+        ah_log_error("GetQueuedCompletionStatus", error_code);
       } else {
         *error_code_out = error_code;
       }
@@ -752,5 +2718,14 @@ bool server_tick(ah_server* server, int* error_code_out)
     overlapped->Offset = (DWORD)error_code;
   }
 
-  return base->handler(overlapped);
+  if (!base->handler(overlapped)) {
+    return false;
+  }
+
+  return finish_tick(server);
+}
+
+ah_server_stats stats_from_server(ah_server* server)
+{
+  return server->core.stats;
 }
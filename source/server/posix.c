@@ -1,23 +1,55 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/bpf.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <linux/tls.h>
+#include <linux/udp.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "server/detail.h"
+#include "server/detail.posix.h"
 
 /* Server creation */
 
 #define MAX_EVENTS 128
 
 typedef struct ah_server {
+  ah_server_core core;
   ah_socket_span socket_span;
   int epoll_descriptor;
+  /* The socket whose event is being dispatched. It is cleared when the socket
+   * gets closed, so the event loop knows not to touch its dock anymore. */
+  ah_socket* dispatch_socket;
+  /* The events of the batch that were not dispatched yet. A callback may free
+   * or reuse the dock of another socket after closing it, so the events of a
+   * closed socket are dropped right away instead of being checked later. */
+  size_t next_event;
+  size_t event_count;
+  /* The arrival time of the data read by the operation whose callback is
+   * running. Keeping it here instead of in every read port keeps the ports
+   * of sockets without timestamps small. */
+  ah_io_port* rx_timestamp_port;
+  uint64_t rx_timestamp;
   struct epoll_event events[MAX_EVENTS];
 } ah_server;
 
@@ -31,12 +63,122 @@ size_t server_alignment()
   return _Alignof(ah_server);
 }
 
+ah_server_core* core_from_server(ah_server* server)
+{
+  return &server->core;
+}
+
+uint64_t monotonic_time_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000U + (uint64_t)now.tv_nsec / 1000000U;
+}
+
+/* Platform services */
+
+#define ERROR_MESSAGE_SIZE 256
+
+void write_error_message(const char* function, int error_code)
+{
+  char buffer[ERROR_MESSAGE_SIZE];
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+  const char* message = strerror_r(error_code, buffer, sizeof(buffer));
+#else
+  const char* message = strerror_r(error_code, buffer, sizeof(buffer)) == 0
+      ? buffer
+      : "Unknown error";
+#endif
+  fprintf(stderr, "%s: %s\n", function, message);
+}
+
+typedef struct thread_start {
+  ah_thread_function function;
+  void* argument;
+} thread_start;
+
+static void* thread_entry(void* argument)
+{
+  thread_start start = *(thread_start*)argument;
+  free(argument);
+  start.function(start.argument);
+  return NULL;
+}
+
+bool start_thread(ah_thread_function function,
+                  void* argument,
+                  void** result_handle)
+{
+  thread_start* start = malloc(sizeof(thread_start));
+  pthread_t* thread = malloc(sizeof(pthread_t));
+  if (start == NULL || thread == NULL) {
+    free(start);
+    free(thread);
+    return false;
+  }
+
+  *start = (thread_start) {function, argument};
+  int result = pthread_create(thread, NULL, thread_entry, start);
+  if (result != 0) {
+    ah_log_error("pthread_create", result);
+    free(start);
+    free(thread);
+    return false;
+  }
+
+  *result_handle = thread;
+  return true;
+}
+
+void join_thread(void* handle)
+{
+  pthread_t* thread = handle;
+  int result = pthread_join(*thread, NULL);
+  if (result != 0) {
+    ah_log_error("pthread_join", result);
+  }
+  free(thread);
+}
+
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_exit_key;
+static int thread_exit_key_result;
+
+static void run_thread_exit(void* value)
+{
+  ah_thread_exit* hook = value;
+  hook->function(hook->argument);
+}
+
+static void create_thread_exit_key(void)
+{
+  thread_exit_key_result =
+      pthread_key_create(&thread_exit_key, run_thread_exit);
+}
+
+bool call_at_thread_exit(ah_thread_exit* hook)
+{
+  return pthread_once(&thread_exit_once, create_thread_exit_key) == 0
+      && thread_exit_key_result == 0
+      && pthread_setspecific(thread_exit_key, hook) == 0;
+}
+
+void sleep_ms(uint32_t milliseconds)
+{
+  struct timespec duration = {
+      (time_t)(milliseconds / 1000U),
+      (long)(milliseconds % 1000U) * 1000000L,
+  };
+  while (nanosleep(&duration, &duration) == -1 && errno == EINTR) {
+  }
+}
+
 static bool set_close_on_exec(int descriptor, bool report)
 {
   int flags = fcntl(descriptor, F_GETFD);
   if (flags == -1 || fcntl(descriptor, F_SETFD, flags | FD_CLOEXEC) == -1) {
     if (report) {
-      perror("fcntl");
+      ah_log_error("fcntl", errno);
     }
 
     return false;
@@ -56,9 +198,9 @@ bool create_server(ah_server* result_server)
   *result_server = (ah_server) {.epoll_descriptor = descriptor};
   if (descriptor == -1) {
 #ifdef EPOLL_CLOEXEC
-    perror("epoll_create1");
+    ah_log_error("epoll_create1", errno);
 #else
-    perror("epoll_create");
+    ah_log_error("epoll_create", errno);
 #endif
 
     return false;
@@ -83,13 +225,27 @@ void set_socket_span(ah_server* server, ah_socket_span span)
 typedef enum ah_socket_role
 {
   AH_SOCKET_ACCEPT = 0,
+  AH_SOCKET_CONNECT,
   AH_SOCKET_IO,
   AH_SOCKET_IO_REARM,
+  AH_SOCKET_CLOSE,
+  AH_SOCKET_HANDOFF,
+  AH_SOCKET_FILE_WATCH,
+  AH_SOCKET_DATAGRAM,
 } ah_socket_role;
 
+typedef enum ah_socket_flag
+{
+  AH_SOCKET_RX_TIMESTAMPS = 1 << 0,
+  AH_SOCKET_IPV6 = 1 << 1,
+} ah_socket_flag;
+
+/* The role and flags are stored as bytes to keep the struct 16 bytes large,
+ * because one of these is embedded in every connection */
 typedef struct ah_socket {
   int socket;
-  ah_socket_role role;
+  uint8_t role;
+  uint8_t flags;
   ah_context* context;
 } ah_socket;
 
@@ -122,15 +278,17 @@ size_t socket_alignment()
   return _Alignof(ah_socket);
 }
 
-static ah_socket_slot create_unbound_socket(ah_socket_slot slot)
+static ah_socket_slot create_unbound_socket(ah_socket_slot slot,
+                                            int family,
+                                            int type)
 {
   if (!slot.ok) {
     return slot;
   }
 
-  int unbound_socket = socket(AF_INET, SOCK_STREAM, 0);
+  int unbound_socket = socket(family, type, 0);
   if (unbound_socket == -1) {
-    perror("socket");
+    ah_log_error("socket", errno);
     slot.ok = false;
   } else {
     slot.socket.socket = unbound_socket;
@@ -139,6 +297,37 @@ static ah_socket_slot create_unbound_socket(ah_socket_slot slot)
   return slot;
 }
 
+/* IPv4 peers are accepted as IPv4-mapped addresses, so one socket serves
+ * both families, unless the kernel was built without IPv6 */
+static ah_socket_slot create_dual_stack_socket(ah_socket_slot slot, int type)
+{
+  if (!slot.ok) {
+    return slot;
+  }
+
+  int descriptor = socket(AF_INET6, type, 0);
+  if (descriptor == -1 && errno == EAFNOSUPPORT) {
+    return create_unbound_socket(slot, AF_INET, type);
+  }
+  if (descriptor == -1) {
+    ah_log_error("socket", errno);
+    slot.ok = false;
+    return slot;
+  }
+
+  slot.socket.socket = descriptor;
+  slot.socket.flags |= AH_SOCKET_IPV6;
+  int disable = false;
+  int result = setsockopt(
+      descriptor, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+  if (result == -1) {
+    ah_log_error("setsockopt", errno);
+    slot.ok = false;
+  }
+
+  return slot;
+}
+
 typedef enum ah_blocking_type
 {
   AH_BLOCKING,
@@ -164,7 +353,7 @@ static ah_socket_slot socket_set_nonblocking(ah_socket_slot slot,
       && fcntl(descriptor, F_SETFL, fcntl_blocking_mask(flags, type)) != -1;
   if (!result) {
     if (report) {
-      perror("fcntl");
+      ah_log_error("fcntl", errno);
     }
 
     slot.ok = false;
@@ -183,31 +372,101 @@ static ah_socket_slot socket_enable_address_reuse(ah_socket_slot slot)
   int result = setsockopt(
       slot.socket.socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
   if (result == -1) {
-    perror("setsockopt");
+    ah_log_error("setsockopt", errno);
     slot.ok = false;
   }
 
   return slot;
 }
 
-static ah_socket_slot bind_socket(ah_socket_slot slot, uint16_t port)
+/* IPv4 addresses are written in the IPv4-mapped form for IPv6 sockets and
+ * IPv4-mapped ones as plain IPv4 for the others. Returns 0 for addresses
+ * without a family. */
+static socklen_t sockaddr_from_address(const ah_address* address,
+                                       bool ipv6_socket,
+                                       struct sockaddr_storage* result)
+{
+  memset(result, 0, sizeof(*result));
+  if (address->family == AH_ADDRESS_NONE) {
+    return 0;
+  }
+
+  ah_ipv4_address ipv4;
+  bool is_ipv4 = ipv4_from_address(address, &ipv4);
+  if (is_ipv4 && !ipv6_socket) {
+    struct sockaddr_in* ipv4_result = (struct sockaddr_in*)result;
+    ipv4_result->sin_family = AF_INET;
+    memcpy(&ipv4_result->sin_addr, ipv4.address, sizeof(ipv4.address));
+    memcpy(&ipv4_result->sin_port, address->port, sizeof(address->port));
+    return sizeof(*ipv4_result);
+  }
+
+  struct sockaddr_in6* ipv6_result = (struct sockaddr_in6*)result;
+  ipv6_result->sin6_family = AF_INET6;
+  uint8_t* bytes = ipv6_result->sin6_addr.s6_addr;
+  if (address->family == AH_ADDRESS_IPV4) {
+    bytes[10] = 0xFF;
+    bytes[11] = 0xFF;
+    memcpy(bytes + 12, ipv4.address, sizeof(ipv4.address));
+  } else {
+    memcpy(bytes, address->bytes, sizeof(address->bytes));
+  }
+  memcpy(&ipv6_result->sin6_port, address->port, sizeof(address->port));
+  return sizeof(*ipv6_result);
+}
+
+static ah_address address_from_sockaddr(const struct sockaddr* address)
+{
+  ah_address result = {0};
+  if (address->sa_family == AF_INET) {
+    const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)address;
+    memcpy(result.bytes, &ipv4->sin_addr, sizeof(ipv4->sin_addr));
+    memcpy(result.port, &ipv4->sin_port, sizeof(result.port));
+    result.family = AH_ADDRESS_IPV4;
+  } else if (address->sa_family == AF_INET6) {
+    const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*)address;
+    memcpy(result.bytes, &ipv6->sin6_addr, sizeof(result.bytes));
+    memcpy(result.port, &ipv6->sin6_port, sizeof(result.port));
+    result.family = AH_ADDRESS_IPV6;
+  }
+
+  return result;
+}
+
+static ah_socket_slot bind_socket_to_sockaddr(ah_socket_slot slot,
+                                              const void* address,
+                                              socklen_t address_length)
 {
   if (!slot.ok) {
     return slot;
   }
 
+  if (bind(slot.socket.socket, address, address_length) == -1) {
+    ah_log_error("bind", errno);
+    slot.ok = false;
+  }
+
+  return slot;
+}
+
+/* Binds to every interface of the family the socket was created with */
+static ah_socket_slot bind_socket(ah_socket_slot slot, uint16_t port)
+{
+  if ((slot.socket.flags & AH_SOCKET_IPV6) != 0) {
+    struct sockaddr_in6 address = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = IN6ADDR_ANY_INIT,
+    };
+    return bind_socket_to_sockaddr(slot, &address, sizeof(address));
+  }
+
   struct sockaddr_in address = {
       .sin_family = AF_INET,
       .sin_port = htons(port),
       .sin_addr = {.s_addr = htonl(INADDR_ANY)},
   };
-  const struct sockaddr* address_ptr = (const struct sockaddr*)&address;
-  if (bind(slot.socket.socket, address_ptr, sizeof(address)) == -1) {
-    perror("bind");
-    slot.ok = false;
-  }
-
-  return slot;
+  return bind_socket_to_sockaddr(slot, &address, sizeof(address));
 }
 
 static ah_socket_slot listen_on_socket(ah_socket_slot slot)
@@ -217,7 +476,7 @@ static ah_socket_slot listen_on_socket(ah_socket_slot slot)
   }
 
   if (listen(slot.socket.socket, SOMAXCONN) == -1) {
-    perror("listen");
+    ah_log_error("listen", errno);
     slot.ok = false;
   }
 
@@ -226,8 +485,11 @@ static ah_socket_slot listen_on_socket(ah_socket_slot slot)
 
 bool create_socket(ah_socket* result_socket, ah_context* context, uint16_t port)
 {
-  ah_socket_slot slot = {true, {.socket = -1, AH_SOCKET_ACCEPT, context}};
-  slot = create_unbound_socket(slot);
+  ah_socket_slot slot = {
+      true,
+      {.socket = -1, AH_SOCKET_ACCEPT, .context = context},
+  };
+  slot = create_dual_stack_socket(slot, SOCK_STREAM);
   slot = socket_set_nonblocking(slot, AH_NONBLOCKING, true);
   slot = socket_enable_address_reuse(slot);
   slot = bind_socket(slot, port);
@@ -237,6 +499,70 @@ bool create_socket(ah_socket* result_socket, ah_context* context, uint16_t port)
   return slot.ok;
 }
 
+/* A leading '@' selects the abstract namespace, where the name is not
+ * terminated and the length of the address tells where it ends */
+static bool sockaddr_from_unix_path(struct sockaddr_un* result_address,
+                                    socklen_t* result_length,
+                                    const char* path)
+{
+  size_t length = strlen(path);
+  if (length == 0 || length >= sizeof(result_address->sun_path)) {
+    return false;
+  }
+
+  *result_address = (struct sockaddr_un) {.sun_family = AF_UNIX};
+  memcpy(result_address->sun_path, path, length);
+  if (path[0] == '@') {
+    result_address->sun_path[0] = '\0';
+    size_t header_length = offsetof(struct sockaddr_un, sun_path);
+    *result_length = (socklen_t)(header_length + length);
+  } else {
+    *result_length = sizeof(struct sockaddr_un);
+  }
+
+  return true;
+}
+
+static ah_socket_slot bind_unix_socket(ah_socket_slot slot,
+                                       struct sockaddr_un address,
+                                       socklen_t address_length)
+{
+  if (!slot.ok) {
+    return slot;
+  }
+
+  const struct sockaddr* address_ptr = (const struct sockaddr*)&address;
+  if (bind(slot.socket.socket, address_ptr, address_length) == -1) {
+    ah_log_error("bind", errno);
+    slot.ok = false;
+  }
+
+  return slot;
+}
+
+bool create_unix_socket(ah_socket* result_socket,
+                        ah_context* context,
+                        const char* path)
+{
+  struct sockaddr_un address;
+  socklen_t address_length;
+  if (!sockaddr_from_unix_path(&address, &address_length, path)) {
+    return false;
+  }
+
+  ah_socket_slot slot = {
+      true,
+      {.socket = -1, AH_SOCKET_ACCEPT, .context = context},
+  };
+  slot = create_unbound_socket(slot, AF_UNIX, SOCK_STREAM);
+  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, true);
+  slot = bind_unix_socket(slot, address, address_length);
+  slot = listen_on_socket(slot);
+
+  memcpy(result_socket, &slot.socket, socket_size());
+  return slot.ok;
+}
+
 /* Server destruction */
 
 bool destroy_server(ah_server* server)
@@ -249,7 +575,7 @@ bool destroy_server(ah_server* server)
   }
 
   if (server->epoll_descriptor != -1 && close(server->epoll_descriptor) == -1) {
-    perror("close");
+    ah_log_error("close", errno);
     result = false;
   }
 
@@ -271,6 +597,22 @@ ah_context* context_from_socket_accepted(ah_socket_accepted* socket)
 
 /* Socket destruction */
 
+static void forget_socket_events(ah_server* server, ah_socket* socket)
+{
+  if (server->dispatch_socket == socket) {
+    server->dispatch_socket = NULL;
+  }
+
+  /* The objects of the remaining events are still alive, because their
+   * sockets would have been forgotten before being freed */
+  for (size_t i = server->next_event; i < server->event_count; ++i) {
+    void* ptr = server->events[i].data.ptr;
+    if (ptr != NULL && *(ah_socket**)ptr == socket) {
+      server->events[i].data.ptr = NULL;
+    }
+  }
+}
+
 bool destroy_socket_base(ah_socket* socket)
 {
   if (socket->socket == -1) {
@@ -281,41 +623,195 @@ bool destroy_socket_base(ah_socket* socket)
   int result =
       epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, socket->socket, NULL);
   if (result == -1 && errno != ENOENT) {
-    perror("epoll_ctl");
+    ah_log_error("epoll_ctl", errno);
     return false;
   }
 
-  if (close(socket->socket) != 0) {
+  forget_socket_events(server, socket);
+
+  /* The descriptor is released even if close fails, so it must not be closed
+   * again. A retryable error only means that a lingering close could not
+   * finish without blocking, which happens in the background anyway. */
+  result = close(socket->socket);
+  socket->socket = -1;
+  if (result != 0) {
     int error_code = errno;
-    bool can_try_nonblocking = is_ah_error_code(error_code)
-        /* This can potentially be redundant, but the man pages say that one
-         * should check for both if at least one is checked */
-        /* NOLINTNEXTLINE(misc-redundant-expression) */
-        && (error_code == AH_ERR_TRY_AGAIN || error_code == AH_ERR_WOULD_BLOCK);
-    if (!can_try_nonblocking) {
-      perror("close");
+    if (error_class_from_code(error_code) != AH_ERROR_CLASS_RETRYABLE) {
+      ah_log_error("close", error_code);
       return false;
     }
+  }
 
-    ah_socket_slot slot = socket_set_nonblocking(
-        (ah_socket_slot) {true, *socket}, AH_BLOCKING, true);
-    if (!slot.ok) {
-      return false;
-    }
+  return true;
+}
+
+bool destroy_socket_accepted(ah_socket_accepted* socket)
+{
+  return destroy_socket_base((ah_socket*)socket);
+}
+
+/* Socket options */
+
+bool enable_rx_timestamps(ah_socket_accepted* socket)
+{
+  ah_socket* base = (ah_socket*)socket;
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  int result = setsockopt(
+      base->socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+  if (result == -1) {
+    ah_log_error("setsockopt", errno);
+    return false;
+  }
+
+  base->flags |= AH_SOCKET_RX_TIMESTAMPS;
+  return true;
+}
 
-    if (close(socket->socket) != 0) {
-      perror("close");
+/* The kernel takes the 12 byte nonce split into a salt and an explicit part
+ * for the AES ciphers, which is how TLS 1.2 transmits it */
+bool enable_kernel_tls(ah_socket_accepted* socket, const ah_tls_keys* keys)
+{
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+  } crypto = {0};
+  socklen_t length = 0;
+  uint8_t sequence[8];
+  for (uint32_t i = 0; i != 8; ++i) {
+    sequence[i] = (uint8_t)(keys->sequence >> (56 - 8 * i));
+  }
+
+  switch (keys->cipher) {
+    case AH_TLS_AES_128_GCM:
+      crypto.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      memcpy(crypto.aes_gcm_128.salt, keys->iv, 4);
+      memcpy(crypto.aes_gcm_128.iv, keys->iv + 4, 8);
+      memcpy(crypto.aes_gcm_128.key, keys->key, 16);
+      memcpy(crypto.aes_gcm_128.rec_seq, sequence, 8);
+      length = sizeof(crypto.aes_gcm_128);
+      break;
+    case AH_TLS_AES_256_GCM:
+      crypto.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+      memcpy(crypto.aes_gcm_256.salt, keys->iv, 4);
+      memcpy(crypto.aes_gcm_256.iv, keys->iv + 4, 8);
+      memcpy(crypto.aes_gcm_256.key, keys->key, 32);
+      memcpy(crypto.aes_gcm_256.rec_seq, sequence, 8);
+      length = sizeof(crypto.aes_gcm_256);
+      break;
+    case AH_TLS_CHACHA20_POLY1305:
+      crypto.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      memcpy(crypto.chacha20_poly1305.iv, keys->iv, 12);
+      memcpy(crypto.chacha20_poly1305.key, keys->key, 32);
+      memcpy(crypto.chacha20_poly1305.rec_seq, sequence, 8);
+      length = sizeof(crypto.chacha20_poly1305);
+      break;
+    default:
       return false;
-    }
   }
+  crypto.info.version = TLS_1_3_VERSION;
 
-  socket->socket = -1;
+  int descriptor = ((ah_socket*)socket)->socket;
+  if (setsockopt(descriptor, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"))
+      == -1)
+  {
+    return false;
+  }
+
+  int result = setsockopt(descriptor, SOL_TLS, TLS_TX, &crypto, length);
+  explicit_bzero(&crypto, sizeof(crypto));
+  return result == 0;
+}
+
+bool tcp_info_from_socket(ah_socket_accepted* socket, ah_tcp_info* result_info)
+{
+  /* Older kernels return a shorter struct, leaving the newer fields zeroed */
+  struct tcp_info info = {0};
+  socklen_t info_length = sizeof(info);
+  int result = getsockopt(
+      ((ah_socket*)socket)->socket, IPPROTO_TCP, TCP_INFO, &info, &info_length);
+  if (result == -1) {
+    ah_log_error("getsockopt", errno);
+    return false;
+  }
+
+  *result_info = (ah_tcp_info) {
+      info.tcpi_rtt,
+      info.tcpi_rttvar,
+      info.tcpi_snd_mss,
+      info.tcpi_snd_cwnd,
+      info.tcpi_unacked,
+      info.tcpi_total_retrans,
+      info.tcpi_notsent_bytes,
+  };
   return true;
 }
 
-bool destroy_socket_accepted(ah_socket_accepted* socket)
+bool peer_credentials_from_socket(ah_socket* socket,
+                                  ah_peer_credentials* result_credentials)
 {
-  return destroy_socket_base((ah_socket*)socket);
+  /* The kernel reports the overflow IDs for sockets of other families instead
+   * of failing, so the family is checked first */
+  int family;
+  socklen_t family_length = sizeof(family);
+  if (getsockopt(
+          socket->socket, SOL_SOCKET, SO_DOMAIN, &family, &family_length)
+      == -1)
+  {
+    ah_log_error("getsockopt", errno);
+    return false;
+  }
+  if (family != AF_UNIX) {
+    return false;
+  }
+
+  struct ucred credentials;
+  socklen_t credentials_length = sizeof(credentials);
+  if (getsockopt(socket->socket,
+                 SOL_SOCKET,
+                 SO_PEERCRED,
+                 &credentials,
+                 &credentials_length)
+      == -1)
+  {
+    ah_log_error("getsockopt", errno);
+    return false;
+  }
+
+  *result_credentials = (ah_peer_credentials) {
+      (uint32_t)credentials.pid,
+      (uint32_t)credentials.uid,
+      (uint32_t)credentials.gid,
+  };
+  return true;
+}
+
+bool local_address_from_socket(ah_socket* socket, ah_address* result_address)
+{
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (getsockname(socket->socket, (struct sockaddr*)&address, &length) == -1)
+  {
+    ah_log_error("getsockname", errno);
+    return false;
+  }
+
+  *result_address = address_from_sockaddr((struct sockaddr*)&address);
+  return true;
+}
+
+bool is_idle_socket_usable(ah_socket_accepted* socket)
+{
+  /* An idle connection is not expected to become readable, so anything that
+   * wakes up a poll, be it data, an end of file or an error, rules it out */
+  struct pollfd descriptor = {((ah_socket*)socket)->socket, POLLIN, 0};
+  int result = poll(&descriptor, 1, 0);
+  if (result == -1) {
+    ah_log_error("poll", errno);
+  }
+
+  return result == 0;
 }
 
 /* Acceptor creation */
@@ -341,13 +837,42 @@ static bool accept_error_handler(ah_context* context,
 {
   int error_code = errno;
   if (!is_ah_error_code(error_code)) {
-    perror(function);
+    ah_log_error(function, error_code);
     return false;
   }
 
   ah_socket_slot slot = {false, {.context = context}};
-  return on_accept(
-      (ah_error_code)error_code, &slot.socket, (ah_ipv4_address) {0});
+  ah_address address = {0};
+  return on_accept((ah_error_code)error_code, &slot.socket, &address);
+}
+
+static bool deliver_accepted_socket(ah_context* context,
+                                    ah_on_accept on_accept,
+                                    int incoming_socket,
+                                    const struct sockaddr_storage* remote)
+{
+  ah_socket_slot slot = {
+      .ok = set_close_on_exec(incoming_socket, false),
+      {incoming_socket, AH_SOCKET_IO, .context = context},
+  };
+  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, false);
+  if (!slot.ok) {
+    bool result = destroy_socket(&slot.socket);
+    result = accept_error_handler(context, on_accept, "fcntl") && result;
+    return result;
+  }
+
+  /* Peers of Unix domain sockets are reported without an address */
+  ah_address address =
+      address_from_sockaddr((const struct sockaddr*)remote);
+  bool result = on_accept(AH_ERR_OK, &slot.socket, &address);
+  /* If ownership of the socket wasn't taken by the handler, then it gets
+   * destroyed */
+  if (slot.ok) {
+    result = destroy_socket(&slot.socket) && result;
+  }
+
+  return result;
 }
 
 static bool accept_handler(ah_acceptor* acceptor)
@@ -355,7 +880,7 @@ static bool accept_handler(ah_acceptor* acceptor)
   ah_on_accept on_accept = acceptor->on_accept;
   ah_socket* socket = acceptor->listening_socket;
   ah_context* context = context_from_socket(socket);
-  struct sockaddr_in remote_address;
+  struct sockaddr_storage remote_address = {0};
   socklen_t remote_address_length = sizeof(remote_address);
   int incoming_socket = accept(socket->socket,
                                (struct sockaddr*)&remote_address,
@@ -378,33 +903,8 @@ static bool accept_handler(ah_acceptor* acceptor)
   }
 #endif
 
-  ah_socket_slot slot = {
-      .ok = set_close_on_exec(incoming_socket, false),
-      {incoming_socket, AH_SOCKET_IO, context},
-  };
-  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, false);
-  if (!slot.ok) {
-    bool result = destroy_socket(&slot.socket);
-    result = accept_error_handler(context, on_accept, "fcntl") && result;
-    return result;
-  }
-
-  uint32_t address_raw = ntohl(remote_address.sin_addr.s_addr);
-  ah_ipv4_address address = {
-      {address_raw >> 24 & 0xFF,
-       address_raw >> 16 & 0xFF,
-       address_raw >> 8 & 0xFF,
-       address_raw & 0xFF},
-      ntohs(remote_address.sin_port),
-  };
-  bool result = on_accept(AH_ERR_OK, &slot.socket, address);
-  /* If ownership of the socket wasn't taken by the handler, then it gets
-   * destroyed */
-  if (slot.ok) {
-    result = destroy_socket(&slot.socket) && result;
-  }
-
-  return result;
+  return deliver_accepted_socket(
+      context, on_accept, incoming_socket, &remote_address);
 }
 
 bool create_acceptor(ah_acceptor* result_acceptor,
@@ -422,7 +922,7 @@ bool create_acceptor(ah_acceptor* result_acceptor,
 #endif
   struct epoll_event event = {events, .data.ptr = result_acceptor};
   if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, socket, &event) == -1) {
-    perror("epoll_ctl");
+    ah_log_error("epoll_ctl", errno);
     result = false;
   }
 
@@ -430,191 +930,3034 @@ bool create_acceptor(ah_acceptor* result_acceptor,
   return result;
 }
 
-/* I/O */
+/* Connector creation */
 
-void move_socket(ah_socket_accepted* result_socket, ah_socket* socket)
+typedef struct ah_connector {
+  /* Points to the embedded socket, so the event loop can find its role the
+   * same way as for acceptors and docks */
+  ah_socket* socket_pointer;
+  ah_socket socket;
+  ah_on_connect on_connect;
+  void* per_call_data;
+} ah_connector;
+
+size_t connector_size()
 {
-  ah_socket_slot* slot =
-      (ah_socket_slot*)((char*)socket - offsetof(ah_socket_slot, socket));
-  if (slot->ok) {
-    memcpy(result_socket, socket, socket_size());
+  return sizeof(ah_connector);
+}
+
+size_t connector_alignment()
+{
+  return _Alignof(ah_connector);
+}
+
+void create_connector(ah_connector* result_connector,
+                      ah_context* context,
+                      ah_on_connect on_connect)
+{
+  *result_connector = (ah_connector) {
+      .socket = {.socket = -1, AH_SOCKET_CONNECT, .context = context},
+      .on_connect = on_connect,
+  };
+  result_connector->socket_pointer = &result_connector->socket;
+}
+
+static bool connect_on_error(ah_connector* connector,
+                             int error_code,
+                             const char* function)
+{
+  if (!is_ah_error_code(error_code)) {
+    ah_log_error(function, error_code);
+    return false;
+  }
+
+  ah_socket_slot slot = {
+      false,
+      {.socket = -1, AH_SOCKET_IO, .context = connector->socket.context},
+  };
+  return connector->on_connect(
+      (ah_error_code)error_code, &slot.socket, connector->per_call_data);
+}
+
+static bool connect_handler(ah_connector* connector)
+{
+  /* The connector is released before calling back, so the callback can queue
+   * the next connect operation */
+  ah_socket_slot slot = {true, connector->socket};
+  connector->socket.socket = -1;
+
+  int error_code = 0;
+  socklen_t error_code_length = sizeof(error_code);
+  int result = getsockopt(slot.socket.socket,
+                          SOL_SOCKET,
+                          SO_ERROR,
+                          &error_code,
+                          &error_code_length);
+  if (result == -1) {
+    error_code = errno;
+  }
+
+  if (error_code != 0) {
+    bool destroyed = destroy_socket(&slot.socket);
+    return connect_on_error(connector, error_code, "connect") && destroyed;
+  }
+
+  /* The socket stays in the epoll set in a disarmed state, so the first I/O
+   * operation only has to modify the registration */
+  slot.socket.role = AH_SOCKET_IO_REARM;
+  bool callback_result =
+      connector->on_connect(AH_ERR_OK, &slot.socket, connector->per_call_data);
+  /* If ownership of the socket wasn't taken by the handler, then it gets
+   * destroyed */
+  if (slot.ok) {
+    callback_result = destroy_socket(&slot.socket) && callback_result;
+  }
+
+  return callback_result;
+}
+
+bool queue_connect_operation(ah_connector* connector,
+                             const ah_address* address,
+                             const ah_address* local_address,
+                             void* per_call_data)
+{
+  if (connector->socket.socket != -1) {
+    return false;
+  }
+
+  ah_ipv4_address ipv4;
+  bool ipv6 = !ipv4_from_address(address, &ipv4);
+  struct sockaddr_storage remote_address;
+  socklen_t remote_length =
+      sockaddr_from_address(address, ipv6, &remote_address);
+  if (remote_length == 0) {
+    return false;
+  }
+
+  ah_socket_slot slot = {true, connector->socket};
+  slot = create_unbound_socket(slot, ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM);
+  if (slot.ok && !set_close_on_exec(slot.socket.socket, true)) {
+    slot.ok = false;
+  }
+  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, true);
+  if (local_address != NULL) {
+    struct sockaddr_storage bound_address;
+    socklen_t bound_length =
+        sockaddr_from_address(local_address, ipv6, &bound_address);
+    slot.ok = slot.ok && bound_length != 0;
+    slot = bind_socket_to_sockaddr(slot, &bound_address, bound_length);
+  }
+
+  if (!slot.ok) {
+    destroy_socket(&slot.socket);
+    return false;
+  }
+
+  connector->per_call_data = per_call_data;
+  int result = connect(slot.socket.socket,
+                       (const struct sockaddr*)&remote_address,
+                       remote_length);
+  if (result == -1 && errno != EINPROGRESS) {
+    int error_code = errno;
+    bool destroyed = destroy_socket(&slot.socket);
+    return connect_on_error(connector, error_code, "connect") && destroyed;
+  }
+
+  /* Even an immediately established connection is reported through the event
+   * loop, so the callback is never called from inside this function on
+   * success */
+  int epoll_descriptor =
+      context_from_socket(&slot.socket)->server->epoll_descriptor;
+  uint32_t events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+  struct epoll_event event = {events, .data.ptr = connector};
+  result = epoll_ctl(
+      epoll_descriptor, EPOLL_CTL_ADD, slot.socket.socket, &event);
+  if (result == -1) {
+    ah_log_error("epoll_ctl", errno);
+    destroy_socket(&slot.socket);
+    return false;
+  }
+
+  connector->socket = slot.socket;
+  return true;
+}
+
+bool destroy_connector(ah_connector* connector)
+{
+  return destroy_socket(&connector->socket);
+}
+
+/* Asynchronous close */
+
+#define CLOSE_DRAIN_BUFFER_SIZE 4096
+#define CLOSE_DRAIN_READS 16
+
+typedef struct ah_closer {
+  /* Points to the embedded socket, so the event loop can find its role the
+   * same way as for acceptors and docks */
+  ah_socket* socket_pointer;
+  ah_socket socket;
+  ah_timer timer;
+  ah_on_close on_close;
+  void* per_call_data;
+} ah_closer;
+
+size_t closer_size()
+{
+  return sizeof(ah_closer);
+}
+
+size_t closer_alignment()
+{
+  return _Alignof(ah_closer);
+}
+
+void create_closer(ah_closer* result_closer, ah_on_close on_close)
+{
+  *result_closer = (ah_closer) {
+      .socket = {.socket = -1, AH_SOCKET_CLOSE},
+      .on_close = on_close,
+  };
+  result_closer->socket_pointer = &result_closer->socket;
+}
+
+static bool reset_socket(ah_socket* socket)
+{
+  /* A zero linger timeout makes close send a RST and drop the send buffer
+   * instead of blocking */
+  struct linger linger = {.l_onoff = 1, .l_linger = 0};
+  int result = setsockopt(
+      socket->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  if (result == -1) {
+    ah_log_error("setsockopt", errno);
+  }
+
+  return destroy_socket(socket) && result != -1;
+}
+
+static bool finish_close(ah_closer* closer, int error_code, bool reset)
+{
+  stop_timer(&closer->timer);
+  bool result =
+      reset ? reset_socket(&closer->socket) : destroy_socket(&closer->socket);
+  return closer->on_close(
+             (ah_error_code)error_code, closer, closer->per_call_data)
+      && result;
+}
+
+static bool close_timeout_handler(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+
+  /* Closes that are done before the event loop gets to them only use the
+   * timer to call back from the event loop */
+  ah_closer* closer = user_data;
+  if (closer->socket.socket == -1) {
+    return closer->on_close(AH_ERR_OK, closer, closer->per_call_data);
+  }
+
+  return finish_close(closer, AH_ERR_TIMED_OUT, true);
+}
+
+static bool register_closer(ah_closer* closer, int operation)
+{
+  int epoll_descriptor =
+      context_from_socket(&closer->socket)->server->epoll_descriptor;
+  uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  struct epoll_event event = {events, .data.ptr = closer};
+  int result =
+      epoll_ctl(epoll_descriptor, operation, closer->socket.socket, &event);
+  if (result == -1) {
+    ah_log_error("epoll_ctl", errno);
+    return false;
+  }
+
+  return true;
+}
+
+static bool close_handler(ah_closer* closer)
+{
+  uint8_t buffer[CLOSE_DRAIN_BUFFER_SIZE];
+  for (int i = 0; i != CLOSE_DRAIN_READS; ++i) {
+    ssize_t bytes_transferred =
+        recv(closer->socket.socket, buffer, sizeof(buffer), 0);
+    if (bytes_transferred == 0) {
+      return finish_close(closer, AH_ERR_OK, false);
+    }
+
+    if (bytes_transferred != -1) {
+      continue;
+    }
+
+    int error_code = errno;
+    if (error_code == AH_ERR_INTERRUPTED) {
+      continue;
+    }
+
+    if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+      return true;
+    }
+
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error("recv", error_code);
+      stop_timer(&closer->timer);
+      reset_socket(&closer->socket);
+      return false;
+    }
+
+    return finish_close(closer, error_code, false);
+  }
+
+  /* The peer keeps sending, so the rest is left for later to let the other
+   * connections make progress. Modifying the registration reports the socket
+   * again, because it is still readable. */
+  return register_closer(closer, EPOLL_CTL_MOD);
+}
+
+bool queue_close_operation(ah_closer* closer,
+                           ah_socket_accepted* socket,
+                           ah_close_mode mode,
+                           uint32_t timeout_ms,
+                           void* per_call_data)
+{
+  ah_socket* base = (ah_socket*)socket;
+  if (closer->socket.socket != -1 || is_timer_active(&closer->timer)
+      || base->socket == -1)
+  {
+    return false;
+  }
+
+  ah_server* server = context_from_socket(base)->server;
+  forget_socket_events(server, base);
+
+  /* Docks stay registered after their last operation, so their registration
+   * has to be modified instead */
+  int operation = base->role == AH_SOCKET_IO_REARM ? EPOLL_CTL_MOD
+                                                   : EPOLL_CTL_ADD;
+  closer->socket = *base;
+  closer->socket.role = AH_SOCKET_CLOSE;
+  closer->per_call_data = per_call_data;
+  base->socket = -1;
+  create_timer(&closer->timer, server, close_timeout_handler, closer);
+
+  if (mode == AH_CLOSE_ABORTIVE) {
+    if (!reset_socket(&closer->socket)) {
+      return false;
+    }
+
+    start_timer(&closer->timer, 0);
+    return true;
+  }
+
+  if (shutdown(closer->socket.socket, SHUT_WR) == -1) {
+    int error_code = errno;
+    /* There is nothing to wait for if the connection is gone already */
+    if (error_code != AH_ERR_NOT_CONNECTED) {
+      ah_log_error("shutdown", error_code);
+      reset_socket(&closer->socket);
+      return false;
+    }
+
+    if (!destroy_socket(&closer->socket)) {
+      return false;
+    }
+
+    start_timer(&closer->timer, 0);
+    return true;
+  }
+
+  if (!register_closer(closer, operation)) {
+    reset_socket(&closer->socket);
+    return false;
+  }
+
+  start_timer(&closer->timer, timeout_ms);
+  return true;
+}
+
+bool destroy_closer(ah_closer* closer)
+{
+  stop_timer(&closer->timer);
+  return closer->socket.socket == -1 || reset_socket(&closer->socket);
+}
+
+/* Hot restart */
+
+/* The kernel accepts at most 253 descriptors in one message */
+#define HANDOFF_BATCH_SIZE 64
+#define HANDOFF_TIMEOUT_MS 5000
+
+/* Every message carries one kind byte per descriptor, which is why the
+ * connection is a SOCK_SEQPACKET one that keeps the message boundaries */
+enum
+{
+  HANDOFF_LISTENER = 'L',
+  HANDOFF_IDLE = 'I',
+};
+
+/* Both processes drive their end of the connection from the event loop. The
+ * predecessor sends the listening sockets first and closes them once they are
+ * sent, then the idle connections, and finally closes the connection, which
+ * tells the successor that it has everything. */
+typedef enum ah_handoff_state
+{
+  HANDOFF_WAITING,
+  HANDOFF_SENDING_LISTENERS,
+  HANDOFF_SENDING,
+  HANDOFF_DRAINING,
+  HANDOFF_RECEIVING,
+  HANDOFF_DONE,
+} ah_handoff_state;
+
+typedef struct ah_handoff_entry {
+  int descriptor;
+  uint8_t kind;
+} ah_handoff_entry;
+
+typedef struct ah_handoff {
+  /* Points to the embedded socket, so the event loop can find its role the
+   * same way as for acceptors and docks. The socket waits for the successor
+   * first and is the connection between the processes after that. */
+  ah_socket* socket_pointer;
+  ah_socket socket;
+  ah_timer timer;
+  ah_handoff_state state;
+  ah_on_handoff on_handoff;
+  ah_on_handoff on_drained;
+  void* user_data;
+  /* The descriptors waiting to be sent. Idle sockets are owned by the queue,
+   * listening sockets by the span. */
+  ah_handoff_entry* entries;
+  uint32_t entry_count;
+  uint32_t entry_capacity;
+  uint32_t sent_count;
+  uint32_t draining_count;
+  /* Where the successor puts the listening sockets it receives */
+  ah_socket_span* span;
+  size_t span_capacity;
+  ah_on_accept on_accept;
+  struct sockaddr_un address;
+} ah_handoff;
+
+typedef union ah_handoff_control {
+  char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH_SIZE)];
+  struct cmsghdr align;
+} ah_handoff_control;
+
+size_t handoff_size()
+{
+  return sizeof(ah_handoff);
+}
+
+size_t handoff_alignment()
+{
+  return _Alignof(ah_handoff);
+}
+
+static bool handoff_address(struct sockaddr_un* result_address,
+                            const char* path)
+{
+  size_t length = strlen(path);
+  if (length == 0 || length >= sizeof(result_address->sun_path)) {
+    ah_log_error("handoff_address", ENAMETOOLONG);
+    return false;
+  }
+
+  *result_address = (struct sockaddr_un) {.sun_family = AF_UNIX};
+  memcpy(result_address->sun_path, path, length + 1);
+  return true;
+}
+
+static bool arm_handoff(ah_handoff* handoff, int operation)
+{
+  int epoll_descriptor =
+      context_from_socket(&handoff->socket)->server->epoll_descriptor;
+  bool is_sending = handoff->state == HANDOFF_SENDING_LISTENERS
+      || handoff->state == HANDOFF_SENDING;
+  uint32_t events = (is_sending ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  struct epoll_event event = {events, .data.ptr = handoff};
+  int result =
+      epoll_ctl(epoll_descriptor, operation, handoff->socket.socket, &event);
+  if (result == -1) {
+    ah_log_error("epoll_ctl", errno);
+    return false;
+  }
+
+  return true;
+}
+
+static bool listen_for_successor(ah_handoff* handoff)
+{
+  ah_socket_slot slot = {true, handoff->socket};
+  int descriptor = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (descriptor == -1) {
+    ah_log_error("socket", errno);
+    return false;
+  }
+
+  slot.socket.socket = descriptor;
+  slot.ok = set_close_on_exec(descriptor, true);
+  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, true);
+  if (!slot.ok) {
+    destroy_socket(&slot.socket);
+    return false;
+  }
+
+  /* The file left behind by the predecessor is replaced */
+  const char* path = handoff->address.sun_path;
+  const struct sockaddr* address_ptr =
+      (const struct sockaddr*)&handoff->address;
+  if (unlink(path) == -1 && errno != ENOENT) {
+    ah_log_error("unlink", errno);
+    slot.ok = false;
+  } else if (bind(descriptor, address_ptr, sizeof(struct sockaddr_un)) == -1) {
+    ah_log_error("bind", errno);
+    slot.ok = false;
+  } else if (listen(descriptor, 1) == -1) {
+    ah_log_error("listen", errno);
+    slot.ok = false;
+  }
+
+  handoff->socket = slot.socket;
+  handoff->state = HANDOFF_WAITING;
+  if (!slot.ok || !arm_handoff(handoff, EPOLL_CTL_ADD)) {
+    destroy_socket(&handoff->socket);
+    return false;
+  }
+
+  return true;
+}
+
+static bool handoff_timeout_handler(ah_timer* timer, void* user_data);
+
+static void init_handoff(ah_handoff* result_handoff,
+                         ah_context* context,
+                         ah_handoff_state state,
+                         ah_on_handoff on_handoff,
+                         void* user_data)
+{
+  *result_handoff = (ah_handoff) {
+      .socket = {.socket = -1, AH_SOCKET_HANDOFF, .context = context},
+      .state = state,
+      .on_handoff = on_handoff,
+      .user_data = user_data,
+  };
+  result_handoff->socket_pointer = &result_handoff->socket;
+  create_timer(&result_handoff->timer,
+               context->server,
+               handoff_timeout_handler,
+               result_handoff);
+}
+
+bool create_handoff(ah_handoff* result_handoff,
+                    ah_context* context,
+                    const char* path,
+                    ah_on_handoff on_handoff,
+                    ah_on_handoff on_drained,
+                    void* user_data)
+{
+  init_handoff(
+      result_handoff, context, HANDOFF_WAITING, on_handoff, user_data);
+  result_handoff->on_drained = on_drained;
+  return handoff_address(&result_handoff->address, path)
+      && listen_for_successor(result_handoff);
+}
+
+static bool reserve_handoff_entry(ah_handoff* handoff)
+{
+  if (handoff->entry_count != handoff->entry_capacity) {
+    return true;
+  }
+
+  uint32_t capacity = handoff->entry_capacity == 0
+      ? HANDOFF_BATCH_SIZE
+      : handoff->entry_capacity * 2;
+  ah_handoff_entry* entries =
+      realloc(handoff->entries, sizeof(ah_handoff_entry) * capacity);
+  if (entries == NULL) {
+    ah_log_error("realloc", ENOMEM);
+    return false;
+  }
+
+  handoff->entries = entries;
+  handoff->entry_capacity = capacity;
+  return true;
+}
+
+/* Closes the idle sockets that were not sent */
+static void clear_handoff_entries(ah_handoff* handoff)
+{
+  for (uint32_t i = handoff->sent_count; i != handoff->entry_count; ++i) {
+    if (handoff->entries[i].kind == HANDOFF_IDLE) {
+      close(handoff->entries[i].descriptor);
+    }
+  }
+
+  free(handoff->entries);
+  handoff->entries = NULL;
+  handoff->entry_count = 0;
+  handoff->entry_capacity = 0;
+  handoff->sent_count = 0;
+}
+
+/* Returns the error that stopped sending, if any */
+static int send_handoff_entries(ah_handoff* handoff)
+{
+  while (handoff->sent_count != handoff->entry_count) {
+    ah_handoff_entry* entries = handoff->entries + handoff->sent_count;
+    uint32_t count = handoff->entry_count - handoff->sent_count;
+    count = count < HANDOFF_BATCH_SIZE ? count : HANDOFF_BATCH_SIZE;
+
+    uint8_t kinds[HANDOFF_BATCH_SIZE];
+    ah_handoff_control control;
+    memset(&control, 0, sizeof(control));
+    struct iovec vector = {kinds, count};
+    struct msghdr message = {
+        .msg_iov = &vector,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    uint8_t* data = CMSG_DATA(header);
+    for (uint32_t i = 0; i != count; ++i) {
+      kinds[i] = entries[i].kind;
+      memcpy(data + sizeof(int) * i, &entries[i].descriptor, sizeof(int));
+    }
+
+    ssize_t result;
+    do {
+      result = sendmsg(handoff->socket.socket, &message, MSG_NOSIGNAL);
+    } while (result == -1 && errno == EINTR);
+    if (result == -1) {
+      return errno;
+    }
+
+    for (uint32_t i = 0; i != count; ++i) {
+      if (entries[i].kind == HANDOFF_IDLE) {
+        close(entries[i].descriptor);
+      }
+    }
+
+    handoff->sent_count += count;
+  }
+
+  return 0;
+}
+
+static bool finish_draining(ah_handoff* handoff)
+{
+  if (handoff->state != HANDOFF_DRAINING || handoff->draining_count != 0) {
+    return true;
+  }
+
+  handoff->state = HANDOFF_DONE;
+  return handoff->on_drained == NULL
+      || handoff->on_drained(handoff, handoff->user_data);
+}
+
+/* Closing the connection tells the successor that it has everything */
+static bool finish_sending(ah_handoff* handoff)
+{
+  stop_timer(&handoff->timer);
+  clear_handoff_entries(handoff);
+  handoff->state = HANDOFF_DRAINING;
+  bool result = destroy_socket(&handoff->socket);
+  return finish_draining(handoff) && result;
+}
+
+/* Listening sockets that did not reach the successor are kept, so this
+ * process goes on accepting and waits for the next successor. Idle
+ * connections that were not sent are closed. */
+static bool fail_handoff(ah_handoff* handoff)
+{
+  if (handoff->state != HANDOFF_SENDING_LISTENERS) {
+    return finish_sending(handoff);
+  }
+
+  stop_timer(&handoff->timer);
+  clear_handoff_entries(handoff);
+  bool result = destroy_socket(&handoff->socket);
+  return listen_for_successor(handoff) && result;
+}
+
+static bool send_handoff(ah_handoff* handoff);
+
+/* The successor has its own references to the listening sockets now, so
+ * closing them here only stops this process from accepting. The file at the
+ * path is left for the successor to replace. */
+static bool hand_over_listeners(ah_handoff* handoff)
+{
+  ah_server* server = context_from_socket(&handoff->socket)->server;
+  ah_socket_span span = server->socket_span;
+  bool result = true;
+  for (size_t i = 0; i != span.size; ++i) {
+    result = destroy_socket(&span.sockets[i]) && result;
+  }
+
+  clear_handoff_entries(handoff);
+  handoff->state = HANDOFF_SENDING;
+  result = handoff->on_handoff(handoff, handoff->user_data) && result;
+  return send_handoff(handoff) && result;
+}
+
+static bool send_handoff(ah_handoff* handoff)
+{
+  int error_code = send_handoff_entries(handoff);
+  if (error_code == EAGAIN) {
+    return arm_handoff(handoff, EPOLL_CTL_MOD);
+  }
+
+  if (error_code != 0) {
+    ah_log_error("sendmsg", error_code);
+    return fail_handoff(handoff);
+  }
+
+  return handoff->state == HANDOFF_SENDING_LISTENERS
+      ? hand_over_listeners(handoff)
+      : finish_sending(handoff);
+}
+
+bool handoff_socket(ah_handoff* handoff, ah_socket_accepted* socket)
+{
+  ah_socket* base = (ah_socket*)socket;
+  if (handoff->state != HANDOFF_SENDING || base->socket == -1
+      || !reserve_handoff_entry(handoff))
+  {
+    return false;
+  }
+
+  /* Registrations belong to the open file, which outlives the descriptor
+   * closed here, so the socket has to leave the epoll set explicitly */
+  ah_server* server = context_from_socket(base)->server;
+  int result =
+      epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, base->socket, NULL);
+  if (result == -1 && errno != ENOENT) {
+    ah_log_error("epoll_ctl", errno);
+    return false;
+  }
+
+  forget_socket_events(server, base);
+  handoff->entries[handoff->entry_count++] =
+      (ah_handoff_entry) {base->socket, HANDOFF_IDLE};
+  base->socket = -1;
+  return true;
+}
+
+static bool on_drain_closed(ah_error_code error_code,
+                            ah_closer* closer,
+                            void* per_call_data)
+{
+  (void)error_code;
+  (void)closer;
+
+  ah_handoff* handoff = per_call_data;
+  --handoff->draining_count;
+  return finish_draining(handoff);
+}
+
+bool drain_handoff_socket(ah_handoff* handoff,
+                          ah_closer* closer,
+                          ah_socket_accepted* socket,
+                          uint32_t timeout_ms)
+{
+  if (handoff->state != HANDOFF_SENDING) {
+    return false;
+  }
+
+  create_closer(closer, on_drain_closed);
+  if (!queue_close_operation(
+          closer, socket, AH_CLOSE_GRACEFUL, timeout_ms, handoff))
+  {
+    return false;
+  }
+
+  ++handoff->draining_count;
+  return true;
+}
+
+static int accept_successor(ah_handoff* handoff)
+{
+  int connection = accept4(
+      handoff->socket.socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (connection == -1) {
+    int error_code = errno;
+    if (error_class_from_code(error_code) != AH_ERROR_CLASS_RETRYABLE) {
+      ah_log_error("accept", error_code);
+    }
+
+    return -1;
+  }
+
+  /* Only a process of the same user may take the sockets over */
+  struct ucred credentials;
+  socklen_t credentials_length = sizeof(credentials);
+  int result = getsockopt(connection,
+                          SOL_SOCKET,
+                          SO_PEERCRED,
+                          &credentials,
+                          &credentials_length);
+  if (result == -1) {
+    ah_log_error("getsockopt", errno);
+  } else if (credentials.uid != geteuid()) {
+    ah_log_error("handoff", EPERM);
+  } else {
+    return connection;
+  }
+
+  close(connection);
+  return -1;
+}
+
+/* Only one successor is served, so the socket waiting for it is replaced by
+ * the connection */
+static bool start_handoff(ah_handoff* handoff)
+{
+  int connection = accept_successor(handoff);
+  if (connection == -1) {
+    return arm_handoff(handoff, EPOLL_CTL_MOD);
+  }
+
+  bool result = destroy_socket(&handoff->socket);
+  handoff->socket.socket = connection;
+  handoff->state = HANDOFF_SENDING_LISTENERS;
+  start_timer(&handoff->timer, HANDOFF_TIMEOUT_MS);
+
+  ah_server* server = context_from_socket(&handoff->socket)->server;
+  ah_socket_span span = server->socket_span;
+  for (size_t i = 0; i != span.size; ++i) {
+    int descriptor = span.sockets[i].socket;
+    if (descriptor == -1) {
+      continue;
+    }
+
+    if (!reserve_handoff_entry(handoff)) {
+      fail_handoff(handoff);
+      return false;
+    }
+
+    handoff->entries[handoff->entry_count++] =
+        (ah_handoff_entry) {descriptor, HANDOFF_LISTENER};
+  }
+
+  if (!arm_handoff(handoff, EPOLL_CTL_ADD)) {
+    fail_handoff(handoff);
+    return false;
+  }
+
+  return send_handoff(handoff) && result;
+}
+
+bool destroy_handoff(ah_handoff* handoff)
+{
+  stop_timer(&handoff->timer);
+  clear_handoff_entries(handoff);
+  bool is_waiting =
+      handoff->state == HANDOFF_WAITING && handoff->socket.socket != -1;
+  handoff->state = HANDOFF_DONE;
+  bool result = destroy_socket(&handoff->socket);
+  if (is_waiting && unlink(handoff->address.sun_path) == -1
+      && errno != ENOENT)
+  {
+    ah_log_error("unlink", errno);
+    result = false;
+  }
+
+  return result;
+}
+
+static bool take_handoff_descriptors(ah_handoff* handoff,
+                                     struct msghdr* message,
+                                     const uint8_t* kinds,
+                                     size_t kind_count)
+{
+  int descriptors[HANDOFF_BATCH_SIZE];
+  size_t count = 0;
+  for (struct cmsghdr* header = CMSG_FIRSTHDR(message); header != NULL;
+       header = CMSG_NXTHDR(message, header))
+  {
+    if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+      size_t size = header->cmsg_len - CMSG_LEN(0);
+      count = size / sizeof(int);
+      memcpy(descriptors, CMSG_DATA(header), size);
+      break;
+    }
+  }
+
+  bool result = kind_count == count
+      && (message->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) == 0;
+  if (!result) {
+    ah_log_error("recvmsg", EPROTO);
+  }
+
+  ah_context* context = context_from_socket(&handoff->socket);
+  ah_socket_span* span = handoff->span;
+  for (size_t i = 0; i != count; ++i) {
+    int descriptor = descriptors[i];
+    if (!result) {
+      close(descriptor);
+    } else if (kinds[i] == HANDOFF_IDLE) {
+      /* A connection the peer reset while it was handed over has no address
+       * anymore and is of no use to the successor */
+      struct sockaddr_storage remote_address = {0};
+      socklen_t remote_address_length = sizeof(remote_address);
+      if (getpeername(descriptor,
+                      (struct sockaddr*)&remote_address,
+                      &remote_address_length)
+          == -1)
+      {
+        if (errno != ENOTCONN) {
+          ah_log_error("getpeername", errno);
+        }
+        close(descriptor);
+        continue;
+      }
+
+      result = deliver_accepted_socket(
+          context, handoff->on_accept, descriptor, &remote_address);
+    } else if (span->size == handoff->span_capacity) {
+      ah_log_error("receive_handoff", ENOBUFS);
+      close(descriptor);
+      result = false;
+    } else {
+      span->sockets[span->size++] = (ah_socket) {
+          descriptor,
+          AH_SOCKET_ACCEPT,
+          .context = context,
+      };
+    }
+  }
+
+  return result;
+}
+
+/* Receives the messages that arrived so far and sets done at the end of
+ * file */
+static bool receive_handoff_messages(ah_handoff* handoff, bool* done)
+{
+  for (;;) {
+    uint8_t kinds[HANDOFF_BATCH_SIZE];
+    ah_handoff_control control;
+    struct iovec vector = {kinds, sizeof(kinds)};
+    struct msghdr message = {
+        .msg_iov = &vector,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t kind_count =
+        recvmsg(handoff->socket.socket, &message, MSG_CMSG_CLOEXEC);
+    if (kind_count == -1) {
+      int error_code = errno;
+      if (error_code == EINTR) {
+        continue;
+      }
+
+      if (error_code == EAGAIN) {
+        return true;
+      }
+
+      ah_log_error("recvmsg", error_code);
+      return false;
+    }
+
+    if (kind_count == 0) {
+      *done = true;
+      return true;
+    }
+
+    if (!take_handoff_descriptors(
+            handoff, &message, kinds, (size_t)kind_count))
+    {
+      return false;
+    }
+  }
+}
+
+static bool finish_receiving(ah_handoff* handoff)
+{
+  stop_timer(&handoff->timer);
+  handoff->state = HANDOFF_DONE;
+  bool result = destroy_socket(&handoff->socket);
+  return handoff->on_handoff(handoff, handoff->user_data) && result;
+}
+
+static bool handoff_handler(ah_handoff* handoff)
+{
+  if (handoff->state == HANDOFF_WAITING) {
+    return start_handoff(handoff);
+  }
+
+  if (handoff->state != HANDOFF_RECEIVING) {
+    return send_handoff(handoff);
+  }
+
+  bool done = false;
+  if (receive_handoff_messages(handoff, &done) && !done) {
+    return arm_handoff(handoff, EPOLL_CTL_MOD);
+  }
+
+  return finish_receiving(handoff);
+}
+
+/* A stalled peer does not keep the listening sockets in limbo forever */
+static bool handoff_timeout_handler(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+
+  ah_handoff* handoff = user_data;
+  ah_log_error("handoff", ETIMEDOUT);
+  return handoff->state == HANDOFF_RECEIVING ? finish_receiving(handoff)
+                                             : fail_handoff(handoff);
+}
+
+bool receive_handoff(ah_handoff* result_handoff,
+                     ah_context* context,
+                     const char* path,
+                     ah_socket_span* span,
+                     ah_on_accept on_accept,
+                     ah_on_handoff on_received,
+                     void* user_data)
+{
+  init_handoff(
+      result_handoff, context, HANDOFF_RECEIVING, on_received, user_data);
+  result_handoff->span = span;
+  result_handoff->span_capacity = span->size;
+  result_handoff->on_accept = on_accept;
+  span->size = 0;
+  if (!handoff_address(&result_handoff->address, path)) {
+    return false;
+  }
+
+  int connection =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (connection == -1) {
+    ah_log_error("socket", errno);
+    return false;
+  }
+
+  /* Connecting to a Unix socket completes right away if the predecessor is
+   * listening, so only the messages are waited for */
+  result_handoff->socket.socket = connection;
+  const struct sockaddr* address_ptr =
+      (const struct sockaddr*)&result_handoff->address;
+  if (connect(connection, address_ptr, sizeof(struct sockaddr_un)) == -1) {
+    ah_log_error("connect", errno);
+    destroy_socket(&result_handoff->socket);
+    return false;
+  }
+
+  if (!arm_handoff(result_handoff, EPOLL_CTL_ADD)) {
+    destroy_socket(&result_handoff->socket);
+    return false;
+  }
+
+  start_timer(&result_handoff->timer, HANDOFF_TIMEOUT_MS);
+  return true;
+}
+
+/* I/O */
+
+/* Unlike sendmsg, sendfile and splice cannot be told to not raise SIGPIPE
+ * when the peer is gone. The signal is blocked for the calling thread around
+ * them instead, and if one was raised, it is consumed before the previous mask
+ * is restored. The disposition of the signal is left to the application. */
+typedef struct sigpipe_mask {
+  sigset_t previous;
+  bool was_pending;
+} sigpipe_mask;
+
+static void block_sigpipe(sigpipe_mask* mask)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  sigset_t pending;
+  sigpending(&pending);
+  mask->was_pending = sigismember(&pending, SIGPIPE) == 1;
+  pthread_sigmask(SIG_BLOCK, &set, &mask->previous);
+}
+
+static void unblock_sigpipe(sigpipe_mask* mask, int error_code)
+{
+  /* A signal that was pending already is left for its owner */
+  if (error_code == EPIPE && !mask->was_pending) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    struct timespec no_wait = {0};
+    while (sigtimedwait(&set, NULL, &no_wait) == -1 && errno == EINTR) {
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &mask->previous, NULL);
+}
+
+void move_socket(ah_socket_accepted* result_socket, ah_socket* socket)
+{
+  ah_socket_slot* slot =
+      (ah_socket_slot*)((char*)socket - offsetof(ah_socket_slot, socket));
+  if (slot->ok) {
+    memcpy(result_socket, socket, socket_size());
     slot->ok = false;
   }
 }
 
-typedef struct ah_io_port {
-  bool active;
-  bool is_read_port;
-  uint32_t buffer_length;
-  void* buffer;
-  ah_on_io_complete on_complete;
-  void* per_call_data;
-} ah_io_port;
+bool is_io_operation_active(ah_io_operation* operation)
+{
+  return ((ah_io_port*)operation)->active;
+}
+
+ah_io_buffer buffer_from_io_operation(ah_io_operation* operation)
+{
+  ah_io_port* port = (ah_io_port*)operation;
+  return (ah_io_buffer) {port->buffer_length, port->buffer};
+}
+
+uint64_t rx_timestamp_from_io_operation(ah_io_operation* operation)
+{
+  ah_io_dock* dock = dock_from_operation(operation);
+  if (dock->socket == NULL) {
+    return 0;
+  }
+
+  ah_context* context = context_from_socket((ah_socket*)dock->socket);
+  if (context == NULL) {
+    return 0;
+  }
+
+  ah_server* server = context->server;
+  return server->rx_timestamp_port == (ah_io_port*)operation
+      ? server->rx_timestamp
+      : 0;
+}
+
+ah_io_dock* dock_from_operation(ah_io_operation* operation)
+{
+  ah_io_port* port = (ah_io_port*)operation;
+  return port->is_read_port ? parentof(port, ah_io_dock, read_port)
+                            : parentof(port, ah_io_dock, write_port);
+}
+
+static bool are_reads_paused(ah_io_dock* dock)
+{
+  ah_io_port* port = (ah_io_port*)&dock->write_port;
+  return port->active && port->is_write_queue
+      && ((ah_write_queue*)port->per_call_data)->reads_paused;
+}
+
+static uint32_t events_from_dock(ah_io_dock* dock)
+{
+  /* Paused reads are not armed, so the kernel applies backpressure by
+   * filling the receive buffer and then shrinking the window */
+  uint32_t events = 0;
+  if (((ah_io_port*)&dock->read_port)->active && !are_reads_paused(dock)) {
+    events |= EPOLLIN;
+  }
+  if (((ah_io_port*)&dock->write_port)->active) {
+    events |= EPOLLOUT;
+  }
+
+  return events;
+}
+
+static bool arm_io_socket(ah_server* server, ah_io_dock* dock, int operation)
+{
+  uint32_t events = events_from_dock(dock) | EPOLLET | EPOLLONESHOT;
+  struct epoll_event event = {events, .data.ptr = dock};
+  int socket = ((ah_socket*)dock->socket)->socket;
+  if (epoll_ctl(server->epoll_descriptor, operation, socket, &event) == -1) {
+    ah_log_error("epoll_ctl", errno);
+    return false;
+  }
+
+  return true;
+}
+
+static bool register_io_socket(ah_io_dock* dock)
+{
+  ah_socket* socket = (ah_socket*)dock->socket;
+  bool rearm = socket->role == AH_SOCKET_IO_REARM;
+  socket->role = AH_SOCKET_IO_REARM;
+
+  /* The dock being dispatched to is re-armed by the event loop after both of
+   * its handlers ran, covering every port that is active by then */
+  ah_server* server = context_from_socket(socket)->server;
+  if (rearm && server->dispatch_socket == socket) {
+    return true;
+  }
+
+  return arm_io_socket(server, dock, rearm ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+}
+
+static uint64_t timespec_to_ns(struct timespec time)
+{
+  return (uint64_t)time.tv_sec * 1000000000U + (uint64_t)time.tv_nsec;
+}
+
+static uint64_t record_rx_timestamp(ah_socket* socket,
+                                    struct msghdr* message)
+{
+  struct cmsghdr* control = CMSG_FIRSTHDR(message);
+  for (; control != NULL; control = CMSG_NXTHDR(message, control)) {
+    if (control->cmsg_level == SOL_SOCKET
+        && control->cmsg_type == SO_TIMESTAMPING)
+    {
+      break;
+    }
+  }
+
+  if (control == NULL) {
+    return 0;
+  }
+
+  /* The payload is a struct scm_timestamping, whose first element holds the
+   * software timestamp */
+  struct timespec arrival;
+  memcpy(&arrival, CMSG_DATA(control), sizeof(arrival));
+  uint64_t arrival_ns = timespec_to_ns(arrival);
+  if (arrival_ns == 0) {
+    return 0;
+  }
+
+  struct timespec now;
+  if (clock_gettime(CLOCK_REALTIME, &now) != 0) {
+    return arrival_ns;
+  }
+
+  uint64_t now_ns = timespec_to_ns(now);
+  uint64_t delay = now_ns > arrival_ns ? now_ns - arrival_ns : 0;
+  ah_server_stats* stats = &context_from_socket(socket)->server->core.stats;
+  ++stats->rx_timestamped_reads;
+  stats->rx_queue_delay_total_ns += delay;
+  if (stats->rx_queue_delay_max_ns < delay) {
+    stats->rx_queue_delay_max_ns = delay;
+  }
+
+  return arrival_ns;
+}
+
+static ssize_t receive_with_timestamp(ah_socket* socket,
+                                      ah_io_port* port,
+                                      uint64_t* arrival_ns)
+{
+  union {
+    char buffer[CMSG_SPACE(sizeof(struct timespec[3]))];
+    struct cmsghdr align;
+  } control;
+  struct iovec vector = {port->buffer, port->buffer_length};
+  struct msghdr message = {
+      .msg_iov = &vector,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+
+  ssize_t bytes_transferred = recvmsg(socket->socket, &message, 0);
+  if (bytes_transferred != -1) {
+    *arrival_ns = record_rx_timestamp(socket, &message);
+  }
+
+  return bytes_transferred;
+}
+
+static bool relay_handler(ah_io_port* port);
+
+static bool read_handler(ah_socket* socket, ah_io_port* port)
+{
+  if (!port->active) {
+    return true;
+  }
+
+  if (port->is_relay) {
+    return relay_handler(port);
+  }
+  port->active = false;
+
+  bool timestamps = (socket->flags & AH_SOCKET_RX_TIMESTAMPS) != 0;
+  uint64_t arrival_ns = 0;
+  ssize_t bytes_transferred = timestamps
+      ? receive_with_timestamp(socket, port, &arrival_ns)
+      : recv(socket->socket, port->buffer, port->buffer_length, 0);
+
+  int error_code = 0;
+  if (bytes_transferred == -1) {
+    error_code = errno;
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error(timestamps ? "recvmsg" : "recv", error_code);
+      return false;
+    }
+
+    bytes_transferred = 0;
+  }
+
+  ah_error_code ec = (ah_error_code)error_code;
+  ah_io_operation* op = (ah_io_operation*)port;
+  if (!timestamps) {
+    return port->on_complete(
+        ec, op, (uint32_t)bytes_transferred, port->per_call_data);
+  }
+
+  ah_server* server = context_from_socket(socket)->server;
+  server->rx_timestamp_port = port;
+  server->rx_timestamp = arrival_ns;
+  bool result = port->on_complete(
+      ec, op, (uint32_t)bytes_transferred, port->per_call_data);
+  server->rx_timestamp_port = NULL;
+  return result;
+}
+
+bool queue_read_operation4(ah_io_dock* dock,
+                           ah_io_buffer buffer,
+                           ah_on_io_complete on_complete,
+                           void* per_call_data)
+{
+  ah_io_port* port = (ah_io_port*)&dock->read_port;
+  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+    return false;
+  }
+
+  init_io_port(port, true, buffer, on_complete, per_call_data);
+  return register_io_socket(dock);
+}
+
+static bool write_queue_handler(ah_socket* socket, ah_io_port* port);
+
+static bool write_handler(ah_socket* socket, ah_io_port* port)
+{
+  if (!port->active) {
+    return true;
+  }
+
+  if (port->is_write_queue) {
+    return write_queue_handler(socket, port);
+  }
+
+  if (port->is_relay) {
+    return relay_handler(port);
+  }
+  port->active = false;
+
+  ssize_t bytes_transferred =
+      send(socket->socket, port->buffer, port->buffer_length, MSG_NOSIGNAL);
+
+  int error_code = 0;
+  if (bytes_transferred == -1) {
+    error_code = errno;
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error("send", error_code);
+      return false;
+    }
+
+    bytes_transferred = 0;
+  }
+
+  ah_error_code ec = (ah_error_code)error_code;
+  ah_io_operation* op = (ah_io_operation*)port;
+  return port->on_complete(
+      ec, op, (uint32_t)bytes_transferred, port->per_call_data);
+}
+
+bool queue_write_operation4(ah_io_dock* dock,
+                            ah_io_buffer buffer,
+                            ah_on_io_complete on_complete,
+                            void* per_call_data)
+{
+  ah_io_port* port = (ah_io_port*)&dock->write_port;
+  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+    return false;
+  }
+
+  init_io_port(port, false, buffer, on_complete, per_call_data);
+  return register_io_socket(dock);
+}
+
+/* Write queue */
+
+#define WRITE_QUEUE_VECTORS 64
+
+/* Detaches the requests that were sent completely, or every request if the
+ * send failed, and calls their callbacks */
+static bool finish_queue_send(ah_write_queue* queue,
+                              ah_io_port* port,
+                              const char* function,
+                              ssize_t bytes_transferred,
+                              int error_code)
+{
+  if (bytes_transferred == -1) {
+    /* The port stays active, so the event loop arms the socket again */
+    if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+      return true;
+    }
+
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error(function, error_code);
+      return false;
+    }
+
+    port->active = false;
+    ah_write_request* failed = take_write_requests(queue);
+    return update_write_pressure(queue)
+        && finish_write_requests(failed, (ah_error_code)error_code);
+  }
+
+  ah_write_request* completed =
+      complete_write_requests(queue, (uint64_t)bytes_transferred);
+  port->active = queue->head != NULL;
+  return update_write_pressure(queue)
+      && finish_write_requests(completed, AH_ERR_OK);
+}
+
+/* Sending from a file takes a system call of its own, because sendfile cannot
+ * be combined with the buffers around it */
+static bool send_file_request(ah_socket* socket,
+                              ah_io_port* port,
+                              ah_write_queue* queue)
+{
+  ah_write_request* request = queue->head;
+  uint32_t offset = request->bytes_transferred;
+  off_t file_offset = (off_t)(request->file_offset + offset);
+  size_t length = request->buffer.buffer_length - offset;
+  sigpipe_mask mask;
+  block_sigpipe(&mask);
+  ssize_t bytes_transferred = sendfile(socket->socket,
+                                       (int)request->file->handle,
+                                       &file_offset,
+                                       length);
+  int error_code = bytes_transferred == -1 ? errno : 0;
+  unblock_sigpipe(&mask, error_code);
+  /* The file was truncated since it was opened */
+  if (bytes_transferred == 0 && length != 0) {
+    bytes_transferred = -1;
+    error_code = AH_ERR_IO_ERROR;
+  }
+
+  return finish_queue_send(
+      queue, port, "sendfile", bytes_transferred, error_code);
+}
+
+static bool write_queue_handler(ah_socket* socket, ah_io_port* port)
+{
+  ah_write_queue* queue = port->per_call_data;
+  if (queue->head->file != NULL) {
+    return send_file_request(socket, port, queue);
+  }
+
+  struct iovec vectors[WRITE_QUEUE_VECTORS];
+  size_t count = 0;
+  ah_write_request* request = queue->head;
+  for (; request != NULL && request->file == NULL
+       && count != WRITE_QUEUE_VECTORS;
+       request = request->next)
+  {
+    uint8_t* buffer = request->buffer.buffer;
+    uint32_t offset = request->bytes_transferred;
+    vectors[count++] = (struct iovec) {
+        buffer + offset,
+        request->buffer.buffer_length - offset,
+    };
+  }
+
+  /* Partial segments are held back if the rest of the queue did not fit into
+   * this call */
+  struct msghdr message = {.msg_iov = vectors, .msg_iovlen = count};
+  int flags = MSG_NOSIGNAL | (request != NULL ? MSG_MORE : 0);
+  ssize_t bytes_transferred = sendmsg(socket->socket, &message, flags);
+  int error_code = bytes_transferred == -1 ? errno : 0;
+  return finish_queue_send(
+      queue, port, "sendmsg", bytes_transferred, error_code);
+}
+
+bool enqueue_write_request(ah_write_queue* queue, ah_write_request* request)
+{
+  ah_io_dock* dock = queue->dock;
+  ah_io_port* port = (ah_io_port*)&dock->write_port;
+  if (port->active && !port->is_write_queue) {
+    return false;
+  }
+
+  append_write_request(queue, request);
+
+  if (!port->active) {
+    ah_io_port new_port = {
+        .active = true,
+        .is_write_queue = true,
+        .per_call_data = queue,
+    };
+    memcpy(port, &new_port, sizeof(ah_io_port));
+    if (!register_io_socket(dock)) {
+      return false;
+    }
+  }
+
+  return update_write_pressure(queue);
+}
+
+bool cancel_write_queue(ah_write_queue* queue)
+{
+  ((ah_io_port*)&queue->dock->write_port)->active = false;
+  ah_write_request* cancelled = take_write_requests(queue);
+  return finish_write_requests(cancelled, AH_ERR_OPERATION_ABORTED);
+}
+
+bool cork_write_queue(ah_write_queue* queue, bool corked)
+{
+  int value = corked;
+  int result = setsockopt(((ah_socket*)queue->dock->socket)->socket,
+                          IPPROTO_TCP,
+                          TCP_CORK,
+                          &value,
+                          sizeof(value));
+  if (result == -1) {
+    ah_log_error("setsockopt", errno);
+    return false;
+  }
+
+  return true;
+}
+
+/* Relay */
+
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define RELAY_SPLICES_PER_EVENT 16
+#define RELAY_END_OF_FILE_MAX_DELAY_MS 64
+#define STREAM_POSITION_ATTEMPTS 4
+
+typedef struct ah_relay_direction {
+  ah_relay* relay;
+  ah_io_dock* source;
+  ah_io_dock* sink;
+  int pipe[2];
+  uint32_t pipe_bytes;
+  uint64_t bytes_transferred;
+  uint64_t cookie;
+  uint64_t consumed_base;
+  uint64_t written_base;
+  bool end_of_file;
+  bool shut_down;
+} ah_relay_direction;
+
+typedef struct ah_relay {
+  ah_relay_direction directions[2];
+  ah_on_relay_done on_done;
+  void* user_data;
+  ah_sockmap* sockmap;
+  ah_timer timer;
+  uint32_t end_of_file_delay_ms;
+} ah_relay;
+
+size_t relay_size()
+{
+  return sizeof(ah_relay);
+}
+
+size_t relay_alignment()
+{
+  return _Alignof(ah_relay);
+}
+
+static int socket_from_dock(ah_io_dock* dock)
+{
+  return ((ah_socket*)dock->socket)->socket;
+}
+
+static void close_relay_pipes(ah_relay* relay)
+{
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &relay->directions[i];
+    for (uint32_t j = 0; j != 2; ++j) {
+      if (direction->pipe[j] != -1) {
+        close(direction->pipe[j]);
+        direction->pipe[j] = -1;
+      }
+    }
+  }
+}
+
+static void unlink_relay(ah_relay* relay);
+
+/* The ports are only deactivated, so the sockets are disarmed the next time
+ * they fire or are re-armed */
+static void stop_relay(ah_relay* relay)
+{
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &relay->directions[i];
+    ((ah_io_port*)&direction->source->read_port)->active = false;
+    ((ah_io_port*)&direction->sink->write_port)->active = false;
+  }
+
+  close_relay_pipes(relay);
+  if (relay->sockmap != NULL) {
+    stop_timer(&relay->timer);
+    unlink_relay(relay);
+  }
+}
+
+static bool fail_relay(ah_relay* relay, const char* function, int error_code)
+{
+  if (!is_ah_error_code(error_code)) {
+    ah_log_error(function, error_code);
+    return false;
+  }
+
+  stop_relay(relay);
+  return relay->on_done((ah_error_code)error_code, relay, relay->user_data);
+}
+
+static bool set_relay_port(ah_io_dock* dock,
+                           bool is_read_port,
+                           bool active,
+                           ah_relay_direction* direction)
+{
+  ah_io_port* port =
+      (ah_io_port*)(is_read_port ? &dock->read_port : &dock->write_port);
+  if (!active || port->active) {
+    port->active = active;
+    return true;
+  }
+
+  init_io_port(port, is_read_port, (ah_io_buffer) {0}, NULL, direction);
+  port->is_relay = true;
+  return register_io_socket(dock);
+}
+
+/* Reads only go into an empty pipe, which tells the two reasons for EAGAIN
+ * apart and bounds the bytes in flight per direction to the size of the
+ * pipe. Returns the error that stopped the splices, if any. */
+static int splice_relay(ah_relay_direction* direction)
+{
+  for (uint32_t i = 0; i != RELAY_SPLICES_PER_EVENT; ++i) {
+    ssize_t result;
+    if (direction->pipe_bytes != 0) {
+      result = splice(direction->pipe[0],
+                      NULL,
+                      socket_from_dock(direction->sink),
+                      NULL,
+                      direction->pipe_bytes,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (result == -1) {
+        return errno == EAGAIN ? 0 : errno;
+      }
+
+      direction->pipe_bytes -= (uint32_t)result;
+      direction->bytes_transferred += (uint64_t)result;
+      continue;
+    }
+
+    if (direction->end_of_file) {
+      break;
+    }
+
+    result = splice(socket_from_dock(direction->source),
+                    NULL,
+                    direction->pipe[1],
+                    NULL,
+                    RELAY_PIPE_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (result == -1) {
+      return errno == EAGAIN ? 0 : errno;
+    }
+
+    direction->end_of_file = result == 0;
+    direction->pipe_bytes = (uint32_t)result;
+  }
+
+  return 0;
+}
+
+static bool pump_relay(ah_relay_direction* direction)
+{
+  ah_relay* relay = direction->relay;
+  sigpipe_mask mask;
+  block_sigpipe(&mask);
+  int error_code = splice_relay(direction);
+  unblock_sigpipe(&mask, error_code);
+  if (error_code != 0) {
+    return fail_relay(relay, "splice", error_code);
+  }
+
+  if (direction->end_of_file && direction->pipe_bytes == 0
+      && !direction->shut_down)
+  {
+    direction->shut_down = true;
+    int sink = socket_from_dock(direction->sink);
+    if (shutdown(sink, SHUT_WR) == -1 && errno != ENOTCONN) {
+      return fail_relay(relay, "shutdown", errno);
+    }
+  }
+
+  if (relay->directions[0].shut_down && relay->directions[1].shut_down) {
+    stop_relay(relay);
+    return relay->on_done(AH_ERR_OK, relay, relay->user_data);
+  }
+
+  /* Hitting the limit with work left keeps the port active, so the socket
+   * fires again right after being re-armed */
+  bool wants_read = !direction->end_of_file && direction->pipe_bytes == 0;
+  bool wants_write = direction->pipe_bytes != 0;
+  return set_relay_port(direction->source, true, wants_read, direction)
+      && set_relay_port(direction->sink, false, wants_write, direction);
+}
+
+static bool settle_sockmap_direction(ah_relay_direction* direction);
+static bool forward_sockmap_end_of_file(ah_relay_direction* direction);
+
+static bool relay_handler(ah_io_port* port)
+{
+  ah_relay_direction* direction = port->per_call_data;
+  if (direction->relay->sockmap == NULL) {
+    return pump_relay(direction);
+  }
+
+  /* The sink of a kernel relay is only watched while the end of file waits
+   * for the sink to make room for the last redirected bytes */
+  if (!port->is_read_port) {
+    port->active = false;
+    return forward_sockmap_end_of_file(direction);
+  }
+
+  return settle_sockmap_direction(direction);
+}
+
+static bool open_relay_pipe(ah_relay_direction* direction)
+{
+  if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    ah_log_error("pipe2", errno);
+    return false;
+  }
+
+  /* A larger pipe moves more per system call, but the default size is fine if
+   * the limit for unprivileged users does not allow this */
+  fcntl(direction->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  return true;
+}
+
+static bool init_relay(ah_relay* result_relay,
+                       ah_io_dock* client,
+                       ah_io_dock* upstream,
+                       ah_on_relay_done on_done,
+                       void* user_data)
+{
+  ah_io_dock* docks[2] = {client, upstream};
+  for (uint32_t i = 0; i != 2; ++i) {
+    if (((ah_io_port*)&docks[i]->read_port)->active
+        || ((ah_io_port*)&docks[i]->write_port)->active)
+    {
+      return false;
+    }
+  }
+
+  *result_relay = (ah_relay) {
+      .directions = {
+          {result_relay, client, upstream, {-1, -1}},
+          {result_relay, upstream, client, {-1, -1}},
+      },
+      .on_done = on_done,
+      .user_data = user_data,
+  };
+
+  return true;
+}
+
+bool start_relay(ah_relay* result_relay,
+                 ah_io_dock* client,
+                 ah_io_dock* upstream,
+                 ah_on_relay_done on_done,
+                 void* user_data)
+{
+  if (!init_relay(result_relay, client, upstream, on_done, user_data)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    if (!open_relay_pipe(&result_relay->directions[i])) {
+      close_relay_pipes(result_relay);
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &result_relay->directions[i];
+    if (!set_relay_port(direction->source, true, true, direction)) {
+      stop_relay(result_relay);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool sockmap_sent_bytes(ah_relay_direction* direction,
+                               bool* result_moving);
+
+ah_relay_counters counters_from_relay(ah_relay* relay)
+{
+  /* The kernel does not report what it redirected, so the counters of the
+   * sinks are read instead while the directions are still open. Counters
+   * that keep moving leave the previous values. */
+  for (uint32_t i = 0; i != 2 && relay->sockmap != NULL; ++i) {
+    bool moving;
+    if (!relay->directions[i].shut_down) {
+      sockmap_sent_bytes(&relay->directions[i], &moving);
+    }
+  }
+
+  return (ah_relay_counters) {
+      relay->directions[0].bytes_transferred,
+      relay->directions[1].bytes_transferred,
+  };
+}
+
+bool destroy_relay(ah_relay* relay)
+{
+  stop_relay(relay);
+  return true;
+}
+
+/* Kernel relay */
+
+#define BPF_INSTRUCTION(code, destination, source, offset, immediate) \
+  ((struct bpf_insn) {(code), (destination), (source), (offset), (immediate)})
+
+#define BPF_LOAD_MAP(destination, map) \
+  BPF_INSTRUCTION(BPF_LD | BPF_DW | BPF_IMM, \
+                  (destination), \
+                  BPF_PSEUDO_MAP_FD, \
+                  0, \
+                  (map)), \
+      BPF_INSTRUCTION(0, 0, 0, 0, 0)
+
+/* The sockets are looked up by their cookies. The verdict program is attached
+ * to the sources, while the redirects go to the targets, which hold the same
+ * sockets without a program. Every socket of a relay is a target before
+ * either one becomes a source, so a redirect never finds its peer missing */
+typedef struct ah_sockmap {
+  int sources;
+  int targets;
+  int peers;
+  int program;
+} ah_sockmap;
+
+size_t sockmap_size()
+{
+  return sizeof(ah_sockmap);
+}
+
+size_t sockmap_alignment()
+{
+  return _Alignof(ah_sockmap);
+}
+
+static long bpf(int command, union bpf_attr* attributes)
+{
+  return syscall(__NR_bpf, command, attributes, sizeof(*attributes));
+}
+
+static int create_bpf_map(uint32_t type,
+                          uint32_t value_size,
+                          uint32_t max_entries)
+{
+  union bpf_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.map_type = type;
+  attributes.key_size = sizeof(uint64_t);
+  attributes.value_size = value_size;
+  attributes.max_entries = max_entries;
+  return (int)bpf(BPF_MAP_CREATE, &attributes);
+}
+
+static bool update_bpf_map(int map, uint64_t key, const void* value)
+{
+  union bpf_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.map_fd = (uint32_t)map;
+  attributes.key = (uintptr_t)&key;
+  attributes.value = (uintptr_t)value;
+  attributes.flags = BPF_NOEXIST;
+  return bpf(BPF_MAP_UPDATE_ELEM, &attributes) == 0;
+}
+
+static void delete_from_bpf_map(int map, uint64_t key)
+{
+  union bpf_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.map_fd = (uint32_t)map;
+  attributes.key = (uintptr_t)&key;
+  bpf(BPF_MAP_DELETE_ELEM, &attributes);
+}
+
+/* Redirects the segment to the peer of the socket it arrived on, or passes it
+ * to the socket itself if the socket has no peer */
+static int load_verdict_program(ah_sockmap* sockmap)
+{
+  struct bpf_insn instructions[] = {
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+      BPF_INSTRUCTION(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+      BPF_INSTRUCTION(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+      BPF_LOAD_MAP(BPF_REG_1, sockmap->peers),
+      BPF_INSTRUCTION(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+      BPF_INSTRUCTION(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 7, 0),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_0, 0, 0),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+      BPF_LOAD_MAP(BPF_REG_2, sockmap->targets),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+      BPF_INSTRUCTION(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+      BPF_INSTRUCTION(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      BPF_INSTRUCTION(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+      BPF_INSTRUCTION(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  union bpf_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attributes.insns = (uintptr_t)instructions;
+  attributes.insn_cnt = sizeof(instructions) / sizeof(instructions[0]);
+  attributes.license = (uintptr_t)"GPL";
+  return (int)bpf(BPF_PROG_LOAD, &attributes);
+}
+
+void destroy_sockmap(ah_sockmap* sockmap)
+{
+  int descriptors[4] = {
+      sockmap->sources, sockmap->targets, sockmap->peers, sockmap->program};
+  for (uint32_t i = 0; i != 4; ++i) {
+    if (descriptors[i] != -1) {
+      close(descriptors[i]);
+    }
+  }
+
+  *sockmap = (ah_sockmap) {-1, -1, -1, -1};
+}
+
+/* Missing privileges are the expected reason for BPF to be unavailable, which
+ * the caller handles by relaying in user space */
+static bool fail_sockmap(ah_sockmap* sockmap, const char* function)
+{
+  if (errno != EPERM && errno != ENOSYS) {
+    ah_log_error(function, errno);
+  }
+
+  destroy_sockmap(sockmap);
+  return false;
+}
+
+bool create_sockmap(ah_sockmap* result_sockmap, uint32_t max_relays)
+{
+  *result_sockmap = (ah_sockmap) {-1, -1, -1, -1};
+  if (max_relays == 0 || max_relays > UINT32_MAX / 2) {
+    return false;
+  }
+
+  uint32_t max_sockets = max_relays * 2;
+  result_sockmap->sources =
+      create_bpf_map(BPF_MAP_TYPE_SOCKHASH, sizeof(int), max_sockets);
+  result_sockmap->targets =
+      create_bpf_map(BPF_MAP_TYPE_SOCKHASH, sizeof(int), max_sockets);
+  result_sockmap->peers =
+      create_bpf_map(BPF_MAP_TYPE_HASH, sizeof(uint64_t), max_sockets);
+  if (result_sockmap->sources == -1 || result_sockmap->targets == -1
+      || result_sockmap->peers == -1)
+  {
+    return fail_sockmap(result_sockmap, "bpf");
+  }
+
+  result_sockmap->program = load_verdict_program(result_sockmap);
+  if (result_sockmap->program == -1) {
+    return fail_sockmap(result_sockmap, "bpf");
+  }
+
+  union bpf_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.target_fd = (uint32_t)result_sockmap->sources;
+  attributes.attach_bpf_fd = (uint32_t)result_sockmap->program;
+  attributes.attach_type = BPF_SK_SKB_VERDICT;
+  if (bpf(BPF_PROG_ATTACH, &attributes) == -1) {
+    return fail_sockmap(result_sockmap, "bpf");
+  }
+
+  return true;
+}
+
+static bool read_tcp_counter(int descriptor, bool received, uint64_t* result)
+{
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  if (getsockopt(descriptor, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) {
+    ah_log_error("getsockopt", errno);
+    return false;
+  }
+
+  *result = received ? info.tcpi_bytes_received : info.tcpi_bytes_acked;
+  return true;
+}
+
+/* Returns the bytes the application took from the socket or gave to it. The
+ * counter and the length of the queue cannot be read at once, so they are
+ * read again until the counter did not move in between. Under steady traffic
+ * it may move every time, in which case \c false is returned with
+ * \c *result_moving set after a few attempts, and the caller tries again
+ * later. */
+static bool read_stream_position(int descriptor,
+                                 bool received,
+                                 uint64_t* result,
+                                 bool* result_moving)
+{
+  *result_moving = false;
+  for (uint32_t i = 0; i != STREAM_POSITION_ATTEMPTS; ++i) {
+    uint64_t before;
+    uint64_t after;
+    int queued;
+    if (!read_tcp_counter(descriptor, received, &before)) {
+      return false;
+    }
+    if (ioctl(descriptor, received ? SIOCINQ : SIOCOUTQ, &queued) == -1) {
+      ah_log_error("ioctl", errno);
+      return false;
+    }
+    if (!read_tcp_counter(descriptor, received, &after)) {
+      return false;
+    }
+
+    if (before == after) {
+      *result =
+          received ? before - (uint64_t)queued : before + (uint64_t)queued;
+      return true;
+    }
+  }
+
+  *result_moving = true;
+  return false;
+}
+
+static bool sockmap_sent_bytes(ah_relay_direction* direction,
+                               bool* result_moving)
+{
+  uint64_t written;
+  if (!read_stream_position(
+          socket_from_dock(direction->sink), false, &written, result_moving))
+  {
+    return false;
+  }
+
+  direction->bytes_transferred = written - direction->written_base;
+  return true;
+}
+
+static void unlink_relay(ah_relay* relay)
+{
+  ah_sockmap* sockmap = relay->sockmap;
+  for (uint32_t i = 0; i != 2; ++i) {
+    delete_from_bpf_map(sockmap->sources, relay->directions[i].cookie);
+  }
+  for (uint32_t i = 0; i != 2; ++i) {
+    delete_from_bpf_map(sockmap->targets, relay->directions[i].cookie);
+    delete_from_bpf_map(sockmap->peers, relay->directions[i].cookie);
+  }
+}
+
+static bool link_relay(ah_relay* relay)
+{
+  ah_sockmap* sockmap = relay->sockmap;
+  ah_relay_direction* directions = relay->directions;
+  for (uint32_t i = 0; i != 2; ++i) {
+    int source = socket_from_dock(directions[i].source);
+    if (!update_bpf_map(sockmap->targets, directions[i].cookie, &source)
+        || !update_bpf_map(
+            sockmap->peers, directions[i].cookie, &directions[1 - i].cookie))
+    {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i != 2; ++i) {
+    int source = socket_from_dock(directions[i].source);
+    if (!update_bpf_map(sockmap->sources, directions[i].cookie, &source)) {
+      return false;
+    }
+  }
+
+  /* Bytes that arrived before the socket became a source are still queued
+   * and only reach the program once the socket signals readable data again,
+   * which setting the low watermark does */
+  int low_watermark = 1;
+  for (uint32_t i = 0; i != 2; ++i) {
+    setsockopt(socket_from_dock(directions[i].source),
+               SOL_SOCKET,
+               SO_RCVLOWAT,
+               &low_watermark,
+               sizeof(low_watermark));
+  }
+
+  return true;
+}
+
+/* A sink without room holds the redirected bytes back until the peer
+ * acknowledged enough, which it signals by becoming writable. Otherwise the
+ * bytes only wait for the work queue of the kernel, which is checked on the
+ * timer, backing off while nothing moves. */
+static bool wait_for_sockmap_sink(ah_relay_direction* direction,
+                                  bool progressed)
+{
+  ah_relay* relay = direction->relay;
+  int sink = socket_from_dock(direction->sink);
+  struct pollfd descriptor = {sink, POLLOUT, 0};
+  if (poll(&descriptor, 1, 0) == -1) {
+    ah_log_error("poll", errno);
+    return false;
+  }
+
+  if ((descriptor.revents & POLLERR) != 0) {
+    int error_code = 0;
+    socklen_t length = sizeof(error_code);
+    if (getsockopt(sink, SOL_SOCKET, SO_ERROR, &error_code, &length) == -1) {
+      error_code = errno;
+    }
+    if (error_code != 0) {
+      return fail_relay(relay, "getsockopt", error_code);
+    }
+  }
+
+  if ((descriptor.revents & POLLOUT) == 0) {
+    return set_relay_port(direction->sink, false, true, direction);
+  }
+
+  uint32_t delay = relay->end_of_file_delay_ms * 2;
+  if (progressed || delay == 0) {
+    delay = 1;
+  } else if (delay > RELAY_END_OF_FILE_MAX_DELAY_MS) {
+    delay = RELAY_END_OF_FILE_MAX_DELAY_MS;
+  }
+
+  relay->end_of_file_delay_ms = delay;
+  start_timer(&relay->timer, delay);
+  return true;
+}
+
+/* The end of file may overtake the last redirected bytes, which the kernel
+ * still hands to the sink on a work queue. It is forwarded only once the sink
+ * was given every byte the source received, counting the end of file as one
+ * byte like the kernel does. */
+static bool forward_sockmap_end_of_file(ah_relay_direction* direction)
+{
+  ah_relay* relay = direction->relay;
+  if (direction->shut_down) {
+    return true;
+  }
+
+  uint64_t received;
+  uint64_t transferred = direction->bytes_transferred;
+  bool moving;
+  if (!read_tcp_counter(
+          socket_from_dock(direction->source), true, &received))
+  {
+    return false;
+  }
+  if (!sockmap_sent_bytes(direction, &moving)) {
+    return moving && wait_for_sockmap_sink(direction, true);
+  }
+
+  if (direction->consumed_base + direction->bytes_transferred + 1 < received) {
+    return wait_for_sockmap_sink(
+        direction, direction->bytes_transferred != transferred);
+  }
+
+  direction->shut_down = true;
+  if (!set_relay_port(direction->sink, false, false, direction)) {
+    return false;
+  }
+
+  int sink = socket_from_dock(direction->sink);
+  if (shutdown(sink, SHUT_WR) == -1 && errno != ENOTCONN) {
+    return fail_relay(relay, "shutdown", errno);
+  }
+
+  if (relay->directions[0].shut_down && relay->directions[1].shut_down) {
+    stop_relay(relay);
+    return relay->on_done(AH_ERR_OK, relay, relay->user_data);
+  }
+
+  return true;
+}
+
+static bool on_sockmap_timer(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+
+  /* The relay may be freed by the callback once the last direction is done,
+   * which is why the directions to check are picked beforehand */
+  ah_relay* relay = user_data;
+  bool waiting[2];
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &relay->directions[i];
+    waiting[i] = direction->end_of_file && !direction->shut_down;
+  }
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    if (waiting[i] && !forward_sockmap_end_of_file(&relay->directions[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Every byte goes to the peer, so the source only becomes readable at the end
+ * of file or on an error. Reading from sockets in the maps fails once their
+ * sending side is shut down, so both are polled for instead */
+static bool settle_sockmap_direction(ah_relay_direction* direction)
+{
+  int source = socket_from_dock(direction->source);
+  struct pollfd descriptor = {source, POLLRDHUP, 0};
+  if (poll(&descriptor, 1, 0) == -1) {
+    ah_log_error("poll", errno);
+    return false;
+  }
+
+  int error_code = 0;
+  socklen_t length = sizeof(error_code);
+  if ((descriptor.revents & POLLERR) != 0
+      && getsockopt(source, SOL_SOCKET, SO_ERROR, &error_code, &length) == -1)
+  {
+    error_code = errno;
+  }
+
+  /* The kernel may still hand the segment carrying the end of file to a sink
+   * that was shut down already, which fails after every byte was delivered */
+  ah_relay* relay = direction->relay;
+  ah_relay_direction* reverse =
+      &relay->directions[direction == &relay->directions[0] ? 1 : 0];
+  if (error_code == EPIPE && reverse->shut_down) {
+    error_code = 0;
+  }
+  if (error_code != 0) {
+    return fail_relay(relay, "getsockopt", error_code);
+  }
+  if ((descriptor.revents & POLLRDHUP) == 0) {
+    return true;
+  }
+
+  direction->end_of_file = true;
+  return set_relay_port(direction->source, true, false, direction)
+      && forward_sockmap_end_of_file(direction);
+}
+
+bool start_sockmap_relay(ah_sockmap* sockmap,
+                         ah_relay* result_relay,
+                         ah_io_dock* client,
+                         ah_io_dock* upstream,
+                         ah_on_relay_done on_done,
+                         void* user_data)
+{
+  if (sockmap == NULL) {
+    return start_relay(result_relay, client, upstream, on_done, user_data);
+  }
+  if (!init_relay(result_relay, client, upstream, on_done, user_data)) {
+    return false;
+  }
+
+  /* The bases are taken before the sockets join the maps, which changes what
+   * SIOCINQ reports */
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &result_relay->directions[i];
+    int source = socket_from_dock(direction->source);
+    socklen_t length = sizeof(direction->cookie);
+    if (getsockopt(
+            source, SOL_SOCKET, SO_COOKIE, &direction->cookie, &length)
+        == -1)
+    {
+      ah_log_error("getsockopt", errno);
+      return false;
+    }
+    bool moving;
+    if (!read_stream_position(
+            source, true, &direction->consumed_base, &moving)
+        || !read_stream_position(socket_from_dock(direction->sink),
+                                 false,
+                                 &direction->written_base,
+                                 &moving))
+    {
+      /* Without a base the redirected bytes cannot be counted, which
+       * splicing does not need */
+      return moving
+          && start_relay(result_relay, client, upstream, on_done, user_data);
+    }
+  }
+
+  /* Sockets the maps do not accept, like the ones handed to kernel TLS, and
+   * full maps make the relay fall back to splicing */
+  result_relay->sockmap = sockmap;
+  if (!link_relay(result_relay)) {
+    unlink_relay(result_relay);
+    result_relay->sockmap = NULL;
+    return start_relay(result_relay, client, upstream, on_done, user_data);
+  }
+
+  ah_server* server = ((ah_socket*)client->socket)->context->server;
+  create_timer(&result_relay->timer, server, on_sockmap_timer, result_relay);
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_relay_direction* direction = &result_relay->directions[i];
+    if (!set_relay_port(direction->source, true, true, direction)) {
+      stop_relay(result_relay);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool is_relay_in_kernel(ah_relay* relay)
+{
+  return relay->sockmap != NULL;
+}
+
+/* Datagrams */
+
+/* The headers of a system call live on the stack of the handler, which bounds
+ * the datagrams moved per call */
+#define DATAGRAM_BATCH 64
+
+typedef struct ah_datagram_batch {
+  bool active;
+  uint32_t count;
+  uint32_t done;
+  ah_datagram* datagrams;
+  ah_on_datagrams on_complete;
+  void* per_call_data;
+} ah_datagram_batch;
+
+struct ah_datagram_socket {
+  ah_socket* socket_pointer;
+  ah_socket socket;
+  ah_datagram_batch receive;
+  ah_datagram_batch send;
+};
+
+/* Every message gets a slot big enough for the segment size of UDP_GRO and
+ * UDP_SEGMENT alike, which keeps the following slots aligned */
+#define DATAGRAM_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+typedef union ah_datagram_controls {
+  char buffer[DATAGRAM_BATCH * DATAGRAM_CONTROL_SIZE];
+  struct cmsghdr align;
+} ah_datagram_controls;
+
+size_t datagram_socket_size()
+{
+  return sizeof(ah_datagram_socket);
+}
+
+size_t datagram_socket_alignment()
+{
+  return _Alignof(ah_datagram_socket);
+}
+
+static uint32_t events_from_datagram_socket(ah_datagram_socket* socket)
+{
+  uint32_t events = 0;
+  if (socket->receive.active) {
+    events |= EPOLLIN;
+  }
+  if (socket->send.active) {
+    events |= EPOLLOUT;
+  }
+
+  return events;
+}
+
+static bool arm_datagram_socket(ah_datagram_socket* socket, int operation)
+{
+  uint32_t events =
+      events_from_datagram_socket(socket) | EPOLLET | EPOLLONESHOT;
+  struct epoll_event event = {events, .data.ptr = socket};
+  ah_server* server = socket->socket.context->server;
+  if (epoll_ctl(server->epoll_descriptor,
+                operation,
+                socket->socket.socket,
+                &event)
+      == -1)
+  {
+    ah_log_error("epoll_ctl", errno);
+    return false;
+  }
+
+  return true;
+}
+
+static ah_socket_slot enable_udp_gro(ah_socket_slot slot, uint32_t flags)
+{
+  if (!slot.ok || (flags & AH_DATAGRAM_GRO) == 0) {
+    return slot;
+  }
+
+  int enable = true;
+  int result = setsockopt(
+      slot.socket.socket, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable));
+  if (result == -1) {
+    ah_log_error("setsockopt", errno);
+    slot.ok = false;
+  }
+
+  return slot;
+}
+
+bool create_datagram_socket(ah_datagram_socket* result_socket,
+                            ah_context* context,
+                            uint16_t port,
+                            uint32_t flags)
+{
+  ah_socket_slot slot = {
+      true,
+      {.socket = -1, AH_SOCKET_DATAGRAM, .context = context},
+  };
+  slot = create_dual_stack_socket(slot, SOCK_DGRAM);
+  slot = socket_set_nonblocking(slot, AH_NONBLOCKING, true);
+  slot = enable_udp_gro(slot, flags);
+  slot = bind_socket(slot, port);
+
+  *result_socket = (ah_datagram_socket) {
+      .socket_pointer = &result_socket->socket,
+      .socket = slot.socket,
+  };
+  if (!slot.ok) {
+    return false;
+  }
+
+  /* The socket is added disarmed and armed by the first queued batch */
+  if (!arm_datagram_socket(result_socket, EPOLL_CTL_ADD)) {
+    destroy_socket_base(&result_socket->socket);
+    return false;
+  }
+
+  return true;
+}
+
+bool local_address_from_datagram_socket(ah_datagram_socket* socket,
+                                        ah_address* result_address)
+{
+  return local_address_from_socket(&socket->socket, result_address);
+}
+
+ah_context* context_from_datagram_socket(ah_datagram_socket* socket)
+{
+  return socket->socket.context;
+}
+
+static bool register_datagram_socket(ah_datagram_socket* socket)
+{
+  /* The socket being dispatched to is re-armed by the event loop after its
+   * handlers ran */
+  ah_server* server = socket->socket.context->server;
+  if (server->dispatch_socket == &socket->socket) {
+    return true;
+  }
+
+  return arm_datagram_socket(socket, EPOLL_CTL_MOD);
+}
+
+static bool queue_datagram_batch(ah_datagram_socket* socket,
+                                 ah_datagram_batch* batch,
+                                 ah_datagram* datagrams,
+                                 uint32_t count,
+                                 ah_on_datagrams on_complete,
+                                 void* per_call_data)
+{
+  if (socket->socket.socket == -1 || batch->active || count == 0) {
+    return false;
+  }
+
+  *batch = (ah_datagram_batch) {
+      true,
+      count,
+      0,
+      datagrams,
+      on_complete,
+      per_call_data,
+  };
+  return register_datagram_socket(socket);
+}
+
+bool queue_datagram_receive(ah_datagram_socket* socket,
+                            ah_datagram* datagrams,
+                            uint32_t count,
+                            ah_on_datagrams on_complete,
+                            void* per_call_data)
+{
+  return queue_datagram_batch(
+      socket, &socket->receive, datagrams, count, on_complete, per_call_data);
+}
 
-_Static_assert(
-    _Alignof(ah_io_port) == _Alignof(ah_io_operation),
-    "AH_IO_OPERATION_ALIGNMENT does not match the internal alignment");
+bool queue_datagram_send(ah_datagram_socket* socket,
+                         ah_datagram* datagrams,
+                         uint32_t count,
+                         ah_on_datagrams on_complete,
+                         void* per_call_data)
+{
+  for (uint32_t i = 0; i != count; ++i) {
+    if (datagrams[i].address.family == AH_ADDRESS_NONE) {
+      return false;
+    }
+  }
 
-_Static_assert(sizeof(ah_io_port) == sizeof(ah_io_operation),
-               "AH_IO_OPERATION_SIZE does not match the internal size");
+  return queue_datagram_batch(
+      socket, &socket->send, datagrams, count, on_complete, per_call_data);
+}
 
-bool is_io_operation_active(ah_io_operation* operation)
+static uint16_t gro_segment_size(struct msghdr* message)
 {
-  return ((ah_io_port*)operation)->active;
+  struct cmsghdr* control = CMSG_FIRSTHDR(message);
+  for (; control != NULL; control = CMSG_NXTHDR(message, control)) {
+    if (control->cmsg_level == IPPROTO_UDP && control->cmsg_type == UDP_GRO) {
+      int segment_size;
+      memcpy(&segment_size, CMSG_DATA(control), sizeof(segment_size));
+      return (uint16_t)segment_size;
+    }
+  }
+
+  return 0;
 }
 
-ah_io_buffer buffer_from_io_operation(ah_io_operation* operation)
+static bool complete_datagram_batch(ah_datagram_socket* socket,
+                                    ah_datagram_batch* batch,
+                                    int error_code)
 {
-  ah_io_port* port = (ah_io_port*)operation;
-  return (ah_io_buffer) {port->buffer_length, port->buffer};
+  batch->active = false;
+  return batch->on_complete((ah_error_code)error_code,
+                            socket,
+                            batch->datagrams,
+                            batch->done,
+                            batch->per_call_data);
 }
 
-ah_io_dock* dock_from_operation(ah_io_operation* operation)
+static bool receive_datagrams(ah_datagram_socket* socket)
 {
-  ah_io_port* port = (ah_io_port*)operation;
-  return port->is_read_port ? parentof(port, ah_io_dock, read_port)
-                            : parentof(port, ah_io_dock, write_port);
+  ah_datagram_batch* batch = &socket->receive;
+  uint32_t count =
+      batch->count < DATAGRAM_BATCH ? batch->count : DATAGRAM_BATCH;
+  struct mmsghdr messages[DATAGRAM_BATCH];
+  struct iovec vectors[DATAGRAM_BATCH];
+  struct sockaddr_storage addresses[DATAGRAM_BATCH];
+  ah_datagram_controls controls;
+  for (uint32_t i = 0; i != count; ++i) {
+    ah_io_buffer buffer = batch->datagrams[i].buffer;
+    vectors[i] = (struct iovec) {buffer.buffer, buffer.buffer_length};
+    messages[i] = (struct mmsghdr) {
+        .msg_hdr =
+            {
+                .msg_name = &addresses[i],
+                .msg_namelen = sizeof(addresses[i]),
+                .msg_iov = &vectors[i],
+                .msg_iovlen = 1,
+                .msg_control = controls.buffer + i * DATAGRAM_CONTROL_SIZE,
+                .msg_controllen = DATAGRAM_CONTROL_SIZE,
+            },
+    };
+  }
+
+  int received =
+      recvmmsg(socket->socket.socket, messages, count, MSG_DONTWAIT, NULL);
+  if (received == -1) {
+    int error_code = errno;
+    /* The batch stays queued until the next datagram arrives */
+    if (error_code == EAGAIN || error_code == EINTR) {
+      return true;
+    }
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error("recvmmsg", error_code);
+      return false;
+    }
+
+    return complete_datagram_batch(socket, batch, error_code);
+  }
+
+  for (uint32_t i = 0, limit = (uint32_t)received; i != limit; ++i) {
+    ah_datagram* datagram = &batch->datagrams[i];
+    datagram->buffer.buffer_length = messages[i].msg_len;
+    datagram->address =
+        address_from_sockaddr((const struct sockaddr*)&addresses[i]);
+    datagram->segment_size = gro_segment_size(&messages[i].msg_hdr);
+  }
+
+  batch->done = (uint32_t)received;
+  return complete_datagram_batch(socket, batch, 0);
 }
 
-static bool register_io_socket(ah_io_dock* dock, uint32_t events)
+/* Datagrams that did not fit into the socket buffer wait for EPOLLOUT, the
+ * ones sent before an error are reported along with it */
+static bool send_datagrams(ah_datagram_socket* socket)
 {
-  events |= EPOLLET | EPOLLONESHOT;
+  ah_datagram_batch* batch = &socket->send;
+  struct mmsghdr messages[DATAGRAM_BATCH];
+  struct iovec vectors[DATAGRAM_BATCH];
+  struct sockaddr_storage addresses[DATAGRAM_BATCH];
+  ah_datagram_controls controls;
+  bool ipv6 = (socket->socket.flags & AH_SOCKET_IPV6) != 0;
+  while (batch->done != batch->count) {
+    uint32_t remaining = batch->count - batch->done;
+    uint32_t count = remaining < DATAGRAM_BATCH ? remaining : DATAGRAM_BATCH;
+    for (uint32_t i = 0; i != count; ++i) {
+      ah_datagram* datagram = &batch->datagrams[batch->done + i];
+      ah_io_buffer buffer = datagram->buffer;
+      vectors[i] = (struct iovec) {buffer.buffer, buffer.buffer_length};
+      socklen_t address_length =
+          sockaddr_from_address(&datagram->address, ipv6, &addresses[i]);
+      messages[i] = (struct mmsghdr) {
+          .msg_hdr =
+              {
+                  .msg_name = &addresses[i],
+                  .msg_namelen = address_length,
+                  .msg_iov = &vectors[i],
+                  .msg_iovlen = 1,
+              },
+      };
+      if (datagram->segment_size == 0) {
+        continue;
+      }
 
-  ah_socket* socket = (ah_socket*)dock->socket;
-  bool rearm = socket->role == AH_SOCKET_IO_REARM;
-  socket->role = AH_SOCKET_IO_REARM;
+      struct msghdr* message = &messages[i].msg_hdr;
+      message->msg_control = controls.buffer + i * DATAGRAM_CONTROL_SIZE;
+      message->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      struct cmsghdr* control = CMSG_FIRSTHDR(message);
+      control->cmsg_level = IPPROTO_UDP;
+      control->cmsg_type = UDP_SEGMENT;
+      control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(control),
+             &datagram->segment_size,
+             sizeof(datagram->segment_size));
+    }
 
-  int epoll_descriptor = context_from_socket(socket)->server->epoll_descriptor;
-  struct epoll_event event = {events, .data.ptr = dock};
-  int operation = rearm ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-  if (epoll_ctl(epoll_descriptor, operation, socket->socket, &event) == -1) {
-    perror("epoll_ctl");
+    int sent = sendmmsg(socket->socket.socket, messages, count, MSG_DONTWAIT);
+    if (sent != -1) {
+      batch->done += (uint32_t)sent;
+      continue;
+    }
+
+    int error_code = errno;
+    if (error_code == EAGAIN) {
+      return true;
+    }
+    if (error_code == EINTR) {
+      continue;
+    }
+    if (!is_ah_error_code(error_code)) {
+      ah_log_error("sendmmsg", error_code);
+      return false;
+    }
+
+    return complete_datagram_batch(socket, batch, error_code);
+  }
+
+  return complete_datagram_batch(socket, batch, 0);
+}
+
+static bool datagram_handler(ah_datagram_socket* socket, uint32_t events)
+{
+  if ((events & (EPOLLERR | EPOLLHUP)) != 0) {
+    events |= EPOLLIN | EPOLLOUT;
+  }
+
+  ah_server* server = socket->socket.context->server;
+  server->dispatch_socket = &socket->socket;
+  if ((events & EPOLLIN) != 0 && socket->receive.active
+      && !receive_datagrams(socket))
+  {
     return false;
   }
 
-  return true;
+  /* The receive callback might have destroyed the socket */
+  if (server->dispatch_socket == NULL) {
+    return true;
+  }
+
+  if ((events & EPOLLOUT) != 0 && socket->send.active
+      && !send_datagrams(socket))
+  {
+    return false;
+  }
+
+  if (server->dispatch_socket == NULL) {
+    return true;
+  }
+
+  server->dispatch_socket = NULL;
+  return events_from_datagram_socket(socket) == 0
+      || arm_datagram_socket(socket, EPOLL_CTL_MOD);
 }
 
-static void init_io_port(ah_io_port* port,
-                         bool is_read_port,
-                         ah_io_buffer buffer,
-                         ah_on_io_complete on_complete,
-                         void* per_call_data)
+bool destroy_datagram_socket(ah_datagram_socket* socket)
 {
-  ah_io_port new_port = {
-      .active = true,
-      is_read_port,
-      buffer.buffer_length,
-      buffer.buffer,
-      on_complete,
-      per_call_data,
-  };
-  memcpy(port, &new_port, sizeof(ah_io_port));
+  socket->receive.active = false;
+  socket->send.active = false;
+  return destroy_socket_base(&socket->socket);
 }
 
-static bool read_handler(ah_socket* socket, ah_io_port* port)
+/* Ring buffers */
+
+size_t ring_granularity(void)
 {
-  if (!port->active) {
-    return true;
-  }
-  port->active = false;
+  long page_size = sysconf(_SC_PAGESIZE);
+  return page_size > 0 ? (size_t)page_size : 4096;
+}
 
-  ssize_t bytes_transferred =
-      recv(socket->socket, port->buffer, port->buffer_length, 0);
+/* Every ring takes two mappings, so a process with tens of thousands of rings
+ * runs into vm.max_map_count, which makes mmap fail with ENOMEM. The caller
+ * falls back to a plain buffer then, so that is not worth reporting. */
+static void log_mapping_error(const char* function, int error_code)
+{
+  if (error_code != ENOMEM) {
+    ah_log_error(function, error_code);
+  }
+}
 
-  int error_code = 0;
-  if (bytes_transferred == -1) {
-    error_code = errno;
-    if (!is_ah_error_code(error_code)) {
-      perror("recv");
+static bool map_ring_halves(uint8_t* data, size_t size, int descriptor)
+{
+  for (size_t i = 0; i != 2; ++i) {
+    void* half = mmap(data + size * i,
+                      size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED,
+                      descriptor,
+                      0);
+    if (half == MAP_FAILED) {
+      log_mapping_error("mmap", errno);
       return false;
     }
+  }
 
-    bytes_transferred = 0;
+  return true;
+}
+
+void* map_ring_memory(size_t size)
+{
+  int descriptor = memfd_create("ah_ring", MFD_CLOEXEC);
+  if (descriptor == -1) {
+    ah_log_error("memfd_create", errno);
+    return NULL;
   }
 
-  ah_error_code ec = (ah_error_code)error_code;
-  ah_io_operation* op = (ah_io_operation*)port;
-  return port->on_complete(
-      ec, op, (uint32_t)bytes_transferred, port->per_call_data);
+  if (ftruncate(descriptor, (off_t)size) == -1) {
+    ah_log_error("ftruncate", errno);
+    close(descriptor);
+    return NULL;
+  }
+
+  /* The whole range is reserved first, so the halves can be placed next to
+   * each other without racing other mappings. The mappings keep the memory
+   * alive after the descriptor is closed. */
+  uint8_t* data = mmap(
+      NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    log_mapping_error("mmap", errno);
+    close(descriptor);
+    return NULL;
+  }
+
+  bool mapped = map_ring_halves(data, size, descriptor);
+  close(descriptor);
+  if (!mapped) {
+    munmap(data, size * 2);
+    return NULL;
+  }
+
+  return data;
 }
 
-bool queue_read_operation4(ah_io_dock* dock,
-                           ah_io_buffer buffer,
-                           ah_on_io_complete on_complete,
-                           void* per_call_data)
+void unmap_ring_memory(void* data, size_t size)
 {
-  ah_io_port* port = (ah_io_port*)&dock->read_port;
-  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
+  if (munmap(data, size * 2) == -1) {
+    ah_log_error("munmap", errno);
+  }
+}
+
+/* File cache */
+
+#define FILE_WATCH_BUFFER_SIZE 4096
+#define FILE_WATCH_EVENTS \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+bool open_file_root(const char* path, intptr_t* result_root)
+{
+  int root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root == -1) {
+    ah_log_error("open", errno);
     return false;
   }
 
-  init_io_port(port, true, buffer, on_complete, per_call_data);
+  *result_root = root;
+  return true;
+}
 
-  uint32_t events = EPOLLIN;
-  if (((ah_io_port*)&dock->write_port)->active) {
-    events |= EPOLLOUT;
+void close_file_root(intptr_t root)
+{
+  close((int)root);
+}
+
+static ah_error_code file_error_code(int error_code)
+{
+  switch (error_code) {
+    case ENOENT:
+    case ENOTDIR:
+      return AH_ERR_NOT_FOUND;
+    case ELOOP:
+      return AH_ERR_ACCESS_DENIED;
   }
 
-  return register_io_socket(dock, events);
+  return is_ah_error_code(error_code) ? (ah_error_code)error_code
+                                      : AH_ERR_IO_ERROR;
 }
 
-static bool write_handler(ah_socket* socket, ah_io_port* port)
+ah_error_code open_cached_file(intptr_t root, ah_cached_file* file)
 {
-  if (!port->active) {
-    return true;
+  /* Opening a FIFO would block without O_NONBLOCK, which has no effect on
+   * regular files */
+  int descriptor = openat(
+      (int)root, file->path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (descriptor == -1) {
+    return file_error_code(errno);
   }
-  port->active = false;
 
-  ssize_t bytes_transferred =
-      send(socket->socket, port->buffer, port->buffer_length, 0);
+  struct stat info;
+  if (fstat(descriptor, &info) == -1) {
+    int error_code = errno;
+    close(descriptor);
+    return file_error_code(error_code);
+  }
 
-  int error_code = 0;
-  if (bytes_transferred == -1) {
-    error_code = errno;
-    if (!is_ah_error_code(error_code)) {
-      perror("send");
-      return false;
+  if (!S_ISREG(info.st_mode)) {
+    close(descriptor);
+    return S_ISDIR(info.st_mode) ? AH_ERR_IS_DIRECTORY : AH_ERR_ACCESS_DENIED;
+  }
+
+  file->handle = descriptor;
+  file->size = (uint64_t)info.st_size;
+  file->modified = (int64_t)info.st_mtim.tv_sec;
+  file->mapping = NULL;
+
+  /* Small files are sent from a shared view of the page cache. A failed
+   * mapping is not fatal, because the file can be sent using sendfile. */
+  if (file->size != 0 && file->size <= AH_FILE_MAP_LIMIT) {
+    void* mapping =
+        mmap(NULL, (size_t)file->size, PROT_READ, MAP_SHARED, descriptor, 0);
+    if (mapping != MAP_FAILED) {
+      file->mapping = mapping;
     }
+  }
 
-    bytes_transferred = 0;
+  return AH_ERR_OK;
+}
+
+void close_cached_file(ah_cached_file* file)
+{
+  if (file->mapping != NULL) {
+    munmap(file->mapping, (size_t)file->size);
   }
 
-  ah_error_code ec = (ah_error_code)error_code;
-  ah_io_operation* op = (ah_io_operation*)port;
-  return port->on_complete(
-      ec, op, (uint32_t)bytes_transferred, port->per_call_data);
+  close((int)file->handle);
 }
 
-bool queue_write_operation4(ah_io_dock* dock,
-                            ah_io_buffer buffer,
-                            ah_on_io_complete on_complete,
-                            void* per_call_data)
+typedef struct ah_file_watcher {
+  /* Points to the embedded socket, so the event loop can find its role the
+   * same way as for acceptors and docks */
+  ah_socket* socket_pointer;
+  ah_socket socket;
+  int epoll_descriptor;
+  ah_on_file_change on_change;
+  void* user_data;
+} ah_file_watcher;
+
+ah_file_watcher* create_file_watcher(ah_server* server,
+                                     intptr_t root,
+                                     ah_on_file_change on_change,
+                                     void* user_data)
 {
-  ah_io_port* port = (ah_io_port*)&dock->write_port;
-  if (buffer.buffer_length > (uint32_t)INT32_MAX || port->active) {
-    return false;
+  (void)root;
+
+  ah_file_watcher* watcher = malloc(sizeof(ah_file_watcher));
+  if (watcher == NULL) {
+    return NULL;
   }
 
-  init_io_port(port, false, buffer, on_complete, per_call_data);
+  int descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (descriptor == -1) {
+    ah_log_error("inotify_init1", errno);
+    free(watcher);
+    return NULL;
+  }
 
-  uint32_t events = EPOLLOUT;
-  if (((ah_io_port*)&dock->read_port)->active) {
-    events |= EPOLLIN;
+  *watcher = (ah_file_watcher) {
+      .socket = {descriptor, AH_SOCKET_FILE_WATCH},
+      .epoll_descriptor = server->epoll_descriptor,
+      .on_change = on_change,
+      .user_data = user_data,
+  };
+  watcher->socket_pointer = &watcher->socket;
+
+  /* Level triggered, because the handler reads until the queue is empty */
+  struct epoll_event event = {EPOLLIN, .data.ptr = watcher};
+  if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, descriptor, &event)
+      == -1)
+  {
+    ah_log_error("epoll_ctl", errno);
+    close(descriptor);
+    free(watcher);
+    return NULL;
+  }
+
+  return watcher;
+}
+
+static bool file_watch_handler(ah_file_watcher* watcher)
+{
+  _Alignas(struct inotify_event) char buffer[FILE_WATCH_BUFFER_SIZE];
+  while (1) {
+    ssize_t length = read(watcher->socket.socket, buffer, sizeof(buffer));
+    if (length == -1) {
+      int error_code = errno;
+      if (error_code == EINTR) {
+        continue;
+      }
+      if (error_code == EAGAIN) {
+        return true;
+      }
+
+      ah_log_error("read", error_code);
+      return false;
+    }
+
+    for (char* pointer = buffer; pointer < buffer + length;) {
+      struct inotify_event* event = (struct inotify_event*)(void*)pointer;
+      pointer += sizeof(struct inotify_event) + event->len;
+      int32_t watch = (event->mask & IN_Q_OVERFLOW) != 0 ? -1 : event->wd;
+      if (!watcher->on_change(watch, watcher->user_data)) {
+        return false;
+      }
+    }
+  }
+}
+
+/* The watch is added through the open descriptor instead of the path, so it
+ * is guaranteed to be on the same inode, even if the path was replaced in the
+ * meantime */
+bool watch_cached_file(ah_file_watcher* watcher, ah_cached_file* file)
+{
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", (int)file->handle);
+  int watch =
+      inotify_add_watch(watcher->socket.socket, path, FILE_WATCH_EVENTS);
+  if (watch == -1) {
+    ah_log_error("inotify_add_watch", errno);
+    return false;
   }
 
-  return register_io_socket(dock, events);
+  file->watch = watch;
+  return true;
+}
+
+void unwatch_cached_file(ah_file_watcher* watcher, int32_t watch)
+{
+  /* The watch is gone already if its inode was deleted */
+  inotify_rm_watch(watcher->socket.socket, watch);
+}
+
+void destroy_file_watcher(ah_file_watcher* watcher)
+{
+  epoll_ctl(watcher->epoll_descriptor,
+            EPOLL_CTL_DEL,
+            watcher->socket.socket,
+            NULL);
+  close(watcher->socket.socket);
+  free(watcher);
 }
 
 /* Event loop */
 
+const char* server_backend_name()
+{
+  return "epoll";
+}
+
+static bool dispatch_event(ah_server* server, struct epoll_event* event)
+{
+  uint32_t events = event->events;
+  void* ptr = event->data.ptr;
+
+  /* A callback earlier in this batch closed the socket */
+  if (ptr == NULL) {
+    return true;
+  }
+
+  ah_socket* socket = *(ah_socket**)ptr;
+  if (socket->role == AH_SOCKET_ACCEPT) {
+    return accept_handler(ptr);
+  }
+
+  if (socket->role == AH_SOCKET_CONNECT) {
+    return connect_handler(ptr);
+  }
+
+  if (socket->role == AH_SOCKET_CLOSE) {
+    return close_handler(ptr);
+  }
+
+  if (socket->role == AH_SOCKET_HANDOFF) {
+    return handoff_handler(ptr);
+  }
+
+  if (socket->role == AH_SOCKET_FILE_WATCH) {
+    return file_watch_handler(ptr);
+  }
+
+  if (socket->role == AH_SOCKET_DATAGRAM) {
+    return datagram_handler(ptr, events);
+  }
+
+  ah_io_dock* dock = ptr;
+  if ((events & (EPOLLERR | EPOLLHUP)) != 0) {
+    events |= EPOLLIN | EPOLLOUT;
+  }
+
+  server->dispatch_socket = socket;
+  ah_io_port* read_port = (events & EPOLLIN) != 0 && !are_reads_paused(dock)
+      ? (ah_io_port*)&dock->read_port
+      : NULL;
+  if (read_port != NULL && !read_handler(socket, read_port)) {
+    return false;
+  }
+
+  /* The read callback might have closed the socket and freed the dock */
+  if (server->dispatch_socket == NULL) {
+    return true;
+  }
+
+  ah_io_port* write_port =
+      (events & EPOLLOUT) != 0 ? (ah_io_port*)&dock->write_port : NULL;
+  if (write_port != NULL && !write_handler(socket, write_port)) {
+    return false;
+  }
+
+  /* EPOLLONESHOT disarmed the socket, so it is armed again for the ports
+   * that are still active, including the one that did not fire */
+  if (server->dispatch_socket == NULL) {
+    return true;
+  }
+
+  server->dispatch_socket = NULL;
+  return events_from_dock(dock) == 0
+      || arm_io_socket(server, dock, EPOLL_CTL_MOD);
+}
+
 bool server_tick(ah_server* server, int* error_code_out)
 {
-  int new_events =
-      epoll_wait(server->epoll_descriptor, server->events, MAX_EVENTS, -1);
+  int timeout = next_timer_timeout(&server->core.timers);
+  int new_events = epoll_wait(
+      server->epoll_descriptor, server->events, MAX_EVENTS, timeout);
   if (new_events == -1) {
     if (error_code_out == NULL) {
-      perror("epoll_wait");
+      ah_log_error("epoll_wait", errno);
     } else {
       *error_code_out = errno;
     }
@@ -622,35 +3965,26 @@ bool server_tick(ah_server* server, int* error_code_out)
     return false;
   }
 
-  for (size_t i = 0, limit = (size_t)new_events; i != limit; ++i) {
-    struct epoll_event* event = &server->events[i];
-    uint32_t events = event->events;
-    void* ptr = event->data.ptr;
-
-    ah_socket* socket = *(ah_socket**)ptr;
-    if (socket->role == AH_SOCKET_ACCEPT) {
-      if (!accept_handler(ptr)) {
-        return false;
-      }
-    } else {
-      ah_io_dock* dock = ptr;
-      if ((events & (EPOLLERR | EPOLLHUP)) != 0) {
-        events |= EPOLLIN | EPOLLOUT;
-      }
-
-      ah_io_port* read_port =
-          (events & EPOLLIN) != 0 ? (ah_io_port*)&dock->read_port : NULL;
-      if (read_port != NULL && !read_handler(socket, read_port)) {
-        return false;
-      }
+  bool result = true;
+  server->next_event = 0;
+  server->event_count = (size_t)new_events;
+  while (result && server->next_event != server->event_count) {
+    result = dispatch_event(server, &server->events[server->next_event++]);
+  }
 
-      ah_io_port* write_port =
-          (events & EPOLLOUT) != 0 ? (ah_io_port*)&dock->write_port : NULL;
-      if (write_port != NULL && !write_handler(socket, write_port)) {
-        return false;
-      }
-    }
+  server->next_event = 0;
+  server->event_count = 0;
+  if (!result) {
+    return false;
   }
 
-  return true;
+  result = run_expired_timers(&server->core.timers);
+  /* Writing out deferred log messages is the lowest priority work of a tick */
+  flush_log_from_event_loop();
+  return result;
+}
+
+ah_server_stats stats_from_server(ah_server* server)
+{
+  return server->core.stats;
 }
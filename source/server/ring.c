@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/detail.h"
+
+/* Capacities are kept well below INT32_MAX, so the buffers handed out can be
+ * passed to the I/O functions as they are */
+#define RING_MAX_CAPACITY (1U << 30)
+
+bool create_ring(ah_ring* result_ring, uint32_t minimum_capacity)
+{
+  *result_ring = (ah_ring) {0};
+
+  size_t granularity = ring_granularity();
+  size_t capacity = minimum_capacity == 0 ? 1 : minimum_capacity;
+  capacity = (capacity + granularity - 1) / granularity * granularity;
+  if (capacity > RING_MAX_CAPACITY) {
+    return false;
+  }
+
+  /* Running out of mappings should not cost the connection, which still
+   * works with a plain buffer */
+  uint8_t* data = map_ring_memory(capacity);
+  bool mirrored = data != NULL;
+  if (!mirrored) {
+    data = malloc(capacity);
+    if (data == NULL) {
+      return false;
+    }
+  }
+
+  result_ring->data = data;
+  result_ring->capacity = (uint32_t)capacity;
+  result_ring->mirrored = mirrored;
+  return true;
+}
+
+void destroy_ring(ah_ring* ring)
+{
+  if (ring->mirrored) {
+    unmap_ring_memory(ring->data, ring->capacity);
+  } else {
+    free(ring->data);
+  }
+
+  *ring = (ah_ring) {0};
+}
+
+ah_io_buffer ring_read_buffer(ah_ring* ring)
+{
+  return (ah_io_buffer) {ring->size, ring->data + ring->read_offset};
+}
+
+ah_io_buffer ring_write_buffer(ah_ring* ring)
+{
+  /* The unread bytes of a plain buffer never wrap around, so the free space
+   * behind them is made contiguous by moving them to the front */
+  if (!ring->mirrored && ring->read_offset != 0) {
+    memmove(ring->data, ring->data + ring->read_offset, ring->size);
+    ring->read_offset = 0;
+  }
+
+  uint32_t write_offset = ring->read_offset + ring->size;
+  if (write_offset >= ring->capacity) {
+    write_offset -= ring->capacity;
+  }
+
+  return (ah_io_buffer) {
+      ring->capacity - ring->size,
+      ring->data + write_offset,
+  };
+}
+
+bool ring_produce(ah_ring* ring, uint32_t bytes)
+{
+  uint32_t free_space = ring->capacity - ring->size;
+  if (!ring->mirrored) {
+    free_space -= ring->read_offset;
+  }
+
+  if (bytes > free_space) {
+    return false;
+  }
+
+  ring->size += bytes;
+  return true;
+}
+
+bool ring_consume(ah_ring* ring, uint32_t bytes)
+{
+  if (bytes > ring->size) {
+    return false;
+  }
+
+  ring->size -= bytes;
+  /* Starting over at the front of an empty ring keeps small reads and writes
+   * inside the same pages */
+  if (ring->size == 0) {
+    ring->read_offset = 0;
+    return true;
+  }
+
+  ring->read_offset += bytes;
+  if (ring->read_offset >= ring->capacity) {
+    ring->read_offset -= ring->capacity;
+  }
+
+  return true;
+}
@@ -0,0 +1,147 @@
+#include "server/detail.h"
+
+typedef struct ah_tcp_info_sampler {
+  ah_timer timer;
+  ah_server* server;
+  ah_tcp_info_slot* head;
+  ah_tcp_info_slot* cursor;
+  uint32_t interval_ms;
+  uint32_t samples_per_interval;
+  ah_on_tcp_info on_sample;
+  void* user_data;
+} ah_tcp_info_sampler;
+
+size_t tcp_info_sampler_size()
+{
+  return sizeof(ah_tcp_info_sampler);
+}
+
+size_t tcp_info_sampler_alignment()
+{
+  return _Alignof(ah_tcp_info_sampler);
+}
+
+static void account_sample(ah_server_stats* stats, ah_tcp_info* info)
+{
+  ++stats->tcp_info_samples;
+  stats->tcp_info_rtt_total_us += info->rtt_us;
+  if (stats->tcp_info_rtt_max_us < info->rtt_us) {
+    stats->tcp_info_rtt_max_us = info->rtt_us;
+  }
+}
+
+static bool on_sampler_timer(ah_timer* timer, void* user_data)
+{
+  ah_tcp_info_sampler* sampler = user_data;
+  ah_server_stats* stats = &core_from_server(sampler->server)->stats;
+  uint64_t now = monotonic_time_ms();
+
+  start_timer(timer, sampler->interval_ms);
+
+  ah_tcp_info_slot* slot = sampler->cursor;
+  for (uint32_t i = 0; i != sampler->samples_per_interval; ++i) {
+    if (slot == NULL) {
+      slot = sampler->head;
+    }
+    /* A slot is sampled at most once per interval, even if the budget would
+     * allow going around the list again */
+    if (slot == NULL || slot->sampled_at_ms == now) {
+      break;
+    }
+
+    ah_tcp_info_slot* next = slot->next;
+    sampler->cursor = next;
+    if (tcp_info_from_socket(slot->socket, &slot->info)) {
+      slot->sampled_at_ms = now;
+      account_sample(stats, &slot->info);
+      if (sampler->on_sample != NULL
+          && !sampler->on_sample(slot, sampler->user_data))
+      {
+        return false;
+      }
+    }
+
+    /* The callback could have removed the slot that was next in line, in
+     * which case the cursor was moved past it */
+    slot = sampler->cursor;
+  }
+
+  return true;
+}
+
+void create_tcp_info_sampler(ah_tcp_info_sampler* result_sampler,
+                             ah_server* server,
+                             uint32_t interval_ms,
+                             uint32_t samples_per_interval,
+                             ah_on_tcp_info on_sample,
+                             void* user_data)
+{
+  *result_sampler = (ah_tcp_info_sampler) {
+      .server = server,
+      .interval_ms = interval_ms,
+      .samples_per_interval = samples_per_interval,
+      .on_sample = on_sample,
+      .user_data = user_data,
+  };
+  create_timer(
+      &result_sampler->timer, server, on_sampler_timer, result_sampler);
+}
+
+void destroy_tcp_info_sampler(ah_tcp_info_sampler* sampler)
+{
+  stop_timer(&sampler->timer);
+  while (sampler->head != NULL) {
+    remove_tcp_info_slot(sampler->head);
+  }
+}
+
+void add_tcp_info_slot(ah_tcp_info_sampler* sampler,
+                       ah_tcp_info_slot* slot,
+                       ah_socket_accepted* socket,
+                       void* user_data)
+{
+  *slot = (ah_tcp_info_slot) {
+      .next = sampler->head,
+      .sampler = sampler,
+      .socket = socket,
+      .user_data = user_data,
+  };
+  if (sampler->head != NULL) {
+    sampler->head->previous = slot;
+  }
+  sampler->head = slot;
+
+  if (!is_timer_active(&sampler->timer)) {
+    start_timer(&sampler->timer, sampler->interval_ms);
+  }
+}
+
+void remove_tcp_info_slot(ah_tcp_info_slot* slot)
+{
+  ah_tcp_info_sampler* sampler = slot->sampler;
+  if (sampler == NULL) {
+    return;
+  }
+
+  if (sampler->cursor == slot) {
+    sampler->cursor = slot->next;
+  }
+
+  if (slot->previous == NULL) {
+    sampler->head = slot->next;
+  } else {
+    slot->previous->next = slot->next;
+  }
+
+  if (slot->next != NULL) {
+    slot->next->previous = slot->previous;
+  }
+
+  slot->previous = NULL;
+  slot->next = NULL;
+  slot->sampler = NULL;
+
+  if (sampler->head == NULL) {
+    stop_timer(&sampler->timer);
+  }
+}
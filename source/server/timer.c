@@ -0,0 +1,127 @@
+#include <limits.h>
+
+#include "server/detail.h"
+
+size_t timer_size()
+{
+  return sizeof(ah_timer);
+}
+
+size_t timer_alignment()
+{
+  return _Alignof(ah_timer);
+}
+
+void create_timer(ah_timer* result_timer,
+                  ah_server* server,
+                  ah_on_timer on_timer,
+                  void* user_data)
+{
+  *result_timer = (ah_timer) {
+      .server = server,
+      .on_timer = on_timer,
+      .user_data = user_data,
+  };
+}
+
+static void unlink_timer(ah_timer_list* list, ah_timer* timer)
+{
+  if (timer->previous == NULL) {
+    list->head = timer->next;
+  } else {
+    timer->previous->next = timer->next;
+  }
+
+  if (timer->next == NULL) {
+    list->tail = timer->previous;
+  } else {
+    timer->next->previous = timer->previous;
+  }
+
+  timer->previous = NULL;
+  timer->next = NULL;
+  timer->active = false;
+}
+
+void stop_timer(ah_timer* timer)
+{
+  if (timer->active) {
+    unlink_timer(&core_from_server(timer->server)->timers, timer);
+  }
+}
+
+void start_timer(ah_timer* timer, uint32_t timeout_ms)
+{
+  stop_timer(timer);
+
+  ah_timer_list* list = &core_from_server(timer->server)->timers;
+  timer->deadline = monotonic_time_ms() + timeout_ms;
+  timer->started_in_run = list->run;
+  timer->active = true;
+
+  /* Timers mostly get started with the same timeout, so the new deadline is
+   * usually the latest one and the search from the tail ends immediately */
+  ah_timer* previous = list->tail;
+  while (previous != NULL && previous->deadline > timer->deadline) {
+    previous = previous->previous;
+  }
+
+  timer->previous = previous;
+  if (previous == NULL) {
+    timer->next = list->head;
+    list->head = timer;
+  } else {
+    timer->next = previous->next;
+    previous->next = timer;
+  }
+
+  if (timer->next == NULL) {
+    list->tail = timer;
+  } else {
+    timer->next->previous = timer;
+  }
+}
+
+bool is_timer_active(ah_timer* timer)
+{
+  return timer->active;
+}
+
+int next_timer_timeout(ah_timer_list* list)
+{
+  if (list->head == NULL) {
+    return -1;
+  }
+
+  uint64_t now = monotonic_time_ms();
+  uint64_t deadline = list->head->deadline;
+  if (deadline <= now) {
+    return 0;
+  }
+
+  uint64_t timeout = deadline - now;
+  return timeout > (uint64_t)INT_MAX ? INT_MAX : (int)timeout;
+}
+
+bool run_expired_timers(ah_timer_list* list)
+{
+  if (list->head == NULL) {
+    return true;
+  }
+
+  uint64_t now = monotonic_time_ms();
+  uint64_t run = ++list->run;
+  /* Timers started during this run are inserted after every expired timer,
+   * so reaching one means there is nothing left to fire */
+  while (list->head != NULL && list->head->deadline <= now
+         && list->head->started_in_run != run)
+  {
+    ah_timer* timer = list->head;
+    unlink_timer(list, timer);
+    if (!timer->on_timer(timer, timer->user_data)) {
+      return false;
+    }
+  }
+
+  return true;
+}
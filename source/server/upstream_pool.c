@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/detail.h"
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+typedef struct ah_idle_upstream ah_idle_upstream;
+
+struct ah_idle_upstream {
+  ah_socket_accepted socket;
+  ah_idle_upstream* hash_next;
+  ah_idle_upstream* lru_previous;
+  ah_idle_upstream* lru_next;
+  ah_address address;
+  uint64_t released_at_ms;
+};
+
+typedef struct ah_upstream_pool {
+  ah_timer timer;
+  ah_context* context;
+  ah_idle_upstream** buckets;
+  uint32_t bucket_mask;
+  uint32_t max_idle;
+  uint32_t max_idle_per_upstream;
+  uint32_t idle_timeout_ms;
+  uint32_t idle_count;
+  uint32_t pending_count;
+  ah_idle_upstream* lru_head;
+  ah_idle_upstream* lru_tail;
+} ah_upstream_pool;
+
+size_t upstream_pool_size()
+{
+  return sizeof(ah_upstream_pool);
+}
+
+size_t upstream_pool_alignment()
+{
+  return _Alignof(ah_upstream_pool);
+}
+
+/* IPv4-mapped addresses are keyed by the IPv4 address they hold, and the
+ * unused bytes of IPv4 addresses are cleared, so equal upstreams compare and
+ * hash equal */
+static ah_address key_from_address(const ah_address* address)
+{
+  ah_ipv4_address ipv4;
+  if (ipv4_from_address(address, &ipv4)) {
+    return address_from_ipv4(ipv4);
+  }
+
+  return *address;
+}
+
+static bool is_same_address(const ah_address* left, const ah_address* right)
+{
+  return left->family == right->family
+      && memcmp(left->bytes, right->bytes, sizeof(left->bytes)) == 0
+      && memcmp(left->port, right->port, sizeof(left->port)) == 0;
+}
+
+static ah_idle_upstream** address_bucket(ah_upstream_pool* pool,
+                                         const ah_address* address)
+{
+  uint32_t hash = FNV_OFFSET_BASIS;
+  uint32_t length = address->family == AH_ADDRESS_IPV4 ? 4 : 16;
+  for (uint32_t i = 0; i != length; ++i) {
+    hash = (hash ^ address->bytes[i]) * FNV_PRIME;
+  }
+  hash = (hash ^ address->port[0]) * FNV_PRIME;
+  hash = (hash ^ address->port[1]) * FNV_PRIME;
+
+  return &pool->buckets[hash & pool->bucket_mask];
+}
+
+/* Unlinks the connection from the pool, after which it is owned by the
+ * caller */
+static void detach_idle(ah_upstream_pool* pool, ah_idle_upstream* idle)
+{
+  ah_idle_upstream** link = address_bucket(pool, &idle->address);
+  while (*link != idle) {
+    link = &(*link)->hash_next;
+  }
+  *link = idle->hash_next;
+
+  if (idle->lru_previous == NULL) {
+    pool->lru_head = idle->lru_next;
+  } else {
+    idle->lru_previous->lru_next = idle->lru_next;
+  }
+  if (idle->lru_next == NULL) {
+    pool->lru_tail = idle->lru_previous;
+  } else {
+    idle->lru_next->lru_previous = idle->lru_previous;
+  }
+
+  if (--pool->idle_count == 0) {
+    stop_timer(&pool->timer);
+  }
+}
+
+static bool close_idle(ah_upstream_pool* pool, ah_idle_upstream* idle)
+{
+  detach_idle(pool, idle);
+  bool result = destroy_socket(&idle->socket);
+  free(idle);
+  return result;
+}
+
+static bool on_check_timer(ah_timer* timer, void* user_data)
+{
+  ah_upstream_pool* pool = user_data;
+  uint64_t now = monotonic_time_ms();
+  bool result = true;
+
+  /* The list is ordered by release time, so the expired connections are all
+   * at the tail end of it, but the rest still has to be checked for having
+   * been closed by the upstream */
+  for (ah_idle_upstream* idle = pool->lru_tail; idle != NULL;) {
+    ah_idle_upstream* previous = idle->lru_previous;
+    if (now - idle->released_at_ms >= pool->idle_timeout_ms
+        || !is_idle_socket_usable(&idle->socket))
+    {
+      result = close_idle(pool, idle) && result;
+    }
+    idle = previous;
+  }
+
+  if (pool->idle_count != 0) {
+    start_timer(timer, AH_UPSTREAM_CHECK_INTERVAL_MS);
+  }
+
+  return result;
+}
+
+bool create_upstream_pool(ah_upstream_pool* result_pool,
+                          ah_context* context,
+                          uint32_t max_idle,
+                          uint32_t max_idle_per_upstream,
+                          uint32_t idle_timeout_ms)
+{
+  if (max_idle > (UINT32_C(1) << 24)) {
+    return false;
+  }
+
+  uint32_t bucket_count = 1;
+  while (bucket_count < max_idle) {
+    bucket_count <<= 1;
+  }
+
+  *result_pool = (ah_upstream_pool) {
+      .context = context,
+      .bucket_mask = bucket_count - 1,
+      .max_idle = max_idle,
+      .max_idle_per_upstream = max_idle_per_upstream,
+      .idle_timeout_ms = idle_timeout_ms,
+  };
+  create_timer(
+      &result_pool->timer, context->server, on_check_timer, result_pool);
+
+  result_pool->buckets = calloc(bucket_count, sizeof(ah_idle_upstream*));
+  return result_pool->buckets != NULL;
+}
+
+static bool on_upstream_connect(ah_error_code error_code,
+                                ah_socket* socket,
+                                void* per_call_data)
+{
+  ah_upstream_request* request = per_call_data;
+  free(request->connector);
+  request->connector = NULL;
+  --request->pool->pending_count;
+
+  if (error_code == AH_ERR_OK) {
+    move_socket(&request->socket, socket);
+  }
+
+  return request->on_ready(error_code, request, request->per_call_data);
+}
+
+bool acquire_upstream(ah_upstream_pool* pool,
+                      ah_upstream_request* request,
+                      const ah_address* address,
+                      ah_on_upstream on_ready,
+                      void* per_call_data)
+{
+  *request = (ah_upstream_request) {
+      .pool = pool,
+      .address = key_from_address(address),
+      .on_ready = on_ready,
+      .per_call_data = per_call_data,
+  };
+
+  /* Connections are released to the front of their bucket, so the first one
+   * found is the most recently used, which is the least likely to have been
+   * closed by the upstream in the meantime */
+  ah_idle_upstream* idle = *address_bucket(pool, &request->address);
+  while (idle != NULL) {
+    if (!is_same_address(&idle->address, &request->address)) {
+      idle = idle->hash_next;
+      continue;
+    }
+
+    ah_idle_upstream* next = idle->hash_next;
+    detach_idle(pool, idle);
+    if (is_idle_socket_usable(&idle->socket)) {
+      request->socket = idle->socket;
+      request->reused = true;
+      free(idle);
+      return on_ready(AH_ERR_OK, request, per_call_data);
+    }
+
+    bool destroyed = destroy_socket(&idle->socket);
+    free(idle);
+    if (!destroyed) {
+      return false;
+    }
+    idle = next;
+  }
+
+  ah_connector* connector = malloc(connector_size());
+  if (connector == NULL) {
+    return false;
+  }
+
+  create_connector(connector, pool->context, on_upstream_connect);
+  request->connector = connector;
+  ++pool->pending_count;
+  if (queue_connect_operation(connector, &request->address, NULL, request)) {
+    return true;
+  }
+
+  /* The connector is already freed if the failure was reported to the
+   * callback */
+  if (request->connector != NULL) {
+    --pool->pending_count;
+    free(connector);
+    request->connector = NULL;
+  }
+
+  return false;
+}
+
+bool release_upstream(ah_upstream_pool* pool,
+                      ah_socket_accepted* socket,
+                      const ah_address* address)
+{
+  if (pool->max_idle == 0 || pool->max_idle_per_upstream == 0
+      || !is_idle_socket_usable(socket))
+  {
+    return destroy_socket(socket);
+  }
+
+  ah_idle_upstream* idle = malloc(sizeof(ah_idle_upstream));
+  if (idle == NULL) {
+    destroy_socket(socket);
+    return false;
+  }
+
+  ah_address key = key_from_address(address);
+  ah_idle_upstream** bucket = address_bucket(pool, &key);
+  uint32_t count = 0;
+  ah_idle_upstream* oldest = NULL;
+  for (ah_idle_upstream* other = *bucket; other != NULL;
+       other = other->hash_next)
+  {
+    if (is_same_address(&other->address, &key)) {
+      ++count;
+      oldest = other;
+    }
+  }
+
+  *idle = (ah_idle_upstream) {
+      .socket = *socket,
+      .hash_next = *bucket,
+      .lru_next = pool->lru_head,
+      .address = key,
+      .released_at_ms = monotonic_time_ms(),
+  };
+  *bucket = idle;
+  if (pool->lru_head == NULL) {
+    pool->lru_tail = idle;
+  } else {
+    pool->lru_head->lru_previous = idle;
+  }
+  pool->lru_head = idle;
+
+  if (pool->idle_count++ == 0) {
+    start_timer(&pool->timer, AH_UPSTREAM_CHECK_INTERVAL_MS);
+  }
+
+  if (count == pool->max_idle_per_upstream) {
+    return close_idle(pool, oldest);
+  }
+  if (pool->idle_count > pool->max_idle) {
+    return close_idle(pool, pool->lru_tail);
+  }
+
+  return true;
+}
+
+bool destroy_upstream_pool(ah_upstream_pool* pool)
+{
+  if (pool->pending_count != 0) {
+    return false;
+  }
+
+  bool result = true;
+  while (pool->lru_head != NULL) {
+    result = close_idle(pool, pool->lru_head) && result;
+  }
+
+  stop_timer(&pool->timer);
+  free(pool->buckets);
+  *pool = (ah_upstream_pool) {0};
+  return result;
+}
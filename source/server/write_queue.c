@@ -0,0 +1,245 @@
+#include <stdlib.h>
+
+#include "server/detail.h"
+
+void create_write_queue(ah_write_queue* result_queue, ah_io_dock* dock)
+{
+  *result_queue = (ah_write_queue) {.dock = dock};
+}
+
+void append_write_request(ah_write_queue* queue, ah_write_request* request)
+{
+  if (queue->tail == NULL) {
+    queue->head = request;
+  } else {
+    queue->tail->next = request;
+  }
+
+  queue->tail = request;
+  queue->pending_bytes += request->buffer.buffer_length;
+  if (request->shared != NULL) {
+    retain_shared_buf(request->shared);
+  }
+}
+
+bool queue_write_request(ah_write_queue* queue,
+                         ah_write_request* request,
+                         ah_io_buffer buffer,
+                         ah_on_write_request on_complete,
+                         void* per_call_data)
+{
+  if (buffer.buffer_length > (uint32_t)INT32_MAX) {
+    return false;
+  }
+
+  *request = (ah_write_request) {
+      .buffer = buffer,
+      .on_complete = on_complete,
+      .per_call_data = per_call_data,
+  };
+  return enqueue_write_request(queue, request);
+}
+
+bool queue_file_write_request(ah_write_queue* queue,
+                              ah_write_request* request,
+                              ah_cached_file* file,
+                              uint64_t offset,
+                              uint32_t length,
+                              ah_on_write_request on_complete,
+                              void* per_call_data)
+{
+  if (length > (uint32_t)INT32_MAX || offset > file->size
+      || length > file->size - offset)
+  {
+    return false;
+  }
+
+  /* An empty range is not sent as a file, because TransmitFile would send
+   * the whole file for a length of 0 */
+  if (file->mapping != NULL || length == 0) {
+    uint8_t* data =
+        file->mapping == NULL ? NULL : (uint8_t*)file->mapping + offset;
+    ah_io_buffer buffer = {length, data};
+    return queue_write_request(
+        queue, request, buffer, on_complete, per_call_data);
+  }
+
+  *request = (ah_write_request) {
+      .buffer = {length, NULL},
+      .on_complete = on_complete,
+      .per_call_data = per_call_data,
+      .file = file,
+      .file_offset = offset,
+  };
+  return enqueue_write_request(queue, request);
+}
+
+ah_shared_buf* create_shared_buf(uint32_t length)
+{
+  if (length > (uint32_t)INT32_MAX) {
+    return NULL;
+  }
+
+  ah_shared_buf* buffer = malloc(sizeof(ah_shared_buf) + length);
+  if (buffer != NULL) {
+    *buffer = (ah_shared_buf) {1, length};
+  }
+
+  return buffer;
+}
+
+void retain_shared_buf(ah_shared_buf* buffer)
+{
+  ++buffer->references;
+}
+
+void release_shared_buf(ah_shared_buf* buffer)
+{
+  if (--buffer->references == 0) {
+    free(buffer);
+  }
+}
+
+/* The reference is taken when the request is appended, so a request the
+ * queue refuses holds none */
+bool queue_shared_write_request(ah_write_queue* queue,
+                                ah_write_request* request,
+                                ah_shared_buf* buffer,
+                                uint32_t offset,
+                                uint32_t length,
+                                ah_on_write_request on_complete,
+                                void* per_call_data)
+{
+  if (offset > buffer->length || length > buffer->length - offset) {
+    return false;
+  }
+
+  *request = (ah_write_request) {
+      .buffer = {length, buffer->data + offset},
+      .on_complete = on_complete,
+      .per_call_data = per_call_data,
+      .shared = buffer,
+  };
+  return enqueue_write_request(queue, request);
+}
+
+bool broadcast_shared_buf(ah_shared_buf* buffer,
+                          uint32_t offset,
+                          uint32_t length,
+                          ah_write_queue* const* queues,
+                          ah_write_request* requests,
+                          uint32_t count,
+                          ah_on_write_request on_complete,
+                          void* per_call_data)
+{
+  bool result = true;
+  for (uint32_t i = 0; i != count; ++i) {
+    result = queue_shared_write_request(queues[i],
+                                        &requests[i],
+                                        buffer,
+                                        offset,
+                                        length,
+                                        on_complete,
+                                        per_call_data)
+        && result;
+  }
+
+  return result;
+}
+
+ah_write_request* complete_write_requests(ah_write_queue* queue,
+                                          uint64_t bytes_transferred)
+{
+  queue->pending_bytes -= bytes_transferred;
+
+  ah_write_request* last = NULL;
+  for (ah_write_request* request = queue->head; request != NULL;
+       request = request->next)
+  {
+    uint32_t length = request->buffer.buffer_length;
+    uint32_t remaining = length - request->bytes_transferred;
+    if (bytes_transferred < remaining) {
+      request->bytes_transferred += (uint32_t)bytes_transferred;
+      break;
+    }
+
+    bytes_transferred -= remaining;
+    request->bytes_transferred = length;
+    last = request;
+  }
+
+  if (last == NULL) {
+    return NULL;
+  }
+
+  ah_write_request* completed = queue->head;
+  queue->head = last->next;
+  if (queue->head == NULL) {
+    queue->tail = NULL;
+  }
+
+  last->next = NULL;
+  return completed;
+}
+
+ah_write_request* take_write_requests(ah_write_queue* queue)
+{
+  ah_write_request* requests = queue->head;
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->pending_bytes = 0;
+  return requests;
+}
+
+void set_write_queue_watermarks(ah_write_queue* queue,
+                                uint64_t low_watermark,
+                                uint64_t high_watermark,
+                                ah_on_write_pressure on_pressure,
+                                void* user_data)
+{
+  queue->low_watermark = low_watermark;
+  queue->high_watermark = high_watermark;
+  queue->on_pressure = on_pressure;
+  queue->user_data = user_data;
+}
+
+bool update_write_pressure(ah_write_queue* queue)
+{
+  bool paused = queue->reads_paused;
+  if (!paused) {
+    paused = queue->high_watermark != 0
+        && queue->pending_bytes >= queue->high_watermark;
+  } else {
+    paused = queue->pending_bytes > queue->low_watermark;
+  }
+
+  if (paused == queue->reads_paused) {
+    return true;
+  }
+
+  queue->reads_paused = paused;
+  return queue->on_pressure == NULL
+      || queue->on_pressure(queue, paused, queue->user_data);
+}
+
+bool finish_write_requests(ah_write_request* requests,
+                           ah_error_code error_code)
+{
+  while (requests != NULL) {
+    ah_write_request* request = requests;
+    requests = request->next;
+    request->next = NULL;
+    /* The callback may reuse the request, so the buffer is saved first */
+    ah_shared_buf* shared = request->shared;
+    bool result =
+        request->on_complete(error_code, request, request->per_call_data);
+    if (shared != NULL) {
+      release_shared_buf(shared);
+    }
+    if (!result) {
+      return false;
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,593 @@
+#include "tls.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+
+#define TLS_MAX_SECRET 48
+#define TLS_LABEL_PREFIX "tls13 "
+#define TLS_LABEL_PREFIX_LENGTH 6
+
+/* The error queue of OpenSSL is per thread, so the message is taken from it
+ * right away and only writing it out is deferred */
+static void log_ssl_error(const char* function)
+{
+  char message[256];
+  ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+  ERR_clear_error();
+  ah_log_error_message(function, message);
+}
+
+/* Traffic secrets */
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+/* OpenSSL only hands out the traffic secrets through the key log callback,
+ * which is called with lines in the NSS key log format. The application
+ * traffic secrets of TLS 1.3 are all that is needed to derive the keys. */
+static void capture_secret(const SSL* ssl, const char* line)
+{
+  ah_tls_session* session = SSL_get_app_data(ssl);
+  uint8_t* secret;
+  if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+    secret = session->client_secret;
+  } else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+    secret = session->server_secret;
+  } else {
+    return;
+  }
+
+  const char* hex = strrchr(line, ' ') + 1;
+  size_t length = strlen(hex) / 2;
+  if (length > TLS_MAX_SECRET) {
+    return;
+  }
+
+  for (size_t i = 0; i != length; ++i) {
+    int high = hex_value(hex[2 * i]);
+    int low = hex_value(hex[2 * i + 1]);
+    if (high == -1 || low == -1) {
+      return;
+    }
+    secret[i] = (uint8_t)(high << 4 | low);
+  }
+
+  session->secret_length = (uint32_t)length;
+}
+
+/* HKDF-Expand-Label of RFC 8446 with an empty context, which needs a single
+ * HMAC block for the key and IV sizes in use */
+static bool expand_label(const EVP_MD* digest,
+                         const uint8_t* secret,
+                         uint32_t secret_length,
+                         const char* label,
+                         uint8_t* out,
+                         uint32_t length)
+{
+  uint8_t info[32];
+  size_t label_length = strlen(label);
+  info[0] = 0;
+  info[1] = (uint8_t)length;
+  info[2] = (uint8_t)(TLS_LABEL_PREFIX_LENGTH + label_length);
+  memcpy(&info[3], TLS_LABEL_PREFIX, TLS_LABEL_PREFIX_LENGTH);
+  memcpy(&info[3 + TLS_LABEL_PREFIX_LENGTH], label, label_length);
+  size_t info_length = 3 + TLS_LABEL_PREFIX_LENGTH + label_length;
+  info[info_length++] = 0;
+  info[info_length++] = 1;
+
+  uint8_t block[EVP_MAX_MD_SIZE];
+  unsigned int block_length = 0;
+  if (HMAC(digest,
+           secret,
+           (int)secret_length,
+           info,
+           info_length,
+           block,
+           &block_length)
+          == NULL
+      || block_length < length)
+  {
+    return false;
+  }
+
+  memcpy(out, block, length);
+  OPENSSL_cleanse(block, sizeof(block));
+  return true;
+}
+
+static bool derive_keys(const SSL* ssl,
+                        const uint8_t* secret,
+                        uint32_t secret_length,
+                        ah_tls_keys* result_keys)
+{
+  const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+  uint32_t key_length = 32;
+  switch (SSL_CIPHER_get_protocol_id(cipher)) {
+    case 0x1301:
+      result_keys->cipher = AH_TLS_AES_128_GCM;
+      key_length = 16;
+      break;
+    case 0x1302:
+      result_keys->cipher = AH_TLS_AES_256_GCM;
+      break;
+    case 0x1303:
+      result_keys->cipher = AH_TLS_CHACHA20_POLY1305;
+      break;
+    default:
+      return false;
+  }
+
+  const EVP_MD* digest = SSL_CIPHER_get_handshake_digest(cipher);
+  result_keys->sequence = 0;
+  return digest != NULL
+      && expand_label(
+             digest, secret, secret_length, "key", result_keys->key, key_length)
+      && expand_label(digest,
+                      secret,
+                      secret_length,
+                      "iv",
+                      result_keys->iv,
+                      sizeof(result_keys->iv));
+}
+
+/* The kernel continues from the first record after the handshake, so the
+ * sending side can only be offloaded before any application data went
+ * through OpenSSL. The receiving side stays with OpenSSL: the kernel fails
+ * reads of records that are not application data, which would turn a
+ * close_notify alert or a key update of the peer into an I/O error. */
+static void offload_record_layer(ah_tls_session* session)
+{
+  SSL* ssl = session->ssl;
+  if (SSL_version(ssl) != TLS1_3_VERSION || session->secret_length == 0) {
+    return;
+  }
+
+  ah_tls_keys keys;
+  if (derive_keys(
+          ssl, session->server_secret, session->secret_length, &keys))
+  {
+    session->kernel_tx = enable_kernel_tls(&session->socket, &keys);
+  }
+
+  OPENSSL_cleanse(&keys, sizeof(keys));
+}
+
+/* Context */
+
+bool create_tls_context(ah_tls_context* result_context,
+                        const char* certificate_path,
+                        const char* key_path)
+{
+  *result_context = (ah_tls_context) {0};
+
+  SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+  if (context == NULL) {
+    log_ssl_error("SSL_CTX_new");
+    return false;
+  }
+
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  SSL_CTX_set_options(context, SSL_OP_NO_TICKET | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(context, 0);
+  SSL_CTX_set_keylog_callback(context, capture_secret);
+  if (SSL_CTX_use_certificate_chain_file(context, certificate_path) != 1) {
+    log_ssl_error("SSL_CTX_use_certificate_chain_file");
+    SSL_CTX_free(context);
+    return false;
+  }
+  if (SSL_CTX_use_PrivateKey_file(context, key_path, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(context) != 1)
+  {
+    log_ssl_error("SSL_CTX_use_PrivateKey_file");
+    SSL_CTX_free(context);
+    return false;
+  }
+
+  result_context->ssl_context = context;
+  return true;
+}
+
+void destroy_tls_context(ah_tls_context* context)
+{
+  SSL_CTX_free(context->ssl_context);
+  *context = (ah_tls_context) {0};
+}
+
+/* Output */
+
+static bool on_output_written(ah_error_code error_code,
+                              ah_write_request* request,
+                              void* per_call_data);
+
+/* Records produced by OpenSSL outside of an ::ah_tls_write, i.e. during the
+ * handshake, are sent from a buffer allocated along with the request */
+static bool flush_output(ah_tls_session* session)
+{
+  BIO* output = session->output_bio;
+  size_t pending = BIO_ctrl_pending(output);
+  if (pending == 0) {
+    return true;
+  }
+  if (session->kernel_tx || pending > (size_t)INT32_MAX) {
+    (void)BIO_reset(output);
+    return true;
+  }
+
+  ah_tls_write* write = malloc(sizeof(ah_tls_write) + pending);
+  if (write == NULL) {
+    return false;
+  }
+
+  uint8_t* data = (uint8_t*)(write + 1);
+  BIO_read(output, data, (int)pending);
+  write->session = session;
+  ++session->output_writes;
+  ah_io_buffer buffer = {(uint32_t)pending, data};
+  if (!queue_write_request(&session->queue,
+                           &write->request,
+                           buffer,
+                           on_output_written,
+                           write))
+  {
+    --session->output_writes;
+    free(write);
+    return false;
+  }
+
+  return true;
+}
+
+/* Handshake */
+
+static bool fail_handshake(ah_tls_session* session, ah_error_code error_code)
+{
+  session->state = AH_TLS_FAILED;
+  return session->on_handshake(error_code, session, session->user_data);
+}
+
+/* The record layer is offloaded only once the last handshake record was
+ * handed to the kernel, otherwise the kernel would encrypt it again */
+static bool finish_handshake(ah_tls_session* session)
+{
+  offload_record_layer(session);
+  OPENSSL_cleanse(session->client_secret, TLS_MAX_SECRET);
+  OPENSSL_cleanse(session->server_secret, TLS_MAX_SECRET);
+  session->secret_length = 0;
+
+  session->state = AH_TLS_ESTABLISHED;
+  return session->on_handshake(AH_ERR_OK, session, session->user_data);
+}
+
+static bool on_output_written(ah_error_code error_code,
+                              ah_write_request* request,
+                              void* per_call_data)
+{
+  (void)request;
+
+  ah_tls_write* write = per_call_data;
+  ah_tls_session* session = write->session;
+  free(write);
+  --session->output_writes;
+  if (session->state != AH_TLS_HANDSHAKE) {
+    return true;
+  }
+  if (error_code != AH_ERR_OK) {
+    return fail_handshake(session, error_code);
+  }
+  if (session->handshake_done && session->output_writes == 0) {
+    return finish_handshake(session);
+  }
+
+  return true;
+}
+
+static bool on_handshake_read(ah_error_code error_code,
+                              ah_io_operation* operation,
+                              uint32_t bytes_transferred,
+                              void* per_call_data);
+
+static bool advance_handshake(ah_tls_session* session)
+{
+  int result = SSL_do_handshake(session->ssl);
+  if (!flush_output(session)) {
+    return false;
+  }
+
+  if (result == 1) {
+    session->handshake_done = true;
+    return session->output_writes != 0 || finish_handshake(session);
+  }
+
+  if (SSL_get_error(session->ssl, result) == SSL_ERROR_WANT_READ) {
+    ah_io_buffer buffer = {sizeof(session->input), session->input};
+    return queue_read_operation4(
+        &session->dock, buffer, on_handshake_read, session);
+  }
+
+  ERR_clear_error();
+  return fail_handshake(session, AH_ERR_PROTOCOL_ERROR);
+}
+
+static bool on_handshake_read(ah_error_code error_code,
+                              ah_io_operation* operation,
+                              uint32_t bytes_transferred,
+                              void* per_call_data)
+{
+  (void)operation;
+
+  ah_tls_session* session = per_call_data;
+  if (session->state != AH_TLS_HANDSHAKE) {
+    return true;
+  }
+  if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+    ah_io_buffer buffer = {sizeof(session->input), session->input};
+    return queue_read_operation4(
+        &session->dock, buffer, on_handshake_read, session);
+  }
+  if (error_code != AH_ERR_OK) {
+    return fail_handshake(session, error_code);
+  }
+  if (bytes_transferred == 0) {
+    return fail_handshake(session, AH_ERR_CONNECTION_ABORTED);
+  }
+
+  BIO_write(session->input_bio, session->input, (int)bytes_transferred);
+  return advance_handshake(session);
+}
+
+bool tls_accept(ah_tls_context* context,
+                ah_tls_session* result_session,
+                ah_socket* socket,
+                ah_tls_on_handshake on_handshake,
+                void* user_data)
+{
+  SSL* ssl = SSL_new(context->ssl_context);
+  BIO* input = BIO_new(BIO_s_mem());
+  BIO* output = BIO_new(BIO_s_mem());
+  if (ssl == NULL || input == NULL || output == NULL) {
+    BIO_free(output);
+    BIO_free(input);
+    SSL_free(ssl);
+    ERR_clear_error();
+    return false;
+  }
+
+  /* An empty input buffer means more data is needed, not the end of the
+   * stream */
+  BIO_set_mem_eof_return(input, -1);
+  SSL_set_bio(ssl, input, output);
+  SSL_set_accept_state(ssl);
+
+  *result_session = (ah_tls_session) {
+      .ssl = ssl,
+      .input_bio = input,
+      .output_bio = output,
+      .state = AH_TLS_HANDSHAKE,
+      .on_handshake = on_handshake,
+      .user_data = user_data,
+  };
+  SSL_set_app_data(ssl, result_session);
+  move_socket(&result_session->socket, socket);
+  result_session->dock.socket = &result_session->socket;
+  create_write_queue(&result_session->queue, &result_session->dock);
+  return advance_handshake(result_session);
+}
+
+/* Reading */
+
+static bool complete_read(ah_tls_session* session,
+                          ah_error_code error_code,
+                          uint32_t bytes_transferred)
+{
+  ah_tls_on_read on_read = session->on_read;
+  session->on_read = NULL;
+  return on_read(
+      error_code, session, bytes_transferred, session->read_per_call_data);
+}
+
+static bool on_record_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data);
+
+static bool continue_read(ah_tls_session* session)
+{
+  int result =
+      SSL_read(session->ssl, session->read_buffer, (int)session->read_length);
+  /* Reading can produce records of its own, e.g. for a key update. With the
+   * kernel sending, those are dropped and the kernel keeps its keys. */
+  if (!flush_output(session)) {
+    return false;
+  }
+
+  if (result > 0) {
+    return complete_read(session, AH_ERR_OK, (uint32_t)result);
+  }
+
+  switch (SSL_get_error(session->ssl, result)) {
+    case SSL_ERROR_WANT_READ: {
+      ah_io_buffer buffer = {sizeof(session->input), session->input};
+      return queue_read_operation4(
+          &session->dock, buffer, on_record_read, session);
+    }
+    case SSL_ERROR_ZERO_RETURN:
+      return complete_read(session, AH_ERR_OK, 0);
+  }
+
+  ERR_clear_error();
+  return complete_read(session, AH_ERR_PROTOCOL_ERROR, 0);
+}
+
+/* A connection closed without a close_notify alert is reported as the end of
+ * the stream like any other, since truncation only matters to protocols that
+ * do not delimit their messages */
+static bool on_record_read(ah_error_code error_code,
+                           ah_io_operation* operation,
+                           uint32_t bytes_transferred,
+                           void* per_call_data)
+{
+  (void)operation;
+
+  ah_tls_session* session = per_call_data;
+  if (error_class_from_code(error_code) == AH_ERROR_CLASS_RETRYABLE) {
+    ah_io_buffer buffer = {sizeof(session->input), session->input};
+    return queue_read_operation4(
+        &session->dock, buffer, on_record_read, session);
+  }
+  if (error_code != AH_ERR_OK || bytes_transferred == 0) {
+    return complete_read(session, error_code, 0);
+  }
+
+  BIO_write(session->input_bio, session->input, (int)bytes_transferred);
+  return continue_read(session);
+}
+
+bool tls_read(ah_tls_session* session,
+              ah_io_buffer buffer,
+              ah_tls_on_read on_read,
+              void* per_call_data)
+{
+  if (session->state != AH_TLS_ESTABLISHED || session->on_read != NULL
+      || buffer.buffer_length > (uint32_t)INT32_MAX)
+  {
+    return false;
+  }
+
+  session->on_read = on_read;
+  session->read_per_call_data = per_call_data;
+  session->read_buffer = buffer.buffer;
+  session->read_length = buffer.buffer_length;
+  return continue_read(session);
+}
+
+/* Writing */
+
+static bool on_tls_written(ah_error_code error_code,
+                           ah_write_request* request,
+                           void* per_call_data)
+{
+  (void)request;
+
+  ah_tls_write* write = per_call_data;
+  free(write->ciphertext);
+  write->ciphertext = NULL;
+  return write->on_complete(error_code, write, write->per_call_data);
+}
+
+bool tls_write(ah_tls_session* session,
+               ah_tls_write* write,
+               ah_io_buffer buffer,
+               ah_tls_on_write on_complete,
+               void* per_call_data)
+{
+  if (session->state != AH_TLS_ESTABLISHED
+      || buffer.buffer_length > (uint32_t)INT32_MAX)
+  {
+    return false;
+  }
+
+  *write = (ah_tls_write) {
+      .session = session,
+      .on_complete = on_complete,
+      .per_call_data = per_call_data,
+  };
+  if (session->kernel_tx || buffer.buffer_length == 0) {
+    return queue_write_request(
+        &session->queue, &write->request, buffer, on_tls_written, write);
+  }
+
+  /* The memory buffer takes everything, so the write never comes up short */
+  int result =
+      SSL_write(session->ssl, buffer.buffer, (int)buffer.buffer_length);
+  if (result <= 0) {
+    log_ssl_error("SSL_write");
+    return false;
+  }
+
+  size_t pending = BIO_ctrl_pending(session->output_bio);
+  if (pending > (size_t)INT32_MAX) {
+    (void)BIO_reset(session->output_bio);
+    return false;
+  }
+
+  write->ciphertext = malloc(pending);
+  if (write->ciphertext == NULL) {
+    (void)BIO_reset(session->output_bio);
+    return false;
+  }
+
+  BIO_read(session->output_bio, write->ciphertext, (int)pending);
+  ah_io_buffer ciphertext = {(uint32_t)pending, write->ciphertext};
+  if (!queue_write_request(
+          &session->queue, &write->request, ciphertext, on_tls_written, write))
+  {
+    free(write->ciphertext);
+    write->ciphertext = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+bool tls_write_file(ah_tls_session* session,
+                    ah_tls_write* write,
+                    ah_cached_file* file,
+                    uint64_t offset,
+                    uint32_t length,
+                    ah_tls_on_write on_complete,
+                    void* per_call_data)
+{
+  if (session->state != AH_TLS_ESTABLISHED) {
+    return false;
+  }
+
+  if (session->kernel_tx) {
+    *write = (ah_tls_write) {
+        .session = session,
+        .on_complete = on_complete,
+        .per_call_data = per_call_data,
+    };
+    return queue_file_write_request(&session->queue,
+                                    &write->request,
+                                    file,
+                                    offset,
+                                    length,
+                                    on_tls_written,
+                                    write);
+  }
+
+  if (file->mapping == NULL || offset > file->size
+      || length > file->size - offset)
+  {
+    return false;
+  }
+
+  ah_io_buffer buffer = {length, (uint8_t*)file->mapping + offset};
+  return tls_write(session, write, buffer, on_complete, per_call_data);
+}
+
+void destroy_tls_session(ah_tls_session* session)
+{
+  SSL_free(session->ssl);
+  OPENSSL_cleanse(session->client_secret, TLS_MAX_SECRET);
+  OPENSSL_cleanse(session->server_secret, TLS_MAX_SECRET);
+  session->ssl = NULL;
+  session->input_bio = NULL;
+  session->output_bio = NULL;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * @file
+ *
+ * TLS for accepted sockets on top of OpenSSL. The handshake is driven through
+ * the dock of the session with OpenSSL working on memory buffers, after which
+ * the sending side of TLS 1.3 connections is handed to the kernel where it is
+ * supported. Such sessions send plaintext with the kernel doing the
+ * encryption, including files sent with \c sendfile, while the rest are
+ * encrypted by OpenSSL in userspace. Received records are always decrypted by
+ * OpenSSL.
+ */
+
+/**
+ * @brief The size of the buffer receiving the encrypted records, which fits
+ * a record of the maximum size.
+ */
+#define AH_TLS_INPUT_SIZE (16 * 1024 + 512)
+
+typedef struct ah_tls_session ah_tls_session;
+typedef struct ah_tls_write ah_tls_write;
+
+/**
+ * @brief Server side configuration shared by the sessions created from it.
+ */
+typedef struct ah_tls_context {
+  void* ssl_context;
+} ah_tls_context;
+
+/**
+ * @brief Callback type for the end of the handshake of an ::ah_tls_session.
+ *
+ * The session can be read from and written to once this is called without an
+ * error.
+ */
+typedef bool (*ah_tls_on_handshake)(ah_error_code error_code,
+                                    ah_tls_session* session,
+                                    void* user_data);
+
+/**
+ * @brief Callback type for ::tls_read, receiving the number of plaintext
+ * bytes read into the buffer, which is 0 at the end of the stream.
+ */
+typedef bool (*ah_tls_on_read)(ah_error_code error_code,
+                               ah_tls_session* session,
+                               uint32_t bytes_transferred,
+                               void* per_call_data);
+
+typedef bool (*ah_tls_on_write)(ah_error_code error_code,
+                                ah_tls_write* write,
+                                void* per_call_data);
+
+/**
+ * @brief A write of an ::ah_tls_session, which must stay alive until its
+ * callback is called.
+ *
+ * The members are managed by the TLS functions. Writes are completed in the
+ * order they were queued.
+ */
+struct ah_tls_write {
+  ah_write_request request;
+  ah_tls_session* session;
+  ah_tls_on_write on_complete;
+  void* per_call_data;
+  uint8_t* ciphertext;
+};
+
+typedef enum ah_tls_state
+{
+  AH_TLS_HANDSHAKE,
+  AH_TLS_ESTABLISHED,
+  AH_TLS_FAILED,
+} ah_tls_state;
+
+/**
+ * @brief TLS connection over an accepted socket.
+ *
+ * The members are managed by the TLS functions, except for \c socket, which
+ * can be closed with an ::ah_closer once the session is not used anymore.
+ * \c kernel_tx tells whether the kernel took over the encryption of what is
+ * sent.
+ */
+struct ah_tls_session {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  ah_write_queue queue;
+  void* ssl;
+  void* input_bio;
+  void* output_bio;
+  ah_tls_state state;
+  bool handshake_done;
+  bool kernel_tx;
+  uint32_t output_writes;
+  ah_tls_on_handshake on_handshake;
+  void* user_data;
+  uint8_t* read_buffer;
+  uint32_t read_length;
+  ah_tls_on_read on_read;
+  void* read_per_call_data;
+  uint32_t secret_length;
+  uint8_t client_secret[48];
+  uint8_t server_secret[48];
+  uint8_t input[AH_TLS_INPUT_SIZE];
+};
+
+/**
+ * @brief Loads the PEM encoded certificate chain and private key for the
+ * server side of TLS connections.
+ *
+ * Session tickets are not issued, which keeps the record sequence of new
+ * sessions at a known state for the kernel to take over.
+ */
+bool create_tls_context(ah_tls_context* result_context,
+                        const char* certificate_path,
+                        const char* key_path);
+
+/**
+ * @brief Frees the context, which must not be used by any session anymore.
+ */
+void destroy_tls_context(ah_tls_context* context);
+
+/**
+ * @brief Takes ownership of a socket from an accept handler and starts the
+ * server side of the handshake on it.
+ *
+ * \c on_handshake is called once the handshake completed or failed. If the
+ * OpenSSL state of the session cannot be allocated, \c false is returned and
+ * the socket is left with the caller.
+ */
+bool tls_accept(ah_tls_context* context,
+                ah_tls_session* result_session,
+                ah_socket* socket,
+                ah_tls_on_handshake on_handshake,
+                void* user_data);
+
+/**
+ * @brief Reads plaintext into \c buffer.
+ *
+ * Only one read can be queued at a time. Data already decrypted by OpenSSL
+ * is delivered before this function returns, which means \c on_read may be
+ * called from inside this call.
+ */
+bool tls_read(ah_tls_session* session,
+              ah_io_buffer buffer,
+              ah_tls_on_read on_read,
+              void* per_call_data);
+
+/**
+ * @brief Queues \c buffer to be sent.
+ *
+ * With the kernel encrypting, the buffer is sent as it is and must stay alive
+ * until the callback is called. Otherwise it is encrypted into a buffer owned
+ * by \c write before this function returns.
+ */
+bool tls_write(ah_tls_session* session,
+               ah_tls_write* write,
+               ah_io_buffer buffer,
+               ah_tls_on_write on_complete,
+               void* per_call_data);
+
+/**
+ * @brief Queues \c length bytes of \c file from \c offset to be sent.
+ *
+ * With the kernel encrypting, the file is sent the same way as by
+ * ::queue_file_write_request. Otherwise only files mapped into memory can be
+ * sent and \c false is returned for the rest.
+ */
+bool tls_write_file(ah_tls_session* session,
+                    ah_tls_write* write,
+                    ah_cached_file* file,
+                    uint64_t offset,
+                    uint32_t length,
+                    ah_tls_on_write on_complete,
+                    void* per_call_data);
+
+/**
+ * @brief Frees the OpenSSL state of the session.
+ *
+ * The socket must be closed or moved before this call and no callbacks of
+ * the session may be pending.
+ */
+void destroy_tls_session(ah_tls_session* session);
@@ -0,0 +1,180 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+
+static ah_address accepted_address;
+static bool accepted;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)socket;
+
+  if (error_code == AH_ERR_OK) {
+    accepted_address = *address;
+    accepted = true;
+  }
+
+  return true;
+}
+
+static ah_address address_from_text(ah_address_family family,
+                                    const char* text,
+                                    uint16_t port)
+{
+  ah_address address = {.family = (uint8_t)family};
+  inet_pton(family == AH_ADDRESS_IPV4 ? AF_INET : AF_INET6,
+            text,
+            address.bytes);
+  uint16_t port_raw = htons(port);
+  memcpy(address.port, &port_raw, sizeof(address.port));
+  return address;
+}
+
+static int check_format(ah_address_family family,
+                        const char* text,
+                        const char* expected)
+{
+  ah_address address = address_from_text(family, text, 8080);
+  char result[AH_ADDRESS_MAX_STRING];
+  size_t length = format_address(&address, result);
+  if (length != strlen(expected) || strcmp(result, expected) != 0) {
+    fprintf(stderr, "'%s' was formatted as '%s'\n", text, result);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int check_formatting(void)
+{
+  CHECK(check_format(AH_ADDRESS_IPV4, "192.0.2.1", "192.0.2.1:8080") == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6, "::1", "[::1]:8080") == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6, "::", "[::]:8080") == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6, "1::", "[1::]:8080") == 0);
+  CHECK(check_format(
+            AH_ADDRESS_IPV6, "2001:0DB8:0:0:0:0:0:1", "[2001:db8::1]:8080")
+        == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6,
+                     "2001:db8:0:1:1:1:1:1",
+                     "[2001:db8:0:1:1:1:1:1]:8080")
+        == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6,
+                     "2001:0:0:1:0:0:0:1",
+                     "[2001:0:0:1::1]:8080")
+        == 0);
+  CHECK(check_format(
+            AH_ADDRESS_IPV6, "2001:db8:0:0:1:0:0:1", "[2001:db8::1:0:0:1]:8080")
+        == 0);
+  CHECK(check_format(AH_ADDRESS_IPV6,
+                     "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff",
+                     "[ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff]:8080")
+        == 0);
+  CHECK(check_format(
+            AH_ADDRESS_IPV6, "::ffff:203.0.113.7", "[::ffff:203.0.113.7]:8080")
+        == 0);
+
+  ah_address none = {0};
+  char result[AH_ADDRESS_MAX_STRING];
+  CHECK(format_address(&none, result) == 0 && result[0] == '\0');
+
+  ah_ipv4_address ipv4;
+  ah_address mapped =
+      address_from_text(AH_ADDRESS_IPV6, "::ffff:203.0.113.7", 443);
+  CHECK(port_from_address(&mapped) == 443);
+  CHECK(ipv4_from_address(&mapped, &ipv4));
+  CHECK(memcmp(ipv4.address, (uint8_t[]) {203, 0, 113, 7}, 4) == 0);
+  CHECK(ipv4.port == 443);
+  ah_address ipv6 = address_from_text(AH_ADDRESS_IPV6, "2001:db8::1", 443);
+  CHECK(!ipv4_from_address(&ipv6, &ipv4));
+  CHECK(!ipv4_from_address(&none, &ipv4));
+
+  ah_address built = address_from_ipv4((ah_ipv4_address) {{192, 0, 2, 1}, 80});
+  CHECK(built.family == AH_ADDRESS_IPV4);
+  format_address(&built, result);
+  CHECK(strcmp(result, "192.0.2.1:80") == 0);
+  return 0;
+}
+
+static int connect_peer(int family, const void* address, socklen_t length)
+{
+  int descriptor = socket(family, SOCK_STREAM, 0);
+  if (descriptor == -1
+      || fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK)
+          == -1)
+  {
+    return -1;
+  }
+
+  int result = connect(descriptor, address, length);
+  return result == 0 || errno == EINPROGRESS ? descriptor : -1;
+}
+
+static int accept_peer(loopback* fixture, int peer)
+{
+  CHECK(peer != -1);
+  accepted = false;
+  for (uint32_t i = 0; i != 100 && !accepted; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(accepted);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+/* One listener takes the peers of both families */
+static int check_dual_stack(void)
+{
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  CHECK(fixture.port != 0);
+
+  struct sockaddr_in ipv4 = {
+      .sin_family = AF_INET,
+      .sin_port = htons(fixture.port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  int peer = connect_peer(AF_INET, &ipv4, sizeof(ipv4));
+  CHECK(accept_peer(&fixture, peer) == 0);
+  ah_ipv4_address peer_ipv4;
+  CHECK(ipv4_from_address(&accepted_address, &peer_ipv4));
+  CHECK(memcmp(peer_ipv4.address, (uint8_t[]) {127, 0, 0, 1}, 4) == 0);
+  CHECK(peer_ipv4.port != 0);
+
+  /* Systems without IPv6 fall back to an IPv4 listener */
+  if (accepted_address.family == AH_ADDRESS_IPV6) {
+    struct sockaddr_in6 ipv6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(fixture.port),
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+    peer = connect_peer(AF_INET6, &ipv6, sizeof(ipv6));
+    CHECK(accept_peer(&fixture, peer) == 0);
+    CHECK(accepted_address.family == AH_ADDRESS_IPV6);
+    CHECK(!ipv4_from_address(&accepted_address, &peer_ipv4));
+    char result[AH_ADDRESS_MAX_STRING];
+    format_address(&accepted_address, result);
+    CHECK(strncmp(result, "[::1]:", 6) == 0);
+  } else {
+    printf("IPv6 is not available, skipping it\n");
+  }
+
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
+
+int main(void)
+{
+  CHECK(check_formatting() == 0);
+  CHECK(check_dual_stack() == 0);
+  return 0;
+}
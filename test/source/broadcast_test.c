@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+#define SUBSCRIBERS 8
+#define PAYLOAD_SIZE (64 * 1024)
+
+static ah_socket_accepted accepted[SUBSCRIBERS];
+static ah_io_dock docks[SUBSCRIBERS];
+static ah_write_queue queues[SUBSCRIBERS];
+static ah_write_request requests[SUBSCRIBERS];
+static uint32_t accepted_count;
+static uint32_t completed_count;
+static uint32_t aborted_count;
+static uint8_t received[PAYLOAD_SIZE];
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && accepted_count != SUBSCRIBERS) {
+    uint32_t i = accepted_count++;
+    move_socket(&accepted[i], socket);
+    docks[i].socket = &accepted[i];
+    create_write_queue(&queues[i], &docks[i]);
+  }
+
+  return true;
+}
+
+static bool on_written(ah_error_code error_code,
+                       ah_write_request* request,
+                       void* per_call_data)
+{
+  ah_shared_buf* buffer = per_call_data;
+  /* The reference of the request is only dropped after the callback */
+  if (request->shared != buffer || buffer->references < 2) {
+    return false;
+  }
+
+  if (error_code == AH_ERR_OK) {
+    ++completed_count;
+  } else if (error_code == AH_ERR_OPERATION_ABORTED) {
+    ++aborted_count;
+  }
+
+  return true;
+}
+
+int main(void)
+{
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  int peers[SUBSCRIBERS];
+  for (uint32_t i = 0; i != SUBSCRIBERS; ++i) {
+    peers[i] = connect_loopback(&fixture);
+    CHECK(peers[i] != -1);
+    for (uint32_t j = 0; j != 100 && accepted_count != i + 1; ++j) {
+      CHECK(tick_loopback(&fixture));
+    }
+  }
+  CHECK(accepted_count == SUBSCRIBERS);
+
+  ah_shared_buf* buffer = create_shared_buf(PAYLOAD_SIZE);
+  CHECK(buffer != NULL && buffer->references == 1);
+  for (uint32_t i = 0; i != PAYLOAD_SIZE; ++i) {
+    buffer->data[i] = (uint8_t)(i * 7 + i / 251);
+  }
+  CHECK(create_shared_buf(UINT32_MAX) == NULL);
+
+  /* A slice past the end is refused without taking a reference */
+  CHECK(!queue_shared_write_request(
+      &queues[0], &requests[0], buffer, 1, PAYLOAD_SIZE, on_written, buffer));
+  CHECK(buffer->references == 1 && queues[0].head == NULL);
+
+  ah_write_queue* queue_pointers[SUBSCRIBERS];
+  for (uint32_t i = 0; i != SUBSCRIBERS; ++i) {
+    queue_pointers[i] = &queues[i];
+  }
+  CHECK(broadcast_shared_buf(buffer,
+                             0,
+                             PAYLOAD_SIZE,
+                             queue_pointers,
+                             requests,
+                             SUBSCRIBERS,
+                             on_written,
+                             buffer));
+  CHECK(buffer->references == SUBSCRIBERS + 1);
+  CHECK(requests[0].buffer.buffer == buffer->data);
+
+  /* The first subscriber leaves before anything is sent */
+  CHECK(destroy_socket(&accepted[0]));
+  CHECK(cancel_write_queue(&queues[0]));
+  CHECK(aborted_count == 1 && buffer->references == SUBSCRIBERS);
+  CHECK(close(peers[0]) == 0);
+
+  for (uint32_t i = 1; i != SUBSCRIBERS; ++i) {
+    size_t total = 0;
+    for (uint32_t j = 0; j != 1000 && total != PAYLOAD_SIZE; ++j) {
+      CHECK(tick_loopback(&fixture));
+      ssize_t result =
+          recv(peers[i], received + total, PAYLOAD_SIZE - total, 0);
+      CHECK(result > 0 || (result == -1 && errno == EAGAIN));
+      total += result > 0 ? (size_t)result : 0;
+    }
+    CHECK(total == PAYLOAD_SIZE);
+    CHECK(memcmp(received, buffer->data, PAYLOAD_SIZE) == 0);
+  }
+
+  for (uint32_t i = 0; i != 100 && completed_count != SUBSCRIBERS - 1; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(completed_count == SUBSCRIBERS - 1);
+  CHECK(buffer->references == 1);
+  release_shared_buf(buffer);
+
+  for (uint32_t i = 1; i != SUBSCRIBERS; ++i) {
+    CHECK(close(peers[i]) == 0);
+    CHECK(destroy_socket(&accepted[i]));
+  }
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @file
+ *
+ * Helpers shared by the test programs. A check that fails reports where it
+ * failed and returns 1 from the enclosing function, so helpers return 0 on
+ * success and are checked in turn by their callers.
+ */
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      return 1; \
+    } \
+  } while (0)
+
+/* aligned_alloc needs the size to be a multiple of the alignment */
+static inline void* allocate(size_t size, size_t alignment)
+{
+  size_t rounded = (size + alignment - 1) / alignment * alignment;
+  return aligned_alloc(alignment, rounded);
+}
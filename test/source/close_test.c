@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* The same closer closes three connections one after the other: gracefully
+ * with a peer that closes its side as well, abortively, and gracefully with
+ * a peer that never closes, which runs into the drain timeout. */
+
+static ah_socket_accepted accepted;
+static bool has_accepted;
+static ah_closer* closer;
+static ah_error_code close_result;
+static bool close_called;
+static bool write_done;
+static uint8_t farewell[3] = {'b', 'y', 'e'};
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && !has_accepted) {
+    move_socket(&accepted, socket);
+    has_accepted = true;
+  }
+
+  return true;
+}
+
+static bool on_close(ah_error_code error_code,
+                     ah_closer* completed_closer,
+                     void* per_call_data)
+{
+  (void)per_call_data;
+
+  close_result = error_code;
+  close_called = completed_closer == closer;
+  return true;
+}
+
+static bool on_write(ah_error_code error_code,
+                     ah_io_operation* operation,
+                     uint32_t bytes_transferred,
+                     void* per_call_data)
+{
+  (void)operation;
+  (void)per_call_data;
+
+  write_done = error_code == AH_ERR_OK && bytes_transferred == 3;
+  return true;
+}
+
+/* Connects a peer and waits for the listener to accept it */
+static int accept_peer(loopback* fixture, int* result_peer)
+{
+  has_accepted = false;
+  *result_peer = connect_loopback(fixture);
+  CHECK(*result_peer != -1);
+  for (uint32_t i = 0; i != 100 && !has_accepted; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(has_accepted);
+  return 0;
+}
+
+/* Ticks until the next byte or error of the peer is there and returns the
+ * result of recv */
+static ssize_t receive_peer(loopback* fixture, int peer, char* byte)
+{
+  for (uint32_t i = 0; i != 100; ++i) {
+    ssize_t result = recv(peer, byte, 1, MSG_DONTWAIT);
+    if (result != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return result;
+    }
+
+    if (!tick_loopback(fixture)) {
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+static int wait_for_close(loopback* fixture)
+{
+  for (uint32_t i = 0; i != 1000 && !close_called; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(close_called);
+  return 0;
+}
+
+static int close_gracefully(loopback* fixture)
+{
+  int peer;
+  CHECK(accept_peer(fixture, &peer) == 0);
+
+  /* The data still in the send buffer reaches the peer before the end of
+   * file, and the data sent by the peer afterwards is discarded */
+  ah_io_dock dock = {.socket = &accepted};
+  ah_io_buffer buffer = {sizeof(farewell), farewell};
+  CHECK(queue_write_operation(&dock, buffer, on_write, NULL));
+  for (uint32_t i = 0; i != 100 && !write_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(write_done);
+  close_called = false;
+  CHECK(queue_close_operation(
+      closer, &accepted, AH_CLOSE_GRACEFUL, 5000, NULL));
+  CHECK(!close_called);
+
+  char received[3];
+  for (uint32_t i = 0; i != 3; ++i) {
+    CHECK(receive_peer(fixture, peer, &received[i]) == 1);
+  }
+  CHECK(memcmp(received, "bye", 3) == 0);
+  CHECK(receive_peer(fixture, peer, &received[0]) == 0);
+  CHECK(write(peer, "ignored", 7) == 7);
+  CHECK(close(peer) == 0);
+
+  CHECK(wait_for_close(fixture) == 0);
+  CHECK(close_result == AH_ERR_OK);
+  return 0;
+}
+
+static int close_abortively(loopback* fixture)
+{
+  int peer;
+  CHECK(accept_peer(fixture, &peer) == 0);
+
+  /* The callback is deferred to the event loop even though the connection is
+   * reset right away */
+  close_called = false;
+  CHECK(queue_close_operation(closer, &accepted, AH_CLOSE_ABORTIVE, 0, NULL));
+  CHECK(!close_called);
+  CHECK(wait_for_close(fixture) == 0);
+  CHECK(close_result == AH_ERR_OK);
+
+  char byte;
+  CHECK(receive_peer(fixture, peer, &byte) == -1 && errno == ECONNRESET);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+static int close_after_timeout(loopback* fixture)
+{
+  int peer;
+  CHECK(accept_peer(fixture, &peer) == 0);
+
+  /* The peer reads the end of file but keeps its side open */
+  close_called = false;
+  CHECK(queue_close_operation(closer, &accepted, AH_CLOSE_GRACEFUL, 20, NULL));
+  char byte;
+  CHECK(receive_peer(fixture, peer, &byte) == 0);
+
+  CHECK(wait_for_close(fixture) == 0);
+  CHECK(close_result == AH_ERR_TIMED_OUT);
+  /* The connection was reset while the peer was in CLOSE_WAIT */
+  CHECK(send(peer, "x", 1, MSG_NOSIGNAL) == -1);
+  CHECK(errno == EPIPE || errno == ECONNRESET);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+int main(void)
+{
+  loopback fixture;
+  closer = allocate(closer_size(), closer_alignment());
+  CHECK(closer != NULL);
+  create_closer(closer, on_close);
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  CHECK(close_gracefully(&fixture) == 0);
+  CHECK(close_abortively(&fixture) == 0);
+  CHECK(close_after_timeout(&fixture) == 0);
+
+  CHECK(destroy_closer(closer));
+  CHECK(close_loopback(&fixture) == 0);
+  free(closer);
+  return 0;
+}
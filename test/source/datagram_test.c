@@ -0,0 +1,235 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+#define REQUEST_COUNT 10
+#define REPLY_COUNT 4
+#define SEGMENT_SIZE 1000
+#define SEGMENT_COUNT 3
+
+static ah_datagram datagrams[16];
+static uint8_t buffers[16][64];
+static uint8_t segments[SEGMENT_SIZE * SEGMENT_COUNT];
+static bool batch_done;
+static ah_error_code batch_error;
+static uint32_t batch_count;
+
+static bool on_datagrams(ah_error_code error_code,
+                         ah_datagram_socket* socket,
+                         ah_datagram* batch,
+                         uint32_t count,
+                         void* per_call_data)
+{
+  (void)socket;
+  (void)batch;
+  (void)per_call_data;
+
+  batch_error = error_code;
+  batch_count = count;
+  batch_done = true;
+  return true;
+}
+
+/* The peer is a plain non-blocking socket bound to an ephemeral port */
+static int bind_peer(uint16_t* result_port)
+{
+  int descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+  if (descriptor == -1
+      || fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK)
+          == -1)
+  {
+    return -1;
+  }
+
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t length = sizeof(address);
+  if (bind(descriptor, (struct sockaddr*)&address, sizeof(address)) == -1
+      || getsockname(descriptor, (struct sockaddr*)&address, &length) == -1)
+  {
+    return -1;
+  }
+
+  *result_port = ntohs(address.sin_port);
+  return descriptor;
+}
+
+/* A dual-stack socket answers IPv6 peers as well, to the address they were
+ * reported with */
+static int exchange_ipv6(loopback* fixture,
+                         ah_datagram_socket* receiver,
+                         uint16_t port)
+{
+  int peer = socket(AF_INET6, SOCK_DGRAM, 0);
+  CHECK(peer != -1);
+  struct sockaddr_in6 address = {
+      .sin6_family = AF_INET6,
+      .sin6_port = htons(port),
+      .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+  };
+  CHECK(sendto(peer, "ipv6", 4, 0, (struct sockaddr*)&address, sizeof(address))
+        == 4);
+
+  datagrams[0] = (ah_datagram) {.buffer = {sizeof(buffers[0]), buffers[0]}};
+  batch_done = false;
+  CHECK(queue_datagram_receive(receiver, datagrams, 1, on_datagrams, NULL));
+  for (uint32_t i = 0; i != 100 && !batch_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(batch_done && batch_error == AH_ERR_OK && batch_count == 1);
+  CHECK(datagrams[0].buffer.buffer_length == 4);
+  CHECK(datagrams[0].address.family == AH_ADDRESS_IPV6);
+  char sender[AH_ADDRESS_MAX_STRING];
+  format_address(&datagrams[0].address, sender);
+  CHECK(strncmp(sender, "[::1]:", 6) == 0);
+
+  batch_done = false;
+  CHECK(queue_datagram_send(receiver, datagrams, 1, on_datagrams, NULL));
+  for (uint32_t i = 0; i != 100 && !batch_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(batch_done && batch_error == AH_ERR_OK && batch_count == 1);
+  uint8_t reply[16];
+  CHECK(recv(peer, reply, sizeof(reply), 0) == 4);
+  CHECK(memcmp(reply, "ipv6", 4) == 0);
+
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+static int run_batches(loopback* fixture, ah_datagram_socket* socket)
+{
+  ah_address local_address;
+  CHECK(local_address_from_datagram_socket(socket, &local_address));
+  uint16_t port = port_from_address(&local_address);
+  CHECK(port != 0);
+
+  uint16_t peer_port;
+  int peer = bind_peer(&peer_port);
+  CHECK(peer != -1);
+
+  /* Everything is sent before the first tick, so a single receive takes the
+   * whole burst */
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  for (uint32_t i = 0; i != REQUEST_COUNT; ++i) {
+    char request[16];
+    int length = snprintf(request, sizeof(request), "request %u", i);
+    CHECK(sendto(peer,
+                 request,
+                 (size_t)length,
+                 0,
+                 (struct sockaddr*)&address,
+                 sizeof(address))
+          == length);
+  }
+
+  for (uint32_t i = 0; i != 16; ++i) {
+    datagrams[i] = (ah_datagram) {.buffer = {sizeof(buffers[i]), buffers[i]}};
+  }
+  batch_done = false;
+  CHECK(queue_datagram_receive(socket, datagrams, 16, on_datagrams, NULL));
+  CHECK(!queue_datagram_receive(socket, datagrams, 16, on_datagrams, NULL));
+  for (uint32_t i = 0; i != 100 && !batch_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(batch_done && batch_error == AH_ERR_OK);
+  CHECK(batch_count == REQUEST_COUNT);
+  for (uint32_t i = 0; i != REQUEST_COUNT; ++i) {
+    char request[16];
+    int length = snprintf(request, sizeof(request), "request %u", i);
+    CHECK(datagrams[i].buffer.buffer_length == (uint32_t)length);
+    CHECK(memcmp(datagrams[i].buffer.buffer, request, (size_t)length) == 0);
+    ah_ipv4_address sender;
+    CHECK(ipv4_from_address(&datagrams[i].address, &sender));
+    CHECK(sender.port == peer_port && sender.address[0] == 127);
+    CHECK(datagrams[i].segment_size == 0);
+  }
+
+  /* The replies go back to the addresses they came from, the last one is
+   * split into segments on the way */
+  for (uint32_t i = 0; i != REPLY_COUNT; ++i) {
+    datagrams[i].buffer.buffer_length = 5;
+    memcpy(datagrams[i].buffer.buffer, "reply", 5);
+  }
+  for (uint32_t i = 0; i != sizeof(segments); ++i) {
+    segments[i] = (uint8_t)(i / SEGMENT_SIZE);
+  }
+  datagrams[REPLY_COUNT] = (ah_datagram) {
+      {sizeof(segments), segments},
+      datagrams[0].address,
+      SEGMENT_SIZE,
+  };
+  batch_done = false;
+  CHECK(queue_datagram_send(
+      socket, datagrams, REPLY_COUNT + 1, on_datagrams, NULL));
+  for (uint32_t i = 0; i != 100 && !batch_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(batch_done && batch_error == AH_ERR_OK);
+  CHECK(batch_count == REPLY_COUNT + 1);
+
+  for (uint32_t i = 0; i != REPLY_COUNT; ++i) {
+    uint8_t reply[16];
+    CHECK(recv(peer, reply, sizeof(reply), 0) == 5);
+    CHECK(memcmp(reply, "reply", 5) == 0);
+  }
+  for (uint32_t i = 0; i != SEGMENT_COUNT; ++i) {
+    uint8_t segment[SEGMENT_SIZE * 2];
+    CHECK(recv(peer, segment, sizeof(segment), 0) == SEGMENT_SIZE);
+    CHECK(segment[0] == i && segment[SEGMENT_SIZE - 1] == i);
+  }
+  CHECK(recv(peer, segments, 1, 0) == -1 && errno == EAGAIN);
+  CHECK(close(peer) == 0);
+
+  /* A destination without an address is rejected before anything is sent */
+  datagrams[1].address = (ah_address) {0};
+  CHECK(!queue_datagram_send(socket, datagrams, 2, on_datagrams, NULL));
+
+  if (local_address.family == AH_ADDRESS_IPV6) {
+    CHECK(exchange_ipv6(fixture, socket, port) == 0);
+  } else {
+    printf("IPv6 is not available, skipping it\n");
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  loopback fixture;
+  ah_datagram_socket* socket =
+      allocate(datagram_socket_size(), datagram_socket_alignment());
+  CHECK(socket != NULL);
+  CHECK(open_loopback(&fixture, NULL, NULL) == 0);
+  ah_context* context = &fixture.context;
+
+  CHECK(create_datagram_socket(socket, context, 0, 0));
+  CHECK(context_from_datagram_socket(socket) == context);
+  CHECK(run_batches(&fixture, socket) == 0);
+  CHECK(destroy_datagram_socket(socket));
+
+  /* Loopback traffic skips GRO, so the results are the same with it */
+  if (create_datagram_socket(socket, context, 0, AH_DATAGRAM_GRO)) {
+    CHECK(run_batches(&fixture, socket) == 0);
+    CHECK(destroy_datagram_socket(socket));
+  } else {
+    printf("UDP_GRO is not available, skipping it\n");
+  }
+
+  CHECK(close_loopback(&fixture) == 0);
+  free(socket);
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* Two connections become readable in the same batch, and the handler of the
+ * first one closes the other and recycles its dock the way the services do
+ * with their connection pools. The event already reported for the closed
+ * socket must not be dispatched to the recycled dock. */
+
+typedef struct connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  uint8_t buffer[16];
+} connection;
+
+static connection connections[2];
+static uint32_t accepted_count;
+static uint32_t read_count;
+static connection* closed;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK || accepted_count == 2) {
+    return true;
+  }
+
+  connection* accepted = &connections[accepted_count++];
+  move_socket(&accepted->socket, socket);
+  accepted->dock.socket = &accepted->socket;
+  return true;
+}
+
+static bool on_read(ah_error_code error_code,
+                    ah_io_operation* operation,
+                    uint32_t bytes_transferred,
+                    void* per_call_data)
+{
+  (void)bytes_transferred;
+  (void)per_call_data;
+
+  ++read_count;
+  if (error_code != AH_ERR_OK) {
+    return false;
+  }
+
+  connection* other = (connection*)dock_from_operation(operation)
+          == &connections[0]
+      ? &connections[1]
+      : &connections[0];
+  if (!destroy_socket(&other->socket)) {
+    return false;
+  }
+
+  memset(other, 0, sizeof(*other));
+  closed = other;
+  return true;
+}
+
+int main(void)
+{
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  int peers[2] = {connect_loopback(&fixture), connect_loopback(&fixture)};
+  CHECK(peers[0] != -1 && peers[1] != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 2; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(accepted_count == 2);
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    ah_io_buffer buffer = {sizeof(connections[i].buffer),
+                           connections[i].buffer};
+    CHECK(queue_read_operation(&connections[i].dock, buffer, on_read, NULL));
+  }
+
+  /* Loopback delivers the bytes right away, so both sockets are reported by
+   * the next epoll_wait */
+  CHECK(write(peers[0], "a", 1) == 1);
+  CHECK(write(peers[1], "b", 1) == 1);
+  for (uint32_t i = 0; i != 10; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(read_count == 1);
+
+  connection* remaining =
+      closed == &connections[0] ? &connections[1] : &connections[0];
+  CHECK(destroy_socket(&remaining->socket));
+  close(peers[0]);
+  close(peers[1]);
+
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
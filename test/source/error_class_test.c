@@ -0,0 +1,99 @@
+#include "check.h"
+#include "server.h"
+
+/* The classes are repeated here rather than taken from the generator, so a
+ * code moved to another class by accident fails the test. The table must not
+ * classify any value other than these codes either. */
+
+typedef struct expected_class {
+  ah_error_code code;
+  ah_error_class error_class;
+} expected_class;
+
+static const expected_class expected_classes[] = {
+    {AH_ERR_ACCESS_DENIED, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_ADDRESS_FAMILY_NOT_SUPPORTED, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_ADDRESS_IN_USE, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_ADDRESS_NOT_AVAILABLE, AH_ERROR_CLASS_RESOURCE_EXHAUSTED},
+    {AH_ERR_ALREADY_CONNECTED, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_ALREADY_STARTED, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_BROKEN_PIPE, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_CONNECTION_ABORTED, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_CONNECTION_REFUSED, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_CONNECTION_RESET, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_BAD_DESCRIPTOR, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_FAULT, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_HOST_UNREACHABLE, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_IN_PROGRESS, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_INTERRUPTED, AH_ERROR_CLASS_RETRYABLE},
+    {AH_ERR_INVALID_ARGUMENT, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_IO_ERROR, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_IS_DIRECTORY, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_MESSAGE_SIZE, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NAME_TOO_LONG, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NETWORK_DOWN, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_NETWORK_RESET, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_NETWORK_UNREACHABLE, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_NO_DESCRIPTORS, AH_ERROR_CLASS_RESOURCE_EXHAUSTED},
+    {AH_ERR_NO_BUFFER_SPACE, AH_ERROR_CLASS_RESOURCE_EXHAUSTED},
+    {AH_ERR_NO_MEMORY, AH_ERROR_CLASS_RESOURCE_EXHAUSTED},
+    {AH_ERR_NO_PERMISSION, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NO_PROTOCOL_OPTION, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NO_SUCH_DEVICE, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NOT_CONNECTED, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_NOT_FOUND, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_NOT_SOCKET, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_OPERATION_ABORTED, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_OPERATION_NOT_SUPPORTED, AH_ERROR_CLASS_FATAL},
+    {AH_ERR_PROTOCOL_ERROR, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_SHUT_DOWN, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_TIMED_OUT, AH_ERROR_CLASS_PEER_CLOSED},
+    {AH_ERR_TRY_AGAIN, AH_ERROR_CLASS_RETRYABLE},
+    {AH_ERR_WOULD_BLOCK, AH_ERROR_CLASS_RETRYABLE},
+};
+
+#define EXPECTED_COUNT (sizeof(expected_classes) / sizeof(expected_class))
+
+/* Codes sharing a value, like TRY_AGAIN and WOULD_BLOCK, have one entry */
+static uint32_t count_distinct_values(void)
+{
+  uint32_t count = 0;
+  for (size_t i = 0; i != EXPECTED_COUNT; ++i) {
+    size_t j = 0;
+    while (expected_classes[j].code != expected_classes[i].code) {
+      ++j;
+    }
+    if (j == i) {
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+int main(void)
+{
+  for (size_t i = 0; i != EXPECTED_COUNT; ++i) {
+    expected_class expected = expected_classes[i];
+    CHECK((unsigned int)expected.code < AH_ERROR_CLASS_TABLE_SIZE);
+    CHECK(error_class_from_code(expected.code) == expected.error_class);
+    CHECK(is_ah_error_code(expected.code));
+  }
+
+  uint32_t classified = 0;
+  for (unsigned int i = 0; i != AH_ERROR_CLASS_TABLE_SIZE; ++i) {
+    if (ah_error_classes[i] != AH_ERROR_CLASS_NONE) {
+      ++classified;
+    }
+  }
+  CHECK(classified == count_distinct_values());
+
+  /* Success and values outside the table are not error codes */
+  CHECK(error_class_from_code(AH_ERR_OK) == AH_ERROR_CLASS_NONE);
+  CHECK(!is_ah_error_code(AH_ERR_OK));
+  CHECK(error_class_from_code(-1) == AH_ERROR_CLASS_NONE);
+  CHECK(error_class_from_code((int)AH_ERROR_CLASS_TABLE_SIZE)
+        == AH_ERROR_CLASS_NONE);
+  CHECK(!is_ah_error_code(0x7FFFFFFF));
+  return 0;
+}
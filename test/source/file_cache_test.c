@@ -0,0 +1,133 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "server.h"
+
+static char directory[] = "/tmp/adhoc-file-cache-XXXXXX";
+static char path_buffer[64];
+
+static const char* full_path(const char* name)
+{
+  snprintf(path_buffer, sizeof(path_buffer), "%s/%s", directory, name);
+  return path_buffer;
+}
+
+static bool write_file(const char* name, const char* contents)
+{
+  int descriptor =
+      open(full_path(name), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (descriptor == -1) {
+    return false;
+  }
+
+  size_t length = strlen(contents);
+  bool written = write(descriptor, contents, length) == (ssize_t)length;
+  return close(descriptor) == 0 && written;
+}
+
+static ah_cached_file* acquire(ah_file_cache* cache,
+                               const char* path,
+                               ah_error_code* error_code)
+{
+  char copy[64];
+  strcpy(copy, path);
+  ah_cached_file* file = NULL;
+  ah_io_buffer buffer = {(uint32_t)strlen(copy), copy};
+  return acquire_cached_file(cache, buffer, &file, error_code) ? file : NULL;
+}
+
+static bool on_timer(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+  (void)user_data;
+
+  return true;
+}
+
+int main(void)
+{
+  CHECK(mkdtemp(directory) != NULL);
+  CHECK(write_file("a.txt", "hello"));
+  CHECK(write_file("b.txt", "b"));
+  CHECK(write_file("c.txt", "c"));
+  CHECK(mkdir(full_path("d"), 0755) == 0);
+
+  ah_server* server = allocate(server_size(), server_alignment());
+  ah_timer* timer = allocate(timer_size(), timer_alignment());
+  ah_file_cache* cache = allocate(file_cache_size(), file_cache_alignment());
+  CHECK(server != NULL && timer != NULL && cache != NULL);
+  CHECK(create_server(server));
+  create_timer(timer, server, on_timer, NULL);
+  CHECK(create_file_cache(cache, server, directory, 2, NULL, NULL));
+
+  ah_error_code error_code;
+  ah_cached_file* file = acquire(cache, "a.txt", &error_code);
+  CHECK(file != NULL && error_code == AH_ERR_OK);
+  CHECK(file->size == 5 && file->cached);
+  CHECK(file->mapping != NULL && memcmp(file->mapping, "hello", 5) == 0);
+  CHECK(acquire(cache, "a.txt", &error_code) == file);
+  release_cached_file(file);
+
+  const char* invalid_paths[] = {
+      "/a.txt",
+      "../a.txt",
+      "./a.txt",
+      "d//a.txt",
+      "d/",
+      "d\\a.txt",
+  };
+  for (size_t i = 0; i != sizeof(invalid_paths) / sizeof(char*); ++i) {
+    CHECK(acquire(cache, invalid_paths[i], &error_code) == NULL);
+    CHECK(error_code == AH_ERR_INVALID_ARGUMENT);
+  }
+  CHECK(acquire(cache, "missing", &error_code) == NULL);
+  CHECK(error_code == AH_ERR_NOT_FOUND);
+  CHECK(acquire(cache, "a.txt/b", &error_code) == NULL);
+  CHECK(error_code == AH_ERR_NOT_FOUND);
+  CHECK(acquire(cache, "d", &error_code) == NULL);
+  CHECK(error_code == AH_ERR_IS_DIRECTORY);
+
+  /* The change is reported by the event loop, after which the file is opened
+   * again, while the stale one stays usable until it is released */
+  CHECK(write_file("a.txt", "changed!"));
+  for (uint32_t i = 0; i != 100 && file->cached; ++i) {
+    start_timer(timer, 10);
+    CHECK(server_tick(server, NULL));
+  }
+  CHECK(!file->cached);
+  CHECK(memcmp(file->mapping, "chang", 5) == 0);
+  ah_cached_file* changed = acquire(cache, "a.txt", &error_code);
+  CHECK(changed != NULL && changed != file && changed->size == 8);
+  release_cached_file(file);
+
+  /* The least recently used file is evicted */
+  ah_cached_file* b = acquire(cache, "b.txt", &error_code);
+  ah_cached_file* c = acquire(cache, "c.txt", &error_code);
+  CHECK(b != NULL && c != NULL);
+  CHECK(!changed->cached && b->cached && c->cached);
+  release_cached_file(changed);
+  release_cached_file(b);
+
+  destroy_file_cache(cache);
+  CHECK(c->size == 1);
+  release_cached_file(c);
+
+  stop_timer(timer);
+  CHECK(destroy_server(server));
+  free(cache);
+  free(timer);
+  free(server);
+
+  const char* names[] = {"a.txt", "b.txt", "c.txt"};
+  for (size_t i = 0; i != sizeof(names) / sizeof(char*); ++i) {
+    CHECK(unlink(full_path(names[i])) == 0);
+  }
+  CHECK(rmdir(full_path("d")) == 0);
+  CHECK(rmdir(directory) == 0);
+  return 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "server.h"
+
+#define MAX_FRAMES (64 * 1024)
+#define STREAM_SIZE (256 * 1024)
+
+typedef struct frames {
+  size_t count;
+  uint32_t lengths[MAX_FRAMES];
+  ah_error_code error_code;
+} frames;
+
+static bool on_frame(ah_error_code error_code,
+                     ah_framer* framer,
+                     ah_io_buffer frame,
+                     void* user_data)
+{
+  (void)framer;
+
+  frames* result = user_data;
+  if (error_code != AH_ERR_OK) {
+    result->error_code = error_code;
+    return true;
+  }
+
+  if (result->count == MAX_FRAMES) {
+    return false;
+  }
+
+  result->lengths[result->count++] = frame.buffer_length;
+  return true;
+}
+
+/* Copies the stream into the ring in chunks of varying sizes */
+static bool feed(ah_framer* framer, const uint8_t* stream, size_t size)
+{
+  size_t offset = 0;
+  uint32_t chunk = 1;
+  while (offset != size) {
+    ah_io_buffer free_space = ring_write_buffer(framer->ring);
+    if (free_space.buffer_length == 0) {
+      return false;
+    }
+
+    uint32_t length = chunk < free_space.buffer_length
+        ? chunk
+        : free_space.buffer_length;
+    if (length > size - offset) {
+      length = (uint32_t)(size - offset);
+    }
+
+    memcpy(free_space.buffer, stream + offset, length);
+    ring_produce(framer->ring, length);
+    offset += length;
+    chunk = chunk * 7 % 1021 + 1;
+    if (!deliver_frames(framer)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static int test_delimited(uint8_t* delimiter, uint32_t length)
+{
+  static uint8_t stream[STREAM_SIZE];
+
+  /* Random bytes with plenty of partial matches of the delimiter */
+  uint32_t state = 12345;
+  for (size_t i = 0; i != STREAM_SIZE; ++i) {
+    state = state * 1103515245U + 12345U;
+    stream[i] = (uint8_t)"\r\n\rab"[(state >> 16) % 5];
+  }
+
+  ah_ring ring;
+  CHECK(create_ring(&ring, 4096));
+  ah_framer framer;
+  frames* result = calloc(1, sizeof(frames));
+  CHECK(result != NULL);
+  CHECK(create_delimited_framer(
+      &framer, NULL, &ring, (ah_io_buffer) {length, delimiter}, 0,
+      on_frame, result));
+
+  CHECK(feed(&framer, stream, STREAM_SIZE));
+  CHECK(result->error_code == AH_ERR_OK);
+
+  /* Compare against a naive search */
+  size_t expected = 0;
+  size_t start = 0;
+  for (size_t i = 0; i + length <= STREAM_SIZE && expected != MAX_FRAMES;) {
+    if (memcmp(stream + i, delimiter, length) == 0) {
+      CHECK(result->lengths[expected] == i - start);
+      ++expected;
+      i += length;
+      start = i;
+    } else {
+      ++i;
+    }
+  }
+  CHECK(expected != 0);
+  CHECK(result->count == expected);
+
+  free(result);
+  destroy_ring(&ring);
+  return 0;
+}
+
+static int test_too_long(void)
+{
+  ah_ring ring;
+  CHECK(create_ring(&ring, 4096));
+  ah_framer framer;
+  frames result = {0};
+  static uint8_t newline[] = "\n";
+  CHECK(create_delimited_framer(
+      &framer, NULL, &ring, (ah_io_buffer) {1, newline}, 8, on_frame, &result));
+
+  CHECK(feed(&framer, (const uint8_t*)"12345678\n123456789", 18));
+  CHECK(result.count == 1 && result.lengths[0] == 8);
+  CHECK(result.error_code == AH_ERR_MESSAGE_SIZE);
+
+  destroy_ring(&ring);
+  return 0;
+}
+
+static int test_length_prefixed(void)
+{
+  ah_ring ring;
+  CHECK(create_ring(&ring, 4096));
+  ah_framer framer;
+  frames result = {0};
+
+  CHECK(!create_length_prefixed_framer(
+      &framer, NULL, &ring, 3, 0, on_frame, &result));
+  CHECK(create_length_prefixed_framer(
+      &framer, NULL, &ring, 2, 0, on_frame, &result));
+  static const uint8_t fixed[] = {0, 3, 'a', 'b', 'c', 0, 0, 1, 0};
+  CHECK(feed(&framer, fixed, sizeof(fixed)));
+  CHECK(result.count == 2 && result.lengths[0] == 3 && result.lengths[1] == 0);
+  CHECK(ring_read_buffer(&ring).buffer_length == 2);
+
+  /* 300 is encoded as 0xAC 0x02 */
+  ring_consume(&ring, 2);
+  result = (frames) {0};
+  CHECK(create_length_prefixed_framer(
+      &framer, NULL, &ring, 0, 1000, on_frame, &result));
+  static uint8_t varint[2 + 300 + 1];
+  varint[0] = 0xAC;
+  varint[1] = 0x02;
+  varint[302] = 0x7F;
+  CHECK(feed(&framer, varint, sizeof(varint)));
+  CHECK(result.count == 1 && result.lengths[0] == 300);
+  CHECK(result.error_code == AH_ERR_OK);
+
+  static const uint8_t too_long[] = {0xE9, 0x07};
+  CHECK(feed(&framer, too_long, sizeof(too_long)));
+  CHECK(result.error_code == AH_ERR_OK);
+
+  /* The bytes above were the start of a frame of 127 bytes */
+  ring_consume(&ring, ring_read_buffer(&ring).buffer_length);
+  CHECK(feed(&framer, too_long, sizeof(too_long)));
+  CHECK(result.error_code == AH_ERR_MESSAGE_SIZE);
+
+  destroy_ring(&ring);
+  return 0;
+}
+
+int main(void)
+{
+  static uint8_t delimiter[] = "\r\n\r\n";
+  static uint8_t letter[] = "a";
+  printf("Delimiters are searched for using %s\n", framing_isa_name());
+  return test_delimited(delimiter + 2, 2) || test_delimited(delimiter, 4)
+      || test_delimited(letter, 1) || test_too_long()
+      || test_length_prefixed();
+}
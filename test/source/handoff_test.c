@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* The predecessor and the successor run their own event loops in this
+ * process, ticked one after the other. The predecessor has an idle and a busy
+ * connection: the idle one is handed off, the busy one is drained. A third
+ * connection is reset by its peer right after being handed off, which the
+ * successor must skip. */
+
+static ah_socket_accepted predecessor_sockets[3];
+static uint32_t predecessor_accepts;
+static ah_closer* closer;
+static int reset_peer;
+static bool handed_off;
+static bool drained;
+
+static ah_socket_span successor_span;
+static ah_acceptor* successor_acceptor;
+static ah_socket_accepted successor_sockets[2];
+static ah_io_dock successor_dock;
+static uint32_t successor_accepts;
+static bool received;
+static bool request_read;
+static uint8_t request[4];
+
+static bool on_predecessor_accept(ah_error_code error_code,
+                                  ah_socket* socket,
+                                  const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && predecessor_accepts != 3) {
+    move_socket(&predecessor_sockets[predecessor_accepts++], socket);
+  }
+
+  return true;
+}
+
+static bool on_handoff(ah_handoff* handoff, void* user_data)
+{
+  (void)user_data;
+
+  handed_off = handoff_socket(handoff, &predecessor_sockets[0])
+      && drain_handoff_socket(handoff, closer, &predecessor_sockets[1], 1000)
+      && handoff_socket(handoff, &predecessor_sockets[2]);
+
+  struct linger linger = {1, 0};
+  handed_off = handed_off
+      && setsockopt(
+             reset_peer, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger))
+          == 0
+      && close(reset_peer) == 0;
+  return true;
+}
+
+static bool on_drained(ah_handoff* handoff, void* user_data)
+{
+  (void)handoff;
+  (void)user_data;
+
+  drained = true;
+  return true;
+}
+
+static bool on_successor_accept(ah_error_code error_code,
+                                ah_socket* socket,
+                                const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && successor_accepts != 2) {
+    move_socket(&successor_sockets[successor_accepts++], socket);
+  }
+
+  return true;
+}
+
+static bool on_received(ah_handoff* handoff, void* user_data)
+{
+  ah_server* server = user_data;
+  (void)handoff;
+
+  received = true;
+  set_socket_span(server, successor_span);
+  return successor_span.size != 1
+      || create_acceptor(successor_acceptor,
+                         span_get_socket(server, 0),
+                         on_successor_accept);
+}
+
+static bool on_read(ah_error_code error_code,
+                    ah_io_operation* operation,
+                    uint32_t bytes_transferred,
+                    void* per_call_data)
+{
+  (void)operation;
+  (void)per_call_data;
+
+  request_read = error_code == AH_ERR_OK && bytes_transferred == 4;
+  return true;
+}
+
+static int tick_both(loopback* predecessor, loopback* successor)
+{
+  CHECK(tick_loopback(predecessor));
+  CHECK(tick_loopback(successor));
+  return 0;
+}
+
+int main(void)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/adhoc-handoff-%d", (int)getpid());
+
+  loopback predecessor;
+  loopback successor;
+  ah_handoff* sender = allocate(handoff_size(), handoff_alignment());
+  ah_handoff* receiver = allocate(handoff_size(), handoff_alignment());
+  closer = allocate(closer_size(), closer_alignment());
+  successor_acceptor = allocate(acceptor_size(), acceptor_alignment());
+  ah_socket* listeners = allocate(socket_size() * 2, socket_alignment());
+  CHECK(sender != NULL && receiver != NULL && listeners != NULL);
+  CHECK(closer != NULL && successor_acceptor != NULL);
+  successor_span = (ah_socket_span) {2, listeners};
+  CHECK(open_loopback(&predecessor, on_predecessor_accept, NULL) == 0);
+  CHECK(open_loopback(&successor, NULL, NULL) == 0);
+
+  int idle_peer = connect_loopback(&predecessor);
+  CHECK(idle_peer != -1);
+  for (uint32_t i = 0; i != 100 && predecessor_accepts != 1; ++i) {
+    CHECK(tick_loopback(&predecessor));
+  }
+  int busy_peer = connect_loopback(&predecessor);
+  CHECK(busy_peer != -1);
+  for (uint32_t i = 0; i != 100 && predecessor_accepts != 2; ++i) {
+    CHECK(tick_loopback(&predecessor));
+  }
+  reset_peer = connect_loopback(&predecessor);
+  CHECK(reset_peer != -1);
+  for (uint32_t i = 0; i != 100 && predecessor_accepts != 3; ++i) {
+    CHECK(tick_loopback(&predecessor));
+  }
+  CHECK(predecessor_accepts == 3);
+
+  /* The request already sent on the idle connection travels with it */
+  CHECK(write(idle_peer, "ping", 4) == 4);
+  CHECK(create_handoff(
+      sender, &predecessor.context, path, on_handoff, on_drained, NULL));
+  CHECK(receive_handoff(receiver,
+                        &successor.context,
+                        path,
+                        &successor_span,
+                        on_successor_accept,
+                        on_received,
+                        successor.server));
+
+  /* The busy peer closes its side once it sees the end of file */
+  bool busy_closed = false;
+  for (uint32_t i = 0; i != 1000 && !(received && drained); ++i) {
+    CHECK(tick_both(&predecessor, &successor) == 0);
+    char byte;
+    if (!busy_closed && handed_off
+        && recv(busy_peer, &byte, 1, MSG_DONTWAIT) == 0)
+    {
+      CHECK(close(busy_peer) == 0);
+      busy_closed = true;
+    }
+  }
+  CHECK(handed_off && received && drained);
+  CHECK(successor_span.size == 1 && successor_accepts == 1);
+
+  /* The idle connection is served by the successor */
+  successor_dock.socket = &successor_sockets[0];
+  ah_io_buffer buffer = {sizeof(request), request};
+  CHECK(queue_read_operation(&successor_dock, buffer, on_read, NULL));
+  for (uint32_t i = 0; i != 100 && !request_read; ++i) {
+    CHECK(tick_loopback(&successor));
+  }
+  CHECK(request_read && memcmp(request, "ping", 4) == 0);
+
+  /* New connections are accepted by the successor only */
+  int new_peer = connect_loopback(&predecessor);
+  CHECK(new_peer != -1);
+  for (uint32_t i = 0; i != 100 && successor_accepts != 2; ++i) {
+    CHECK(tick_both(&predecessor, &successor) == 0);
+  }
+  CHECK(successor_accepts == 2 && predecessor_accepts == 3);
+
+  CHECK(close(new_peer) == 0);
+  CHECK(close(idle_peer) == 0);
+  CHECK(destroy_socket(&successor_sockets[0]));
+  CHECK(destroy_socket(&successor_sockets[1]));
+  CHECK(destroy_socket(span_get_socket(successor.server, 0)));
+  CHECK(destroy_handoff(sender));
+  CHECK(destroy_handoff(receiver));
+  CHECK(close_loopback(&successor) == 0);
+  CHECK(close_loopback(&predecessor) == 0);
+  unlink(path);
+  free(listeners);
+  free(successor_acceptor);
+  free(closer);
+  free(receiver);
+  free(sender);
+  return 0;
+}
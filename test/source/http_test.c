@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "http.h"
+
+static uint8_t input[4096];
+static ah_http_request request;
+
+static ah_http_parse_result parse(const char* text, uint32_t* header_length)
+{
+  size_t length = strlen(text);
+  memcpy(input, text, length);
+  return parse_http_request(input, (uint32_t)length, &request, header_length);
+}
+
+static bool equals(ah_io_buffer buffer, const char* text)
+{
+  return buffer.buffer_length == strlen(text)
+      && memcmp(buffer.buffer, text, buffer.buffer_length) == 0;
+}
+
+int main(void)
+{
+  uint32_t header_length = 0;
+
+  /* The values are long enough to take the vectorized path */
+  const char* get =
+      "\r\nGET /a/rather/long/path/to/a/resource?with=query HTTP/1.1\r\n"
+      "Host: example.com\r\n"
+      "User-Agent:  Mozilla/5.0 (X11; Linux x86_64)\tGecko \r\n"
+      "Accept:\r\n"
+      "\r\n"
+      "GET";
+  CHECK(parse(get, &header_length) == AH_HTTP_PARSE_COMPLETE);
+  CHECK(header_length == strlen(get) - 3);
+  CHECK(equals(request.method, "GET"));
+  CHECK(equals(request.target, "/a/rather/long/path/to/a/resource?with=query"));
+  CHECK(request.minor_version == 1);
+  CHECK(request.keep_alive);
+  CHECK(request.content_length == 0);
+  CHECK(request.header_count == 3);
+  CHECK(equals(request.headers[0].name, "Host"));
+  CHECK(equals(request.headers[0].value, "example.com"));
+  CHECK(equals(request.headers[1].value,
+               "Mozilla/5.0 (X11; Linux x86_64)\tGecko"));
+  CHECK(equals(request.headers[2].name, "Accept"));
+  CHECK(equals(request.headers[2].value, ""));
+
+  /* Every prefix of a complete request is incomplete */
+  for (uint32_t i = 0; i != header_length; ++i) {
+    CHECK(parse_http_request(input, i, &request, &header_length)
+          == AH_HTTP_PARSE_INCOMPLETE);
+  }
+
+  CHECK(parse("POST /form HTTP/1.0\r\n"
+              "Content-Length: 5\r\n"
+              "connection: Keep-Alive\r\n\r\nhello",
+              &header_length)
+        == AH_HTTP_PARSE_COMPLETE);
+  CHECK(request.minor_version == 0);
+  CHECK(request.keep_alive);
+  CHECK(request.content_length == 5);
+
+  CHECK(parse("GET / HTTP/1.1\r\nConnection: Upgrade, close\r\n\r\n",
+              &header_length)
+        == AH_HTTP_PARSE_COMPLETE);
+  CHECK(!request.keep_alive);
+  CHECK(parse("GET / HTTP/1.0\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_COMPLETE);
+  CHECK(!request.keep_alive);
+  CHECK(parse("PUT / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+              &header_length)
+        == AH_HTTP_PARSE_COMPLETE);
+  CHECK(request.has_transfer_encoding);
+
+  CHECK(parse("GET / HTTP/2.0\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTQ", &header_length) == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET  / HTTP/1.1\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTP/1.1\n\n", &header_length) == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTP/1.1\r\nHost : x\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTP/1.1\r\nHost: a\x01 b\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", &header_length)
+        == AH_HTTP_PARSE_INVALID);
+  CHECK(parse("GET / HTTP/1.1\r\nContent-Length: 1\r\n"
+              "Content-Length: 2\r\n\r\n",
+              &header_length)
+        == AH_HTTP_PARSE_INVALID);
+
+  char many[2048] = "GET / HTTP/1.1\r\n";
+  for (uint32_t i = 0; i != AH_HTTP_MAX_HEADERS + 1; ++i) {
+    strcat(many, "X: y\r\n");
+  }
+  strcat(many, "\r\n");
+  CHECK(parse(many, &header_length) == AH_HTTP_PARSE_INVALID);
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <pthread.h>
+#include <stdlib.h>
+#ifdef __GLIBC__
+#  include <malloc.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "server.h"
+
+/* Standard output is redirected to a temporary file, which is read back to
+ * see what the logging functions wrote out. The ring of a thread holds 64 KiB
+ * and large writes are split into records of 4 KiB, each with an 8 byte
+ * header, so 15 records fit and the rest is dropped. */
+
+#define CHUNK_SIZE 4096
+#define CHUNKS_FITTING 15
+#define CHUNKS_LOGGED 20
+#define EXITING_THREADS 64
+
+static char chunk[CHUNK_SIZE];
+static char output[CHUNK_SIZE * CHUNKS_LOGGED];
+
+static ssize_t read_output(int descriptor)
+{
+  return pread(descriptor, output, sizeof(output), 0);
+}
+
+static int drop_when_full(int descriptor)
+{
+  uint64_t dropped = ah_log_dropped();
+
+  /* Nothing consumes the ring until it is flushed in this mode */
+  CHECK(ah_log_start(AH_LOG_EVENT_LOOP));
+  for (uint32_t i = 0; i != CHUNKS_LOGGED; ++i) {
+    memset(chunk, 'a' + (int)i, sizeof(chunk));
+    ah_log_bytes(chunk, sizeof(chunk));
+  }
+  CHECK(read_output(descriptor) == 0);
+  CHECK(ah_log_dropped() - dropped == CHUNKS_LOGGED - CHUNKS_FITTING);
+
+  /* The messages that fit are written in order */
+  ah_log_flush();
+  CHECK(read_output(descriptor) == CHUNK_SIZE * CHUNKS_FITTING);
+  for (uint32_t i = 0; i != CHUNKS_FITTING; ++i) {
+    CHECK(output[i * CHUNK_SIZE] == 'a' + (int)i);
+    CHECK(output[i * CHUNK_SIZE + CHUNK_SIZE - 1] == 'a' + (int)i);
+  }
+
+  /* The ring has room again after the flush */
+  ah_log("%s\n", "after");
+  ah_log_stop();
+  CHECK(read_output(descriptor) == CHUNK_SIZE * CHUNKS_FITTING + 6);
+  CHECK(memcmp(&output[CHUNK_SIZE * CHUNKS_FITTING], "after\n", 6) == 0);
+  CHECK(ah_log_dropped() - dropped == CHUNKS_LOGGED - CHUNKS_FITTING);
+  return 0;
+}
+
+static void* log_and_exit(void* argument)
+{
+  (void)argument;
+
+  ah_log("x");
+  return NULL;
+}
+
+static size_t allocated_bytes(void)
+{
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+/* Threads that exit leave their messages to be written by the next flush,
+ * which frees their rings. Were the rings kept, the threads would hold on to
+ * 4 MiB between them. */
+static int exit_after_logging(int descriptor)
+{
+  CHECK(ftruncate(descriptor, 0) == 0);
+  CHECK(lseek(descriptor, 0, SEEK_SET) == 0);
+  CHECK(ah_log_start(AH_LOG_EVENT_LOOP));
+
+  size_t allocated = allocated_bytes();
+  for (uint32_t i = 0; i != EXITING_THREADS; ++i) {
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, log_and_exit, NULL) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    if (i % 8 == 7) {
+      ah_log_flush();
+    }
+  }
+  CHECK(allocated_bytes() < allocated + 4 * sizeof(output));
+
+  ah_log_stop();
+  CHECK(read_output(descriptor) == EXITING_THREADS);
+  for (uint32_t i = 0; i != EXITING_THREADS; ++i) {
+    CHECK(output[i] == 'x');
+  }
+  return 0;
+}
+
+/* Error messages formatted by the caller go to stderr once flushed. Stderr
+ * is only redirected while logging, so failed checks are still reported. */
+static int defer_error_messages(void)
+{
+  char path[] = "/tmp/adhoc-log-XXXXXX";
+  int descriptor = mkstemp(path);
+  CHECK(descriptor != -1);
+  CHECK(unlink(path) == 0);
+  int saved_stderr = dup(STDERR_FILENO);
+  CHECK(saved_stderr != -1);
+  CHECK(dup2(descriptor, STDERR_FILENO) == STDERR_FILENO);
+
+  CHECK(ah_log_start(AH_LOG_EVENT_LOOP));
+  ah_log_error_message("SSL_write", "bad record");
+  ssize_t length_before_flush = read_output(descriptor);
+  ah_log_flush();
+  ssize_t length = read_output(descriptor);
+  ah_log_stop();
+  CHECK(dup2(saved_stderr, STDERR_FILENO) == STDERR_FILENO);
+  CHECK(close(saved_stderr) == 0);
+  CHECK(close(descriptor) == 0);
+
+  static const char expected[] = "SSL_write: bad record\n";
+  CHECK(length_before_flush == 0);
+  CHECK(length == sizeof(expected) - 1);
+  CHECK(memcmp(output, expected, sizeof(expected) - 1) == 0);
+  return 0;
+}
+
+/* The background thread writes the messages without any flush requested */
+static int flush_in_background(int descriptor)
+{
+  CHECK(ftruncate(descriptor, 0) == 0);
+  CHECK(lseek(descriptor, 0, SEEK_SET) == 0);
+  CHECK(ah_log_start(AH_LOG_BACKGROUND));
+  CHECK(!ah_log_start(AH_LOG_EVENT_LOOP));
+  ah_log("first %d\n", 1);
+  ah_log("second %d\n", 2);
+
+  static const char expected[] = "first 1\nsecond 2\n";
+  ssize_t length = 0;
+  for (uint32_t i = 0; i != 1000 && length != sizeof(expected) - 1; ++i) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+    length = read_output(descriptor);
+  }
+  CHECK(length == sizeof(expected) - 1);
+  CHECK(memcmp(output, expected, sizeof(expected) - 1) == 0);
+
+  ah_log_stop();
+  return 0;
+}
+
+int main(void)
+{
+  char path[] = "/tmp/adhoc-log-XXXXXX";
+  int descriptor = mkstemp(path);
+  CHECK(descriptor != -1);
+  CHECK(unlink(path) == 0);
+  CHECK(fflush(stdout) == 0);
+  CHECK(dup2(descriptor, STDOUT_FILENO) == STDOUT_FILENO);
+
+  CHECK(drop_when_full(descriptor) == 0);
+  CHECK(defer_error_messages() == 0);
+  CHECK(exit_after_logging(descriptor) == 0);
+  CHECK(flush_in_background(descriptor) == 0);
+
+  CHECK(close(descriptor) == 0);
+  return 0;
+}
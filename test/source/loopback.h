@@ -0,0 +1,143 @@
+#pragma once
+
+#ifndef _WIN32
+#  include <arpa/inet.h>
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <netinet/in.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
+#include "check.h"
+#include "server.h"
+
+/**
+ * @file
+ *
+ * Event loop with a listener on a port picked by the kernel, so tests running
+ * at the same time do not compete for ports. The timer keeps every tick short,
+ * because the tests poll their peers between ticks.
+ */
+
+typedef struct loopback {
+  ah_server* server;
+  ah_socket* listener;
+  ah_acceptor* acceptor;
+  ah_timer* timer;
+  ah_context context;
+  uint16_t port;
+} loopback;
+
+static inline bool on_loopback_timer(ah_timer* timer, void* user_data)
+{
+  (void)timer;
+  (void)user_data;
+
+  return true;
+}
+
+/* The accept handler finds \c user_data in the context of the listener. The
+ * listener is only created if there is an accept handler, and the fixture
+ * must stay in place while it is open, because the listener refers to the
+ * context in it. */
+static inline int open_loopback(loopback* result_loopback,
+                                ah_on_accept on_accept,
+                                void* user_data)
+{
+  *result_loopback = (loopback) {
+      .server = allocate(server_size(), server_alignment()),
+      .listener = allocate(socket_size(), socket_alignment()),
+      .acceptor = allocate(acceptor_size(), acceptor_alignment()),
+      .timer = allocate(timer_size(), timer_alignment()),
+  };
+  CHECK(result_loopback->server != NULL && result_loopback->listener != NULL);
+  CHECK(result_loopback->acceptor != NULL && result_loopback->timer != NULL);
+  CHECK(create_server(result_loopback->server));
+  result_loopback->context = (ah_context) {result_loopback->server, user_data};
+  create_timer(
+      result_loopback->timer, result_loopback->server, on_loopback_timer, NULL);
+  if (on_accept == NULL) {
+    free(result_loopback->listener);
+    result_loopback->listener = NULL;
+    return 0;
+  }
+
+  ah_address address;
+  set_socket_span(result_loopback->server,
+                  (ah_socket_span) {1, result_loopback->listener});
+  CHECK(create_socket(result_loopback->listener, &result_loopback->context, 0));
+  CHECK(local_address_from_socket(result_loopback->listener, &address));
+  result_loopback->port = port_from_address(&address);
+  CHECK(create_acceptor(
+      result_loopback->acceptor, result_loopback->listener, on_accept));
+  return 0;
+}
+
+static inline int close_loopback(loopback* fixture)
+{
+  stop_timer(fixture->timer);
+  if (fixture->listener != NULL) {
+    CHECK(destroy_socket(fixture->listener));
+  }
+  CHECK(destroy_server(fixture->server));
+  free(fixture->timer);
+  free(fixture->acceptor);
+  free(fixture->listener);
+  free(fixture->server);
+  return 0;
+}
+
+static inline bool tick_loopback(loopback* fixture)
+{
+  start_timer(fixture->timer, 1);
+  return server_tick(fixture->server, NULL);
+}
+
+static inline bool on_loopback_accept_nothing(ah_error_code error_code,
+                                              ah_socket* socket,
+                                              const ah_address* address)
+{
+  (void)error_code;
+  (void)socket;
+  (void)address;
+
+  return true;
+}
+
+/* Returns a port that refuses connections: one the kernel just picked for a
+ * listener that is closed again */
+static inline int closed_port(uint16_t* result_port)
+{
+  loopback probe;
+  CHECK(open_loopback(&probe, on_loopback_accept_nothing, NULL) == 0);
+  *result_port = probe.port;
+  CHECK(close_loopback(&probe) == 0);
+  return 0;
+}
+
+#ifndef _WIN32
+
+/* Starts connecting a non-blocking socket to the listener, which accepts it
+ * on one of the following ticks. Returns -1 on failure. */
+static inline int connect_loopback(loopback* fixture)
+{
+  int descriptor = socket(AF_INET, SOCK_STREAM, 0);
+  if (descriptor == -1
+      || fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK)
+          == -1)
+  {
+    return -1;
+  }
+
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(fixture->port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  int result =
+      connect(descriptor, (struct sockaddr*)&address, sizeof(address));
+  return result == 0 || errno == EINPROGRESS ? descriptor : -1;
+}
+
+#endif
@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <string.h>
+
+#include "loopback.h"
+#include "memcached.h"
+
+#define LARGE_VALUE_SIZE (200 * 1024)
+#define KEY_COUNT 1000
+#define KEYS_PER_GET 100
+#define EVICTION_VALUE_SIZE 1000
+#define EVICTION_KEY_COUNT 3000
+#define BATCH 100
+
+static loopback fixture;
+static ah_memcached_server cache;
+static uint32_t accepted_count;
+static char buffer[512 * 1024];
+static char received[512 * 1024];
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK) {
+    return true;
+  }
+
+  ++accepted_count;
+  return memcached_accept(&cache, socket);
+}
+
+static int connect_peer(void)
+{
+  int descriptor = connect_loopback(&fixture);
+  if (descriptor == -1) {
+    return -1;
+  }
+
+  uint32_t expected = accepted_count + 1;
+  for (uint32_t i = 0; i != 100 && accepted_count != expected; ++i) {
+    if (!tick_loopback(&fixture)) {
+      return -1;
+    }
+  }
+
+  return accepted_count == expected ? descriptor : -1;
+}
+
+/* The server is driven while sending, so requests larger than the socket
+ * buffers get through */
+static int send_all(int peer, const char* data, size_t length)
+{
+  size_t total = 0;
+  for (uint32_t i = 0; i != 10000 && total != length; ++i) {
+    ssize_t result = send(peer, data + total, length - total, 0);
+    CHECK(result > 0 || (result == -1 && errno == EAGAIN));
+    total += result > 0 ? (size_t)result : 0;
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(total == length);
+  return 0;
+}
+
+static int receive_exactly(int peer, char* data, size_t length)
+{
+  size_t total = 0;
+  for (uint32_t i = 0; i != 10000 && total != length; ++i) {
+    CHECK(tick_loopback(&fixture));
+    ssize_t result = recv(peer, data + total, length - total, 0);
+    CHECK(result > 0 || (result == -1 && errno == EAGAIN));
+    total += result > 0 ? (size_t)result : 0;
+  }
+  CHECK(total == length);
+  return 0;
+}
+
+static int expect_response(int peer, const char* expected, size_t length)
+{
+  CHECK(receive_exactly(peer, received, length) == 0);
+  CHECK(memcmp(received, expected, length) == 0);
+
+  char byte;
+  CHECK(tick_loopback(&fixture));
+  CHECK(recv(peer, &byte, 1, 0) == -1 && errno == EAGAIN);
+  return 0;
+}
+
+static int command(int peer, const char* request, const char* expected)
+{
+  CHECK(send_all(peer, request, strlen(request)) == 0);
+  CHECK(expect_response(peer, expected, strlen(expected)) == 0);
+  return 0;
+}
+
+static int check_commands(void)
+{
+  int peer = connect_peer();
+  CHECK(peer != -1);
+
+  CHECK(command(peer, "set a 5 0 3\r\nabc\r\n", "STORED\r\n") == 0);
+  CHECK(command(peer, "get a b\r\n", "VALUE a 5 3\r\nabc\r\nEND\r\n") == 0);
+  CHECK(command(peer, "gets a\r\n", "VALUE a 5 3 1\r\nabc\r\nEND\r\n") == 0);
+  CHECK(command(peer, "set a 0 0 2 noreply\r\nxy\r\nget a\n",
+                "VALUE a 0 2\r\nxy\r\nEND\r\n")
+        == 0);
+  CHECK(command(peer, "gets a\r\n", "VALUE a 0 2 2\r\nxy\r\nEND\r\n") == 0);
+  CHECK(cache.hits == 4 && cache.misses == 1);
+
+  CHECK(command(peer, "delete a\r\n", "DELETED\r\n") == 0);
+  CHECK(command(peer, "delete a\r\n", "NOT_FOUND\r\n") == 0);
+  CHECK(command(peer, "get a\r\n", "END\r\n") == 0);
+  CHECK(memcached_item_count(&cache) == 0);
+
+  CHECK(command(peer, "set n 7 0 2\r\n10\r\n", "STORED\r\n") == 0);
+  CHECK(command(peer, "incr n 95\r\n", "105\r\n") == 0);
+  CHECK(command(peer, "get n\r\n", "VALUE n 7 3\r\n105\r\nEND\r\n") == 0);
+  CHECK(command(peer, "decr n 200\r\n", "0\r\n") == 0);
+  CHECK(command(peer, "incr n 1 noreply\r\nget n\r\n",
+                "VALUE n 7 1\r\n1\r\nEND\r\n")
+        == 0);
+  CHECK(command(peer, "set n 0 0 20\r\n18446744073709551615\r\nincr n 2\r\n",
+                "STORED\r\n1\r\n")
+        == 0);
+  CHECK(command(peer, "incr missing 1\r\n", "NOT_FOUND\r\n") == 0);
+  CHECK(command(peer, "set t 0 0 1\r\nx\r\nincr t 1\r\n",
+                "STORED\r\nCLIENT_ERROR cannot increment or decrement "
+                "non-numeric value\r\n")
+        == 0);
+  CHECK(command(peer, "incr t x\r\n",
+                "CLIENT_ERROR invalid numeric delta argument\r\n")
+        == 0);
+
+  /* Negative expiration times expire the item right away */
+  CHECK(command(peer, "set e 0 -1 1\r\nx\r\nget e\r\n", "STORED\r\nEND\r\n")
+        == 0);
+
+  /* The trailing bytes of a bad chunk are taken as the next command */
+  CHECK(command(peer, "set x 0 0 2\r\nabcd\r\n",
+                "CLIENT_ERROR bad data chunk\r\nERROR\r\n")
+        == 0);
+  CHECK(command(peer, "bogus\r\nset x 0 0\r\n",
+                "ERROR\r\nERROR\r\n")
+        == 0);
+  CHECK(command(peer, "set x 0 zero 1\r\n",
+                "CLIENT_ERROR bad command line format\r\n")
+        == 0);
+
+  /* The value arrives in many reads and is sent in one piece */
+  char* request = buffer;
+  int length = sprintf(request, "set large 0 0 %u\r\n", LARGE_VALUE_SIZE);
+  for (uint32_t i = 0; i != LARGE_VALUE_SIZE; ++i) {
+    request[length + (int)i] = (char)('a' + i % 26);
+  }
+  memcpy(request + length + LARGE_VALUE_SIZE, "\r\n", 2);
+  CHECK(send_all(peer, request, (size_t)length + LARGE_VALUE_SIZE + 2) == 0);
+  CHECK(expect_response(peer, "STORED\r\n", 8) == 0);
+
+  char header[64];
+  int header_length =
+      sprintf(header, "VALUE large 0 %u\r\n", LARGE_VALUE_SIZE);
+  memmove(request + header_length, request + length, LARGE_VALUE_SIZE + 2);
+  memcpy(request, header, (size_t)header_length);
+  memcpy(request + header_length + LARGE_VALUE_SIZE + 2, "END\r\n", 5);
+  CHECK(send_all(peer, "get large\r\n", 11) == 0);
+  CHECK(expect_response(
+            peer, request, (size_t)header_length + LARGE_VALUE_SIZE + 7)
+        == 0);
+
+  /* The responses are sent after the peer shut down its sending side */
+  CHECK(send_all(peer, "get n\r\n", 7) == 0);
+  CHECK(shutdown(peer, SHUT_WR) == 0);
+  const char* last = "VALUE n 0 1\r\n1\r\nEND\r\n";
+  CHECK(receive_exactly(peer, received, strlen(last)) == 0);
+  CHECK(memcmp(received, last, strlen(last)) == 0);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+/* Growing the index moves the keys gradually, and the gets pipelined below
+ * need more responses than a connection has */
+static int check_index_growth(void)
+{
+  int peer = connect_peer();
+  CHECK(peer != -1);
+
+  uint32_t base = memcached_item_count(&cache);
+  size_t length = 0;
+  for (uint32_t i = 0; i != KEY_COUNT; ++i) {
+    char value[16];
+    int value_length = sprintf(value, "v%u", i * 7);
+    length += (size_t)sprintf(buffer + length,
+                              "set k%u %u 0 %d noreply\r\n%s\r\n",
+                              i,
+                              i,
+                              value_length,
+                              value);
+  }
+  CHECK(send_all(peer, buffer, length) == 0);
+  CHECK(command(peer, "get k0\r\n", "VALUE k0 0 2\r\nv0\r\nEND\r\n") == 0);
+  CHECK(memcached_item_count(&cache) == base + KEY_COUNT);
+  CHECK(cache.index.mask + 1 >= 2 * KEY_COUNT);
+
+  length = 0;
+  size_t expected_length = 0;
+  char* expected = received + sizeof(received) / 2;
+  for (uint32_t i = 0; i != KEY_COUNT; i += KEYS_PER_GET) {
+    length += (size_t)sprintf(buffer + length, "get");
+    for (uint32_t j = i; j != i + KEYS_PER_GET; ++j) {
+      char value[16];
+      int value_length = sprintf(value, "v%u", j * 7);
+      length += (size_t)sprintf(buffer + length, " k%u", j);
+      expected_length += (size_t)sprintf(expected + expected_length,
+                                         "VALUE k%u %u %d\r\n%s\r\n",
+                                         j,
+                                         j,
+                                         value_length,
+                                         value);
+    }
+    length += (size_t)sprintf(buffer + length, "\r\n");
+    expected_length += (size_t)sprintf(expected + expected_length, "END\r\n");
+  }
+
+  CHECK(send_all(peer, buffer, length) == 0);
+  memcpy(buffer, expected, expected_length);
+  CHECK(expect_response(peer, buffer, expected_length) == 0);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+/* The limit is two pages, which all go to the class of the values stored
+ * first. The value read regularly survives the sweeps of the hand. */
+static int check_eviction(void)
+{
+  int peer = connect_peer();
+  CHECK(peer != -1);
+
+  static char value[EVICTION_VALUE_SIZE];
+  memset(value, 'v', sizeof(value));
+  size_t length =
+      (size_t)sprintf(buffer, "set hot 0 0 %d\r\n", EVICTION_VALUE_SIZE);
+  memcpy(buffer + length, value, sizeof(value));
+  length += sizeof(value);
+  memcpy(buffer + length, "\r\n", 2);
+  CHECK(send_all(peer, buffer, length + 2) == 0);
+  CHECK(expect_response(peer, "STORED\r\n", 8) == 0);
+
+  char expected[1100];
+  size_t expected_length =
+      (size_t)sprintf(expected, "VALUE hot 0 %d\r\n", EVICTION_VALUE_SIZE);
+  memcpy(expected + expected_length, value, sizeof(value));
+  expected_length += sizeof(value);
+  expected_length += (size_t)sprintf(expected + expected_length, "\r\nEND\r\n");
+
+  for (uint32_t i = 0; i != EVICTION_KEY_COUNT; i += BATCH) {
+    length = 0;
+    for (uint32_t j = i; j != i + BATCH; ++j) {
+      length += (size_t)sprintf(buffer + length,
+                                "set cold%u 0 0 %d noreply\r\n",
+                                j,
+                                EVICTION_VALUE_SIZE);
+      memcpy(buffer + length, value, sizeof(value));
+      length += sizeof(value);
+      memcpy(buffer + length, "\r\n", 2);
+      length += 2;
+    }
+    length += (size_t)sprintf(buffer + length, "get hot\r\n");
+    CHECK(send_all(peer, buffer, length) == 0);
+    CHECK(expect_response(peer, expected, expected_length) == 0);
+  }
+
+  CHECK(cache.page_count == 2 && cache.evictions != 0);
+  CHECK(memcached_item_count(&cache) + cache.evictions
+        == EVICTION_KEY_COUNT + 1);
+  CHECK(command(peer, "get cold0\r\n", "END\r\n") == 0);
+
+  /* No page is left for the class of larger values, and their data is
+   * skipped */
+  length = (size_t)sprintf(buffer, "set big 0 0 %d\r\n", 5000);
+  memset(buffer + length, 'b', 5000);
+  length += 5000;
+  length += (size_t)sprintf(buffer + length, "\r\nget big\r\n");
+  CHECK(send_all(peer, buffer, length) == 0);
+  const char* refused = "SERVER_ERROR out of memory storing object\r\nEND\r\n";
+  CHECK(expect_response(peer, refused, strlen(refused)) == 0);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+static int run(uint64_t memory_limit, int (*check)(void))
+{
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  CHECK(create_memcached_server(&cache, fixture.server, memory_limit));
+
+  CHECK(check() == 0);
+
+  destroy_memcached_server(&cache);
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
+
+int main(void)
+{
+  CHECK(!create_memcached_server(&cache, NULL, AH_MEMCACHED_PAGE_SIZE - 1));
+  CHECK(run(16 * AH_MEMCACHED_PAGE_SIZE, check_commands) == 0);
+  CHECK(run(16 * AH_MEMCACHED_PAGE_SIZE, check_index_growth) == 0);
+  CHECK(run(2 * AH_MEMCACHED_PAGE_SIZE, check_eviction) == 0);
+  return 0;
+}
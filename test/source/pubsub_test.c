@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <string.h>
+
+#include "loopback.h"
+#include "pubsub.h"
+
+#define BURST (AH_PUBSUB_MAX_PENDING + 6)
+
+static loopback fixture;
+static ah_pubsub_server broker;
+static uint32_t accepted_count;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK) {
+    return true;
+  }
+
+  ++accepted_count;
+  return pubsub_accept(&broker, socket);
+}
+
+static int connect_peer(void)
+{
+  int descriptor = connect_loopback(&fixture);
+  if (descriptor == -1) {
+    return -1;
+  }
+
+  uint32_t expected = accepted_count + 1;
+  for (uint32_t i = 0; i != 100 && accepted_count != expected; ++i) {
+    if (!tick_loopback(&fixture)) {
+      return -1;
+    }
+  }
+
+  return accepted_count == expected ? descriptor : -1;
+}
+
+/* Appends a frame to \c out and returns the length of the frame with its
+ * header */
+static size_t format_frame(uint8_t* out,
+                           char operation,
+                           const char* topic,
+                           const char* payload)
+{
+  size_t topic_length = strlen(topic);
+  size_t payload_length = strlen(payload);
+  uint32_t length = (uint32_t)(2 + topic_length + payload_length);
+  out[0] = (uint8_t)(length >> 24);
+  out[1] = (uint8_t)(length >> 16);
+  out[2] = (uint8_t)(length >> 8);
+  out[3] = (uint8_t)length;
+  out[4] = (uint8_t)operation;
+  out[5] = (uint8_t)topic_length;
+  memcpy(out + 6, topic, topic_length);
+  memcpy(out + 6 + topic_length, payload, payload_length);
+  return 4 + length;
+}
+
+static int send_frame(int peer,
+                      char operation,
+                      const char* topic,
+                      const char* payload)
+{
+  uint8_t frame[64];
+  size_t length = format_frame(frame, operation, topic, payload);
+  CHECK(send(peer, frame, length, 0) == (ssize_t)length);
+  return 0;
+}
+
+static uint32_t subscriber_count(const char* topic)
+{
+  uint8_t name[AH_PUBSUB_MAX_TOPIC];
+  uint32_t length = (uint32_t)strlen(topic);
+  memcpy(name, topic, length);
+  return pubsub_subscriber_count(&broker, (ah_io_buffer) {length, name});
+}
+
+static int wait_for_subscribers(const char* topic, uint32_t count)
+{
+  for (uint32_t i = 0; i != 100 && subscriber_count(topic) != count; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(subscriber_count(topic) == count);
+  return 0;
+}
+
+static int receive_exactly(int peer, uint8_t* buffer, size_t length)
+{
+  size_t total = 0;
+  for (uint32_t i = 0; i != 1000 && total != length; ++i) {
+    CHECK(tick_loopback(&fixture));
+    ssize_t result = recv(peer, buffer + total, length - total, 0);
+    CHECK(result > 0 || (result == -1 && errno == EAGAIN));
+    total += result > 0 ? (size_t)result : 0;
+  }
+  CHECK(total == length);
+  return 0;
+}
+
+static int receive_message(int peer, const char* topic, const char* payload)
+{
+  uint8_t expected[64];
+  size_t length = format_frame(expected, 'M', topic, payload);
+  uint8_t received[64];
+  CHECK(receive_exactly(peer, received, length) == 0);
+  CHECK(memcmp(received, expected, length) == 0);
+  return 0;
+}
+
+static int expect_nothing(int peer)
+{
+  uint8_t byte;
+  CHECK(tick_loopback(&fixture));
+  CHECK(recv(peer, &byte, 1, 0) == -1 && errno == EAGAIN);
+  return 0;
+}
+
+/* The burst arrives in a single read, so every message is queued before any
+ * of them could be sent */
+static int publish_burst(int publisher)
+{
+  static uint8_t frames[BURST * 16];
+  size_t length = 0;
+  for (uint32_t i = 0; i != BURST; ++i) {
+    length += format_frame(frames + length, 'P', "news", "burst");
+  }
+  CHECK(send(publisher, frames, length, 0) == (ssize_t)length);
+
+  uint64_t published = broker.published + BURST;
+  for (uint32_t i = 0; i != 100 && broker.published != published; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(broker.published == published);
+  return 0;
+}
+
+static int check_routing(void)
+{
+  int first = connect_peer();
+  int second = connect_peer();
+  int publisher = connect_peer();
+  CHECK(first != -1 && second != -1 && publisher != -1);
+
+  CHECK(send_frame(first, 'S', "news", "") == 0);
+  CHECK(send_frame(second, 'S', "news", "") == 0);
+  CHECK(send_frame(second, 'S', "other", "") == 0);
+  CHECK(wait_for_subscribers("news", 2) == 0);
+  CHECK(wait_for_subscribers("other", 1) == 0);
+  CHECK(broker.topic_count == 2);
+
+  CHECK(send_frame(publisher, 'P', "news", "hello") == 0);
+  CHECK(receive_message(first, "news", "hello") == 0);
+  CHECK(receive_message(second, "news", "hello") == 0);
+  CHECK(send_frame(publisher, 'P', "other", "world") == 0);
+  CHECK(receive_message(second, "other", "world") == 0);
+  CHECK(expect_nothing(first) == 0);
+  CHECK(expect_nothing(publisher) == 0);
+
+  /* Topics disappear with their last subscriber */
+  CHECK(send_frame(second, 'U', "other", "") == 0);
+  CHECK(wait_for_subscribers("other", 0) == 0);
+  CHECK(broker.topic_count == 1);
+  CHECK(send_frame(publisher, 'P', "other", "nobody") == 0);
+  CHECK(send_frame(publisher, 'P', "news", "again") == 0);
+  CHECK(receive_message(second, "news", "again") == 0);
+  CHECK(receive_message(first, "news", "again") == 0);
+  CHECK(expect_nothing(second) == 0);
+
+  /* Enough topics to grow the table, then removed again in another order */
+  char names[12][4];
+  for (uint32_t i = 0; i != 12; ++i) {
+    snprintf(names[i], sizeof(names[i]), "t%u", i);
+    CHECK(send_frame(second, 'S', names[i], "") == 0);
+  }
+  CHECK(wait_for_subscribers(names[11], 1) == 0);
+  CHECK(broker.topic_count == 13 && broker.slot_mask + 1 == 32);
+  for (uint32_t i = 0; i != 12; ++i) {
+    CHECK(send_frame(second, 'U', names[(i * 5) % 12], "") == 0);
+    CHECK(wait_for_subscribers(names[(i * 5) % 12], 0) == 0);
+    for (uint32_t j = i + 1; j != 12; ++j) {
+      CHECK(subscriber_count(names[(j * 5) % 12]) == 1);
+    }
+  }
+  CHECK(broker.topic_count == 1 && subscriber_count("news") == 2);
+
+  /* Slow subscribers miss the messages that do not fit */
+  uint64_t delivered = broker.delivered;
+  CHECK(publish_burst(publisher) == 0);
+  CHECK(broker.delivered - delivered == 2 * AH_PUBSUB_MAX_PENDING);
+  CHECK(broker.dropped == 2 * (BURST - AH_PUBSUB_MAX_PENDING));
+  for (uint32_t i = 0; i != AH_PUBSUB_MAX_PENDING; ++i) {
+    CHECK(receive_message(first, "news", "burst") == 0);
+    CHECK(receive_message(second, "news", "burst") == 0);
+  }
+  CHECK(expect_nothing(first) == 0);
+  CHECK(send_frame(publisher, 'P', "news", "caught up") == 0);
+  CHECK(receive_message(first, "news", "caught up") == 0);
+  CHECK(receive_message(second, "news", "caught up") == 0);
+
+  /* Subscribers leave their topics when they disconnect */
+  CHECK(close(first) == 0);
+  CHECK(wait_for_subscribers("news", 1) == 0);
+  CHECK(close(second) == 0);
+  CHECK(wait_for_subscribers("news", 0) == 0);
+  CHECK(broker.topic_count == 0);
+  CHECK(close(publisher) == 0);
+  return 0;
+}
+
+static int wait_for_reset(int peer)
+{
+  ssize_t result = -1;
+  uint8_t buffer[256];
+  for (uint32_t i = 0; i != 100; ++i) {
+    CHECK(tick_loopback(&fixture));
+    result = recv(peer, buffer, sizeof(buffer), 0);
+    if (result != -1 || errno != EAGAIN) {
+      break;
+    }
+  }
+  CHECK(result == 0 || (result == -1 && errno == ECONNRESET));
+  return 0;
+}
+
+static int check_disconnect_policy(void)
+{
+  int subscriber = connect_peer();
+  int publisher = connect_peer();
+  CHECK(subscriber != -1 && publisher != -1);
+
+  CHECK(send_frame(subscriber, 'S', "news", "") == 0);
+  CHECK(wait_for_subscribers("news", 1) == 0);
+
+  CHECK(publish_burst(publisher) == 0);
+  CHECK(broker.dropped == 1);
+  CHECK(subscriber_count("news") == 0 && broker.topic_count == 0);
+  CHECK(wait_for_reset(subscriber) == 0);
+  CHECK(expect_nothing(publisher) == 0);
+
+  /* Malformed frames reset the connection */
+  int peer = connect_peer();
+  CHECK(peer != -1);
+  CHECK(send_frame(peer, 'S', "", "") == 0);
+  CHECK(wait_for_reset(peer) == 0);
+
+  CHECK(close(subscriber) == 0);
+  CHECK(close(publisher) == 0);
+  CHECK(close(peer) == 0);
+  return 0;
+}
+
+static int run(ah_pubsub_slow_policy policy, int (*check)(void))
+{
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  CHECK(create_pubsub_server(
+      &broker, fixture.server, policy, 0, 1024 * 1024));
+
+  CHECK(check() == 0);
+
+  destroy_pubsub_server(&broker);
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
+
+int main(void)
+{
+  CHECK(run(AH_PUBSUB_DROP_MESSAGES, check_routing) == 0);
+  CHECK(run(AH_PUBSUB_DISCONNECT, check_disconnect_policy) == 0);
+  return 0;
+}
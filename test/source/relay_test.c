@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+#define PAYLOAD_SIZE (1024 * 1024)
+#define STALLED_BUFFER_SIZE (16 * 1024)
+
+static ah_socket_accepted accepted[2];
+static ah_io_dock docks[2];
+static uint32_t accepted_count;
+static ah_error_code relay_error;
+static bool relay_done;
+static uint8_t payload[PAYLOAD_SIZE];
+static uint8_t received[PAYLOAD_SIZE];
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && accepted_count != 2) {
+    move_socket(&accepted[accepted_count], socket);
+    docks[accepted_count].socket = &accepted[accepted_count];
+    ++accepted_count;
+  }
+
+  return true;
+}
+
+static bool on_relay_done(ah_error_code error_code,
+                          ah_relay* relay,
+                          void* user_data)
+{
+  (void)relay;
+  (void)user_data;
+
+  relay_error = error_code;
+  relay_done = true;
+  return true;
+}
+
+static ssize_t receive(int descriptor, uint8_t* buffer, size_t length)
+{
+  ssize_t result = recv(descriptor, buffer, length, 0);
+  return result == -1 && errno == EAGAIN ? -2 : result;
+}
+
+/* Runs the relay between two new peers, in the kernel if a sockmap is
+ * given */
+static int run_relay(loopback* fixture, ah_relay* relay, ah_sockmap* sockmap)
+{
+  accepted_count = 0;
+  relay_done = false;
+
+  /* The peers are accepted in order, so the first dock is the client */
+  int client = connect_loopback(fixture);
+  CHECK(client != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 1; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  int upstream = connect_loopback(fixture);
+  CHECK(upstream != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 2; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(accepted_count == 2);
+  CHECK(start_sockmap_relay(
+      sockmap, relay, &docks[0], &docks[1], on_relay_done, NULL));
+  CHECK(is_relay_in_kernel(relay) == (sockmap != NULL));
+
+  /* Sending and receiving are interleaved, because the relay only moves as
+   * much as fits into the socket buffers */
+  size_t sent = 0;
+  size_t total = 0;
+  for (uint32_t i = 0; i != 10000 && total != PAYLOAD_SIZE; ++i) {
+    if (sent != PAYLOAD_SIZE) {
+      ssize_t result = send(client, payload + sent, PAYLOAD_SIZE - sent, 0);
+      CHECK(result != -1 || errno == EAGAIN);
+      sent += result == -1 ? 0 : (size_t)result;
+    }
+
+    CHECK(tick_loopback(fixture));
+    ssize_t result =
+        receive(upstream, received + total, PAYLOAD_SIZE - total);
+    CHECK(result > 0 || result == -2);
+    total += result > 0 ? (size_t)result : 0;
+  }
+  CHECK(total == PAYLOAD_SIZE);
+  CHECK(memcmp(received, payload, PAYLOAD_SIZE) == 0);
+
+  /* The end of file reaches the upstream, while the other direction keeps
+   * working */
+  CHECK(shutdown(client, SHUT_WR) == 0);
+  ssize_t result = -2;
+  for (uint32_t i = 0; i != 100 && result == -2; ++i) {
+    CHECK(tick_loopback(fixture));
+    result = receive(upstream, received, 1);
+  }
+  CHECK(result == 0 && !relay_done);
+
+  CHECK(send(upstream, "reply", 5, 0) == 5);
+  CHECK(shutdown(upstream, SHUT_WR) == 0);
+  for (uint32_t i = 0; i != 100 && !relay_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(relay_done && relay_error == AH_ERR_OK);
+  CHECK(receive(client, received, sizeof(received)) == 5);
+  CHECK(memcmp(received, "reply", 5) == 0);
+  CHECK(receive(client, received, 1) == 0);
+
+  ah_relay_counters counters = counters_from_relay(relay);
+  CHECK(counters.client_to_upstream == PAYLOAD_SIZE);
+  CHECK(counters.upstream_to_client == 5);
+
+  CHECK(close(client) == 0);
+  CHECK(close(upstream) == 0);
+  CHECK(destroy_socket(&accepted[0]));
+  CHECK(destroy_socket(&accepted[1]));
+  return 0;
+}
+
+/* Splicing into a peer that is gone fails the relay, but must not raise
+ * SIGPIPE, which would end the test with its default disposition */
+static int run_broken_relay(loopback* fixture, ah_relay* relay)
+{
+  accepted_count = 0;
+  relay_done = false;
+
+  int client = connect_loopback(fixture);
+  CHECK(client != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 1; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  int upstream = connect_loopback(fixture);
+  CHECK(upstream != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 2; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(accepted_count == 2);
+  CHECK(start_relay(relay, &docks[0], &docks[1], on_relay_done, NULL));
+
+  /* The socket of the relay sees the end of file first, so the reset its
+   * next send provokes is reported as EPIPE */
+  CHECK(close(upstream) == 0);
+  for (uint32_t i = 0; i != 1000 && !relay_done; ++i) {
+    CHECK(send(client, payload, 1024, 0) != -1 || errno == EAGAIN);
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(relay_done);
+  CHECK(relay_error == AH_ERR_BROKEN_PIPE
+        || relay_error == AH_ERR_CONNECTION_RESET);
+
+  struct sigaction action;
+  CHECK(sigaction(SIGPIPE, NULL, &action) == 0);
+  CHECK(action.sa_handler == SIG_DFL);
+
+  CHECK(close(client) == 0);
+  CHECK(destroy_socket(&accepted[0]));
+  CHECK(destroy_socket(&accepted[1]));
+  return 0;
+}
+
+/* The upstream does not read, so the redirected bytes back up in the sink
+ * and the end of file that follows them has to wait until the upstream
+ * caught up */
+static int run_stalled_sink(loopback* fixture,
+                            ah_relay* relay,
+                            ah_sockmap* sockmap)
+{
+  accepted_count = 0;
+  relay_done = false;
+
+  int client = connect_loopback(fixture);
+  CHECK(client != -1);
+  for (uint32_t i = 0; i != 100 && accepted_count != 1; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  int upstream = connect_loopback(fixture);
+  CHECK(upstream != -1);
+  int buffer_size = STALLED_BUFFER_SIZE;
+  CHECK(setsockopt(upstream,
+                   SOL_SOCKET,
+                   SO_RCVBUF,
+                   &buffer_size,
+                   sizeof(buffer_size))
+        == 0);
+  for (uint32_t i = 0; i != 100 && accepted_count != 2; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(accepted_count == 2);
+  CHECK(start_sockmap_relay(
+      sockmap, relay, &docks[0], &docks[1], on_relay_done, NULL));
+  CHECK(is_relay_in_kernel(relay));
+
+  size_t sent = 0;
+  for (uint32_t i = 0; i != 10000 && sent != PAYLOAD_SIZE; ++i) {
+    ssize_t result = send(client, payload + sent, PAYLOAD_SIZE - sent, 0);
+    CHECK(result != -1 || errno == EAGAIN);
+    sent += result == -1 ? 0 : (size_t)result;
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(sent == PAYLOAD_SIZE);
+  CHECK(shutdown(client, SHUT_WR) == 0);
+  for (uint32_t i = 0; i != 50; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(!relay_done);
+
+  size_t total = 0;
+  ssize_t result = -2;
+  for (uint32_t i = 0; i != 10000 && result != 0; ++i) {
+    CHECK(tick_loopback(fixture));
+    result = receive(upstream, received + total, PAYLOAD_SIZE - total);
+    CHECK(result >= 0 || result == -2);
+    total += result > 0 ? (size_t)result : 0;
+  }
+  CHECK(result == 0 && total == PAYLOAD_SIZE);
+  CHECK(memcmp(received, payload, PAYLOAD_SIZE) == 0);
+
+  CHECK(shutdown(upstream, SHUT_WR) == 0);
+  for (uint32_t i = 0; i != 100 && !relay_done; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(relay_done && relay_error == AH_ERR_OK);
+  CHECK(counters_from_relay(relay).client_to_upstream == PAYLOAD_SIZE);
+
+  CHECK(close(client) == 0);
+  CHECK(close(upstream) == 0);
+  CHECK(destroy_socket(&accepted[0]));
+  CHECK(destroy_socket(&accepted[1]));
+  return 0;
+}
+
+int main(void)
+{
+  for (uint32_t i = 0; i != PAYLOAD_SIZE; ++i) {
+    payload[i] = (uint8_t)(i * 7 + i / 251);
+  }
+
+  loopback fixture;
+  ah_relay* relay = allocate(relay_size(), relay_alignment());
+  ah_sockmap* sockmap = allocate(sockmap_size(), sockmap_alignment());
+  CHECK(relay != NULL && sockmap != NULL);
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  CHECK(run_relay(&fixture, relay, NULL) == 0);
+  CHECK(run_broken_relay(&fixture, relay) == 0);
+
+  /* Loading the program needs privileges the test may be run without */
+  if (create_sockmap(sockmap, 1)) {
+    CHECK(run_relay(&fixture, relay, sockmap) == 0);
+    CHECK(run_stalled_sink(&fixture, relay, sockmap) == 0);
+    destroy_sockmap(sockmap);
+  } else {
+    printf("BPF is not available, skipping the kernel relay\n");
+  }
+
+  CHECK(close_loopback(&fixture) == 0);
+  free(sockmap);
+  free(relay);
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "server.h"
+
+int main(void)
+{
+  ah_ring ring;
+  CHECK(create_ring(&ring, 1));
+  CHECK(ring.capacity != 0 && ring.mirrored);
+  uint32_t capacity = ring.capacity;
+
+  /* Both mappings refer to the same memory */
+  ring.data[0] = 'a';
+  CHECK(ring.data[capacity] == 'a');
+  ring.data[capacity + 1] = 'b';
+  CHECK(ring.data[1] == 'b');
+
+  ah_io_buffer free_space = ring_write_buffer(&ring);
+  CHECK(free_space.buffer_length == capacity);
+  CHECK(!ring_produce(&ring, capacity + 1));
+
+  /* Leave 3 bytes unread right before the end of the storage */
+  CHECK(ring_produce(&ring, capacity));
+  CHECK(ring_write_buffer(&ring).buffer_length == 0);
+  CHECK(ring_consume(&ring, capacity - 3));
+  memcpy(ring_read_buffer(&ring).buffer, "abc", 3);
+
+  /* The free space starts over at the front */
+  free_space = ring_write_buffer(&ring);
+  CHECK(free_space.buffer_length == capacity - 3);
+  CHECK(free_space.buffer == ring.data);
+  memcpy(free_space.buffer, "def", 3);
+  CHECK(ring_produce(&ring, 3));
+
+  /* The unread bytes wrap around, yet read as one buffer */
+  ah_io_buffer unread = ring_read_buffer(&ring);
+  CHECK(unread.buffer_length == 6);
+  CHECK(memcmp(unread.buffer, "abcdef", 6) == 0);
+  CHECK(memcmp(ring.data, "def", 3) == 0);
+
+  CHECK(!ring_consume(&ring, 7));
+  CHECK(ring_consume(&ring, 4));
+  unread = ring_read_buffer(&ring);
+  CHECK(unread.buffer_length == 2);
+  CHECK((uint8_t*)unread.buffer == ring.data + 1);
+  CHECK(memcmp(unread.buffer, "ef", 2) == 0);
+
+  /* An empty ring starts over at the front */
+  CHECK(ring_consume(&ring, 2));
+  CHECK(ring_read_buffer(&ring).buffer == ring.data);
+  CHECK(ring_write_buffer(&ring).buffer_length == capacity);
+
+  /* Free space that wraps around is one buffer as well */
+  CHECK(ring_produce(&ring, capacity - 2));
+  CHECK(ring_consume(&ring, capacity - 4));
+  free_space = ring_write_buffer(&ring);
+  CHECK(free_space.buffer_length == capacity - 2);
+  CHECK((uint8_t*)free_space.buffer == ring.data + capacity - 2);
+  memset(free_space.buffer, 'x', free_space.buffer_length);
+  CHECK(ring.data[0] == 'x' && ring.data[capacity - 5] == 'x');
+
+  destroy_ring(&ring);
+  CHECK(ring.data == NULL);
+
+  /* Rings fall back to a plain buffer if the storage cannot be mapped, whose
+   * unread bytes are moved to the front to make room */
+  ah_ring plain = {malloc(capacity), capacity, 0, 0, false};
+  CHECK(plain.data != NULL);
+  CHECK(ring_produce(&plain, capacity));
+  CHECK(ring_consume(&plain, capacity - 3));
+  memcpy(ring_read_buffer(&plain).buffer, "abc", 3);
+  CHECK(!ring_produce(&plain, 1));
+  free_space = ring_write_buffer(&plain);
+  CHECK(free_space.buffer_length == capacity - 3);
+  CHECK(free_space.buffer == plain.data + 3);
+  memcpy(free_space.buffer, "def", 3);
+  CHECK(ring_produce(&plain, 3));
+  unread = ring_read_buffer(&plain);
+  CHECK(unread.buffer == plain.data && unread.buffer_length == 6);
+  CHECK(memcmp(unread.buffer, "abcdef", 6) == 0);
+  destroy_ring(&plain);
+  CHECK(plain.data == NULL);
+
+  CHECK(!create_ring(&ring, (1U << 30) + 1));
+  return 0;
+}
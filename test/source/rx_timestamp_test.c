@@ -0,0 +1,122 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* Only the first of the two connections has receive timestamps enabled. The
+ * timestamp of its read must fall between the peer sending the data and the
+ * callback running, and is only available from inside the callback. */
+
+typedef struct connection {
+  ah_io_dock dock;
+  ah_socket_accepted socket;
+  uint8_t buffer[4];
+  uint64_t rx_timestamp;
+  uint64_t callback_time;
+  bool read;
+} connection;
+
+static connection connections[2];
+static uint32_t accepted_count;
+
+static uint64_t realtime_ns(void)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_REALTIME, &now) != 0) {
+    return 0;
+  }
+
+  return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code != AH_ERR_OK || accepted_count == 2) {
+    return true;
+  }
+
+  connection* accepted = &connections[accepted_count++];
+  move_socket(&accepted->socket, socket);
+  accepted->dock.socket = &accepted->socket;
+  return true;
+}
+
+static bool on_read(ah_error_code error_code,
+                    ah_io_operation* operation,
+                    uint32_t bytes_transferred,
+                    void* per_call_data)
+{
+  connection* completed = per_call_data;
+  completed->read = error_code == AH_ERR_OK && bytes_transferred == 4;
+  completed->rx_timestamp = rx_timestamp_from_io_operation(operation);
+  completed->callback_time = realtime_ns();
+  return true;
+}
+
+/* Sends a request from the peer and waits for the connection to read it */
+static int exchange(loopback* fixture,
+                    connection* receiver,
+                    int peer,
+                    uint64_t* result_send_time)
+{
+  ah_io_buffer buffer = {sizeof(receiver->buffer), receiver->buffer};
+  receiver->read = false;
+  CHECK(queue_read_operation(&receiver->dock, buffer, on_read, receiver));
+  *result_send_time = realtime_ns();
+  CHECK(*result_send_time != 0);
+  CHECK(write(peer, "ping", 4) == 4);
+  for (uint32_t i = 0; i != 100 && !receiver->read; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(receiver->read);
+  return 0;
+}
+
+int main(void)
+{
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  int peers[2];
+  for (uint32_t i = 0; i != 2; ++i) {
+    peers[i] = connect_loopback(&fixture);
+    CHECK(peers[i] != -1);
+    for (uint32_t j = 0; j != 100 && accepted_count != i + 1; ++j) {
+      CHECK(tick_loopback(&fixture));
+    }
+  }
+  CHECK(accepted_count == 2);
+  CHECK(enable_rx_timestamps(&connections[0].socket));
+
+  /* The kernel switches the timestamping on from a work queue, so the first
+   * packets after enabling it may arrive without a timestamp */
+  connection* stamped = &connections[0];
+  uint64_t send_time = 0;
+  for (uint32_t i = 0; i != 100 && stamped->rx_timestamp == 0; ++i) {
+    CHECK(tick_loopback(&fixture));
+    CHECK(exchange(&fixture, stamped, peers[0], &send_time) == 0);
+  }
+  CHECK(stamped->rx_timestamp >= send_time);
+  CHECK(stamped->rx_timestamp <= stamped->callback_time);
+  CHECK(rx_timestamp_from_io_operation(&stamped->dock.read_port) == 0);
+
+  CHECK(exchange(&fixture, &connections[1], peers[1], &send_time) == 0);
+  CHECK(connections[1].rx_timestamp == 0);
+
+  ah_server_stats stats = stats_from_server(fixture.server);
+  CHECK(stats.rx_timestamped_reads == 1);
+  CHECK(stats.rx_queue_delay_max_ns
+        <= stamped->callback_time - stamped->rx_timestamp);
+  CHECK(stats.rx_queue_delay_total_ns == stats.rx_queue_delay_max_ns);
+
+  for (uint32_t i = 0; i != 2; ++i) {
+    CHECK(destroy_socket(&connections[i].socket));
+    CHECK(close(peers[i]) == 0);
+  }
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* Timers fire in the order of their deadlines, ties in the order they were
+ * started. The sampler is a timer as well, which goes around its slots a few
+ * at a time. */
+
+#define TIMERS 5
+#define CONNECTIONS 3
+#define SAMPLES (CONNECTIONS * 3)
+
+static ah_timer* timers[TIMERS];
+static uint32_t fired[TIMERS];
+static uint32_t fired_count;
+static uint32_t periodic_count;
+
+static ah_socket_accepted sockets[CONNECTIONS];
+static ah_tcp_info_slot slots[CONNECTIONS];
+static uint32_t accepted_count;
+static uint32_t sampled[SAMPLES];
+static uint32_t sampled_count;
+static uint64_t total_samples;
+static uint64_t sampled_at_ms;
+static uint32_t samples_at_once;
+static uint32_t most_samples_at_once;
+
+static bool on_timer(ah_timer* timer, void* user_data)
+{
+  uint32_t index = (uint32_t)(uintptr_t)user_data;
+  if (timer != timers[index] || is_timer_active(timer)
+      || fired_count == TIMERS)
+  {
+    return false;
+  }
+
+  fired[fired_count++] = index;
+  return true;
+}
+
+static bool on_periodic_timer(ah_timer* timer, void* user_data)
+{
+  (void)user_data;
+
+  ++periodic_count;
+  start_timer(timer, 0);
+  return true;
+}
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && accepted_count != CONNECTIONS) {
+    move_socket(&sockets[accepted_count++], socket);
+  }
+
+  return true;
+}
+
+static bool on_sample(ah_tcp_info_slot* slot, void* user_data)
+{
+  (void)user_data;
+
+  if (slot->info.mss == 0) {
+    return false;
+  }
+
+  ++total_samples;
+  if (sampled_count != SAMPLES) {
+    sampled[sampled_count++] = (uint32_t)(slot - slots);
+  }
+
+  /* The slots sampled by the same timer share the time of the sample */
+  if (slot->sampled_at_ms != sampled_at_ms) {
+    sampled_at_ms = slot->sampled_at_ms;
+    samples_at_once = 0;
+  }
+  if (++samples_at_once > most_samples_at_once) {
+    most_samples_at_once = samples_at_once;
+  }
+
+  return true;
+}
+
+static int order_timers(loopback* fixture)
+{
+  static const uint32_t timeouts[TIMERS] = {40, 10, 20, 10, 60};
+  for (uint32_t i = 0; i != TIMERS; ++i) {
+    timers[i] = allocate(timer_size(), timer_alignment());
+    CHECK(timers[i] != NULL);
+    create_timer(timers[i], fixture->server, on_timer, (void*)(uintptr_t)i);
+    start_timer(timers[i], timeouts[i]);
+    CHECK(is_timer_active(timers[i]));
+  }
+
+  /* A stopped timer never fires and starting an active timer moves its
+   * deadline */
+  stop_timer(timers[2]);
+  CHECK(!is_timer_active(timers[2]));
+  stop_timer(timers[2]);
+  start_timer(timers[4], 5);
+
+  for (uint32_t i = 0; i != 1000 && fired_count != TIMERS - 1; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(fired_count == TIMERS - 1);
+  CHECK(fired[0] == 4 && fired[1] == 1 && fired[2] == 3 && fired[3] == 0);
+  for (uint32_t i = 0; i != 20; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(fired_count == TIMERS - 1);
+
+  for (uint32_t i = 0; i != TIMERS; ++i) {
+    CHECK(!is_timer_active(timers[i]));
+    free(timers[i]);
+  }
+
+  return 0;
+}
+
+/* A timer started again from its callback fires on the next tick only */
+static int restart_from_callback(loopback* fixture)
+{
+  ah_timer* timer = allocate(timer_size(), timer_alignment());
+  CHECK(timer != NULL);
+  create_timer(timer, fixture->server, on_periodic_timer, NULL);
+  start_timer(timer, 0);
+  for (uint32_t i = 0; i != 10; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(periodic_count == 10 && is_timer_active(timer));
+  stop_timer(timer);
+  free(timer);
+  return 0;
+}
+
+static int sample_connections(loopback* fixture,
+                              uint32_t samples_per_interval)
+{
+  ah_tcp_info_sampler* sampler =
+      allocate(tcp_info_sampler_size(), tcp_info_sampler_alignment());
+  CHECK(sampler != NULL);
+  create_tcp_info_sampler(
+      sampler, fixture->server, 5, samples_per_interval, on_sample, NULL);
+  for (uint32_t i = 0; i != CONNECTIONS; ++i) {
+    add_tcp_info_slot(sampler, &slots[i], &sockets[i], NULL);
+  }
+
+  sampled_count = 0;
+  total_samples = 0;
+  sampled_at_ms = 0;
+  most_samples_at_once = 0;
+  ah_server_stats before = stats_from_server(fixture->server);
+  for (uint32_t i = 0; i != 1000 && sampled_count != SAMPLES; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(sampled_count == SAMPLES);
+  ah_server_stats after = stats_from_server(fixture->server);
+  CHECK(after.tcp_info_samples - before.tcp_info_samples == total_samples);
+
+  destroy_tcp_info_sampler(sampler);
+  for (uint32_t i = 0; i != CONNECTIONS; ++i) {
+    CHECK(slots[i].sampler == NULL);
+  }
+  free(sampler);
+  return 0;
+}
+
+int main(void)
+{
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  CHECK(order_timers(&fixture) == 0);
+  CHECK(restart_from_callback(&fixture) == 0);
+
+  int peers[CONNECTIONS];
+  for (uint32_t i = 0; i != CONNECTIONS; ++i) {
+    peers[i] = connect_loopback(&fixture);
+    CHECK(peers[i] != -1);
+    for (uint32_t j = 0; j != 100 && accepted_count != i + 1; ++j) {
+      CHECK(tick_loopback(&fixture));
+    }
+  }
+  CHECK(accepted_count == CONNECTIONS);
+
+  /* A smaller budget than connections goes around the slots in a fixed
+   * order, picking up where the previous interval stopped */
+  CHECK(sample_connections(&fixture, 2) == 0);
+  CHECK(most_samples_at_once == 2);
+  for (uint32_t i = 0; i != SAMPLES; ++i) {
+    CHECK(sampled[i] == sampled[i % CONNECTIONS]);
+  }
+  CHECK(sampled[0] != sampled[1] && sampled[1] != sampled[2]
+        && sampled[0] != sampled[2]);
+
+  /* A larger budget still samples every connection once per interval */
+  CHECK(sample_connections(&fixture, CONNECTIONS + 2) == 0);
+  CHECK(most_samples_at_once == CONNECTIONS);
+
+  for (uint32_t i = 0; i != CONNECTIONS; ++i) {
+    CHECK(destroy_socket(&sockets[i]));
+    CHECK(close(peers[i]) == 0);
+  }
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
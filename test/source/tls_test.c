@@ -0,0 +1,315 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "loopback.h"
+#include "tls.h"
+
+#define PAYLOAD_SIZE (100 * 1024)
+
+typedef enum client_mode
+{
+  CLIENT_TLS_1_3,
+  CLIENT_TLS_1_2,
+  CLIENT_CLOSE_NOTIFY,
+  CLIENT_PLAINTEXT,
+} client_mode;
+
+static char certificate_path[] = "/tmp/adhoc-tls-certificate-XXXXXX";
+static char key_path[] = "/tmp/adhoc-tls-key-XXXXXX";
+static uint8_t payload[PAYLOAD_SIZE];
+
+static loopback fixture;
+static ah_tls_context context;
+static ah_tls_session session;
+static ah_tls_write writes[2];
+static uint8_t request[16];
+static ah_error_code handshake_error;
+static bool kernel_tx_at_handshake;
+static bool end_of_stream;
+static bool server_done;
+static bool client_ok;
+
+/* Self-signed certificate */
+
+static bool write_pem_files(void)
+{
+  EVP_PKEY* key = EVP_EC_gen("P-256");
+  X509* certificate = X509_new();
+  if (key == NULL || certificate == NULL) {
+    return false;
+  }
+
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+  X509_set_pubkey(certificate, key);
+  X509_NAME* name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  bool ok = X509_sign(certificate, key, EVP_sha256()) != 0;
+
+  int certificate_file = mkstemp(certificate_path);
+  int key_file = mkstemp(key_path);
+  FILE* certificate_stream = fdopen(certificate_file, "w");
+  FILE* key_stream = fdopen(key_file, "w");
+  ok = ok && certificate_stream != NULL && key_stream != NULL
+      && PEM_write_X509(certificate_stream, certificate) == 1
+      && PEM_write_PrivateKey(key_stream, key, NULL, NULL, 0, NULL, NULL)
+          == 1;
+  if (certificate_stream != NULL) {
+    fclose(certificate_stream);
+  }
+  if (key_stream != NULL) {
+    fclose(key_stream);
+  }
+
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+  return ok;
+}
+
+/* Attaching the upper layer protocol loads the module on demand, so this is
+ * the only reliable way to tell whether the kernel can take over records */
+static bool is_kernel_tls_available(void)
+{
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t length = sizeof(address);
+  bool available = listener != -1 && client != -1
+      && bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0
+      && listen(listener, 1) == 0
+      && getsockname(listener, (struct sockaddr*)&address, &length) == 0
+      && connect(client, (struct sockaddr*)&address, sizeof(address)) == 0
+      && setsockopt(client, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+  close(client);
+  close(listener);
+  return available;
+}
+
+/* Blocking client */
+
+static bool read_exactly(SSL* ssl, uint8_t* buffer, size_t length)
+{
+  size_t received = 0;
+  while (received != length) {
+    int result = SSL_read(ssl, buffer + received, (int)(length - received));
+    if (result <= 0) {
+      return false;
+    }
+    received += (size_t)result;
+  }
+
+  return true;
+}
+
+static bool run_tls_client(int descriptor, client_mode mode)
+{
+  SSL_CTX* client_context = SSL_CTX_new(TLS_client_method());
+  if (mode == CLIENT_TLS_1_2) {
+    SSL_CTX_set_max_proto_version(client_context, TLS1_2_VERSION);
+  }
+
+  SSL* ssl = SSL_new(client_context);
+  SSL_set_fd(ssl, descriptor);
+  static uint8_t response[4 + PAYLOAD_SIZE];
+  bool ok = SSL_connect(ssl) == 1;
+  if (mode != CLIENT_CLOSE_NOTIFY) {
+    ok = ok && SSL_write(ssl, "ping", 4) == 4
+        && read_exactly(ssl, response, sizeof(response))
+        && memcmp(response, "pong", 4) == 0
+        && memcmp(response + 4, payload, PAYLOAD_SIZE) == 0;
+  }
+
+  /* The close_notify alert ends the stream the server is reading */
+  ok = ok && SSL_shutdown(ssl) >= 0;
+  SSL_free(ssl);
+  SSL_CTX_free(client_context);
+  return ok;
+}
+
+static void* client_thread(void* argument)
+{
+  client_mode mode = *(client_mode*)argument;
+  int descriptor = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(fixture.port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  bool connected =
+      connect(descriptor, (struct sockaddr*)&address, sizeof(address)) == 0;
+  if (connected && mode == CLIENT_PLAINTEXT) {
+    const char* text = "GET / HTTP/1.1\r\n\r\n";
+    client_ok = write(descriptor, text, strlen(text)) > 0;
+    char byte;
+    while (read(descriptor, &byte, 1) > 0) {
+    }
+  } else if (connected) {
+    client_ok = run_tls_client(descriptor, mode);
+  }
+
+  close(descriptor);
+  return NULL;
+}
+
+/* Server */
+
+static bool finish_session(void)
+{
+  server_done = true;
+  destroy_socket(&session.socket);
+  destroy_tls_session(&session);
+  return true;
+}
+
+static bool on_closed(ah_error_code error_code,
+                      ah_tls_session* tls_session,
+                      uint32_t bytes_transferred,
+                      void* per_call_data)
+{
+  (void)tls_session;
+  (void)per_call_data;
+
+  end_of_stream = error_code == AH_ERR_OK && bytes_transferred == 0;
+  return end_of_stream && finish_session();
+}
+
+static bool on_written(ah_error_code error_code,
+                       ah_tls_write* write,
+                       void* per_call_data)
+{
+  (void)per_call_data;
+
+  if (error_code != AH_ERR_OK) {
+    return false;
+  }
+  if (write != &writes[1]) {
+    return true;
+  }
+
+  ah_io_buffer buffer = {sizeof(request), request};
+  return tls_read(&session, buffer, on_closed, NULL);
+}
+
+static bool on_request(ah_error_code error_code,
+                       ah_tls_session* tls_session,
+                       uint32_t bytes_transferred,
+                       void* per_call_data)
+{
+  if (error_code == AH_ERR_OK && bytes_transferred == 0) {
+    return on_closed(error_code, tls_session, 0, per_call_data);
+  }
+  if (error_code != AH_ERR_OK || bytes_transferred != 4
+      || memcmp(request, "ping", 4) != 0)
+  {
+    return false;
+  }
+
+  static uint8_t pong[] = "pong";
+  ah_io_buffer buffers[2] = {{4, pong}, {PAYLOAD_SIZE, payload}};
+  return tls_write(tls_session, &writes[0], buffers[0], on_written, NULL)
+      && tls_write(tls_session, &writes[1], buffers[1], on_written, NULL);
+}
+
+static bool on_handshake(ah_error_code error_code,
+                         ah_tls_session* tls_session,
+                         void* user_data)
+{
+  (void)user_data;
+
+  handshake_error = error_code;
+  if (error_code != AH_ERR_OK) {
+    return finish_session();
+  }
+
+  kernel_tx_at_handshake = tls_session->kernel_tx;
+  ah_io_buffer buffer = {sizeof(request), request};
+  return tls_read(tls_session, buffer, on_request, NULL);
+}
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  return error_code != AH_ERR_OK
+      || tls_accept(&context, &session, socket, on_handshake, NULL);
+}
+
+static int run_client(client_mode mode)
+{
+  server_done = false;
+  client_ok = false;
+  handshake_error = AH_ERR_OK;
+  kernel_tx_at_handshake = false;
+  end_of_stream = false;
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, client_thread, &mode) == 0);
+  for (uint32_t i = 0; i != 1000 && !server_done; ++i) {
+    start_timer(fixture.timer, 10);
+    CHECK(server_tick(fixture.server, NULL));
+  }
+  CHECK(pthread_join(thread, NULL) == 0);
+  CHECK(server_done);
+  return 0;
+}
+
+int main(void)
+{
+  for (uint32_t i = 0; i != PAYLOAD_SIZE; ++i) {
+    payload[i] = (uint8_t)(i * 7);
+  }
+
+  CHECK(write_pem_files());
+  CHECK(create_tls_context(&context, certificate_path, key_path));
+
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+
+  /* The kernel encrypts what TLS 1.3 sessions send where it can, and the
+   * alerts the client sends afterwards are still read as such */
+  bool kernel_tls = is_kernel_tls_available();
+  if (!kernel_tls) {
+    printf("Kernel TLS is not available, skipping the offload checks\n");
+  }
+
+  CHECK(run_client(CLIENT_TLS_1_3) == 0);
+  CHECK(handshake_error == AH_ERR_OK && client_ok && end_of_stream);
+  CHECK(kernel_tx_at_handshake == kernel_tls);
+
+  CHECK(run_client(CLIENT_CLOSE_NOTIFY) == 0);
+  CHECK(handshake_error == AH_ERR_OK && client_ok && end_of_stream);
+  CHECK(kernel_tx_at_handshake == kernel_tls);
+
+  /* TLS 1.2 is always encrypted in userspace */
+  CHECK(run_client(CLIENT_TLS_1_2) == 0);
+  CHECK(handshake_error == AH_ERR_OK && client_ok && end_of_stream);
+  CHECK(!kernel_tx_at_handshake);
+
+  CHECK(run_client(CLIENT_PLAINTEXT) == 0);
+  CHECK(handshake_error == AH_ERR_PROTOCOL_ERROR);
+
+  CHECK(close_loopback(&fixture) == 0);
+  destroy_tls_context(&context);
+  unlink(certificate_path);
+  unlink(key_path);
+  return 0;
+}
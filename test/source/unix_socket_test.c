@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+static ah_socket_accepted accepted;
+static ah_io_dock dock;
+static bool accepted_ok;
+static bool has_credentials;
+static ah_peer_credentials credentials;
+static ah_address peer_address;
+static uint8_t request[4];
+static bool request_read;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  if (error_code != AH_ERR_OK) {
+    return true;
+  }
+
+  has_credentials = peer_credentials_from_socket(socket, &credentials);
+  peer_address = *address;
+  move_socket(&accepted, socket);
+  dock.socket = &accepted;
+  accepted_ok = true;
+  return true;
+}
+
+static bool on_read(ah_error_code error_code,
+                    ah_io_operation* operation,
+                    uint32_t bytes_transferred,
+                    void* per_call_data)
+{
+  (void)operation;
+  (void)per_call_data;
+
+  request_read = error_code == AH_ERR_OK && bytes_transferred == 4;
+  return true;
+}
+
+/* The abstract name is written with a leading '@' here as well */
+static int connect_peer(const char* path)
+{
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  size_t length = strlen(path);
+  memcpy(address.sun_path, path, length);
+  socklen_t address_length = sizeof(address);
+  if (path[0] == '@') {
+    address.sun_path[0] = '\0';
+    address_length = (socklen_t)(sizeof(address.sun_family) + length);
+  }
+
+  int descriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (descriptor != -1
+      && connect(descriptor, (struct sockaddr*)&address, address_length)
+          == -1)
+  {
+    close(descriptor);
+    return -1;
+  }
+
+  return descriptor;
+}
+
+static int exchange(loopback* fixture, const char* path)
+{
+  accepted_ok = false;
+  has_credentials = false;
+  request_read = false;
+
+  int peer = connect_peer(path);
+  CHECK(peer != -1);
+  for (uint32_t i = 0; i != 100 && !accepted_ok; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(accepted_ok);
+
+  CHECK(has_credentials);
+  CHECK(credentials.pid == (uint32_t)getpid());
+  CHECK(credentials.uid == (uint32_t)getuid());
+  CHECK(credentials.gid == (uint32_t)getgid());
+  CHECK(peer_address.family == AH_ADDRESS_NONE);
+
+  CHECK(send(peer, "ping", 4, 0) == 4);
+  ah_io_buffer buffer = {sizeof(request), request};
+  CHECK(queue_read_operation(&dock, buffer, on_read, NULL));
+  for (uint32_t i = 0; i != 100 && !request_read; ++i) {
+    CHECK(tick_loopback(fixture));
+  }
+  CHECK(request_read && memcmp(request, "ping", 4) == 0);
+
+  CHECK(close(peer) == 0);
+  CHECK(destroy_socket(&accepted));
+  return 0;
+}
+
+int main(void)
+{
+  char path[64];
+  char abstract_path[64];
+  snprintf(path, sizeof(path), "/tmp/adhoc-unix-%d.sock", (int)getpid());
+  snprintf(
+      abstract_path, sizeof(abstract_path), "@adhoc-unix-%d", (int)getpid());
+
+  loopback fixture;
+  ah_socket* listeners = allocate(socket_size() * 2, socket_alignment());
+  ah_acceptor* acceptor = allocate(acceptor_size(), acceptor_alignment());
+  ah_acceptor* abstract_acceptor =
+      allocate(acceptor_size(), acceptor_alignment());
+  CHECK(listeners != NULL && acceptor != NULL && abstract_acceptor != NULL);
+  CHECK(open_loopback(&fixture, NULL, NULL) == 0);
+  ah_server* server = fixture.server;
+  ah_context* context = &fixture.context;
+  set_socket_span(server, (ah_socket_span) {2, listeners});
+
+  ah_socket* listener = span_get_socket(server, 0);
+  ah_socket* abstract_listener = span_get_socket(server, 1);
+  CHECK(create_unix_socket(listener, context, path));
+  CHECK(create_unix_socket(abstract_listener, context, abstract_path));
+  CHECK(create_acceptor(acceptor, listener, on_accept));
+  CHECK(create_acceptor(abstract_acceptor, abstract_listener, on_accept));
+
+  /* An existing socket file is not replaced */
+  ah_socket* duplicate = allocate(socket_size(), socket_alignment());
+  CHECK(duplicate != NULL);
+  CHECK(!create_unix_socket(duplicate, context, path));
+  free(duplicate);
+
+  CHECK(exchange(&fixture, path) == 0);
+  CHECK(exchange(&fixture, abstract_path) == 0);
+
+  CHECK(close_loopback(&fixture) == 0);
+  CHECK(unlink(path) == 0);
+  free(abstract_acceptor);
+  free(acceptor);
+  free(listeners);
+  return 0;
+}
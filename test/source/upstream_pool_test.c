@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "loopback.h"
+
+#define MAX_ACCEPTED 8
+
+static ah_socket_accepted accepted[MAX_ACCEPTED];
+static uint32_t accepted_count;
+static uint32_t ready_count;
+static ah_error_code ready_error;
+static ah_address peer_address;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  if (error_code == AH_ERR_OK && accepted_count != MAX_ACCEPTED) {
+    move_socket(&accepted[accepted_count++], socket);
+    peer_address = *address;
+  }
+
+  return true;
+}
+
+static bool on_ready(ah_error_code error_code,
+                     ah_upstream_request* request,
+                     void* per_call_data)
+{
+  (void)request;
+  (void)per_call_data;
+
+  ready_error = error_code;
+  ++ready_count;
+  return true;
+}
+
+/* Runs the event loop until the request is ready and the upstream accepted
+ * the new connection, if there is one */
+static bool wait_for(loopback* fixture, uint32_t accepts)
+{
+  for (uint32_t i = 0; i != 100; ++i) {
+    if (ready_count != 0 && accepted_count == accepts) {
+      return true;
+    }
+
+    start_timer(fixture->timer, 10);
+    if (!server_tick(fixture->server, NULL)) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+static ah_address loopback_address(uint16_t port)
+{
+  return address_from_ipv4((ah_ipv4_address) {{127, 0, 0, 1}, port});
+}
+
+static int acquire_address(ah_upstream_pool* pool,
+                           ah_upstream_request* request,
+                           const ah_address* address)
+{
+  ready_count = 0;
+  ready_error = AH_ERR_OK;
+  CHECK(acquire_upstream(pool, request, address, on_ready, NULL));
+  return 0;
+}
+
+static int acquire(ah_upstream_pool* pool,
+                   ah_upstream_request* request,
+                   uint16_t port)
+{
+  ah_address address = loopback_address(port);
+  return acquire_address(pool, request, &address);
+}
+
+int main(void)
+{
+  loopback fixture;
+  uint16_t unused_port;
+  ah_upstream_pool* pool =
+      allocate(upstream_pool_size(), upstream_pool_alignment());
+  CHECK(pool != NULL);
+  CHECK(closed_port(&unused_port) == 0);
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  CHECK(create_upstream_pool(pool, &fixture.context, 4, 1, 60000));
+
+  ah_address upstream = loopback_address(fixture.port);
+  ah_upstream_request first;
+  ah_upstream_request second;
+
+  /* A new connection is reported from the event loop */
+  CHECK(acquire(pool, &first, fixture.port) == 0);
+  CHECK(ready_count == 0);
+  CHECK(wait_for(&fixture, 1));
+  CHECK(ready_error == AH_ERR_OK && !first.reused);
+
+  /* A released connection is handed out again right away, also when it was
+   * released under the IPv4-mapped form of the address */
+  ah_address mapped = {.family = AH_ADDRESS_IPV6};
+  mapped.bytes[10] = 0xFF;
+  mapped.bytes[11] = 0xFF;
+  memcpy(&mapped.bytes[12], upstream.bytes, 4);
+  memcpy(mapped.port, upstream.port, sizeof(mapped.port));
+  CHECK(release_upstream(pool, &first.socket, &mapped));
+  CHECK(acquire(pool, &first, fixture.port) == 0);
+  CHECK(ready_count == 1 && ready_error == AH_ERR_OK && first.reused);
+
+  /* Only one connection is kept for the upstream, so the older one is closed
+   * and the next request needs a new connection */
+  CHECK(acquire(pool, &second, fixture.port) == 0);
+  CHECK(wait_for(&fixture, 2));
+  CHECK(ready_error == AH_ERR_OK && !second.reused);
+  CHECK(release_upstream(pool, &first.socket, &upstream));
+  CHECK(release_upstream(pool, &second.socket, &upstream));
+  CHECK(acquire(pool, &second, fixture.port) == 0);
+  CHECK(ready_count == 1 && second.reused);
+  CHECK(acquire(pool, &first, fixture.port) == 0);
+  CHECK(wait_for(&fixture, 3));
+  CHECK(ready_error == AH_ERR_OK && !first.reused);
+
+  /* A connection the upstream closed while it was idle is not reused */
+  CHECK(release_upstream(pool, &first.socket, &upstream));
+  CHECK(destroy_socket(&accepted[2]));
+  for (uint32_t i = 0; i != 5; ++i) {
+    start_timer(fixture.timer, 10);
+    CHECK(server_tick(fixture.server, NULL));
+  }
+  CHECK(acquire(pool, &first, fixture.port) == 0);
+  CHECK(ready_count == 0);
+  CHECK(wait_for(&fixture, 4));
+  CHECK(ready_error == AH_ERR_OK && !first.reused);
+  CHECK(destroy_socket(&first.socket));
+
+  /* IPv6 upstreams are connected to over IPv6, unless the listener fell back
+   * to IPv4 */
+  uint32_t accepts = 4;
+  ah_address listener_address;
+  CHECK(local_address_from_socket(fixture.listener, &listener_address));
+  if (listener_address.family == AH_ADDRESS_IPV6) {
+    ah_address ipv6 = {.family = AH_ADDRESS_IPV6};
+    ipv6.bytes[15] = 1;
+    memcpy(ipv6.port, upstream.port, sizeof(ipv6.port));
+    CHECK(acquire_address(pool, &first, &ipv6) == 0);
+    CHECK(wait_for(&fixture, ++accepts));
+    CHECK(ready_error == AH_ERR_OK && !first.reused);
+    ah_ipv4_address peer_ipv4;
+    CHECK(!ipv4_from_address(&peer_address, &peer_ipv4));
+    CHECK(destroy_socket(&first.socket));
+  } else {
+    printf("IPv6 is not available, skipping it\n");
+  }
+
+  CHECK(acquire(pool, &first, unused_port) == 0);
+  CHECK(wait_for(&fixture, accepts));
+  CHECK(ready_error == AH_ERR_CONNECTION_REFUSED);
+
+  CHECK(destroy_socket(&second.socket));
+  CHECK(destroy_upstream_pool(pool));
+  for (uint32_t i = 0; i != accepted_count; ++i) {
+    CHECK(destroy_socket(&accepted[i]));
+  }
+
+  CHECK(close_loopback(&fixture) == 0);
+  free(pool);
+  return 0;
+}
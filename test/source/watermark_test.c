@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* A peer that sends a request but does not read the responses makes the
+ * pending bytes of the write queue reach the high watermark. The request must
+ * not be read until the peer caught up and the pending bytes fell to the low
+ * watermark again. */
+
+#define RESPONSES 16
+#define RESPONSE_SIZE (512 * 1024)
+#define LOW_WATERMARK (1024 * 1024)
+#define HIGH_WATERMARK (4 * 1024 * 1024)
+#define PEER_BUFFER_SIZE (16 * 1024)
+
+static ah_socket_accepted accepted;
+static bool has_accepted;
+static ah_io_dock dock;
+static ah_write_queue queue;
+static ah_write_request requests[RESPONSES];
+static uint8_t responses[RESPONSES * RESPONSE_SIZE];
+static uint8_t received[RESPONSE_SIZE];
+static uint8_t request[4];
+static uint32_t pause_count;
+static uint32_t resume_count;
+static bool request_read;
+static bool read_while_paused;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && !has_accepted) {
+    move_socket(&accepted, socket);
+    dock.socket = &accepted;
+    create_write_queue(&queue, &dock);
+    has_accepted = true;
+  }
+
+  return true;
+}
+
+static bool on_pressure(ah_write_queue* pressured_queue,
+                        bool paused,
+                        void* user_data)
+{
+  (void)user_data;
+
+  if (pressured_queue != &queue || paused != pressured_queue->reads_paused) {
+    return false;
+  }
+
+  if (paused) {
+    ++pause_count;
+    return pressured_queue->pending_bytes >= HIGH_WATERMARK;
+  }
+
+  ++resume_count;
+  return pressured_queue->pending_bytes <= LOW_WATERMARK;
+}
+
+static bool on_written(ah_error_code error_code,
+                       ah_write_request* written,
+                       void* per_call_data)
+{
+  (void)written;
+  (void)per_call_data;
+
+  /* The responses left after the peer is gone are cancelled */
+  return error_code == AH_ERR_OK || error_code == AH_ERR_OPERATION_ABORTED;
+}
+
+static bool on_read(ah_error_code error_code,
+                    ah_io_operation* operation,
+                    uint32_t bytes_transferred,
+                    void* per_call_data)
+{
+  (void)operation;
+  (void)per_call_data;
+
+  request_read = error_code == AH_ERR_OK && bytes_transferred == 4;
+  read_while_paused = queue.reads_paused;
+  return true;
+}
+
+int main(void)
+{
+  for (uint32_t i = 0; i != sizeof(responses); ++i) {
+    responses[i] = (uint8_t)(i * 7 + i / 251);
+  }
+
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  int peer = connect_loopback(&fixture);
+  CHECK(peer != -1);
+  int buffer_size = PEER_BUFFER_SIZE;
+  CHECK(setsockopt(
+            peer, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size))
+        == 0);
+  for (uint32_t i = 0; i != 100 && !has_accepted; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(has_accepted);
+
+  /* The request that pushes the pending bytes over the high watermark
+   * reports the pressure from inside the call */
+  set_write_queue_watermarks(
+      &queue, LOW_WATERMARK, HIGH_WATERMARK, on_pressure, NULL);
+  for (uint32_t i = 0; i != RESPONSES; ++i) {
+    ah_io_buffer buffer = {RESPONSE_SIZE, &responses[i * RESPONSE_SIZE]};
+    CHECK(queue_write_request(&queue, &requests[i], buffer, on_written, NULL));
+    CHECK(pause_count == ((i + 1) * RESPONSE_SIZE >= HIGH_WATERMARK ? 1 : 0));
+  }
+  CHECK(queue.reads_paused);
+
+  ah_io_buffer buffer = {sizeof(request), request};
+  CHECK(queue_read_operation(&dock, buffer, on_read, NULL));
+  CHECK(write(peer, "ping", 4) == 4);
+  for (uint32_t i = 0; i != 50; ++i) {
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(!request_read && queue.reads_paused && resume_count == 0);
+
+  /* Draining the responses resumes the reads once, at the low watermark */
+  size_t offset = 0;
+  for (uint32_t i = 0; i != 100000 && !request_read; ++i) {
+    ssize_t result = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+    if (result == -1) {
+      CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+    } else {
+      CHECK(result != 0);
+      CHECK(memcmp(received, &responses[offset], (size_t)result) == 0);
+      offset += (size_t)result;
+    }
+
+    CHECK(tick_loopback(&fixture));
+  }
+  CHECK(request_read && !read_while_paused);
+  CHECK(memcmp(request, "ping", 4) == 0);
+  CHECK(pause_count == 1 && resume_count == 1);
+
+  CHECK(destroy_socket(&accepted));
+  CHECK(cancel_write_queue(&queue));
+  CHECK(close(peer) == 0);
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+/* The small requests queued before the socket becomes writable are sent by a
+ * single system call. The large ones do not fit into the buffers of a peer
+ * that is not reading, so they are sent in parts, and every part has to
+ * resume where the previous one stopped. */
+
+#define SMALL_REQUESTS 3
+#define SMALL_SIZE 5
+#define LARGE_REQUESTS 16
+#define LARGE_SIZE (512 * 1024)
+#define PEER_BUFFER_SIZE (16 * 1024)
+
+static ah_socket_accepted accepted;
+static bool has_accepted;
+static ah_io_dock dock;
+static ah_write_queue queue;
+static ah_write_request requests[LARGE_REQUESTS];
+static uint8_t payload[LARGE_REQUESTS * LARGE_SIZE];
+static uint8_t received[LARGE_SIZE];
+static uint32_t completed_count;
+static uint32_t completion_order[LARGE_REQUESTS];
+static uint32_t completion_ticks[LARGE_REQUESTS];
+static uint32_t ticks;
+
+static bool on_accept(ah_error_code error_code,
+                      ah_socket* socket,
+                      const ah_address* address)
+{
+  (void)address;
+
+  if (error_code == AH_ERR_OK && !has_accepted) {
+    move_socket(&accepted, socket);
+    dock.socket = &accepted;
+    create_write_queue(&queue, &dock);
+    has_accepted = true;
+  }
+
+  return true;
+}
+
+static bool on_written(ah_error_code error_code,
+                       ah_write_request* request,
+                       void* per_call_data)
+{
+  uint32_t index = (uint32_t)(uintptr_t)per_call_data;
+  if (error_code != AH_ERR_OK || request != &requests[index]
+      || request->bytes_transferred != request->buffer.buffer_length)
+  {
+    return false;
+  }
+
+  completion_order[completed_count++] = index;
+  completion_ticks[index] = ticks;
+  return true;
+}
+
+static bool tick(loopback* fixture)
+{
+  ++ticks;
+  return tick_loopback(fixture);
+}
+
+static int queue_requests(uint32_t count, uint32_t size)
+{
+  completed_count = 0;
+  for (uint32_t i = 0; i != count; ++i) {
+    ah_io_buffer buffer = {size, &payload[i * size]};
+    CHECK(queue_write_request(
+        &queue, &requests[i], buffer, on_written, (void*)(uintptr_t)i));
+  }
+  CHECK(queue.pending_bytes == (uint64_t)count * size);
+  return 0;
+}
+
+/* Reads what the peer received and compares it to the payload */
+static int read_peer(int peer, size_t* offset)
+{
+  ssize_t result = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  if (result == -1) {
+    CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+    return 0;
+  }
+
+  CHECK(result != 0);
+  CHECK(memcmp(received, &payload[*offset], (size_t)result) == 0);
+  *offset += (size_t)result;
+  return 0;
+}
+
+static int coalesce_small_requests(loopback* fixture, int peer)
+{
+  CHECK(queue_requests(SMALL_REQUESTS, SMALL_SIZE) == 0);
+  for (uint32_t i = 0; i != 100 && completed_count != SMALL_REQUESTS; ++i) {
+    CHECK(tick(fixture));
+  }
+  CHECK(completed_count == SMALL_REQUESTS);
+  CHECK(queue.head == NULL && queue.pending_bytes == 0);
+
+  for (uint32_t i = 0; i != SMALL_REQUESTS; ++i) {
+    CHECK(completion_order[i] == i);
+    CHECK(completion_ticks[i] == completion_ticks[0]);
+  }
+
+  size_t offset = 0;
+  for (uint32_t i = 0; i != 100 && offset != SMALL_REQUESTS * SMALL_SIZE;
+       ++i)
+  {
+    CHECK(read_peer(peer, &offset) == 0);
+    CHECK(tick(fixture));
+  }
+  CHECK(offset == SMALL_REQUESTS * SMALL_SIZE);
+  return 0;
+}
+
+static int resume_partial_writes(loopback* fixture, int peer)
+{
+  CHECK(queue_requests(LARGE_REQUESTS, LARGE_SIZE) == 0);
+
+  /* The socket buffers fill up while the peer is not reading */
+  for (uint32_t i = 0; i != 50; ++i) {
+    CHECK(tick(fixture));
+  }
+  CHECK(completed_count < LARGE_REQUESTS && queue.head != NULL);
+  CHECK(queue.pending_bytes < (uint64_t)LARGE_REQUESTS * LARGE_SIZE);
+
+  /* The small receive buffer would make the rest take thousands of ticks */
+  int buffer_size = LARGE_SIZE;
+  CHECK(setsockopt(
+            peer, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size))
+        == 0);
+
+  size_t offset = 0;
+  for (uint32_t i = 0; i != 1000000 && offset != sizeof(payload); ++i) {
+    CHECK(read_peer(peer, &offset) == 0);
+    CHECK(tick(fixture));
+  }
+  CHECK(offset == sizeof(payload));
+  CHECK(completed_count == LARGE_REQUESTS && queue.head == NULL);
+  for (uint32_t i = 0; i != LARGE_REQUESTS; ++i) {
+    CHECK(completion_order[i] == i);
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  for (uint32_t i = 0; i != sizeof(payload); ++i) {
+    payload[i] = (uint8_t)(i * 7 + i / 251);
+  }
+
+  loopback fixture;
+  CHECK(open_loopback(&fixture, on_accept, NULL) == 0);
+  int peer = connect_loopback(&fixture);
+  CHECK(peer != -1);
+  int buffer_size = PEER_BUFFER_SIZE;
+  CHECK(setsockopt(
+            peer, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size))
+        == 0);
+  for (uint32_t i = 0; i != 100 && !has_accepted; ++i) {
+    CHECK(tick(&fixture));
+  }
+  CHECK(has_accepted);
+
+  CHECK(coalesce_small_requests(&fixture, peer) == 0);
+  CHECK(resume_partial_writes(&fixture, peer) == 0);
+
+  CHECK(destroy_socket(&accepted));
+  CHECK(close(peer) == 0);
+  CHECK(close_loopback(&fixture) == 0);
+  return 0;
+}